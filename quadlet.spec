@@ -9,8 +9,7 @@ Source0:        %{url}/archive/%{version}/%{name}-%{version}.tar.xz
 
 BuildRequires:  meson
 BuildRequires:  gcc
-BuildRequires:  pkgconfig(glib-2.0) >= 2.44.0
-BuildRequires:  pkgconfig(gobject-2.0)
+BuildRequires:  pkgconfig(glib-2.0) >= 2.58.0
 
 Requires(pre):  /usr/sbin/useradd
 Requires:       podman
@@ -48,6 +47,7 @@ exit 0
 %doc README.md
 %doc docs/Fileformat.md
 %doc docs/ContainerSetup.md
+%{_bindir}/quadlet-query
 %{_libexecdir}/quadlet-generator
 %_prefix/lib/systemd/system-generators/quadlet-system-generator
 %_prefix/lib/systemd/user-generators/quadlet-user-generator
@@ -0,0 +1,403 @@
+#include "quadlet-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "unitfile.h"
+
+/* Each unit has an entry file, named after the unit, that describes
+ * its inputs and outputs in unit file syntax. The service files are
+ * stored by the hash of their contents, so an entry can never point to
+ * a file that was written for another version of it. Nothing is synced,
+ * everything read from the cache is checked instead, so a crash can at
+ * worst cause a miss */
+#define CACHE_GROUP "Cache"
+#define CACHE_VERSION "1"
+
+QuadCacheEntry *
+quad_cache_entry_new (const char *source)
+{
+  QuadCacheEntry *entry = g_new0 (QuadCacheEntry, 1);
+
+  entry->source = g_strdup (source);
+  entry->inputs = g_ptr_array_new_with_free_func (g_free);
+  entry->drop_ins = g_ptr_array_new_with_free_func (g_free);
+  entry->symlinks = g_ptr_array_new_with_free_func (g_free);
+  entry->log = g_ptr_array_new_with_free_func (g_free);
+
+  return entry;
+}
+
+void
+quad_cache_entry_free (QuadCacheEntry *entry)
+{
+  g_free (entry->source);
+  g_ptr_array_unref (entry->inputs);
+  g_ptr_array_unref (entry->drop_ins);
+  g_free (entry->service_name);
+  g_free (entry->output_hash);
+  g_ptr_array_unref (entry->symlinks);
+  g_ptr_array_unref (entry->log);
+  g_free (entry);
+}
+
+/* Adds to an array like the inputs of an entry */
+void
+quad_cache_add_input (GPtrArray *inputs,
+                      const char *path,
+                      QuadHash128 hash)
+{
+  g_autofree char *hash_str = quad_hash128_to_string (hash);
+
+  g_ptr_array_add (inputs, g_strconcat (hash_str, " ", path, NULL));
+}
+
+static char *
+get_entry_path (const char *cache_dir,
+                const char *name)
+{
+  g_autofree char *entry_name = g_strconcat (name, ".entry", NULL);
+
+  return g_build_filename (cache_dir, entry_name, NULL);
+}
+
+static char *
+get_output_path (const char *cache_dir,
+                 const char *output_hash)
+{
+  g_autofree char *output_name = g_strconcat (output_hash, ".service", NULL);
+
+  return g_build_filename (cache_dir, output_name, NULL);
+}
+
+static char *
+hash_file (const char *path)
+{
+  g_autofree char *data = NULL;
+  gsize len;
+
+  if (!g_file_get_contents (path, &data, &len, NULL))
+    return NULL;
+
+  return quad_hash128_to_string (quad_hash128 (data, len, 0));
+}
+
+static gboolean
+strv_equal_array (const char **strv,
+                  GPtrArray *array)
+{
+  guint i;
+
+  for (i = 0; strv[i] != NULL; i++)
+    {
+      if (i >= array->len || strcmp (strv[i], g_ptr_array_index (array, i)) != 0)
+        return FALSE;
+    }
+
+  return i == array->len;
+}
+
+static void
+add_strv (GPtrArray *array,
+          const char **strv)
+{
+  for (guint i = 0; strv[i] != NULL; i++)
+    g_ptr_array_add (array, g_strdup (strv[i]));
+}
+
+/* Returns the entry if it was stored with the same key, for the same
+ * source and drop-ins, and all the files it read are unchanged. Only
+ * the inputs are hashed, nothing is parsed but the entry itself. The
+ * source is hashed from source_contents if they were already read */
+QuadCacheEntry *
+quad_cache_lookup (const char *cache_dir,
+                   const char *key,
+                   const char *name,
+                   const char *source,
+                   GBytes *source_contents,
+                   GPtrArray *drop_ins)
+{
+  g_autofree char *entry_path = get_entry_path (cache_dir, name);
+  g_autoptr(QuadUnitFile) file = NULL;
+  g_autoptr(QuadCacheEntry) entry = NULL;
+  g_autofree const char **inputs = NULL;
+  g_autofree const char **entry_drop_ins = NULL;
+  g_autofree const char **symlinks = NULL;
+  g_autofree const char **log = NULL;
+  const char *service_name, *output_hash;
+
+  file = quad_unit_file_new_from_path (entry_path, QUAD_UNIT_FILE_PARSE_NONE, NULL);
+  if (file == NULL)
+    return NULL;
+
+  if (g_strcmp0 (quad_unit_file_lookup_last_raw (file, CACHE_GROUP, "Version"), CACHE_VERSION) != 0 ||
+      g_strcmp0 (quad_unit_file_lookup_last_raw (file, CACHE_GROUP, "Key"), key) != 0 ||
+      g_strcmp0 (quad_unit_file_lookup_last_raw (file, CACHE_GROUP, "Source"), source) != 0)
+    return NULL;
+
+  service_name = quad_unit_file_lookup_last_raw (file, CACHE_GROUP, "Service");
+  output_hash = quad_unit_file_lookup_last_raw (file, CACHE_GROUP, "Output");
+  if (service_name == NULL || output_hash == NULL)
+    return NULL;
+
+  entry_drop_ins = quad_unit_file_lookup_all_raw (file, CACHE_GROUP, "DropIn");
+  if (!strv_equal_array (entry_drop_ins, drop_ins))
+    return NULL;
+
+  inputs = quad_unit_file_lookup_all_raw (file, CACHE_GROUP, "Input");
+  for (guint i = 0; inputs[i] != NULL; i++)
+    {
+      const char *space = strchr (inputs[i], ' ');
+      g_autofree char *hash = NULL;
+
+      if (space == NULL)
+        return NULL;
+
+      if (source_contents != NULL && strcmp (space + 1, source) == 0)
+        {
+          gsize len;
+          const char *data = g_bytes_get_data (source_contents, &len);
+
+          hash = quad_hash128_to_string (quad_hash128 (data, len, 0));
+        }
+      else
+        hash = hash_file (space + 1);
+      if (hash == NULL || strncmp (hash, inputs[i], space - inputs[i]) != 0)
+        return NULL;
+    }
+
+  entry = quad_cache_entry_new (source);
+  add_strv (entry->inputs, inputs);
+  add_strv (entry->drop_ins, entry_drop_ins);
+  entry->service_name = g_strdup (service_name);
+  entry->output_hash = g_strdup (output_hash);
+  symlinks = quad_unit_file_lookup_all_raw (file, CACHE_GROUP, "Symlink");
+  add_strv (entry->symlinks, symlinks);
+  log = quad_unit_file_lookup_all_raw (file, CACHE_GROUP, "Log");
+  add_strv (entry->log, log);
+
+  return g_steal_pointer (&entry);
+}
+
+/* Writes to a temporary file that is renamed over path, so a file is
+ * never seen half written while the generator is running */
+static gboolean
+write_file_atomic (const char *path,
+                   const char *data,
+                   gsize len,
+                   GError **error)
+{
+  g_autofree char *tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  int fd;
+
+  fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to create file '%s': %s", tmp_path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  if (!quad_write_all (fd, data, len, error))
+    {
+      close (fd);
+      unlink (tmp_path);
+      return FALSE;
+    }
+
+  if (!g_close (fd, error))
+    {
+      unlink (tmp_path);
+      return FALSE;
+    }
+
+  if (rename (tmp_path, path) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to rename '%s': %s", tmp_path, g_strerror (errsv));
+      unlink (tmp_path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The entry is a unit file, so values can't span lines or have
+ * whitespace that the parser would strip */
+static gboolean
+is_storable (const char *value)
+{
+  gsize len = strlen (value);
+
+  if (len == 0)
+    return TRUE;
+
+  return strchr (value, '\n') == NULL &&
+    !g_ascii_isspace (value[0]) && !g_ascii_isspace (value[len - 1]) &&
+    value[len - 1] != '\\';
+}
+
+static gboolean
+add_all (QuadUnitFile *file,
+         const char *key,
+         GPtrArray *values)
+{
+  for (guint i = 0; i < values->len; i++)
+    {
+      const char *value = g_ptr_array_index (values, i);
+
+      if (!is_storable (value))
+        return FALSE;
+      quad_unit_file_add (file, CACHE_GROUP, key, value);
+    }
+
+  return TRUE;
+}
+
+/* Stores the entry with a copy of the service file contents. Fails
+ * without error if the entry can't be represented, in which case the
+ * unit is just converted every time */
+gboolean
+quad_cache_store (const char *cache_dir,
+                  const char *key,
+                  const char *name,
+                  QuadCacheEntry *entry,
+                  GBytes *output,
+                  GError **error)
+{
+  g_autofree char *entry_path = get_entry_path (cache_dir, name);
+  g_autofree char *output_path = NULL;
+  g_autoptr(QuadUnitFile) file = NULL;
+  g_autoptr(GString) str = g_string_new ("");
+  gsize len;
+  const char *data = g_bytes_get_data (output, &len);
+
+  if (!is_storable (entry->source) || !is_storable (entry->service_name))
+    return FALSE;
+
+  g_free (entry->output_hash);
+  entry->output_hash = quad_hash128_to_string (quad_hash128 (data, len, 0));
+
+  file = quad_unit_file_new ();
+  quad_unit_file_add (file, CACHE_GROUP, "Version", CACHE_VERSION);
+  quad_unit_file_add (file, CACHE_GROUP, "Key", key);
+  quad_unit_file_add (file, CACHE_GROUP, "Source", entry->source);
+  quad_unit_file_add (file, CACHE_GROUP, "Service", entry->service_name);
+  quad_unit_file_add (file, CACHE_GROUP, "Output", entry->output_hash);
+  if (!add_all (file, "Input", entry->inputs) ||
+      !add_all (file, "DropIn", entry->drop_ins) ||
+      !add_all (file, "Symlink", entry->symlinks) ||
+      !add_all (file, "Log", entry->log))
+    return FALSE;
+  quad_unit_file_print (file, str);
+
+  if (g_mkdir_with_parents (cache_dir, 0755) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to create '%s': %s", cache_dir, g_strerror (errsv));
+      return FALSE;
+    }
+
+  /* Written even if it exists, in case that copy is corrupt */
+  output_path = get_output_path (cache_dir, entry->output_hash);
+  if (!write_file_atomic (output_path, data, len, error))
+    return FALSE;
+
+  /* The previous output is removed by quad_cache_prune() */
+  return write_file_atomic (entry_path, str->str, str->len, error);
+}
+
+/* Returns the cached service file, after checking that it is the one
+ * the entry was stored with */
+GBytes *
+quad_cache_read_output (const char *cache_dir,
+                        QuadCacheEntry *entry,
+                        GError **error)
+{
+  g_autofree char *output_path = NULL;
+  g_autofree char *data = NULL;
+  g_autofree char *hash = NULL;
+  gsize len;
+
+  if (strchr (entry->output_hash, '/') != NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Invalid cached output '%s'", entry->output_hash);
+      return NULL;
+    }
+
+  output_path = get_output_path (cache_dir, entry->output_hash);
+  if (!g_file_get_contents (output_path, &data, &len, error))
+    return NULL;
+
+  hash = quad_hash128_to_string (quad_hash128 (data, len, 0));
+  if (strcmp (hash, entry->output_hash) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Cached file '%s' is corrupt", output_path);
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&data), len);
+}
+
+/* Returns the part of name before suffix, or NULL if it doesn't end
+ * with it */
+static char *
+strip_suffix (const char *name,
+              const char *suffix)
+{
+  if (!g_str_has_suffix (name, suffix))
+    return NULL;
+
+  return g_strndup (name, strlen (name) - strlen (suffix));
+}
+
+/* Removes the entries of the units that are not in names, which are
+ * gone or failed to convert, the outputs that are not in output_hashes,
+ * and the temporary files a crash left behind. Other files are kept, in
+ * case the cache directory is shared */
+void
+quad_cache_prune (const char *cache_dir,
+                  QuadTable *names,
+                  QuadTable *output_hashes)
+{
+  g_autoptr(GDir) dir = g_dir_open (cache_dir, 0, NULL);
+  const char *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      const char *dot = strrchr (name, '.');
+      g_autofree char *tmp_name = NULL;
+      g_autofree char *unit_name = NULL;
+      g_autofree char *output_hash = NULL;
+      gboolean stale;
+
+      /* Temporary files are only there while a file is written */
+      if (dot != NULL && strlen (dot) == 7 && dot > name)
+        tmp_name = g_strndup (name, dot - name);
+
+      unit_name = strip_suffix (tmp_name ? tmp_name : name, ".entry");
+      output_hash = strip_suffix (tmp_name ? tmp_name : name, ".service");
+      if (unit_name != NULL)
+        stale = tmp_name != NULL || !quad_table_contains (names, unit_name);
+      else if (output_hash != NULL && strlen (output_hash) == 32 &&
+               strspn (output_hash, "0123456789abcdef") == 32)
+        stale = tmp_name != NULL || !quad_table_contains (output_hashes, output_hash);
+      else
+        continue;
+
+      if (stale)
+        {
+          g_autofree char *path = g_build_filename (cache_dir, name, NULL);
+          unlink (path);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glib.h>
+#include <utils.h>
+
+G_BEGIN_DECLS
+
+/* What converting a unit read and produced, so the result can be
+ * reused in later runs for as long as none of the inputs change */
+typedef struct {
+  char *source;        /* Path of the unit */
+  GPtrArray *inputs;   /* "<hash> <path>" of each file that was read */
+  GPtrArray *drop_ins; /* Paths of the drop-ins, in the order they apply */
+  char *service_name;
+  char *output_hash;   /* Of the written service file */
+  GPtrArray *symlinks; /* Relative to the output directory */
+  GPtrArray *log;      /* Messages logged during the conversion */
+} QuadCacheEntry;
+
+QuadCacheEntry *quad_cache_entry_new       (const char      *source);
+void            quad_cache_entry_free      (QuadCacheEntry  *entry);
+void            quad_cache_add_input       (GPtrArray       *inputs,
+                                            const char      *path,
+                                            QuadHash128      hash);
+
+QuadCacheEntry *quad_cache_lookup          (const char      *cache_dir,
+                                            const char      *key,
+                                            const char      *name,
+                                            const char      *source,
+                                            GBytes          *source_contents,
+                                            GPtrArray       *drop_ins);
+gboolean        quad_cache_store           (const char      *cache_dir,
+                                            const char      *key,
+                                            const char      *name,
+                                            QuadCacheEntry  *entry,
+                                            GBytes          *output,
+                                            GError         **error);
+GBytes *        quad_cache_read_output     (const char      *cache_dir,
+                                            QuadCacheEntry  *entry,
+                                            GError         **error);
+void            quad_cache_prune           (const char      *cache_dir,
+                                            QuadTable       *names,
+                                            QuadTable       *output_hashes);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadCacheEntry, quad_cache_entry_free)
+
+G_END_DECLS
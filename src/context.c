@@ -0,0 +1,417 @@
+#define _GNU_SOURCE /* For dl_iterate_phdr() */
+
+#include "quadlet-config.h"
+
+#include <fcntl.h>
+#include <link.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "context.h"
+
+struct QuadContext {
+  gboolean user;
+  char **unit_dirs;
+  char **subuid_lines;
+  char **subgid_lines;
+  QuadRanges *default_remap_uids;
+  QuadRanges *default_remap_gids;
+  QuadTable *supported_keys; /* group name -> set of keys */
+  gboolean debug;
+  int kmsg_fd;
+};
+
+static const char *supported_container_keys[] = {
+  "ContainerName",
+  "Image",
+  "Environment",
+  "Exec",
+  "NoNewPrivileges",
+  "DropCapability",
+  "AddCapability",
+  "ReadOnly",
+  "RemapUsers",
+  "RemapUidStart",
+  "RemapGidStart",
+  "RemapUidRanges",
+  "RemapGidRanges",
+  "Notify",
+  "SocketActivated",
+  "ExposeHostPort",
+  "PublishPort",
+  "KeepId",
+  "User",
+  "Group",
+  "HostUser",
+  "HostGroup",
+  "Volume",
+  "PodmanArgs",
+  "Label",
+  "Annotation",
+  "RunInit",
+  "VolatileTmp",
+  "Timezone",
+  "Base",
+  NULL
+};
+
+static const char *supported_volume_keys[] = {
+  "User",
+  "Group",
+  "Label",
+  "Base",
+  NULL
+};
+
+static QuadTable *
+new_supported_keys_hash (const char **supported_keys)
+{
+  QuadTable *hash = quad_str_table_new (NULL, NULL);
+
+  for (guint i = 0; supported_keys[i] != NULL; i++)
+    quad_table_add (hash, (char *)supported_keys[i]);
+
+  return hash;
+}
+
+/* Adds the groups and keys of quadlet units to names, so units that
+ * use them share the strings rather than having their own copies */
+void
+quad_context_add_known_names (GPtrArray *names)
+{
+  g_ptr_array_add (names, (char *)"Container");
+  for (guint i = 0; supported_container_keys[i] != NULL; i++)
+    g_ptr_array_add (names, (char *)supported_container_keys[i]);
+
+  g_ptr_array_add (names, (char *)"Volume");
+  for (guint i = 0; supported_volume_keys[i] != NULL; i++)
+    g_ptr_array_add (names, (char *)supported_volume_keys[i]);
+}
+
+static char **
+read_lines (const char *path)
+{
+  g_autofree char *data = NULL;
+
+  if (!g_file_get_contents (path, &data, NULL, NULL))
+    return g_new0 (char *, 1);
+
+  return g_strsplit (data, "\n", -1);
+}
+
+QuadContext *
+quad_context_new (gboolean user)
+{
+  QuadContext *ctx = g_new0 (QuadContext, 1);
+  const char *unit_dirs_env = g_getenv ("QUADLET_UNIT_DIRS");
+
+  ctx->user = user;
+  ctx->kmsg_fd = -1;
+
+  if (unit_dirs_env != NULL)
+    ctx->unit_dirs = g_strsplit (unit_dirs_env, ":", -1);
+  else if (user)
+    {
+      ctx->unit_dirs = g_new0 (char *, 2);
+      ctx->unit_dirs[0] = g_build_filename (g_get_user_config_dir (), "containers/systemd", NULL);
+    }
+  else
+    {
+      ctx->unit_dirs = g_new0 (char *, 3);
+      ctx->unit_dirs[0] = g_strdup (QUADLET_UNIT_DIR_ADMIN);
+      ctx->unit_dirs[1] = g_strdup (QUADLET_UNIT_DIR_DISTRO);
+    }
+
+  ctx->supported_keys = quad_str_table_new (NULL, (GDestroyNotify)quad_table_free);
+  quad_table_insert (ctx->supported_keys, (char *)"Container",
+                     new_supported_keys_hash (supported_container_keys));
+  quad_table_insert (ctx->supported_keys, (char *)"Volume",
+                     new_supported_keys_hash (supported_volume_keys));
+
+  quad_context_set_subid_files (ctx, "/etc/subuid", "/etc/subgid");
+
+  return ctx;
+}
+
+void
+quad_context_free (QuadContext *ctx)
+{
+  g_strfreev (ctx->unit_dirs);
+  g_strfreev (ctx->subuid_lines);
+  g_strfreev (ctx->subgid_lines);
+  quad_ranges_free (ctx->default_remap_uids);
+  quad_ranges_free (ctx->default_remap_gids);
+  quad_table_free (ctx->supported_keys);
+  if (ctx->kmsg_fd >= 0)
+    close (ctx->kmsg_fd);
+  g_free (ctx);
+}
+
+void
+quad_context_set_unit_dirs (QuadContext *ctx,
+                            const char **unit_dirs)
+{
+  g_strfreev (ctx->unit_dirs);
+  ctx->unit_dirs = g_strdupv ((char **)unit_dirs);
+}
+
+/* The files are read once here, as all conversions use them. The
+ * default remaps are the ranges of the quadlet user */
+void
+quad_context_set_subid_files (QuadContext *ctx,
+                              const char *subuid_path,
+                              const char *subgid_path)
+{
+  g_strfreev (ctx->subuid_lines);
+  g_strfreev (ctx->subgid_lines);
+  g_clear_pointer (&ctx->default_remap_uids, quad_ranges_free);
+  g_clear_pointer (&ctx->default_remap_gids, quad_ranges_free);
+
+  ctx->subuid_lines = read_lines (subuid_path);
+  ctx->subgid_lines = read_lines (subgid_path);
+
+  ctx->default_remap_uids = quad_lookup_subid (ctx->subuid_lines, QUADLET_USERNAME);
+  if (ctx->default_remap_uids == NULL) /* Fall back to built-in default */
+    ctx->default_remap_uids = quad_ranges_new (QUADLET_FALLBACK_UID_START, QUADLET_FALLBACK_UID_LENGTH);
+
+  ctx->default_remap_gids = quad_lookup_subid (ctx->subgid_lines, QUADLET_USERNAME);
+  if (ctx->default_remap_gids == NULL) /* Fall back to built-in default */
+    ctx->default_remap_gids = quad_ranges_new (QUADLET_FALLBACK_GID_START, QUADLET_FALLBACK_GID_LENGTH);
+}
+
+void
+quad_context_set_debug (QuadContext *ctx,
+                        gboolean debug)
+{
+  ctx->debug = debug;
+}
+
+/* Generators have no stderr to speak of, so they log to the kernel */
+void
+quad_context_set_use_kmsg (QuadContext *ctx,
+                           gboolean use_kmsg)
+{
+  if (ctx->kmsg_fd >= 0)
+    close (ctx->kmsg_fd);
+  ctx->kmsg_fd = -1;
+
+  if (use_kmsg)
+    ctx->kmsg_fd = open ("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+}
+
+gboolean
+quad_context_is_user (QuadContext *ctx)
+{
+  return ctx->user;
+}
+
+const char **
+quad_context_get_unit_dirs (QuadContext *ctx)
+{
+  return (const char **)ctx->unit_dirs;
+}
+
+/* Returns a set of keys, or NULL if any key is allowed */
+QuadTable *
+quad_context_get_supported_keys (QuadContext *ctx,
+                                 const char *group_name)
+{
+  return quad_table_lookup (ctx->supported_keys, group_name);
+}
+
+QuadRanges *
+quad_context_get_default_remap_uids (QuadContext *ctx)
+{
+  return ctx->default_remap_uids;
+}
+
+QuadRanges *
+quad_context_get_default_remap_gids (QuadContext *ctx)
+{
+  return ctx->default_remap_gids;
+}
+
+/* These are QuadRangeLookupFuncs, with the context as user data */
+QuadRanges *
+quad_context_lookup_subuid (const char *user,
+                            gpointer ctx)
+{
+  return quad_lookup_subid (((QuadContext *)ctx)->subuid_lines, user);
+}
+
+QuadRanges *
+quad_context_lookup_subgid (const char *user,
+                            gpointer ctx)
+{
+  return quad_lookup_subid (((QuadContext *)ctx)->subgid_lines, user);
+}
+
+/* This is a dl_iterate_phdr() callback, the first object is the
+ * program itself */
+static int
+append_build_id (struct dl_phdr_info *info,
+                 G_GNUC_UNUSED size_t size,
+                 void *data)
+{
+  GString *state = data;
+
+  for (guint i = 0; i < info->dlpi_phnum; i++)
+    {
+      const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+      const char *p, *end;
+
+      if (phdr->p_type != PT_NOTE)
+        continue;
+
+      p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+      end = p + phdr->p_memsz;
+      while (p + sizeof (ElfW(Nhdr)) <= end)
+        {
+          const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+          const char *name = p + sizeof (ElfW(Nhdr));
+          const char *desc = name + ((note->n_namesz + 3) & ~3);
+
+          if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+              memcmp (name, "GNU", 4) == 0 && desc + note->n_descsz <= end)
+            {
+              g_string_append_len (state, desc, note->n_descsz);
+              return 1;
+            }
+
+          p = desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+
+  return 1;
+}
+
+/* Identifies the generator, so a new build doesn't use what an older
+ * one converted. Without a build ID, the executable is identified by
+ * its inode and modification time */
+static void
+append_generator_id (GString *state)
+{
+  gsize len;
+  struct stat st;
+
+  g_string_append_len (state, PACKAGE_VERSION, strlen (PACKAGE_VERSION) + 1);
+  len = state->len;
+
+  dl_iterate_phdr (append_build_id, state);
+  if (state->len == len && stat ("/proc/self/exe", &st) == 0)
+    g_string_append_printf (state, "%lu:%lu:%lld:%lld", (gulong)st.st_dev, (gulong)st.st_ino,
+                            (long long)st.st_size, (long long)st.st_mtime);
+  g_string_append_c (state, '\0');
+}
+
+/* Everything conversions depend on apart from the units themselves,
+ * as a string of 32 hex digits. The passwd and group files are used
+ * for the HostUser and HostGroup keys */
+char *
+quad_context_get_state_hash (QuadContext *ctx)
+{
+  g_autoptr(GString) state = g_string_new (ctx->user ? "user" : "system");
+  const char *files[] = { "/etc/passwd", "/etc/group" };
+
+  if (ctx->user)
+    g_string_append_printf (state, " %lu:%lu", (gulong)getuid (), (gulong)getgid ());
+  g_string_append_c (state, '\0');
+
+  append_generator_id (state);
+
+  for (guint i = 0; ctx->unit_dirs[i] != NULL; i++)
+    g_string_append_len (state, ctx->unit_dirs[i], strlen (ctx->unit_dirs[i]) + 1);
+  g_string_append_c (state, '\0');
+
+  for (guint i = 0; ctx->subuid_lines[i] != NULL; i++)
+    g_string_append_len (state, ctx->subuid_lines[i], strlen (ctx->subuid_lines[i]) + 1);
+  g_string_append_c (state, '\0');
+
+  for (guint i = 0; ctx->subgid_lines[i] != NULL; i++)
+    g_string_append_len (state, ctx->subgid_lines[i], strlen (ctx->subgid_lines[i]) + 1);
+  g_string_append_c (state, '\0');
+
+  for (guint i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      g_autofree char *data = NULL;
+      gsize len = 0;
+
+      if (g_file_get_contents (files[i], &data, &len, NULL))
+        g_string_append_len (state, data, len);
+      g_string_append_c (state, '\0');
+    }
+
+  return quad_hash128_to_string (quad_hash128 (state->str, state->len, 0));
+}
+
+/* The messages that are logged on this thread, see
+ * quad_context_capture_log() */
+static GPrivate log_capture;
+
+static void
+context_log (QuadContext *ctx,
+             const char *s)
+{
+  g_autofree char *log = NULL;
+
+  if (ctx->kmsg_fd < 0)
+    {
+      quad_log ("%s", s);
+      return;
+    }
+
+  log = g_strdup_printf ("quadlet-generator[%d]: %s\n", getpid (), s);
+
+  /* A single write, so lines from different threads don't mix */
+  if (write (ctx->kmsg_fd, log, strlen (log)) < 0)
+    quad_log ("%s", s);
+}
+
+void
+quad_context_log (QuadContext *ctx,
+                  const char *fmt,
+                  ...)
+{
+  GPtrArray *capture = g_private_get (&log_capture);
+  g_autofree char *s = NULL;
+  va_list args;
+
+  va_start (args, fmt);
+  s = g_strdup_vprintf (fmt, args);
+  va_end (args);
+
+  if (capture != NULL)
+    g_ptr_array_add (capture, g_strdup (s));
+
+  context_log (ctx, s);
+}
+
+void
+quad_context_debug (QuadContext *ctx,
+                    const char *fmt,
+                    ...)
+{
+  g_autofree char *s = NULL;
+  va_list args;
+
+  if (!ctx->debug)
+    return;
+
+  va_start (args, fmt);
+  s = g_strdup_vprintf (fmt, args);
+  va_end (args);
+
+  context_log (ctx, s);
+}
+
+/* Adds copies of the messages that are logged with quad_context_log()
+ * on the calling thread to messages, until this is called with NULL.
+ * They are still logged as usual */
+void
+quad_context_capture_log (G_GNUC_UNUSED QuadContext *ctx,
+                          GPtrArray *messages)
+{
+  g_private_set (&log_capture, messages);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glib.h>
+#include <utils.h>
+
+G_BEGIN_DECLS
+
+/* The host state that conversions depend on: the unit directories, the
+ * subuid/subgid files, the supported keys and where to log. It is set
+ * up with the setters first, after which it is only read, apart from
+ * logging, so it can be shared between threads */
+typedef struct QuadContext QuadContext;
+
+QuadContext *       quad_context_new                   (gboolean      user);
+void                quad_context_free                  (QuadContext  *ctx);
+
+void                quad_context_set_unit_dirs         (QuadContext  *ctx,
+                                                        const char  **unit_dirs);
+void                quad_context_set_subid_files       (QuadContext  *ctx,
+                                                        const char   *subuid_path,
+                                                        const char   *subgid_path);
+void                quad_context_set_debug             (QuadContext  *ctx,
+                                                        gboolean      debug);
+void                quad_context_set_use_kmsg          (QuadContext  *ctx,
+                                                        gboolean      use_kmsg);
+
+gboolean            quad_context_is_user               (QuadContext  *ctx);
+const char **       quad_context_get_unit_dirs         (QuadContext  *ctx);
+QuadTable *         quad_context_get_supported_keys    (QuadContext  *ctx,
+                                                        const char   *group_name);
+QuadRanges *        quad_context_get_default_remap_uids (QuadContext *ctx);
+QuadRanges *        quad_context_get_default_remap_gids (QuadContext *ctx);
+QuadRanges *        quad_context_lookup_subuid         (const char   *user,
+                                                        gpointer      ctx);
+QuadRanges *        quad_context_lookup_subgid         (const char   *user,
+                                                        gpointer      ctx);
+
+char *              quad_context_get_state_hash        (QuadContext  *ctx);
+
+void                quad_context_add_known_names       (GPtrArray    *names);
+
+void                quad_context_log                   (QuadContext  *ctx,
+                                                        const char   *fmt,
+                                                        ...) G_GNUC_PRINTF (2, 3);
+void                quad_context_debug                 (QuadContext  *ctx,
+                                                        const char   *fmt,
+                                                        ...) G_GNUC_PRINTF (2, 3);
+void                quad_context_capture_log           (QuadContext  *ctx,
+                                                        GPtrArray    *messages);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadContext, quad_context_free)
+
+G_END_DECLS
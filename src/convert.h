@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glib.h>
+#include <context.h>
+#include <unitfile.h>
+
+G_BEGIN_DECLS
+
+#define UNIT_GROUP "Unit"
+#define INSTALL_GROUP "Install"
+#define SERVICE_GROUP "Service"
+#define CONTAINER_GROUP "Container"
+#define X_CONTAINER_GROUP "X-Container"
+#define VOLUME_GROUP "Volume"
+#define X_VOLUME_GROUP "X-Volume"
+
+/* Convert a unit into the service that runs it. The unit is only read,
+ * so different units can be converted on different threads with the
+ * same context */
+QuadUnitFile *quad_convert_container (QuadContext   *ctx,
+                                      QuadUnitFile  *container,
+                                      GError       **error);
+QuadUnitFile *quad_convert_volume    (QuadContext   *ctx,
+                                      QuadUnitFile  *container,
+                                      const char    *name,
+                                      GError       **error);
+
+G_END_DECLS
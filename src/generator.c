@@ -1,818 +1,747 @@
 #include "quadlet-config.h"
 
-#include <glib-object.h>
+#include <glib.h>
+#include <context.h>
+#include <cache.h>
+#include <convert.h>
 #include <unitfile.h>
-#include <podman.h>
 #include <utils.h>
+#include <uring.h>
+#include <writer.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
-#define UNIT_GROUP "Unit"
-#define INSTALL_GROUP "Install"
-#define SERVICE_GROUP "Service"
-#define CONTAINER_GROUP "Container"
-#define X_CONTAINER_GROUP "X-Container"
-#define VOLUME_GROUP "Volume"
-#define X_VOLUME_GROUP "X-Volume"
-
-
-static const char *supported_container_keys[] = {
-  "ContainerName",
-  "Image",
-  "Environment",
-  "Exec",
-  "NoNewPrivileges",
-  "DropCapability",
-  "AddCapability",
-  "ReadOnly",
-  "RemapUsers",
-  "RemapUidStart",
-  "RemapGidStart",
-  "RemapUidRanges",
-  "RemapGidRanges",
-  "Notify",
-  "SocketActivated",
-  "ExposeHostPort",
-  "PublishPort",
-  "KeepId",
-  "User",
-  "Group",
-  "HostUser",
-  "HostGroup",
-  "Volume",
-  "PodmanArgs",
-  "Label",
-  "Annotation",
-  "RunInit",
-  "VolatileTmp",
-  "Timezone",
-  NULL
-};
-static GHashTable *supported_container_keys_hash = NULL;
-
-static const char *supported_volume_keys[] = {
-  "User",
-  "Group",
-  "Label",
-  NULL
-};
-static GHashTable *supported_volume_keys_hash = NULL;
+/* Operations per io_uring batch */
+#define URING_ENTRIES 256
 
-static QuadRanges *default_remap_uids = NULL;
-static QuadRanges *default_remap_gids = NULL;
+#define SERVICE_HEADER "# Automatically generated by quadlet-generator\n"
 
-static gboolean quad_is_user = FALSE;
+/* Writes the unit straight from its line values instead of printing
+ * it to a string first, this is a QuadWriteFunc */
+static gboolean
+write_service_file (int fd,
+                    gpointer user_data,
+                    GError **error)
+{
+  QuadUnitFile *service = user_data;
 
-const char *default_drop_caps[] = {
-  "all",
-  NULL
-};
+  return quad_write_all (fd, SERVICE_HEADER, strlen (SERVICE_HEADER), error) &&
+    quad_unit_file_write_fd (service, fd, error);
+}
 
-static void
-warn_for_unknown_keys (QuadUnitFile *unit,
-                       const char *group_name,
-                       const char **supported_keys,
-                       GHashTable **supported_hash_p)
+/* For when the contents are needed for more than writing them */
+static GBytes *
+print_service_file (QuadUnitFile *service)
 {
-  g_autofree const char **keys = quad_unit_file_list_keys (unit, group_name);
-  g_autoptr(GHashTable) warned = NULL;
-
-  if (*supported_hash_p == NULL)
-    {
-      *supported_hash_p = g_hash_table_new (g_str_hash, g_str_equal);
-      for (guint i = 0; supported_keys[i] != NULL; i++)
-        g_hash_table_add (*supported_hash_p, (char *)supported_keys[i]);
-    }
+  GString *str = g_string_new (SERVICE_HEADER);
 
-  for (guint i = 0; keys[i] != NULL; i++)
-    {
-      const char *key = keys[i];
-      if (!g_hash_table_contains (*supported_hash_p, key))
-        {
-          if (warned == NULL)
-            warned = g_hash_table_new (g_str_hash, g_str_equal);
-          if (!g_hash_table_contains (warned, key))
-            {
-              quad_log ("Unsupported key '%s' in group '%s' in %s", key, group_name, quad_unit_file_get_path (unit));
-              g_hash_table_add (warned, (char *)key);
-            }
-        }
-    }
+  quad_unit_file_print (service, str);
+  return g_string_free_to_bytes (str);
 }
 
 static void
-parse_key_val (GHashTable *out,
-               const char *env_val)
+add_source_keys (QuadUnitFile *service,
+                 QuadUnitFile *orig_unit)
 {
-  char *eq = strchr (env_val, '=');
-  if (eq != NULL)
-    g_hash_table_insert (out, g_strndup (env_val, eq - env_val), g_strdup (eq+1));
-  else
-    quad_log ("Invalid key=value assignment '%s'", env_val);
+  const char *orig_path = quad_unit_file_get_path (orig_unit);
+  QuadHash128 source_hash = quad_unit_file_hash (orig_unit);
+  g_autofree char *source_hash_str = quad_hash128_to_string (source_hash);
+
+  if (orig_path)
+    quad_unit_file_add (service, UNIT_GROUP,
+                        "SourcePath", orig_path);
+
+  /* Lets tools tell if a generated file is out of date without
+   * comparing the text, which also depends on comments and layout */
+  quad_unit_file_add (service, UNIT_GROUP,
+                      "X-Quadlet-SourceHash", source_hash_str);
 }
 
-static GHashTable *
-parse_keys (char **key_vals)
+/* Writes the service, from the unit or from output if it was printed */
+static gboolean
+generate_service_file (QuadContext *ctx,
+                       QuadWriter *writer,
+                       const char *service_name,
+                       QuadUnitFile *service,
+                       GBytes *output)
 {
-  GHashTable *res = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  for (int i = 0 ; key_vals[i] != NULL; i++)
+  g_autoptr(GError) error = NULL;
+  gboolean ok;
+
+  quad_context_debug (ctx, "writing '%s/%s'", quad_writer_get_path (writer), service_name);
+
+  if (output != NULL)
     {
-      g_autoptr(GPtrArray) assigns = quad_split_string (key_vals[i], WHITESPACE, QUAD_SPLIT_RELAX|QUAD_SPLIT_UNQUOTE|QUAD_SPLIT_CUNESCAPE);
-      for (guint j = 0; j < assigns->len; j++)
-        parse_key_val (res, g_ptr_array_index (assigns, j));
+      gsize len;
+      const char *data = g_bytes_get_data (output, &len);
+
+      ok = quad_writer_write_data (writer, service_name, data, len, &error);
     }
-  return res;
-}
+  else
+    ok = quad_writer_write (writer, service_name, write_service_file, service, &error);
 
-static void
-add_id_map (QuadPodman *podman,
-            const char *arg_prefix,
-            guint32 container_id_start,
-            guint32 host_id_start,
-            guint32 num_ids)
-{
-  if (num_ids != 0)
+  if (!ok)
     {
-      quad_podman_add (podman, arg_prefix);
-      quad_podman_addf (podman, "%"G_GUINT32_FORMAT":%"G_GUINT32_FORMAT":%"G_GUINT32_FORMAT, container_id_start, host_id_start, num_ids);
+      quad_context_log (ctx, "Error writing '%s/%s', ignoring: %s",
+                        quad_writer_get_path (writer), service_name, error->message);
+      return FALSE;
     }
+
+  return TRUE;
 }
 
-static void
-add_id_maps (QuadPodman *podman,
-             const char *arg_prefix,
-             guint32 container_id,
-             guint32 host_id,
-             guint32 remap_start_id,
-             QuadRanges *available_host_ids)
+/* Returns the symlinks that enable the service, relative to the
+ * output directory */
+static GPtrArray *
+get_service_symlinks (const char *service_name,
+                      QuadUnitFile *service)
 {
-  g_autoptr(QuadRanges) unmapped_ids = NULL;
-  g_autoptr(QuadRanges) mapped_ids = NULL;
-  g_autoptr(QuadRanges) no_uids = NULL;
+  GPtrArray *symlinks = g_ptr_array_new_with_free_func (g_free);
 
-  if (available_host_ids == NULL)
+  g_auto(GStrv) alias = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "Alias");
+  for (guint i = 0; alias[i] != NULL; i++)
+    g_ptr_array_add (symlinks, canonicalize_relative_path (alias[i]));
+
+  g_auto(GStrv) wanted_by = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "WantedBy");
+  for (guint i = 0; wanted_by[i] != NULL; i++)
     {
-      /* Map everything by default */
-      no_uids = quad_ranges_new_empty ();
-      available_host_ids = no_uids;
+      char *wanted_by_unit = wanted_by[i];
+      /* Only allow filenames, not paths */
+      if (strchr (wanted_by_unit, '/') == NULL)
+        g_ptr_array_add (symlinks, g_strdup_printf ("%s.wants/%s", wanted_by_unit, service_name));
     }
 
-  /* Map the first ids up to remap_start_id to the host equivalent */
-  unmapped_ids = quad_ranges_new (0, remap_start_id);
-
-  /* The rest we want to map to available_host_ids. Note that this
-   * overlaps unmapped_ids, because below we may remove ranges from
-   * unmapped ids and we want to backfill those. */
-  mapped_ids = quad_ranges_new (0, UINT32_MAX);
-
-  /* Always map specified uid to specified host_uid */
-  add_id_map (podman, arg_prefix, container_id, host_id, 1);
-
-  /* We no longer want to map this container id as its already mapped*/
-  quad_ranges_remove (mapped_ids, container_id, 1);
-  quad_ranges_remove (unmapped_ids, container_id, 1);
-
-  /* But also, we don't want to use the *host* id again, as we can only map it once  */
-  quad_ranges_remove (unmapped_ids, host_id, 1);
-  quad_ranges_remove (available_host_ids, host_id, 1);
-
-  /* Map unmapped ids to equivalent host range, and remove from mapped_ids to avoid double-mapping */
-  for (guint idx = 0; idx < unmapped_ids->n_ranges; idx++)
+  g_auto(GStrv) required_by = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "RequiredBy");
+  for (guint i = 0; required_by[i] != NULL; i++)
     {
-      QuadRange *range = &unmapped_ids->ranges[idx];
-      guint32 start = range->start;
-      guint32 length = range->length;
-
-      add_id_map (podman, arg_prefix, start, start, length);
-      quad_ranges_remove (mapped_ids, start, length);
-      quad_ranges_remove (available_host_ids, start, length);
+      char *required_by_unit = required_by[i];
+      /* Only allow filenames, not paths */
+      if (strchr (required_by_unit, '/') == NULL)
+        g_ptr_array_add (symlinks, g_strdup_printf ("%s.requires/%s", required_by_unit, service_name));
     }
 
-  for (guint c_idx = 0; c_idx < mapped_ids->n_ranges && available_host_ids->n_ranges > 0; c_idx++)
+  return symlinks;
+}
+
+static void
+enable_service_file (QuadContext *ctx,
+                     QuadWriter *writer,
+                     const char *service_name,
+                     GPtrArray *symlinks)
+{
+  for (guint i = 0; i < symlinks->len; i++)
     {
-      QuadRange *c_range = &mapped_ids->ranges[c_idx];
-      guint32 c_start = c_range->start;
-      guint32 c_length = c_range->length;
+      const char *symlink_rel = g_ptr_array_index (symlinks, i);
+      g_autoptr(GString) target = g_string_new ("");
 
-      while (c_length > 0 && available_host_ids->n_ranges > 0)
+      /* At this point the symlinks are all relative, canonicalized
+         paths, so number of slashes is the depth */
+
+      const char *p = symlink_rel;
+      while ((p = strchr (p, '/')) != NULL)
         {
-          QuadRange *h_range = &available_host_ids->ranges[0];
-          guint32 h_start = h_range->start;
-          guint32 h_length = h_range->length;
+          p++;
+          g_string_append (target, "../");
+        }
+      g_string_append (target, service_name);
 
-          guint32 next_length = MIN (h_length, c_length);
+      quad_context_log (ctx, "Creating symlink %s/%s -> %s",
+                        quad_writer_get_path (writer), symlink_rel, target->str);
 
-          add_id_map (podman, arg_prefix, c_start, h_start, next_length);
-          quad_ranges_remove (available_host_ids, h_start, next_length);
-          c_start += next_length;
-          c_length -= next_length;
-        }
+      /* If an earlier unit already took the name, it is skipped */
+      quad_writer_queue_symlink (writer, target->str, symlink_rel);
     }
 }
 
-static gboolean
-is_port_range (const char *port)
+static int
+compare_basenames (gconstpointer a,
+                   gconstpointer b)
 {
-  return g_regex_match_simple ("\\d+(-\\d+)?(/udp|/tcp)?$", port, G_REGEX_DOLLAR_ENDONLY, G_REGEX_MATCH_ANCHORED);
+  const char *path_a = *(const char **)a;
+  const char *path_b = *(const char **)b;
+
+  return strcmp (strrchr (path_a, '/') + 1, strrchr (path_b, '/') + 1);
 }
 
-static QuadUnitFile *
-convert_container (QuadUnitFile *container, GError **error)
+/* Drop-ins with the same name shadow each other in the same way as
+ * units, and are applied in the order of their names */
+static GPtrArray *
+find_drop_ins (const char *name,
+               const char **source_paths)
 {
-  g_autoptr(QuadUnitFile) service =  quad_unit_file_copy (container);
-
-  /* Rename old Container group to x-Container so that systemd ignores it */
-  quad_unit_file_rename_group (service, CONTAINER_GROUP, X_CONTAINER_GROUP);
-
-  warn_for_unknown_keys (container, CONTAINER_GROUP, supported_container_keys, &supported_container_keys_hash);
+  g_autoptr(QuadTable) seen = quad_str_table_new (NULL, NULL);
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *dropin_dir_name = g_strconcat (name, ".d", NULL);
 
-  g_autofree char *image = quad_unit_file_lookup (container, CONTAINER_GROUP, "Image");
-  if (image == NULL || image[0] == 0)
+  for (guint i = 0; source_paths[i] != NULL; i++)
     {
-      quad_fail (error, "No Image key specified");
-      return NULL;
-    }
+      g_autofree char *dropin_dir = g_build_filename (source_paths[i], dropin_dir_name, NULL);
+      g_autoptr(GDir) dir = g_dir_open (dropin_dir, 0, NULL);
+      const char *conf;
 
-  g_autofree char *container_name = quad_unit_file_lookup (container, CONTAINER_GROUP, "ContainerName");
-  if (container_name == NULL || container_name[0] == 0)
-    /* By default, We want to name the container by the service name */
-    container_name = g_strdup ("systemd-%N");
+      if (dir == NULL)
+        continue;
 
-  /* Set PODMAN_SYSTEMD_UNIT so that podman auto-update can restart the service. */
-  quad_unit_file_add (service, SERVICE_GROUP,
-                      "Environment", "PODMAN_SYSTEMD_UNIT=%n");
+      while ((conf = g_dir_read_name (dir)) != NULL)
+        {
+          char *path;
 
-  /* Only allow mixed or control-group, as nothing else works well */
-  g_autofree char *kill_mode = quad_unit_file_lookup (service, SERVICE_GROUP, "KillMode");
-  if (kill_mode == NULL ||
-      !(strcmp (kill_mode, "mixed") == 0 ||
-        strcmp (kill_mode, "control-group") == 0))
-    {
-      if (kill_mode != NULL)
-        quad_log ("Invalid KillMode '%s', ignoring", kill_mode);
+          if (!g_str_has_suffix (conf, ".conf") || quad_table_contains (seen, conf))
+            continue;
 
-      /* We default to mixed instead of control-group, because it lets conmon do its thing */
-      quad_unit_file_set (service, SERVICE_GROUP, "KillMode", "mixed");
+          path = g_build_filename (dropin_dir, conf, NULL);
+          g_ptr_array_add (paths, path);
+          /* Points into path, which has the name as the last element */
+          quad_table_add (seen, path + strlen (path) - strlen (conf));
+        }
     }
 
-  /* Read env early so we can override it below */
-  g_auto(GStrv) environments = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "Environment");
-  g_autoptr(GHashTable) podman_env = parse_keys (environments);
+  g_ptr_array_sort (paths, compare_basenames);
 
-  /* Need the containers filesystem mounted to start podman */
-  quad_unit_file_add (service, UNIT_GROUP,
-                      "RequiresMountsFor", "%t/containers");
+  return paths;
+}
 
-  /* Remove any leftover cid file before starting, just to be sure.
-   * We remove any actual pre-existing container by name with --replace=true.
-   * But --cidfile will fail if the target exists. */
-  quad_unit_file_add (service, SERVICE_GROUP,
-                      "ExecStartPre", "-rm -f %t/%N.cid");
+/* Base units are shared by all units that use them, so they are only
+ * loaded once per run. They are frozen, as units that are converted on
+ * other threads look them up too */
+typedef struct {
+  QuadUnitFile *unit; /* Frozen */
+  GPtrArray *inputs;  /* The files it was loaded from, for the cache */
+} BaseUnit;
 
-  /* If the conman exited uncleanly it may not have removed the container, so force it,
-   * -i makes it ignore non-existing files. */
-  quad_unit_file_add (service, SERVICE_GROUP,
-                      "ExecStopPost", "-/usr/bin/podman rm -f -i --cidfile=%t/%N.cid");
+static void
+base_unit_free (BaseUnit *base)
+{
+  quad_unit_file_unref (base->unit);
+  g_ptr_array_unref (base->inputs);
+  g_free (base);
+}
 
-  /* Remove the cid file, to avoid confusion as the container is no longer running. */
-  quad_unit_file_add (service, SERVICE_GROUP,
-                      "ExecStopPost", "-rm -f %t/%N.cid");
+typedef struct {
+  GMutex lock;
+  QuadTable *units; /* path -> BaseUnit */
+} BaseUnitCache;
+
+static QuadUnitFile *load_unit (QuadContext *ctx,
+                                const char *path,
+                                GBytes *contents,
+                                const char *group_name,
+                                GPtrArray *drop_ins,
+                                BaseUnitCache *base_units,
+                                GPtrArray *loading,
+                                GPtrArray *inputs,
+                                GError **error);
 
-  g_autoptr(QuadPodman) podman = quad_podman_new ("run", NULL);
+static QuadUnitFile *
+use_base_unit (BaseUnit *base,
+               GPtrArray *inputs)
+{
+  for (guint i = 0; i < base->inputs->len; i++)
+    g_ptr_array_add (inputs, g_strdup (g_ptr_array_index (base->inputs, i)));
 
-  quad_podman_addf (podman, "--name=%s", container_name);
+  return quad_unit_file_ref (base->unit);
+}
 
-  quad_podman_addv (podman,
+/* loading has the paths of the base units that this thread is loading,
+ * to detect loops. The files the base unit is loaded from are added
+ * to inputs */
+static QuadUnitFile *
+load_base_unit (QuadContext *ctx,
+                const char *path,
+                const char *group_name,
+                BaseUnitCache *base_units,
+                GPtrArray *loading,
+                GPtrArray *inputs,
+                GError **error)
+{
+  g_autoptr(QuadUnitFile) loaded = NULL;
+  g_autoptr(GPtrArray) loaded_inputs = NULL;
+  QuadUnitFile *unit = NULL;
+  BaseUnit *base;
 
-                    /* We store the container id so we can clean it up in case of failure */
-                    "--cidfile=%t/%N.cid",
+  g_mutex_lock (&base_units->lock);
+  base = quad_table_lookup (base_units->units, path);
+  if (base != NULL)
+    unit = use_base_unit (base, inputs);
+  g_mutex_unlock (&base_units->lock);
 
-                    /* And replace any previous container with the same name, not fail */
-                    "--replace",
+  if (unit != NULL)
+    return unit;
 
-                    /* On clean shutdown, remove container */
-                    "--rm",
+  for (guint i = 0; i < loading->len; i++)
+    {
+      if (strcmp (g_ptr_array_index (loading, i), path) == 0)
+        {
+          quad_fail (error, "Base unit %s includes itself", path);
+          return NULL;
+        }
+    }
 
-                    /* Detach from container, we don't need the podman process to hang around */
-                    "-d",
+  quad_context_debug (ctx, "Loading base unit file %s", path);
 
-                    /* But we still want output to the journal, so use the log driver.
-                     * TODO: Once available we want to use the passthrough log-driver instead. */
-                    "--log-driver", "journald",
+  loaded_inputs = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (loading, (char *)path);
+  loaded = load_unit (ctx, path, NULL, group_name, NULL, base_units, loading, loaded_inputs, error);
+  g_ptr_array_remove_index (loading, loading->len - 1);
+  if (loaded == NULL)
+    return NULL;
 
-                    /* Never try to pull the image during service start */
-                    "--pull=never",
+  /* Another thread may have loaded it in the meantime, which gives
+   * the same unit, so whichever was first is used */
+  g_mutex_lock (&base_units->lock);
+  base = quad_table_lookup (base_units->units, path);
+  if (base == NULL)
+    {
+      base = g_new0 (BaseUnit, 1);
+      base->unit = quad_unit_file_freeze (loaded);
+      base->inputs = g_steal_pointer (&loaded_inputs);
+      quad_table_insert (base_units->units, g_strdup (path), base);
+    }
+  unit = use_base_unit (base, inputs);
+  g_mutex_unlock (&base_units->lock);
 
-                    NULL);
+  return unit;
+}
 
-  /* We use crun as the runtime and delegated groups to it */
-  quad_unit_file_add (service, SERVICE_GROUP, "Delegate", "yes");
-  quad_podman_addv (podman,
-                    "--runtime", "/usr/bin/crun",
-                    "--cgroups=split",
-                    NULL);
+/* Loads the file, unless its contents were already read, and adds its
+ * hash to inputs */
+static QuadUnitFile *
+load_input (const char *path,
+            GBytes *contents,
+            GPtrArray *inputs,
+            GError **error)
+{
+  QuadUnitFile *unit;
+  QuadHash128 hash;
 
-  g_autofree char *timezone =  quad_unit_file_lookup (container, CONTAINER_GROUP, "Timezone");
-  if (timezone != NULL && *timezone != 0)
-    quad_podman_addf (podman, "--tz=%s", timezone);
+  if (contents != NULL)
+    unit = quad_unit_file_new_from_contents (path, contents, QUAD_UNIT_FILE_PARSE_NONE, &hash, error);
+  else
+    unit = quad_unit_file_new_from_path_full (path, QUAD_UNIT_FILE_PARSE_NONE, &hash, error);
+  if (unit != NULL)
+    quad_cache_add_input (inputs, path, hash);
 
-  /* Run with a pid1 init to reap zombies by default (as most apps don't do that) */
-  gboolean run_init = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "RunInit", TRUE);
-  if (run_init)
-    quad_podman_addv (podman, "--init", NULL);
+  return unit;
+}
 
+/* Loads a unit with its drop-ins and base unit. These are added as
+ * layers rather than merged, so they are never copied. Every file
+ * that is read is added to inputs */
+static QuadUnitFile *
+load_unit (QuadContext *ctx,
+           const char *path,
+           GBytes *contents,
+           const char *group_name,
+           GPtrArray *drop_ins,
+           BaseUnitCache *base_units,
+           GPtrArray *loading,
+           GPtrArray *inputs,
+           GError **error)
+{
+  g_autoptr(QuadUnitFile) unit = NULL;
+  g_autoptr(QuadUnitFile) layered = NULL;
+  g_autoptr(GPtrArray) layers = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_file_unref);
+  g_autofree char *base_name = NULL;
 
-  /* By default we handle startup notification with conmon, but allow passing it to the container with Notify=yes */
-  gboolean notify = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "Notify", FALSE);
-  if (notify)
-    quad_podman_add (podman, "--sdnotify=container");
-  else
-    quad_podman_add (podman, "--sdnotify=conmon");
-  quad_unit_file_setv (service, SERVICE_GROUP,
-                       "Type", "notify",
-                       "NotifyAccess", "all",
-                       NULL);
-
-  if (!quad_unit_file_has_key (container, SERVICE_GROUP, "SyslogIdentifier"))
-    quad_unit_file_set (service, SERVICE_GROUP, "SyslogIdentifier", "%N");
-
-  /* Default to no higher level privileges or caps */
-  gboolean no_new_privileges = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "NoNewPrivileges", TRUE);
-  if (no_new_privileges)
-    quad_podman_addv (podman, "--security-opt=no-new-privileges", NULL);
-
-  const char **drop_caps;
-  g_auto(GStrv) drop_caps_opts = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "DropCapability");
-  if (quad_unit_file_has_key (container, CONTAINER_GROUP, "DropCapability"))
-    drop_caps = (const char **)drop_caps_opts;
-  else
-    drop_caps = default_drop_caps;
-  for (guint i = 0; drop_caps[i] != NULL; i++)
-    {
-      g_autofree char *caps = g_strdup (drop_caps[i]);
-      for (guint j = 0; caps[j] != 0; j++)
-        caps[j] = g_ascii_tolower (caps[j]);
-      quad_podman_addf (podman, "--cap-drop=%s", caps);
-    }
+  unit = load_input (path, contents, inputs, error);
+  if (unit == NULL)
+    return NULL;
+  g_ptr_array_add (layers, quad_unit_file_ref (unit));
 
-  /* But allow overrides with AddCapability*/
-  g_auto(GStrv) add_caps = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "AddCapability");
-  for (guint i = 0; add_caps[i] != NULL; i++)
+  for (guint i = 0; drop_ins != NULL && i < drop_ins->len; i++)
     {
-      g_autofree char *caps = g_strdup (add_caps[i]);
-      for (guint j = 0; caps[j] != 0; j++)
-        caps[j] = g_ascii_tolower (caps[j]);
-      quad_podman_addf (podman, "--cap-add=%s", caps);
-    }
+      const char *drop_in_path = g_ptr_array_index (drop_ins, i);
+      QuadUnitFile *drop_in;
 
-  gboolean read_only = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "ReadOnly", FALSE);
-  if (read_only)
-    quad_podman_add (podman, "--read-only");
+      quad_context_debug (ctx, "Loading drop-in file %s", drop_in_path);
 
-  /* We want /tmp to be a tmpfs, like on rhel host */
-  gboolean volatile_tmp = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "VolatileTmp", TRUE);
-  if (volatile_tmp)
-    {
-      /* Read only mode already has a tmpfs by default */
-      if (!read_only)
-        quad_podman_addv (podman, "--tmpfs", "/tmp:rw,size=512M,mode=1777", NULL);
-    }
-  else if (read_only)
-    {
-      quad_podman_add (podman, "--read-only-tmpfs=false");
+      drop_in = load_input (drop_in_path, NULL, inputs, error);
+      if (drop_in == NULL)
+        return NULL;
+      g_ptr_array_add (layers, drop_in);
     }
 
-  gboolean socket_activated = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "SocketActivated", FALSE);
-  if (socket_activated)
-    {
-      /* TODO: This will not be needed with later podman versions that support activation directly:
-       *  https://github.com/containers/podman/pull/11316  */
-      quad_podman_add (podman, "--preserve-fds=1");
-      g_hash_table_insert (podman_env, g_strdup ("LISTEN_FDS"), g_strdup ("1"));
-
-      /* TODO: This will not be 2 when catatonit forwards fds:
-       *  https://github.com/openSUSE/catatonit/pull/15 */
-      g_hash_table_insert (podman_env, g_strdup ("LISTEN_PID"), g_strdup ("2"));
-    }
+  /* Drop-ins can change the base too, the last one wins */
+  for (guint i = layers->len; base_name == NULL && i-- > 0; )
+    base_name = quad_unit_file_lookup (g_ptr_array_index (layers, i), group_name, "Base");
+
+  if ((base_name == NULL || *base_name == 0) && layers->len == 1)
+    return g_steal_pointer (&unit);
 
-  uid_t default_container_uid = 0;
-  gid_t default_container_gid = 0;
+  layered = quad_unit_file_new ();
+  quad_unit_file_set_path (layered, path);
 
-  gboolean keep_id = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "KeepId", FALSE);
-  if (keep_id)
+  if (base_name != NULL && *base_name != 0)
     {
-      if (quad_is_user)
-        {
-          default_container_uid = getuid ();
-          default_container_gid = getgid ();
-          quad_podman_addv (podman, "--userns", "keep-id", NULL);
-        }
+      g_autofree char *base_path = NULL;
+      g_autoptr(QuadUnitFile) base = NULL;
+
+      /* Relative paths are relative to the unit using it */
+      if (g_path_is_absolute (base_name))
+        base_path = g_strdup (base_name);
       else
         {
-          keep_id = FALSE;
-          quad_log ("Key 'KeepId' in '%s' unsupported for system units, ignoring", quad_unit_file_get_path (container));
+          g_autofree char *dir = g_path_get_dirname (path);
+          base_path = g_build_filename (dir, base_name, NULL);
         }
-    }
 
-  uid_t uid = MAX (quad_unit_file_lookup_int (container, CONTAINER_GROUP, "User", default_container_uid), 0);
-  gid_t gid = MAX (quad_unit_file_lookup_int (container, CONTAINER_GROUP, "Group", default_container_gid), 0);
+      base = load_base_unit (ctx, base_path, group_name, base_units, loading, inputs, error);
+      if (base == NULL)
+        return NULL;
+      quad_unit_file_add_layer (layered, base);
+    }
 
-  uid_t host_uid = quad_unit_file_lookup_uid (container,CONTAINER_GROUP, "HostUser", uid, error);
-  if (host_uid == (uid_t)-1)
-    return NULL;
+  for (guint i = 0; i < layers->len; i++)
+    quad_unit_file_add_layer (layered, g_ptr_array_index (layers, i));
 
-  gid_t host_gid = quad_unit_file_lookup_gid (container,CONTAINER_GROUP, "HostGroup", gid, error);
-  if (host_gid == (gid_t)-1)
-    return NULL;
+  return g_steal_pointer (&layered);
+}
 
-  if (uid != default_container_uid || gid != default_container_uid)
-    {
-      quad_podman_add (podman, "--user");
-      if (gid == default_container_gid)
-        quad_podman_addf (podman, "%lu", (long unsigned)uid);
-      else
-        quad_podman_addf (podman, "%lu:%lu", (long unsigned)uid, (long unsigned)gid);
-    }
+/* A unit found in one of the source directories */
+typedef struct SourceUnit SourceUnit;
+struct SourceUnit {
+  char *name;
+  char *path;
+  const char *group_name;
+  GBytes *contents; /* If it was read in advance */
+  SourceUnit *shadowed; /* Same name in a later directory */
+  /* Set by the worker if the service was written, or is to be */
+  char *service_name;
+  GBytes *output;
+  char *output_hash; /* If the service is in the cache */
+  GPtrArray *symlinks;
+};
 
-  gboolean remap_users = quad_unit_file_lookup_boolean (container, CONTAINER_GROUP, "RemapUsers", FALSE);
+static void
+source_unit_free (SourceUnit *source)
+{
+  g_free (source->name);
+  g_free (source->path);
+  g_free (source->service_name);
+  g_free (source->output_hash);
+  g_clear_pointer (&source->contents, g_bytes_unref);
+  g_clear_pointer (&source->shadowed, source_unit_free);
+  g_clear_pointer (&source->output, g_bytes_unref);
+  g_clear_pointer (&source->symlinks, g_ptr_array_unref);
+  g_free (source);
+}
 
-  if (quad_is_user)
-    remap_users = FALSE;
+/* Units in earlier directories shadow those with the same name in later
+ * ones, so the admin can override what the distro ships. The shadowed
+ * units are kept, as they are used if the one shadowing them fails to
+ * load */
+static void
+find_units_in_dir (QuadContext *ctx,
+                   const char *source_path,
+                   QuadTable *units)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GError) dir_error = NULL;
+  const char *name;
 
-  if (!remap_users)
-    {
-      /* No remapping of users, although we still need maps if the
-         main user/group is remapped, even if most ids map one-to-one. */
-      if (uid != host_uid)
-        add_id_maps (podman, "--uidmap",
-                     uid, host_uid, UINT32_MAX, NULL);
-      if (gid != host_gid)
-        add_id_maps (podman, "--gidmap",
-                     gid, host_gid, UINT32_MAX, NULL);
-    }
-  else
+  dir = g_dir_open (source_path, 0, &dir_error);
+  if (dir == NULL)
     {
-      g_autoptr(QuadRanges) uid_remap_ids = quad_unit_file_lookup_ranges (container, CONTAINER_GROUP, "RemapUidRanges",
-                                                                          quad_lookup_host_subuid, default_remap_uids);
-      g_autoptr(QuadRanges) gid_remap_ids = quad_unit_file_lookup_ranges (container, CONTAINER_GROUP, "RemapGidRanges",
-                                                                          quad_lookup_host_subgid, default_remap_gids);
-      guint32 remap_uid_start = MAX (quad_unit_file_lookup_int (container, CONTAINER_GROUP, "RemapUidStart", 1), 0);
-      guint32 remap_gid_start = MAX (quad_unit_file_lookup_int (container, CONTAINER_GROUP, "RemapGidStart", 1), 0);
-
-      add_id_maps (podman, "--uidmap",
-                   uid, host_uid,
-                   remap_uid_start, uid_remap_ids);
-      add_id_maps (podman, "--gidmap",
-                   gid, host_gid,
-                   remap_gid_start, gid_remap_ids);
+      if (!g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        quad_context_log (ctx, "Can't read \"%s\": %s", source_path, dir_error->message);
+      return;
     }
 
-  g_auto(GStrv) volumes = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "Volume");
-  for (guint i = 0; volumes[i] != NULL; i++)
+  while ((name = g_dir_read_name (dir)) != NULL)
     {
-      const char *volume = volumes[i];
-      char *source, *dest, *options = NULL;
-      g_autofree char *volume_name = NULL;
-      g_autofree char *volume_service_name = NULL;
+      const char *group_name = NULL;
+      SourceUnit *source, *shadowing;
 
-      g_auto(GStrv) parts = g_strsplit (volume, ":", 3);
-      if (g_strv_length (parts) < 2)
-        {
-          quad_log ("Ignoring invalid volume %s", volume);
-          continue;
-        }
-      source = parts[0];
-      dest = parts[1];
-      if (g_strv_length (parts) >= 3)
-        options = parts[2];
-
-      if (source[0] == '/')
-        {
-          /* Absolute path */
-          quad_unit_file_add (service, UNIT_GROUP,
-                              "RequiresMountsFor", source);
-        }
-      else
-        {
-          /* unit name (with .volume suffix) or named podman volume */
-
-          if (g_str_has_suffix (source, ".volume"))
-            {
-              /* the podman volume name is systemd-$name */
-              volume_name = quad_replace_extension (source, NULL, "systemd-", NULL);
-
-              /* the systemd unit name is $name-volume.service */
-              volume_service_name = quad_replace_extension (source, ".service", NULL, "-volume");
-
-              source = volume_name;
-
-              quad_unit_file_add (service, UNIT_GROUP,
-                                  "Requires", volume_service_name);
-              quad_unit_file_add (service, UNIT_GROUP,
-                                  "After", volume_service_name);
-            }
-        }
+      if (g_str_has_suffix (name, ".container"))
+        group_name = CONTAINER_GROUP;
+      else if (g_str_has_suffix (name, ".volume"))
+        group_name = VOLUME_GROUP;
 
-      quad_podman_add (podman, "-v");
-      quad_podman_addf (podman, "%s:%s%s%s", source, dest, options ? ":" : "", options ? options : "");
-    }
+      if (group_name == NULL)
+        continue;
 
-  g_auto(GStrv) exposed_ports = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "ExposeHostPort");
-  for (guint i = 0; exposed_ports[i] != NULL; i++)
-    {
-      char *exposed_port = g_strchomp (exposed_ports[i]); /* Allow whitespace after */
+      source = g_new0 (SourceUnit, 1);
+      source->name = g_strdup (name);
+      source->path = g_build_filename (source_path, name, NULL);
+      source->group_name = group_name;
 
-      if (!is_port_range (exposed_port))
+      shadowing = quad_table_lookup (units, name);
+      if (shadowing == NULL)
         {
-          quad_log ("Invalid port format '%s'", exposed_port);
+          quad_table_insert (units, source->name, source);
           continue;
         }
 
-      quad_podman_addf (podman, "--expose=%s", exposed_port);
+      while (shadowing->shadowed != NULL)
+        shadowing = shadowing->shadowed;
+      shadowing->shadowed = source;
     }
+}
 
-  g_auto(GStrv) publish_ports = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "PublishPort");
-  for (guint i = 0; publish_ports[i] != NULL; i++)
-    {
-      char *publish_port = g_strstrip (publish_ports[i]); /* Allow whitespaces before and after */
-      /* IP address could have colons in it. For example: "[::]:8080:80/tcp, so use custom splitter */
-      g_auto(GStrv) parts = quad_split_ports (publish_port);
-      const char *container_port = NULL, *ip = NULL, *host_port = NULL;
-
-      /* format (from podman run):
-       * ip:hostPort:containerPort | ip::containerPort | hostPort:containerPort | containerPort
-       *
-       * ip could be IPv6 with minimum of these chars "[::]"
-       * containerPort can have a suffix of "/tcp" or "/udp"
-       */
-
-      switch (g_strv_length (parts))
-        {
-        case 1:
-          container_port = parts[0];
-          break;
-
-        case 2:
-          host_port = parts[0];
-          container_port = parts[1];
-          break;
-
-        case 3:
-          ip = parts[0];
-          host_port = parts[1];
-          container_port = parts[2];
-          break;
-
-        default:
-          quad_log ("Ignoring invalid published port '%s'", publish_port);
-          continue;
-        }
-
-      if (host_port && *host_port == 0)
-        host_port = NULL;
+/* Replaces the source by the unit it shadows, if there is one */
+static gboolean
+source_unit_use_shadowed (SourceUnit *source)
+{
+  SourceUnit *shadowed = g_steal_pointer (&source->shadowed);
 
-      if (ip && (strcmp (ip, "0.0.0.0") == 0 || *ip == 0))
-        ip = NULL;
+  if (shadowed == NULL)
+    return FALSE;
 
-      if (host_port && !is_port_range (host_port))
-        {
-          quad_log ("Invalid port format '%s'", host_port);
-          continue;
-        }
+  g_free (source->path);
+  source->path = g_steal_pointer (&shadowed->path);
+  g_clear_pointer (&source->contents, g_bytes_unref);
+  source->contents = g_steal_pointer (&shadowed->contents);
+  source->shadowed = g_steal_pointer (&shadowed->shadowed);
+  source_unit_free (shadowed);
 
-      if (container_port && !is_port_range (container_port))
-        {
-          quad_log ("Invalid port format '%s'", container_port);
-          continue;
-        }
+  return TRUE;
+}
 
-      if (ip)
-        quad_podman_addf (podman, "-p=%s:%s:%s", ip, host_port ? host_port : "", container_port);
-      else if (host_port)
-        quad_podman_addf (podman, "-p=%s:%s", host_port, container_port);
-      else
-        quad_podman_addf (podman, "-p=%s", container_port);
-    }
+static int
+compare_source_units (gconstpointer a,
+                      gconstpointer b)
+{
+  const SourceUnit *source_a = *(const SourceUnit **)a;
+  const SourceUnit *source_b = *(const SourceUnit **)b;
 
-  quad_podman_add_env (podman, podman_env);
+  return strcmp (source_a->name, source_b->name);
+}
 
-  g_auto(GStrv) labels = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "Label");
-  g_autoptr(GHashTable) podman_labels = parse_keys (labels);
-  quad_podman_add_labels (podman, podman_labels);
+typedef struct {
+  QuadContext *ctx;
+  GPtrArray *sources;
+  QuadWriter *writer;
+  gboolean batch_writes; /* Services are written after conversion */
+  BaseUnitCache *base_units;
+  const char *cache_dir; /* NULL if the cache is not used */
+  const char *cache_key;
+  int next_source;
+} GeneratorJob;
+
+/* Writes the service from the cache if none of the files it was
+ * converted from changed since, without parsing them */
+static gboolean
+restore_unit (GeneratorJob *job,
+              SourceUnit *source,
+              GPtrArray *drop_ins)
+{
+  g_autoptr(QuadCacheEntry) entry = NULL;
+  g_autoptr(GBytes) output = NULL;
+  g_autoptr(GError) error = NULL;
 
-  g_auto(GStrv) annotations = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "Annotation");
-  g_autoptr(GHashTable) podman_annotations = parse_keys (annotations);
-  quad_podman_add_annotations (podman, podman_annotations);
+  entry = quad_cache_lookup (job->cache_dir, job->cache_key, source->name, source->path,
+                             source->contents, drop_ins);
+  if (entry == NULL)
+    return FALSE;
 
-  g_auto(GStrv) podman_argsv = quad_unit_file_lookup_all (container, CONTAINER_GROUP, "PodmanArgs");
-  for (guint i = 0; podman_argsv[i] != NULL; i++)
+  output = quad_cache_read_output (job->cache_dir, entry, &error);
+  if (output == NULL)
     {
-      char *podman_args_s = podman_argsv[i];
-      g_autoptr(GPtrArray) podman_args = quad_split_string (podman_args_s, WHITESPACE,
-                                                            QUAD_SPLIT_RELAX|QUAD_SPLIT_UNQUOTE|QUAD_SPLIT_CUNESCAPE);
-      quad_podman_add_array (podman, (const char **)podman_args->pdata, podman_args->len);
+      quad_context_debug (job->ctx, "Can't use cached '%s': %s", source->name, error->message);
+      return FALSE;
     }
 
-  quad_podman_add (podman, image);
+  if (job->batch_writes)
+    source->output = g_steal_pointer (&output);
+  else if (!generate_service_file (job->ctx, job->writer, entry->service_name, NULL, output))
+    return FALSE;
 
-  g_autofree char *exec_key = quad_unit_file_lookup_last (container, CONTAINER_GROUP, "Exec");
-  if (exec_key != NULL)
-    {
-      g_autoptr(GPtrArray) exec_args = quad_split_string (exec_key, WHITESPACE,
-                                                          QUAD_SPLIT_RELAX|QUAD_SPLIT_UNQUOTE|QUAD_SPLIT_CUNESCAPE);
-      quad_podman_add_array (podman, (const char **)exec_args->pdata, exec_args->len);
-    }
+  quad_context_debug (job->ctx, "Using cached %s for %s", entry->service_name, source->path);
+
+  /* Conversion warnings are repeated, as if it was converted again */
+  for (guint i = 0; i < entry->log->len; i++)
+    quad_context_log (job->ctx, "%s", (char *)g_ptr_array_index (entry->log, i));
 
-  g_autofree char *exec_start = quad_podman_to_exec (podman);
-  quad_unit_file_add (service, SERVICE_GROUP, "ExecStart", exec_start);
+  source->service_name = g_steal_pointer (&entry->service_name);
+  source->symlinks = g_ptr_array_ref (entry->symlinks);
+  source->output_hash = g_steal_pointer (&entry->output_hash);
 
-  return g_steal_pointer (&service);
+  return TRUE;
 }
 
-static QuadUnitFile *
-convert_volume (QuadUnitFile *container,
-                const char *name,
-                G_GNUC_UNUSED GError **error)
+/* Loads, converts and writes a unit. This runs on the workers, so it
+ * only touches the unit itself and the shared base unit cache */
+static void
+process_unit (GeneratorJob *job,
+              SourceUnit *source)
 {
-  g_autoptr(QuadUnitFile) service =  quad_unit_file_copy (container);
-  g_autofree char *volume_name = quad_replace_extension (name, NULL, "systemd-", NULL);
-
-  warn_for_unknown_keys (container, VOLUME_GROUP, supported_volume_keys, &supported_volume_keys_hash);
-
-  /* Rename old Volume group to x-Volume so that systemd ignores it */
-  quad_unit_file_rename_group (service, VOLUME_GROUP, X_VOLUME_GROUP);
+  QuadContext *ctx = job->ctx;
+  g_autoptr(QuadUnitFile) unit = NULL;
+  g_autoptr(QuadUnitFile) service = NULL;
+  g_autoptr(QuadCacheEntry) entry = NULL;
+  g_autoptr(GPtrArray) drop_ins = NULL;
+  g_autoptr(GPtrArray) loading = g_ptr_array_new ();
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) output = NULL;
+  const char *extra_suffix = NULL;
 
-  /* Need the containers filesystem mounted to start podman */
-  quad_unit_file_add (service, UNIT_GROUP,
-                      "RequiresMountsFor", "%t/containers");
+  drop_ins = find_drop_ins (source->name, quad_context_get_unit_dirs (ctx));
 
-  g_autofree char *exec_cond = g_strdup_printf ("/usr/bin/bash -c \"! /usr/bin/podman volume exists %s\"", volume_name);
+  /* A unit that fails to load doesn't shadow anything */
+  do
+    {
+      if (job->cache_dir != NULL && restore_unit (job, source, drop_ins))
+        return;
 
-  g_auto(GStrv) labels = quad_unit_file_lookup_all (container, VOLUME_GROUP, "Label");
-  g_autoptr(GHashTable) podman_labels = parse_keys (labels);
+      quad_context_debug (ctx, "Loading source unit file %s", source->path);
 
-  g_autoptr(QuadPodman) podman = quad_podman_new ("volume", "create");
+      g_clear_pointer (&entry, quad_cache_entry_free);
+      g_clear_error (&error);
+      entry = quad_cache_entry_new (source->path);
+      unit = load_unit (ctx, source->path, source->contents, source->group_name, drop_ins,
+                        job->base_units, loading, entry->inputs, &error);
+      if (unit == NULL)
+        quad_context_log (ctx, "Error loading '%s', ignoring: %s", source->path, error->message);
+    }
+  while (unit == NULL && source_unit_use_shadowed (source));
 
-  g_autoptr(GString) opts = g_string_new ("o=");
+  if (unit == NULL)
+    return;
 
-  if (quad_unit_file_has_key (container, VOLUME_GROUP, "User"))
+  quad_context_capture_log (ctx, entry->log);
+  if (strcmp (source->group_name, CONTAINER_GROUP) == 0)
+    service = quad_convert_container (ctx, unit, &error);
+  else
     {
-      long uid = MAX (quad_unit_file_lookup_int (container, VOLUME_GROUP, "User", 0), 0);
-      if (opts->len > 2)
-        g_string_append (opts, ",");
-      g_string_append_printf (opts, "uid=%ld", uid);
+      service = quad_convert_volume (ctx, unit, source->name, &error);
+      extra_suffix = "-volume";
     }
+  quad_context_capture_log (ctx, NULL);
 
-  if (quad_unit_file_has_key (container, VOLUME_GROUP, "Group"))
+  if (service == NULL)
     {
-      long gid = MAX (quad_unit_file_lookup_int (container, VOLUME_GROUP, "Group", 0), 0);
-      if (opts->len > 2)
-        g_string_append (opts, ",");
-      g_string_append_printf (opts, "gid=%ld", gid);
+      quad_context_log (ctx, "Error converting '%s', ignoring: %s", source->name, error->message);
+      return;
     }
 
-  if (opts->len > 2)
-    quad_podman_addv (podman, "--opt", opts->str, NULL);
+  source->service_name = quad_replace_extension (source->name, ".service", NULL, extra_suffix);
+  add_source_keys (service, unit);
+  source->symlinks = get_service_symlinks (source->service_name, service);
 
-  quad_podman_add_labels (podman, podman_labels);
-  quad_podman_add (podman,volume_name);
+  /* Batched writes and the cache need the contents, otherwise the
+   * service is written straight from the unit */
+  if (job->batch_writes || job->cache_dir != NULL)
+    output = print_service_file (service);
 
-  g_autofree char *exec_start = quad_podman_to_exec (podman);
+  if (job->batch_writes)
+    source->output = g_bytes_ref (output);
+  else if (!generate_service_file (ctx, job->writer, source->service_name, service, output))
+    return;
 
-  quad_unit_file_setv (service, SERVICE_GROUP,
-                       "Type", "oneshot",
-                       "RemainAfterExit", "yes",
-                       "ExecCondition", exec_cond,
-                       "ExecStart", exec_start,
+  if (job->cache_dir == NULL)
+    return;
 
-                       /* The default syslog identifier is the exec basename (podman) which isn't very useful here */
-                       "SyslogIdentifier", "%N",
-                       NULL);
+  for (guint i = 0; i < drop_ins->len; i++)
+    g_ptr_array_add (entry->drop_ins, g_strdup (g_ptr_array_index (drop_ins, i)));
+  for (guint i = 0; i < source->symlinks->len; i++)
+    g_ptr_array_add (entry->symlinks, g_strdup (g_ptr_array_index (source->symlinks, i)));
+  entry->service_name = g_strdup (source->service_name);
 
-  return g_steal_pointer (&service);
+  if (quad_cache_store (job->cache_dir, job->cache_key, source->name, entry, output, &error))
+    source->output_hash = g_steal_pointer (&entry->output_hash);
+  else if (error != NULL)
+    quad_context_debug (ctx, "Can't cache '%s': %s", source->name, error->message);
 }
 
-static void
-generate_service_file (const char *output_path,
-                       const char *service_name,
-                       QuadUnitFile *service,
-                       QuadUnitFile *orig_unit)
+static gpointer
+generator_worker (gpointer user_data)
 {
-  g_autoptr(GString) str = g_string_new ("");
-  g_autoptr(GError) error = NULL;
-  const char *orig_path = quad_unit_file_get_path (orig_unit);
-  g_autofree char *out_filename = g_build_filename (output_path, service_name, NULL);
+  GeneratorJob *job = user_data;
+  guint i;
 
-  g_string_append (str, "# Automatically generated by quadlet-generator\n");
-  if (orig_path)
-    quad_unit_file_add (service, UNIT_GROUP,
-                        "SourcePath", orig_path);
-  quad_unit_file_print (service, str);
+  while ((i = g_atomic_int_add (&job->next_source, 1)) < job->sources->len)
+    {
+      SourceUnit *source = g_ptr_array_index (job->sources, i);
+
+      process_unit (job, source);
+      g_clear_pointer (&source->contents, g_bytes_unref);
+    }
 
-  quad_debug ("writing '%s'", out_filename);
-  if (!g_file_set_contents (out_filename, str->str, str->len, &error))
-    quad_log ("Error writing '%s', ignoring: %s", out_filename, error->message);
+  return NULL;
 }
 
+/* This is a QuadWriteErrorFunc. Symlinks that can't be created only
+ * leave the service disabled, so they are logged in debug mode */
 static void
-enable_service_file (const char *output_path,
-                     const char *service_name,
-                     QuadUnitFile *service)
+log_write_error (const char *name,
+                 const char *target,
+                 const GError *error,
+                 gpointer user_data)
 {
-  g_autoptr(GPtrArray) symlinks = g_ptr_array_new_with_free_func (g_free);
-
-  g_auto(GStrv) alias = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "Alias");
-  for (guint i = 0; alias[i] != NULL; i++)
-    g_ptr_array_add (symlinks, canonicalize_relative_path (alias[i]));
+  GeneratorJob *job = user_data;
 
-  g_auto(GStrv) wanted_by = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "WantedBy");
-  for (guint i = 0; wanted_by[i] != NULL; i++)
-    {
-      char *wanted_by_unit = wanted_by[i];
-      /* Only allow filenames, not paths */
-      if (strchr (wanted_by_unit, '/') == NULL)
-        g_ptr_array_add (symlinks, g_strdup_printf ("%s.wants/%s", wanted_by_unit, service_name));
-    }
+  if (target != NULL)
+    quad_context_debug (job->ctx, "%s", error->message);
+  else
+    quad_context_log (job->ctx, "Error writing '%s/%s', ignoring: %s",
+                      quad_writer_get_path (job->writer), name, error->message);
+}
 
-  g_auto(GStrv) required_by = quad_unit_file_lookup_all_strv (service, INSTALL_GROUP, "RequiredBy");
-  for (guint i = 0; required_by[i] != NULL; i++)
-    {
-      char *required_by_unit = required_by[i];
-      /* Only allow filenames, not paths */
-      if (strchr (required_by_unit, '/') == NULL)
-        g_ptr_array_add (symlinks, g_strdup_printf ("%s.requires/%s", required_by_unit, service_name));
-    }
+/* Only what this run used or stored is kept in the cache */
+static void
+prune_cache (const char *cache_dir,
+             GPtrArray *sources)
+{
+  g_autoptr(QuadTable) names = quad_str_table_new (NULL, NULL);
+  g_autoptr(QuadTable) output_hashes = quad_str_table_new (NULL, NULL);
 
-  for (guint i = 0; i < symlinks->len; i++)
+  for (guint i = 0; i < sources->len; i++)
     {
-      const char *symlink_rel = g_ptr_array_index (symlinks, i);
-      g_autoptr(GString) target = g_string_new ("");
-
-      /* At this point the symlinks are all relative, canonicalized
-         paths, so number of slashes is the depth */
+      SourceUnit *source = g_ptr_array_index (sources, i);
 
-      const char *p = symlink_rel;
-      while ((p = strchr (p, '/')) != NULL)
+      if (source->output_hash != NULL)
         {
-          p++;
-          g_string_append (target, "../");
+          quad_table_add (names, source->name);
+          quad_table_add (output_hashes, source->output_hash);
         }
-      g_string_append (target, service_name);
-
-      g_autofree char *symlink_path = g_build_filename (output_path, symlink_rel, NULL);
-
-      g_autofree char *symlink_dir = g_path_get_dirname (symlink_path);
-      g_mkdir_with_parents (symlink_dir, 0755);
-
-      quad_log ("Creating symlink %s -> %s", symlink_path, target->str);
-      symlink (target->str, symlink_path);
     }
+
+  quad_cache_prune (cache_dir, names, output_hashes);
 }
 
-static void
-load_units_from_dir (const char *source_path,
-                     GHashTable *units)
+/* Reads all the sources in batches, so the workers don't have to.
+ * Returns FALSE if the ring failed, the sources that were not read are
+ * then read by the workers */
+static gboolean
+read_sources (QuadUring *ring,
+              GPtrArray *sources)
 {
-  g_autoptr(GDir) dir = NULL;
-  g_autoptr(GError) dir_error = NULL;
-  const char *name;
+  g_autofree const char **paths = g_new (const char *, sources->len);
+  g_autofree GBytes **contents = g_new (GBytes *, sources->len);
+  QuadUnitFileLimits limits;
+  gboolean ok;
 
-  dir = g_dir_open (source_path, 0, &dir_error);
-  if (dir == NULL)
-    {
-      if (!g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-        quad_log ("Can't read \"%s\": %s", source_path, dir_error->message);
-      return;
-    }
+  quad_unit_file_get_default_limits (&limits);
 
-  while ((name = g_dir_read_name (dir)) != NULL)
-    {
-      if ((g_str_has_suffix (name, ".container") ||
-           g_str_has_suffix (name, ".volume")) &&
-          !g_hash_table_contains (units, name))
-        {
-          g_autofree char *path = g_build_filename (source_path, name, NULL);
-          g_autoptr(QuadUnitFile) unit = NULL;
-          g_autoptr(GError) error = NULL;
+  for (guint i = 0; i < sources->len; i++)
+    paths[i] = ((SourceUnit *)g_ptr_array_index (sources, i))->path;
 
-          quad_debug ("Loading source unit file %s", path);
+  ok = quad_uring_read_files (ring, sources->len, paths, limits.max_file_size, contents);
 
-          unit = quad_unit_file_new_from_path (path, &error);
-          if (unit == NULL)
-            quad_log ("Error loading '%s', ignoring: %s", path, error->message);
-          else
-            g_hash_table_insert (units, g_strdup (name), g_steal_pointer (&unit));
-        }
-    }
+  for (guint i = 0; i < sources->len; i++)
+    ((SourceUnit *)g_ptr_array_index (sources, i))->contents = contents[i];
+
+  return ok;
 }
 
 static gboolean opt_verbose;
 static gboolean opt_version;
+static int opt_jobs = 0;
+static char *opt_cache_dir = NULL;
+static gboolean opt_no_cache;
+static char *opt_io = NULL;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version information and exit", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of units to convert in parallel, defaults to the number of CPUs", "N" },
+  { "cache-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_dir, "Where to keep converted units between runs", "DIR" },
+  { "no-cache", 0, 0, G_OPTION_ARG_NONE, &opt_no_cache, "Convert all units, without reading or writing the cache", NULL },
+  { "io", 0, 0, G_OPTION_ARG_STRING, &opt_io, "How to read and write files: io_uring, sync or auto, which is currently sync", "BACKEND" },
   { NULL }
 };
 
@@ -821,25 +750,36 @@ main (int argc,
       char **argv)
 {
   g_autoptr(GOptionContext) context = NULL;
-  g_autoptr(GHashTable) units = NULL;
+  g_autoptr(QuadContext) ctx = NULL;
+  g_autoptr(QuadTable) units = NULL;
+  g_autoptr(GPtrArray) sources = NULL;
+  g_autoptr(GPtrArray) threads = NULL;
+  g_autoptr(QuadWriter) writer = NULL;
+  g_autoptr(QuadUring) ring = NULL;
+  BaseUnitCache base_units = { { NULL }, NULL };
+  GeneratorJob job;
+  guint n_threads;
   g_autoptr(GError) error = NULL;
   const char *output_path;
   const char **source_paths;
   g_autofree char *prgname = NULL;
+  g_autofree char *cache_dir = NULL;
+  g_autofree char *cache_key = NULL;
 
   setlocale (LC_ALL, "");
 
   prgname = g_path_get_basename (argv[0]);
   g_set_prgname (prgname);
 
-  quad_is_user = strstr (prgname, "user") != NULL;
+  ctx = quad_context_new (strstr (prgname, "user") != NULL);
+  quad_context_set_use_kmsg (ctx, TRUE);
 
   context = g_option_context_new ("OUTPUTDIR - Generate service files");
   g_option_context_add_main_entries (context, entries, NULL);
 
   if (!g_option_context_parse (context, &argc, &argv, &error))
     {
-      quad_log ("Option parsing failed: %s\n", error->message);
+      quad_context_log (ctx, "Option parsing failed: %s\n", error->message);
       return 1;
     }
 
@@ -850,63 +790,128 @@ main (int argc,
     }
 
   if (opt_verbose)
-    quad_enable_debug ();
+    quad_context_set_debug (ctx, TRUE);
+
+  if (opt_io != NULL && strcmp (opt_io, "auto") != 0 &&
+      strcmp (opt_io, "io_uring") != 0 && strcmp (opt_io, "sync") != 0)
+    {
+      quad_context_log (ctx, "Unknown I/O backend '%s'", opt_io);
+      return 1;
+    }
 
   if (argc < 2)
     {
-      quad_log ("Missing output directory argument");
+      quad_context_log (ctx, "Missing output directory argument");
       return 1;
     }
 
   output_path = argv[1];
 
-  quad_debug ("Starting quadlet-generator, output to: %s", output_path);
-
-  default_remap_uids = quad_lookup_host_subuid (QUADLET_USERNAME);
-  if (default_remap_uids == NULL) /* Fall back to built-in default */
-    default_remap_uids = quad_ranges_new (QUADLET_FALLBACK_UID_START, QUADLET_FALLBACK_UID_LENGTH);
+  quad_context_debug (ctx, "Starting quadlet-generator, output to: %s", output_path);
 
-  default_remap_gids = quad_lookup_host_subgid (QUADLET_USERNAME);
-  if (default_remap_gids == NULL) /* Fall back to built-in default */
-    default_remap_gids = quad_ranges_new (QUADLET_FALLBACK_GID_START, QUADLET_FALLBACK_GID_LENGTH);
+  writer = quad_writer_new (output_path, &error);
+  if (writer == NULL)
+    {
+      quad_context_log (ctx, "Can't write output: %s", error->message);
+      return 1;
+    }
 
-  source_paths = quad_get_unit_dirs (quad_is_user);
+  source_paths = quad_context_get_unit_dirs (ctx);
 
-  units = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  units = quad_str_table_new (NULL, (GDestroyNotify)source_unit_free);
   for (guint i = 0; source_paths[i] != NULL; i++)
-    load_units_from_dir (source_paths[i], units);
+    find_units_in_dir (ctx, source_paths[i], units);
 
-  QUAD_HASH_TABLE_FOREACH_KV (units, const char*, name, QuadUnitFile *, unit)
-    {
-      g_autoptr(QuadUnitFile) service = NULL;
-      g_autoptr(GError) error = NULL;
-      const char *extra_suffix = NULL;
+  sources = g_ptr_array_new ();
+  QUAD_TABLE_FOREACH_KV (units, const char *, name, SourceUnit *, source)
+    g_ptr_array_add (sources, source);
+  g_ptr_array_sort (sources, compare_source_units);
 
-      if (g_str_has_suffix (name, ".container"))
-        {
-          service = convert_container (unit, &error);
-        }
-      else if (g_str_has_suffix (name, ".volume"))
+  /* With io_uring, the sources are read and the services written in
+   * batches, which saves many system calls on large trees. It is not
+   * the default until it is measured to be faster than the workers
+   * doing it all with plain system calls */
+  if (g_strcmp0 (opt_io, "io_uring") == 0)
+    {
+      ring = quad_uring_new (URING_ENTRIES, &error);
+      if (ring == NULL)
         {
-          service = convert_volume (unit, name, &error);
-          extra_suffix = "-volume";
+          quad_context_log (ctx, "Can't use io_uring, falling back to synchronous I/O: %s", error->message);
+          g_clear_error (&error);
         }
+    }
+
+  if (ring != NULL && !read_sources (ring, sources))
+    {
+      quad_context_log (ctx, "io_uring failed, falling back to synchronous I/O");
+      g_clear_pointer (&ring, quad_uring_free);
+    }
+
+  /* The cache is only valid for the same host state and generator */
+  if (!opt_no_cache)
+    {
+      if (opt_cache_dir != NULL)
+        cache_dir = g_strdup (opt_cache_dir);
+      else if (quad_context_is_user (ctx))
+        cache_dir = g_build_filename (g_get_user_cache_dir (), "quadlet", NULL);
       else
+        cache_dir = g_strdup (QUADLET_CACHE_DIR);
+
+      cache_key = quad_context_get_state_hash (ctx);
+    }
+
+  base_units.units = quad_str_table_new (g_free, (GDestroyNotify)base_unit_free);
+  job.ctx = ctx;
+  job.sources = sources;
+  job.writer = writer;
+  job.batch_writes = ring != NULL;
+  job.base_units = &base_units;
+  job.cache_dir = cache_dir;
+  job.cache_key = cache_key;
+  job.next_source = 0;
+
+  /* Units are independent apart from their base units, so they are
+   * loaded, converted and written in parallel */
+  n_threads = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  n_threads = MIN (n_threads, sources->len);
+  if (n_threads <= 1)
+    generator_worker (&job);
+  else
+    {
+      threads = g_ptr_array_new ();
+      for (guint i = 0; i < n_threads; i++)
+        g_ptr_array_add (threads, g_thread_new ("generator", generator_worker, &job));
+      for (guint i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+    }
+
+  for (guint i = 0; i < sources->len; i++)
+    {
+      SourceUnit *source = g_ptr_array_index (sources, i);
+
+      if (source->output != NULL)
         {
-          quad_log ("Unsupported type '%s'", name);
-          continue;
+          quad_context_debug (ctx, "writing '%s/%s'", output_path, source->service_name);
+          quad_writer_queue_data (writer, source->service_name, source->output);
         }
+    }
 
-      if (service == NULL)
-        quad_log ("Error converting '%s', ignoring: %s", name, error->message);
-      else
-        {
-          g_autofree char *service_name = quad_replace_extension (name, ".service", NULL, extra_suffix);
+  /* Units can ask for the same symlinks, so they are created in a
+   * fixed order, where the first one wins */
+  for (guint i = 0; i < sources->len; i++)
+    {
+      SourceUnit *source = g_ptr_array_index (sources, i);
 
-          generate_service_file (output_path, service_name, service, unit);
-          enable_service_file (output_path, service_name, service);
-        }
+      if (source->symlinks != NULL)
+        enable_service_file (ctx, writer, source->service_name, source->symlinks);
     }
 
+  quad_writer_flush (writer, ring, log_write_error, &job);
+
+  if (cache_dir != NULL)
+    prune_cache (cache_dir, sources);
+
+  quad_table_free (base_units.units);
+
   return 0;
 }
@@ -83,14 +83,15 @@ cmpstringp (const void *p1, const void *p2)
 static void
 quad_podman_add_keys (QuadPodman *podman,
                       const char *arg,
-                      GHashTable *keys_ht)
+                      QuadTable *keys_table)
 {
-  g_autofree char **keys = (char **)g_hash_table_get_keys_as_array (keys_ht, NULL);
-  qsort (keys, g_strv_length (keys), sizeof (const char *), cmpstringp);
+  gsize n_keys;
+  g_autofree char **keys = (char **)quad_table_get_keys (keys_table, &n_keys);
+  qsort (keys, n_keys, sizeof (const char *), cmpstringp);
   for (guint i = 0; keys[i] != NULL; i++)
     {
       const char *key = keys[i];
-      const char *value = g_hash_table_lookup (keys_ht, key);
+      const char *value = quad_table_lookup (keys_table, key);
       if (value)
         {
           quad_podman_add (podman, arg);
@@ -101,21 +102,21 @@ quad_podman_add_keys (QuadPodman *podman,
 
 void
 quad_podman_add_env (QuadPodman *podman,
-                     GHashTable *env)
+                     QuadTable *env)
 {
   quad_podman_add_keys (podman, "--env", env);
 }
 
 void
 quad_podman_add_labels (QuadPodman *podman,
-                        GHashTable *labels)
+                        QuadTable *labels)
 {
   quad_podman_add_keys (podman, "--label", labels);
 }
 
 void
 quad_podman_add_annotations (QuadPodman *podman,
-                             GHashTable *annotations)
+                             QuadTable *annotations)
 {
   quad_podman_add_keys (podman, "--annotation", annotations);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glib.h>
+#include <utils.h>
 
 G_BEGIN_DECLS
 
@@ -20,11 +21,11 @@ void        quad_podman_add_array (QuadPodman *podman,
                                    const char **strv,
                                    gsize len);
 void        quad_podman_add_env (QuadPodman *podman,
-                                 GHashTable *envs);
+                                 QuadTable  *envs);
 void        quad_podman_add_labels (QuadPodman *podman,
-                                    GHashTable *labels);
+                                    QuadTable  *labels);
 void        quad_podman_add_annotations (QuadPodman *podman,
-                                         GHashTable *annotations);
+                                         QuadTable  *annotations);
 char *      quad_podman_to_exec (QuadPodman *podman);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadPodman, quad_podman_free)
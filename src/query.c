@@ -0,0 +1,487 @@
+#include "quadlet-config.h"
+
+#include <glib.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "unitfile.h"
+#include "utils.h"
+
+static char **opt_queries = NULL;
+static char *opt_files_from = NULL;
+static gboolean opt_json = FALSE;
+static gboolean opt_no_header = FALSE;
+static int opt_jobs = 0;
+static gboolean opt_version = FALSE;
+
+static GOptionEntry entries[] = {
+  { "query", 'q', 0, G_OPTION_ARG_STRING_ARRAY, &opt_queries, "Key to look up, as Group.Key, Group.Key:all or Group.Key:words", "QUERY" },
+  { "files-from", 'f', 0, G_OPTION_ARG_FILENAME, &opt_files_from, "Read the files to query from FILE, one per line, or stdin if FILE is -", "FILE" },
+  { "json", 0, 0, G_OPTION_ARG_NONE, &opt_json, "Print JSON rather than tab separated values", NULL },
+  { "no-header", 'H', 0, G_OPTION_ARG_NONE, &opt_no_header, "Don't print the header line of the tab separated values", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of files to parse in parallel, defaults to the number of CPUs", "N" },
+  { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version information and exit", NULL },
+  { NULL }
+};
+
+typedef enum {
+  QUERY_LAST,  /* The value systemd uses for a single-valued key */
+  QUERY_ALL,   /* All values since the last empty one */
+  QUERY_WORDS, /* All values, split into words like systemd lists */
+} QueryKind;
+
+typedef struct {
+  char *name; /* As given on the command line */
+  char *group_name;
+  char *key;
+  QueryKind kind;
+} Query;
+
+static void
+query_free (Query *query)
+{
+  g_free (query->name);
+  g_free (query->group_name);
+  g_free (query->key);
+  g_free (query);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Query, query_free)
+
+static Query *
+query_parse (const char *name,
+             GError **error)
+{
+  g_autoptr(Query) query = g_new0 (Query, 1);
+  g_autofree char *group_key = NULL;
+  const char *suffix = strrchr (name, ':');
+  const char *dot;
+
+  query->name = g_strdup (name);
+  query->kind = QUERY_LAST;
+
+  if (suffix != NULL)
+    {
+      if (strcmp (suffix, ":all") == 0)
+        query->kind = QUERY_ALL;
+      else if (strcmp (suffix, ":words") == 0)
+        query->kind = QUERY_WORDS;
+      else
+        {
+          quad_fail (error, "Unknown query type '%s' in %s", suffix + 1, name);
+          return NULL;
+        }
+      group_key = g_strndup (name, suffix - name);
+    }
+  else
+    group_key = g_strdup (name);
+
+  /* Keys can't contain dots, but group names can */
+  dot = strrchr (group_key, '.');
+  if (dot == NULL || dot == group_key || dot[1] == 0)
+    {
+      quad_fail (error, "Invalid query %s, expected Group.Key", name);
+      return NULL;
+    }
+
+  query->group_name = g_strndup (group_key, dot - group_key);
+  query->key = g_strdup (dot + 1);
+
+  return g_steal_pointer (&query);
+}
+
+typedef struct {
+  GPtrArray *queries;
+  GPtrArray *paths;
+  char **results; /* The formatted output for each path, NULL if it failed */
+  gint next_path;
+  gint n_failed;
+} QueryJob;
+
+static void
+append_tsv_escaped (GString *out,
+                    const char *str,
+                    gsize len)
+{
+  for (gsize i = 0; i < len; i++)
+    {
+      switch (str[i])
+        {
+        case '\t':
+          g_string_append (out, "\\t");
+          break;
+        case '\n':
+          g_string_append (out, "\\n");
+          break;
+        case '\\':
+          g_string_append (out, "\\\\");
+          break;
+        default:
+          g_string_append_c (out, str[i]);
+        }
+    }
+}
+
+static void
+append_json_string (GString *out,
+                    const char *str,
+                    gsize len)
+{
+  g_autofree char *valid = NULL;
+
+  /* JSON has to be utf8 */
+  if (!g_utf8_validate (str, len, NULL))
+    {
+      valid = g_utf8_make_valid (str, len);
+      str = valid;
+      len = strlen (valid);
+    }
+
+  g_string_append_c (out, '"');
+  for (gsize i = 0; i < len; i++)
+    {
+      guchar c = str[i];
+
+      if (c == '"' || c == '\\')
+        {
+          g_string_append_c (out, '\\');
+          g_string_append_c (out, c);
+        }
+      else if (c == '\n')
+        g_string_append (out, "\\n");
+      else if (c == '\t')
+        g_string_append (out, "\\t");
+      else if (c < 0x20)
+        g_string_append_printf (out, "\\u%04x", c);
+      else
+        g_string_append_c (out, c);
+    }
+  g_string_append_c (out, '"');
+}
+
+static void
+append_value (GString *out,
+              const char *str,
+              gsize len)
+{
+  if (opt_json)
+    append_json_string (out, str, len);
+  else
+    append_tsv_escaped (out, str, len);
+}
+
+/* In tab separated output lists are one value per line, which is
+ * escaped as \n like any other newline */
+static void
+append_list_separator (GString *out,
+                       gboolean first)
+{
+  if (opt_json)
+    g_string_append (out, first ? "" : ", ");
+  else if (!first)
+    g_string_append (out, "\\n");
+}
+
+static void
+append_query_result (GString *out,
+                     QuadUnitFile *unit,
+                     Query *query)
+{
+  switch (query->kind)
+    {
+    case QUERY_LAST:
+      {
+        QuadStrView view;
+
+        if (quad_unit_file_lookup_view (unit, query->group_name, query->key, &view))
+          append_value (out, view.str, view.len);
+        else if (opt_json)
+          g_string_append (out, "null");
+      }
+      break;
+
+    case QUERY_ALL:
+      {
+        QuadUnitValueIter iter;
+        QuadStrView value;
+        gboolean first = TRUE;
+
+        if (opt_json)
+          g_string_append_c (out, '[');
+        quad_unit_value_iter_init (&iter, unit, query->group_name, query->key);
+        while (quad_unit_value_iter_next (&iter, &value))
+          {
+            append_list_separator (out, first);
+            append_value (out, value.str, value.len);
+            first = FALSE;
+          }
+        if (opt_json)
+          g_string_append_c (out, ']');
+      }
+      break;
+
+    case QUERY_WORDS:
+      {
+        g_auto(GStrv) words = quad_unit_file_lookup_all_strv (unit, query->group_name, query->key);
+
+        if (opt_json)
+          g_string_append_c (out, '[');
+        for (guint i = 0; words[i] != NULL; i++)
+          {
+            append_list_separator (out, i == 0);
+            append_value (out, words[i], strlen (words[i]));
+          }
+        if (opt_json)
+          g_string_append_c (out, ']');
+      }
+      break;
+    }
+}
+
+static char *
+query_file (QueryJob *job,
+            const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(QuadUnitFile) unit = NULL;
+  g_autoptr(GString) out = g_string_new ("");
+
+  /* Only the groups that are queried get parsed, but a malformed line
+   * anywhere still fails the load */
+  unit = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_LAZY, &error);
+  if (unit == NULL)
+    {
+      quad_log ("%s", error->message);
+      return NULL;
+    }
+
+  if (opt_json)
+    {
+      g_string_append (out, "{\"path\": ");
+      append_json_string (out, path, strlen (path));
+    }
+  else
+    append_tsv_escaped (out, path, strlen (path));
+
+  for (guint i = 0; i < job->queries->len; i++)
+    {
+      Query *query = g_ptr_array_index (job->queries, i);
+
+      if (opt_json)
+        {
+          g_string_append (out, ", ");
+          append_json_string (out, query->name, strlen (query->name));
+          g_string_append (out, ": ");
+        }
+      else
+        g_string_append_c (out, '\t');
+
+      append_query_result (out, unit, query);
+    }
+
+  if (opt_json)
+    g_string_append_c (out, '}');
+
+  return g_string_free (g_steal_pointer (&out), FALSE);
+}
+
+static gpointer
+query_worker (gpointer data)
+{
+  QueryJob *job = data;
+  guint i;
+
+  while ((i = g_atomic_int_add (&job->next_path, 1)) < job->paths->len)
+    {
+      job->results[i] = query_file (job, g_ptr_array_index (job->paths, i));
+      if (job->results[i] == NULL)
+        g_atomic_int_inc (&job->n_failed);
+    }
+
+  return NULL;
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Directories are expanded to the files in them, sorted by name */
+static gboolean
+add_path (GPtrArray *paths,
+          const char *path,
+          GError **error)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GPtrArray) files = NULL;
+  const char *name;
+
+  if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      g_ptr_array_add (paths, g_strdup (path));
+      return TRUE;
+    }
+
+  dir = g_dir_open (path, 0, error);
+  if (dir == NULL)
+    return FALSE;
+
+  files = g_ptr_array_new ();
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      char *file = g_build_filename (path, name, NULL);
+
+      if (g_file_test (file, G_FILE_TEST_IS_REGULAR))
+        g_ptr_array_add (files, file);
+      else
+        g_free (file);
+    }
+
+  g_ptr_array_sort (files, compare_strings);
+  for (guint i = 0; i < files->len; i++)
+    g_ptr_array_add (paths, g_ptr_array_index (files, i));
+
+  return TRUE;
+}
+
+static gboolean
+add_paths_from (GPtrArray *paths,
+                const char *list_path,
+                GError **error)
+{
+  g_autofree char *data = NULL;
+  g_auto(GStrv) lines = NULL;
+
+  if (strcmp (list_path, "-") == 0)
+    {
+      g_autoptr(GString) str = g_string_new ("");
+      char buf[4096];
+      size_t n;
+
+      while ((n = fread (buf, 1, sizeof (buf), stdin)) > 0)
+        g_string_append_len (str, buf, n);
+      data = g_string_free (g_steal_pointer (&str), FALSE);
+    }
+  else if (!g_file_get_contents (list_path, &data, NULL, error))
+    return FALSE;
+
+  lines = g_strsplit (data, "\n", -1);
+  for (guint i = 0; lines[i] != NULL; i++)
+    {
+      if (*lines[i] != 0 && !add_path (paths, lines[i], error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) queries = g_ptr_array_new_with_free_func ((GDestroyNotify)query_free);
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  g_autofree char **results = NULL;
+  QueryJob job = { 0 };
+  guint n_threads;
+
+  setlocale (LC_ALL, "");
+  g_set_prgname ("quadlet-query");
+
+  context = g_option_context_new ("[FILE|DIRECTORY...] - Look up keys in unit files");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      quad_log ("Option parsing failed: %s", error->message);
+      return 1;
+    }
+
+  if (opt_version)
+    {
+      g_print ("quadlet %s\n", PACKAGE_VERSION);
+      return 0;
+    }
+
+  if (opt_queries == NULL)
+    {
+      quad_log ("No queries given, use --query Group.Key");
+      return 1;
+    }
+
+  for (guint i = 0; opt_queries[i] != NULL; i++)
+    {
+      Query *query = query_parse (opt_queries[i], &error);
+      if (query == NULL)
+        {
+          quad_log ("%s", error->message);
+          return 1;
+        }
+      g_ptr_array_add (queries, query);
+    }
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (!add_path (paths, argv[i], &error))
+        {
+          quad_log ("%s", error->message);
+          return 1;
+        }
+    }
+
+  if (opt_files_from != NULL && !add_paths_from (paths, opt_files_from, &error))
+    {
+      quad_log ("%s", error->message);
+      return 1;
+    }
+
+  results = g_new0 (char *, paths->len);
+  job.queries = queries;
+  job.paths = paths;
+  job.results = results;
+
+  n_threads = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  n_threads = CLAMP (n_threads, 1, MAX (paths->len, 1));
+
+  /* The calling thread is one of the workers */
+  for (guint i = 1; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("query", query_worker, &job));
+  query_worker (&job);
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
+
+  if (opt_json)
+    fputs ("[\n", stdout);
+  else if (!opt_no_header)
+    {
+      fputs ("path", stdout);
+      for (guint i = 0; i < queries->len; i++)
+        printf ("\t%s", ((Query *)g_ptr_array_index (queries, i))->name);
+      fputc ('\n', stdout);
+    }
+
+  for (guint i = 0, n_printed = 0; i < paths->len; i++)
+    {
+      g_autofree char *result = results[i];
+
+      if (result == NULL)
+        continue;
+
+      if (opt_json && n_printed++ > 0)
+        fputs (",\n", stdout);
+      fputs (result, stdout);
+      if (!opt_json)
+        fputc ('\n', stdout);
+    }
+
+  if (opt_json)
+    fputs ("\n]\n", stdout);
+
+  return job.n_failed > 0 ? 1 : 0;
+}
@@ -1,359 +1,1630 @@
 #include "quadlet-config.h"
 
+#include "context.h"
 #include "unitfile.h"
 #include "utils.h"
 
+#include <errno.h>
+#include <sys/stat.h>
+
 typedef struct
 {
-  char *key;  /* NULL for comments */
-  char *value;
+  /* Keys are names, see quad_unit_name_new(). The value is a slice,
+   * either into a source buffer of the unit, or into its arena. It is
+   * only nul-terminated if QUAD_UNIT_LINE_VALUE_NUL is set */
+  const char *key;  /* NULL for comments */
+  const char *value;
+  guint32 value_len;
+  guint32 flags;
+  /* The value with line continuations applied, points to value if it has none */
+  const char *resolved;
+  guint32 resolved_len;
+  guint32 prev_same_key; /* Only valid if the group has a key index */
 } QuadUnitLine;
 
+#define QUAD_UNIT_LINE_NONE G_MAXUINT32
+
+typedef enum {
+  QUAD_UNIT_LINE_VALUE_NUL = 1 << 0,
+} QuadUnitLineFlags;
+
+/* Lines are stored inline in a growable array, the strings they point
+ * to are owned by the arenas and sources of the QuadUnitFile */
 typedef struct {
-  char *name;
-  GPtrArray *comments; /* Comments before the groupname */
-  GPtrArray *lines;
+  QuadUnitLine *data;
+  guint len;
+  guint allocated;
+} QuadUnitLines;
 
+/* Groups are shared between copies of a unit, and cloned when one
+ * of them modifies it, see quad_unit_file_get_writable_group() */
+typedef struct {
+  gatomicrefcount ref_count;
+  const char *name; /* See quad_unit_name_new() */
+  /* The arena of the unit that created the group. Every unit that has
+   * the group keeps this alive, so values of shared lines can be
+   * materialized there */
+  QuadArena *arena;
+  QuadUnitLines comments; /* Comments before the groupname */
+  QuadUnitLines lines;
+
+  /* Key -> index + 1 of the last line with that key, the
+   * earlier ones are chained by prev_same_key. Created on first lookup */
+  QuadTable *key_index;
+
+  /* QuadUnitLazyBody, the parts of the file that still have to be parsed
+   * into lines. Only set for groups that are not shared, see
+   * QUAD_UNIT_FILE_PARSE_LAZY */
+  GArray *lazy_bodies;
 } QuadUnitGroup;
 
+typedef struct {
+  const char *data;
+  gsize len;
+  int line_nr;
+} QuadUnitLazyBody;
+
 struct _QuadUnitFile
 {
-  GObject parent_instance;
+  gatomicrefcount ref_count;
 
-  GPtrArray *groups;
-  GHashTable *group_hash; /* keys/values owned by groups array */
+  /* Set by quad_unit_file_freeze(), the unit can't be modified and
+   * lookups don't change any state, so it can be read from any thread */
+  gboolean frozen;
+
+  QuadArena *arena; /* Owns all modified strings */
+  GPtrArray *arenas; /* Arenas of units we share lines with */
+  GPtrArray *sources; /* GBytes that parsed lines may point into */
+
+  GPtrArray *groups; /* Owns a reference to each group */
+  QuadTable *group_hash; /* name -> group, values owned by groups array */
+
+  /* Read-only units that are looked up after our own groups, the
+   * last one first. Only the groups of each layer are used, as their
+   * own layers are added here too. NULL unless quad_unit_file_add_layer()
+   * is used */
+  GPtrArray *layers;
 
   char *path;
+  QuadUnitFileLimits limits;
 
   /* During parsing: */
+  const char *parse_data;
+  gsize parse_data_len;
+  int parse_data_is_utf8; /* -1 if not validated yet */
   QuadUnitGroup *current_group;
-  GPtrArray *pending_comments;
+  QuadUnitLines pending_comments;
   int line_nr;
+  gboolean has_lazy_groups;
+};
+
+#define QUAD_UNIT_FILE_ARENA_CHUNK_SIZE 4096
+
+/* Copied into each new unit. Only meant to be changed at startup */
+static QuadUnitFileLimits default_limits = {
+  QUAD_UNIT_FILE_DEFAULT_MAX_FILE_SIZE,
+  QUAD_UNIT_FILE_DEFAULT_MAX_LINE_LENGTH,
+  QUAD_UNIT_FILE_DEFAULT_MAX_LINES,
+  QUAD_UNIT_FILE_DEFAULT_MAX_CONTINUATION_LINES,
 };
 
-G_DEFINE_TYPE (QuadUnitFile, quad_unit_file, G_TYPE_OBJECT)
+/* Interned up front, so units share these names rather than each
+ * having a copy, see quad_unit_name_new() */
+static const char *common_names[] = {
+  "Unit",
+  "Service",
+  "Install",
+  "Description",
+  "Documentation",
+  "After",
+  "Before",
+  "Requires",
+  "Wants",
+  "BindsTo",
+  "Conflicts",
+  "RequiresMountsFor",
+  "SourcePath",
+  "Type",
+  "ExecStart",
+  "ExecStartPre",
+  "ExecStartPost",
+  "ExecStop",
+  "ExecStopPost",
+  "ExecCondition",
+  "Environment",
+  "KillMode",
+  "Delegate",
+  "NotifyAccess",
+  "SyslogIdentifier",
+  "RemainAfterExit",
+  "Restart",
+  "TimeoutStartSec",
+  "TimeoutStopSec",
+  "WantedBy",
+  "RequiredBy",
+  "Alias",
+  NULL
+};
 
 static QuadUnitGroup *quad_unit_file_ensure_group (QuadUnitFile *self,
                                                    const char *group_name);
+static QuadUnitGroup *quad_unit_file_lookup_group (QuadUnitFile *self,
+                                                   const char *group_name);
+static QuadUnitGroup *quad_unit_file_unshare_group (QuadUnitFile *self,
+                                                    QuadUnitGroup *group);
+static void quad_unit_file_flatten (QuadUnitFile *self);
+static void quad_unit_file_parse_lazy_group (QuadUnitFile *self,
+                                             QuadUnitGroup *group);
+static QuadTable *quad_unit_group_get_index (QuadUnitGroup *group);
 
-static QuadUnitLine *
-quad_unit_line_new (const char *key, const char *value, gsize value_len)
+typedef struct {
+  const char *name;
+  gsize len;
+} QuadKnownName;
+
+/* The common names and the names quadlet itself uses, in an open
+ * addressing table that is built once and then only read, so it is
+ * looked up without locking and without copying the name */
+static QuadKnownName *known_names;
+static guint64 known_names_mask;
+
+static void
+quad_known_names_init (void)
 {
-  QuadUnitLine *line = g_new0 (QuadUnitLine, 1);
+  g_autoptr(GPtrArray) names = g_ptr_array_new ();
+  guint64 size = 1;
 
-  line->key = g_strdup (key);
-  line->value = g_strndup (value, value_len);
+  for (guint i = 0; common_names[i] != NULL; i++)
+    g_ptr_array_add (names, (char *)common_names[i]);
+  quad_context_add_known_names (names);
 
-  return line;
-}
+  while (size < names->len * 2)
+    size *= 2;
+  known_names = g_new0 (QuadKnownName, size);
+  known_names_mask = size - 1;
 
-static QuadUnitLine *
-quad_unit_line_copy (QuadUnitLine *line)
-{
-  return quad_unit_line_new (line->key, line->value, strlen (line->value));
+  for (guint i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      gsize len = strlen (name);
+      guint64 j = quad_hash64 (name, len) & known_names_mask;
+
+      while (known_names[j].name != NULL && strcmp (known_names[j].name, name) != 0)
+        j = (j + 1) & known_names_mask;
+      known_names[j].name = name;
+      known_names[j].len = len;
+    }
 }
 
-static void
-quad_unit_line_set (QuadUnitLine *line, const char *value)
+static const char *
+quad_known_name_lookup (const char *name,
+                        gsize len)
 {
-  g_free (line->value);
-  line->value = g_strdup (value);
-}
+  static gsize initialized = 0;
 
-static gboolean
-quad_unit_line_is (QuadUnitLine *line, const char *key)
-{
-  return line->key != NULL && strcmp (key, line->key) == 0;
+  if (g_once_init_enter (&initialized))
+    {
+      quad_known_names_init ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  for (guint64 i = quad_hash64 (name, len) & known_names_mask;
+       known_names[i].name != NULL;
+       i = (i + 1) & known_names_mask)
+    {
+      if (known_names[i].len == len && memcmp (known_names[i].name, name, len) == 0)
+        return known_names[i].name;
+    }
+
+  return NULL;
 }
 
-static gboolean
-quad_unit_line_is_empty (QuadUnitLine *line)
+/* Known group names and keys point to the string in the table of
+ * known names. Any other name is copied into the arena, so the names
+ * in the files we parse can't grow a process-wide table. Names are
+ * equal if their pointers are, and otherwise have to be compared */
+static const char *
+quad_unit_name_new (QuadArena *arena,
+                    const char *name,
+                    gsize len)
 {
-  return line->value[0] == 0;
+  const char *known = quad_known_name_lookup (name, len);
+
+  if (known != NULL)
+    return known;
+
+  return quad_arena_strndup (arena, name, len);
 }
 
-static void
-quad_unit_line_free (QuadUnitLine *line)
+static QuadUnitLine *
+quad_unit_lines_append (QuadUnitLines *lines,
+                        guint n_lines)
 {
-  g_free (line->key);
-  g_free (line->value);
-  g_free (line);
+  QuadUnitLine *res;
+
+  if (lines->len + n_lines > lines->allocated)
+    {
+      lines->allocated = MAX (MAX (lines->allocated * 2, lines->len + n_lines), 8);
+      lines->data = g_renew (QuadUnitLine, lines->data, lines->allocated);
+    }
+
+  res = &lines->data[lines->len];
+  lines->len += n_lines;
+
+  return res;
 }
 
-static QuadUnitGroup *
-quad_unit_group_new (const char *name)
+static void
+quad_unit_lines_clear (QuadUnitLines *lines)
 {
-  QuadUnitGroup *group = g_new0 (QuadUnitGroup, 1);
-  group->name = g_strdup (name);
-  group->comments = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_line_free);
-  group->lines = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_line_free);
-  return group;
+  g_free (lines->data);
+  lines->data = NULL;
+  lines->len = lines->allocated = 0;
 }
 
 static void
-quad_unit_group_add (QuadUnitGroup *group,
+quad_unit_line_init (QuadUnitLine *line,
                      const char *key,
-                     const char *value)
+                     const char *value,
+                     gsize value_len,
+                     QuadUnitLineFlags flags)
 {
-  g_ptr_array_add (group->lines,
-                   quad_unit_line_new (key, value, strlen (value)));
+  line->key = key;
+  line->value = line->resolved = value;
+  line->value_len = line->resolved_len = value_len;
+  line->flags = flags;
+  line->prev_same_key = QUAD_UNIT_LINE_NONE;
 }
 
-
-static QuadUnitLine *
-quad_unit_group_find_last (QuadUnitGroup *group,
-                           const char *key,
-                           guint *index_out)
+static const char *
+find_continuation (const char *p, const char *start, const char *end)
 {
-  for (int i = group->lines->len - 1; i >= 0; i--)
+  const char *nl;
+
+  while ((nl = memchr (p, '\n', end - p)) != NULL)
     {
-      QuadUnitLine *line = g_ptr_array_index (group->lines, i);
-      if (quad_unit_line_is (line, key))
-        {
-          if (index_out)
-            *index_out = i;
-          return line;
-        }
+      if (nl > start && nl[-1] == '\\')
+        return nl - 1;
+      p = nl + 1;
     }
 
   return NULL;
 }
 
+/* Same as quad_apply_line_continuation(), but done once when the value
+ * is set, so lookups don't have to. The raw value is kept for printing. */
 static void
-quad_unit_group_merge (QuadUnitGroup *group,
-                       QuadUnitGroup *source)
+quad_unit_line_resolve (QuadUnitFile *self, QuadUnitLine *line)
 {
-  for (guint i = 0; i < source->comments->len; i++)
-    {
-      QuadUnitLine *line = g_ptr_array_index (source->comments, i);
-      g_ptr_array_add (group->comments, quad_unit_line_copy (line));
-    }
+  const char *p = line->value;
+  const char *end = p + line->value_len;
+  const char *continuation;
+  char *resolved, *dest;
 
-  for (guint i = 0; i < source->lines->len; i++)
+  line->resolved = line->value;
+  line->resolved_len = line->value_len;
+
+  continuation = find_continuation (p, line->value, end);
+  if (continuation == NULL)
+    return;
+
+  resolved = dest = quad_arena_alloc (self->arena, line->value_len + 1);
+  do
     {
-      QuadUnitLine *line = g_ptr_array_index (source->lines, i);
-      g_ptr_array_add (group->lines, quad_unit_line_copy (line));
+      memcpy (dest, p, continuation - p);
+      dest += continuation - p;
+      *dest++ = ' ';
+      p = continuation + 2;
     }
+  while ((continuation = find_continuation (p, line->value, end)) != NULL);
+
+  memcpy (dest, p, end - p);
+  dest += end - p;
+  *dest = 0;
+
+  line->resolved = resolved;
+  line->resolved_len = dest - resolved;
 }
 
+/* Initializes the line with a copy of value in the arena of self */
 static void
-quad_unit_group_free (QuadUnitGroup *group)
+quad_unit_line_init_owned (QuadUnitFile *self,
+                           QuadUnitLine *line,
+                           const char *key,
+                           const char *value,
+                           gsize value_len)
 {
-  g_ptr_array_free (group->comments, TRUE);
-  g_ptr_array_free (group->lines, TRUE);
-  g_free (group->name);
-  g_free (group);
+  quad_unit_line_init (line, key,
+                       quad_arena_strndup (self->arena, value, value_len), value_len,
+                       QUAD_UNIT_LINE_VALUE_NUL);
+  quad_unit_line_resolve (self, line);
 }
 
-QuadUnitFile *
-quad_unit_file_new_from_path (const char *path, GError **error)
+/* Replaces the value, value must be owned by the arena of self */
+static void
+quad_unit_line_set_owned (QuadUnitFile *self,
+                          QuadUnitLine *line,
+                          const char *value,
+                          gsize value_len)
 {
-  g_autofree char *data = NULL;
-  g_autoptr(QuadUnitFile) unit = NULL;
+  line->value = value;
+  line->value_len = value_len;
+  line->flags |= QUAD_UNIT_LINE_VALUE_NUL;
+  quad_unit_line_resolve (self, line);
+}
 
-  if (!g_file_get_contents (path, &data, NULL, error))
+static void
+quad_unit_line_set (QuadUnitFile *self, QuadUnitLine *line, const char *value)
+{
+  gsize value_len = strlen (value);
+
+  quad_unit_line_set_owned (self, line,
+                            quad_arena_strndup (self->arena, value, value_len), value_len);
+}
+
+/* Lines parsed from a source buffer point into it, so we only
+ * create a nul-terminated copy when a caller needs a C string. This
+ * is allowed for shared groups, as it doesn't change the value */
+static const char *
+quad_unit_line_get_value (QuadUnitGroup *group, QuadUnitLine *line)
+{
+  if ((line->flags & QUAD_UNIT_LINE_VALUE_NUL) == 0)
     {
-      g_prefix_error (error, "Failed to open %s: ", path);
-      return NULL;
+      gboolean unresolved = line->resolved == line->value;
+
+      line->value = quad_arena_strndup (group->arena, line->value, line->value_len);
+      line->flags |= QUAD_UNIT_LINE_VALUE_NUL;
+      if (unresolved)
+        line->resolved = line->value;
     }
 
-  unit = quad_unit_file_new ();
+  return line->value;
+}
 
-  if (!quad_unit_file_parse (unit, data, error))
-    return NULL;
+/* Returns the value with continuations applied, and trailing whitespace
+ * removed if chomp is set. Points into the unit, not nul-terminated */
+static QuadStrView
+quad_unit_line_get_view (QuadUnitLine *line, gboolean chomp)
+{
+  QuadStrView view = { line->resolved, line->resolved_len };
 
-  unit->path = g_strdup (path);
+  if (chomp)
+    {
+      while (view.len > 0 && g_ascii_isspace (view.str[view.len - 1]))
+        view.len--;
+    }
 
-  return g_steal_pointer(&unit);
+  return view;
 }
 
-const char *
-quad_unit_file_get_path (QuadUnitFile  *self)
+static gboolean
+quad_unit_line_is (QuadUnitLine *line, const char *key)
 {
-  return self->path;
+  return line->key == key || (line->key != NULL && strcmp (line->key, key) == 0);
 }
 
-void
-quad_unit_file_set_path (QuadUnitFile  *self,
-                         const char *path)
+static gboolean
+quad_unit_line_is_empty (QuadUnitLine *line)
 {
-  g_free (self->path);
-  self->path = g_strdup (path);
+  return line->value_len == 0;
 }
 
-QuadUnitFile *
-quad_unit_file_new (void)
+/* name must be from quad_unit_name_new(), in an arena self keeps alive */
+static QuadUnitGroup *
+quad_unit_group_new (QuadUnitFile *self, const char *name)
 {
-  g_autoptr(QuadUnitFile) unit = g_object_new (QUAD_TYPE_UNIT_FILE, NULL);
+  QuadUnitGroup *group = g_new0 (QuadUnitGroup, 1);
 
-  return g_steal_pointer (&unit);
-}
+  g_atomic_ref_count_init (&group->ref_count);
+  group->name = name;
+  group->arena = self->arena;
 
-void
-quad_unit_file_merge (QuadUnitFile *self,
-                      QuadUnitFile *source)
-{
-  for (guint i = 0; i < source->groups->len; i++)
-    {
-      QuadUnitGroup *src_group = g_ptr_array_index (source->groups, i);
-      QuadUnitGroup *group =  quad_unit_file_ensure_group (self, src_group->name);
-      quad_unit_group_merge (group, src_group);
-    }
+  return group;
 }
 
-QuadUnitFile *
-quad_unit_file_copy (QuadUnitFile *self)
+static QuadUnitGroup *
+quad_unit_group_ref (QuadUnitGroup *group)
 {
-  QuadUnitFile *copy = quad_unit_file_new ();
-  quad_unit_file_merge (copy, self);
-  return copy;
+  g_atomic_ref_count_inc (&group->ref_count);
+  return group;
 }
 
 static gboolean
-line_is_comment (const char *line, const char *line_end)
+quad_unit_group_is_shared (QuadUnitGroup *group)
 {
-  return line == line_end || *line == '#' || *line == ';';
+  return !g_atomic_ref_count_compare (&group->ref_count, 1);
 }
 
-static gboolean
-line_is_group (const char *line, const char *line_end)
+/* Must be called after appending lines to the group, starting at first_index */
+static void
+quad_unit_group_index_lines (QuadUnitGroup *group,
+                             guint first_index)
 {
-  char *p;
-
-  if (line == line_end)
-    return FALSE;
-
-  p = (char *) line;
-  if (*p != '[')
-    return FALSE;
-
-  p++;
+  if (group->key_index == NULL)
+    return;
 
-  while (p < line_end && *p != ']')
-    p = g_utf8_find_next_char (p, NULL);
+  for (guint i = first_index; i < group->lines.len; i++)
+    {
+      QuadUnitLine *line = &group->lines.data[i];
+      if (line->key != NULL)
+        {
+          line->prev_same_key = GPOINTER_TO_UINT (quad_table_lookup (group->key_index, line->key)) - 1;
+          quad_table_insert (group->key_index, (char *)line->key, GUINT_TO_POINTER (i + 1));
+        }
+    }
+}
 
-  if (p >= line_end || *p != ']')
-    return FALSE;
+/* Maps each key to the index of its last line plus one */
+static QuadTable *
+quad_unit_group_get_index (QuadUnitGroup *group)
+{
+  if (group->key_index == NULL)
+    {
+      group->key_index = quad_str_table_new (NULL, NULL);
+      quad_unit_group_index_lines (group, 0);
+    }
 
-  /* silently accept whitespace after the ] */
-  p = g_utf8_find_next_char (p, NULL);
-  while (p < line_end && (*p == ' ' || *p == '\t'))
-    p = g_utf8_find_next_char (p, NULL);
+  return group->key_index;
+}
 
-  if (p != line_end)
-    return FALSE;
+/* Must be called when lines are removed, as that changes the line indexes */
+static void
+quad_unit_group_invalidate_index (QuadUnitGroup *group)
+{
+  g_clear_pointer (&group->key_index, quad_table_free);
+}
 
-  return TRUE;
+static guint
+quad_unit_group_find_last_index (QuadUnitGroup *group,
+                                 const char *key)
+{
+  return GPOINTER_TO_UINT (quad_table_lookup (quad_unit_group_get_index (group), key)) - 1;
 }
 
-static gboolean
-line_is_key_value_pair (const char *line,
-                        const char *line_end)
+static void
+quad_unit_group_add (QuadUnitFile *self,
+                     QuadUnitGroup *group,
+                     const char *key,
+                     const char *value)
 {
-  char *p;
+  QuadUnitLine *line = quad_unit_lines_append (&group->lines, 1);
 
-  if (line == line_end)
-    return FALSE;
+  quad_unit_line_init_owned (self, line, quad_unit_name_new (self->arena, key, strlen (key)),
+                             value, strlen (value));
+  quad_unit_group_index_lines (group, group->lines.len - 1);
+}
 
-  p = (char *) g_utf8_strchr (line, line_end - line, '=');
-  if (!p)
-    return FALSE;
+static QuadUnitLine *
+quad_unit_group_find_last (QuadUnitGroup *group,
+                           const char *key,
+                           guint *index_out)
+{
+  guint i;
 
-  /* Key must be non-empty
-   */
-  if (*p == line[0])
-    return FALSE;
+  i = quad_unit_group_find_last_index (group, key);
+  if (i == QUAD_UNIT_LINE_NONE)
+    return NULL;
 
-  return TRUE;
+  if (index_out)
+    *index_out = i;
+  return &group->lines.data[i];
 }
 
-static gboolean
-is_valid_group_name (const gchar *name)
+/* Only copies the line records, the caller has to make sure the
+ * strings they point to stay alive */
+static void
+quad_unit_lines_merge (QuadUnitLines *lines,
+                       QuadUnitLines *source)
 {
-  char *p, *q;
+  if (source->len > 0)
+    memcpy (quad_unit_lines_append (lines, source->len),
+            source->data, source->len * sizeof (QuadUnitLine));
+}
 
-  if (name == NULL)
-    return FALSE;
+static void
+quad_unit_group_merge (QuadUnitGroup *group,
+                       QuadUnitGroup *source)
+{
+  guint first_index = group->lines.len;
 
-  p = q = (char *) name;
-  while (*q && *q != ']' && *q != '[' && !g_ascii_iscntrl (*q))
-    q = g_utf8_find_next_char (q, NULL);
+  quad_unit_lines_merge (&group->comments, &source->comments);
+  quad_unit_lines_merge (&group->lines, &source->lines);
+  quad_unit_group_index_lines (group, first_index);
+}
 
-  if (*q != '\0' || q == p)
-    return FALSE;
+static void
+quad_unit_group_unref (QuadUnitGroup *group)
+{
+  if (!g_atomic_ref_count_dec (&group->ref_count))
+    return;
 
-  return TRUE;
+  quad_unit_lines_clear (&group->comments);
+  quad_unit_lines_clear (&group->lines);
+  quad_unit_group_invalidate_index (group);
+  g_clear_pointer (&group->lazy_bodies, g_array_unref);
+  g_free (group);
 }
 
-static gboolean
-is_valid_key_name (const char *name)
+static gboolean quad_unit_file_parse_bytes (QuadUnitFile *self,
+                                            GBytes *bytes,
+                                            QuadUnitFileParseFlags flags,
+                                            GError **error);
+static void quad_unit_file_parse_lazy_groups (QuadUnitFile *self);
+static gboolean quad_unit_file_limits_check_size (const QuadUnitFileLimits *limits,
+                                                  guint64 size,
+                                                  GError **error);
+
+QuadUnitFile *
+quad_unit_file_new_from_path (const char *path,
+                              QuadUnitFileParseFlags flags,
+                              GError **error)
 {
-  char *p, *q;
+  return quad_unit_file_new_from_path_full (path, flags, NULL, error);
+}
 
-  if (name == NULL)
-    return FALSE;
+/* Also returns the quad_hash128() of the file contents, which unlike
+ * quad_unit_file_hash() changes with comments and layout too */
+QuadUnitFile *
+quad_unit_file_new_from_path_full (const char *path,
+                                   QuadUnitFileParseFlags flags,
+                                   QuadHash128 *content_hash,
+                                   GError **error)
+{
+  g_autofree char *data = NULL;
+  gsize data_len;
+  g_autoptr(GBytes) bytes = NULL;
+  struct stat st;
+
+  /* Don't read all of a huge file just to reject it. The size is
+   * checked again after reading, in case the file grew */
+  if (stat (path, &st) == 0 && S_ISREG (st.st_mode) &&
+      !quad_unit_file_limits_check_size (&default_limits, st.st_size, error))
+    {
+      g_prefix_error (error, "Failed to load %s: ", path);
+      return NULL;
+    }
 
-  p = q = (char *) name;
+  if (!g_file_get_contents (path, &data, &data_len, error))
+    {
+      g_prefix_error (error, "Failed to open %s: ", path);
+      return NULL;
+    }
 
-  /* We accept a little more than the desktop entry spec says,
-   * since gnome-vfs uses mime-types as keys in its cache.
-   */
-  while (*q && *q != '=' && *q != '[' && *q != ']')
-    q = g_utf8_find_next_char (q, NULL);
+  bytes = g_bytes_new_take (g_steal_pointer (&data), data_len);
 
-  /* No empty keys, please */
-  if (q == p)
-    return FALSE;
+  return quad_unit_file_new_from_contents (path, bytes, flags, content_hash, error);
+}
 
-  /* We accept spaces in the middle of keys to not break
-   * existing apps, but we don't tolerate initial or final
-   * spaces, which would lead to silent corruption when
-   * rereading the file.
-   */
-  if (*p == ' ' || q[-1] == ' ')
-    return FALSE;
+/* Like quad_unit_file_new_from_path_full(), for when the contents of
+ * path were already read */
+QuadUnitFile *
+quad_unit_file_new_from_contents (const char *path,
+                                  GBytes *contents,
+                                  QuadUnitFileParseFlags flags,
+                                  QuadHash128 *content_hash,
+                                  GError **error)
+{
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
 
-  if (*q == '[')
+  if (content_hash != NULL)
     {
-      q++;
-      while (*q && (g_unichar_isalnum (g_utf8_get_char_validated (q, -1)) || *q == '-' || *q == '_' || *q == '.' || *q == '@'))
-        q = g_utf8_find_next_char (q, NULL);
-
-      if (*q != ']')
-        return FALSE;
+      gsize len;
+      const char *data = g_bytes_get_data (contents, &len);
 
-      q++;
+      *content_hash = quad_hash128 (data, len, 0);
     }
 
-  if (*q != '\0')
-    return FALSE;
-
-  return TRUE;
-}
+  /* The lines point directly into the file contents */
+  if (!quad_unit_file_parse_bytes (unit, contents, flags, error))
+    return NULL;
 
+  unit->path = g_strdup (path);
 
-static QuadUnitGroup *
-quad_unit_file_lookup_group (QuadUnitFile *self,
-                             const char *group_name)
-{
-  return g_hash_table_lookup (self->group_hash, group_name);
+  return g_steal_pointer(&unit);
 }
 
-static QuadUnitGroup *
-quad_unit_file_ensure_group (QuadUnitFile *self,
-                             const char *group_name)
+/* Like quad_unit_file_new_from_path(), but maps the file rather than
+ * reading it, so the parsed lines are slices of the page cache */
+QuadUnitFile *
+quad_unit_file_new_from_mapped (const char *path, GError **error)
 {
-  QuadUnitGroup *group = quad_unit_file_lookup_group (self, group_name);
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(QuadUnitFile) unit = NULL;
+  struct stat st;
 
-  if (group == NULL)
+  /* Like quad_unit_file_new_from_path_full(), without mapping a huge
+   * file just to reject it */
+  if (stat (path, &st) == 0 && S_ISREG (st.st_mode) &&
+      !quad_unit_file_limits_check_size (&default_limits, st.st_size, error))
     {
-      group = quad_unit_group_new (group_name);
-      g_ptr_array_add (self->groups, group);
-      g_hash_table_insert (self->group_hash, group->name, group);
+      g_prefix_error (error, "Failed to load %s: ", path);
+      return NULL;
     }
 
-  return group;
-}
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    {
+      g_prefix_error (error, "Failed to open %s: ", path);
+      return NULL;
+    }
+
+  bytes = g_mapped_file_get_bytes (mapped);
+
+  unit = quad_unit_file_new_from_bytes (bytes, error);
+  if (unit == NULL)
+    return NULL;
+
+  unit->path = g_strdup (path);
+
+  return g_steal_pointer(&unit);
+}
+
+/* The unit keeps a reference to bytes, and the parsed lines
+ * point into it until they are modified */
+QuadUnitFile *
+quad_unit_file_new_from_bytes (GBytes *bytes, GError **error)
+{
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+
+  if (!quad_unit_file_parse_bytes (unit, bytes, QUAD_UNIT_FILE_PARSE_NONE, error))
+    return NULL;
+
+  return g_steal_pointer(&unit);
+}
+
+/* The compiled form of a unit is a header, followed by the group and
+ * line tables, followed by a table of nul-terminated strings. All
+ * references are offsets into the string table, so a loaded unit can
+ * point straight into the mapped file. It is only meant as a cache on
+ * the same machine, so it uses the native byte order */
+#define QUAD_COMPILED_MAGIC "QUADUNIT"
+#define QUAD_COMPILED_VERSION 1
+#define QUAD_COMPILED_BYTE_ORDER 0x01020304
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint64 source_size;
+  gint64 source_mtime_sec;
+  guint32 source_mtime_nsec;
+  guint32 source_path; /* string offset */
+  guint64 source_hash;
+  guint32 n_groups;
+  guint32 n_lines;
+  guint32 strings_size;
+  guint32 padding;
+} QuadCompiledHeader;
+
+typedef struct {
+  guint32 name;
+  guint32 n_comments; /* Lines of the group are stored after its comments */
+  guint32 n_lines;
+} QuadCompiledGroup;
+
+#define QUAD_COMPILED_NO_KEY G_MAXUINT32
+
+typedef struct {
+  guint32 key;
+  guint32 value;
+  guint32 value_len;
+  guint32 resolved;
+  guint32 resolved_len;
+} QuadCompiledLine;
+
+G_STATIC_ASSERT (sizeof (QuadCompiledHeader) % 8 == 0);
+
+typedef struct {
+  guint64 size;
+  gint64 mtime_sec;
+  guint32 mtime_nsec;
+} QuadSourceStat;
+
+static gboolean
+quad_source_stat (const char *path,
+                  QuadSourceStat *source_stat,
+                  GError **error)
+{
+  struct stat st;
+
+  if (stat (path, &st) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to stat %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  source_stat->size = st.st_size;
+  source_stat->mtime_sec = st.st_mtim.tv_sec;
+  source_stat->mtime_nsec = st.st_mtim.tv_nsec;
+
+  return TRUE;
+}
+
+static gboolean
+quad_source_hash (const char *path,
+                  guint64 *hash,
+                  GError **error)
+{
+  g_autoptr(GMappedFile) mapped = g_mapped_file_new (path, FALSE, error);
+
+  if (mapped == NULL)
+    return FALSE;
+
+  *hash = quad_hash64 (g_mapped_file_get_contents (mapped),
+                       g_mapped_file_get_length (mapped));
+  return TRUE;
+}
+
+typedef struct {
+  GByteArray *strings;
+  QuadTable *offsets; /* Deduplicates keys and group names */
+} QuadCompiledStrings;
+
+static guint32
+quad_compiled_add_string (QuadCompiledStrings *strings,
+                          const char *str,
+                          gsize len)
+{
+  guint32 offset = strings->strings->len;
+
+  g_byte_array_append (strings->strings, (const guint8 *)str, len);
+  g_byte_array_append (strings->strings, (const guint8 *)"", 1);
+
+  return offset;
+}
+
+/* Names are only stored once */
+static guint32
+quad_compiled_add_name (QuadCompiledStrings *strings,
+                        const char *str)
+{
+  gpointer offset;
+
+  if (quad_table_lookup_extended (strings->offsets, str, NULL, &offset))
+    return GPOINTER_TO_UINT (offset);
+
+  offset = GUINT_TO_POINTER (quad_compiled_add_string (strings, str, strlen (str)));
+  quad_table_insert (strings->offsets, (char *)str, offset);
+
+  return GPOINTER_TO_UINT (offset);
+}
+
+static void
+quad_compiled_add_lines (QuadCompiledStrings *strings,
+                         GArray *compiled_lines,
+                         QuadUnitLines *lines)
+{
+  for (guint i = 0; i < lines->len; i++)
+    {
+      QuadUnitLine *line = &lines->data[i];
+      QuadCompiledLine compiled;
+
+      compiled.key = line->key ? quad_compiled_add_name (strings, line->key) : QUAD_COMPILED_NO_KEY;
+      compiled.value = quad_compiled_add_string (strings, line->value, line->value_len);
+      compiled.value_len = line->value_len;
+      if (line->resolved == line->value)
+        compiled.resolved = compiled.value;
+      else
+        compiled.resolved = quad_compiled_add_string (strings, line->resolved, line->resolved_len);
+      compiled.resolved_len = line->resolved_len;
+
+      g_array_append_val (compiled_lines, compiled);
+    }
+}
+
+/* Saves the unit so that quad_unit_file_load_compiled() can load it
+ * without parsing, as long as the file it was loaded from is unchanged */
+gboolean
+quad_unit_file_save_compiled (QuadUnitFile *self,
+                              const char *compiled_path,
+                              GError **error)
+{
+  g_autoptr(GByteArray) strings = g_byte_array_new ();
+  g_autoptr(QuadTable) offsets = quad_str_table_new (NULL, NULL);
+  QuadCompiledStrings compiled_strings = { strings, offsets };
+  g_autoptr(GArray) groups = g_array_new (FALSE, FALSE, sizeof (QuadCompiledGroup));
+  g_autoptr(GArray) lines = g_array_new (FALSE, FALSE, sizeof (QuadCompiledLine));
+  g_autoptr(GByteArray) out = NULL;
+  QuadCompiledHeader header = { .magic = QUAD_COMPILED_MAGIC };
+  QuadSourceStat source_stat;
+
+  if (self->path == NULL)
+    return quad_fail (error, "Can't compile a unit without a source path");
+
+  /* The layers have their own sources, which we can't check */
+  if (self->layers != NULL)
+    return quad_fail (error, "Can't compile a unit with layers");
+
+  quad_unit_file_parse_lazy_groups (self);
+
+  if (!quad_source_stat (self->path, &source_stat, error) ||
+      !quad_source_hash (self->path, &header.source_hash, error))
+    return FALSE;
+
+  header.version = QUAD_COMPILED_VERSION;
+  header.byte_order = QUAD_COMPILED_BYTE_ORDER;
+  header.source_size = source_stat.size;
+  header.source_mtime_sec = source_stat.mtime_sec;
+  header.source_mtime_nsec = source_stat.mtime_nsec;
+  header.source_path = quad_compiled_add_string (&compiled_strings, self->path, strlen (self->path));
+
+  for (guint i = 0; i < self->groups->len; i++)
+    {
+      QuadUnitGroup *group = g_ptr_array_index (self->groups, i);
+      QuadCompiledGroup compiled;
+
+      compiled.name = quad_compiled_add_name (&compiled_strings, group->name);
+      compiled.n_comments = group->comments.len;
+      compiled.n_lines = group->lines.len;
+      g_array_append_val (groups, compiled);
+
+      quad_compiled_add_lines (&compiled_strings, lines, &group->comments);
+      quad_compiled_add_lines (&compiled_strings, lines, &group->lines);
+    }
+
+  if (strings->len > G_MAXUINT32 - 1)
+    return quad_fail (error, "Unit %s is too large to compile", self->path);
+
+  header.n_groups = groups->len;
+  header.n_lines = lines->len;
+  header.strings_size = strings->len;
+
+  out = g_byte_array_sized_new (sizeof (header) +
+                                groups->len * sizeof (QuadCompiledGroup) +
+                                lines->len * sizeof (QuadCompiledLine) +
+                                strings->len);
+  g_byte_array_append (out, (const guint8 *)&header, sizeof (header));
+  g_byte_array_append (out, (const guint8 *)groups->data, groups->len * sizeof (QuadCompiledGroup));
+  g_byte_array_append (out, (const guint8 *)lines->data, lines->len * sizeof (QuadCompiledLine));
+  g_byte_array_append (out, strings->data, strings->len);
+
+  return g_file_set_contents (compiled_path, (const char *)out->data, out->len, error);
+}
+
+/* Returns the nul-terminated string at offset, or NULL if it is out of bounds */
+static const char *
+quad_compiled_get_string (const char *strings,
+                          guint32 strings_size,
+                          guint32 offset,
+                          guint32 len)
+{
+  if (offset >= strings_size || len >= strings_size - offset ||
+      strings[offset + len] != 0)
+    return NULL;
+
+  return strings + offset;
+}
+
+static const char *
+quad_compiled_get_name (const char *strings,
+                        guint32 strings_size,
+                        guint32 offset)
+{
+  if (offset >= strings_size ||
+      memchr (strings + offset, 0, strings_size - offset) == NULL)
+    return NULL;
+
+  return strings + offset;
+}
+
+/* Keys that are not known names point into the strings, which the
+ * unit keeps alive as a source */
+static gboolean
+quad_compiled_load_lines (QuadUnitLines *lines,
+                          const QuadCompiledLine *compiled,
+                          guint32 n_lines,
+                          const char *strings,
+                          guint32 strings_size)
+{
+  QuadUnitLine *dest = quad_unit_lines_append (lines, n_lines);
+
+  for (guint32 i = 0; i < n_lines; i++)
+    {
+      const char *key = NULL;
+      const char *value, *resolved;
+
+      if (compiled[i].key != QUAD_COMPILED_NO_KEY)
+        {
+          const char *known;
+
+          key = quad_compiled_get_name (strings, strings_size, compiled[i].key);
+          if (key == NULL)
+            return FALSE;
+          known = quad_known_name_lookup (key, strlen (key));
+          if (known != NULL)
+            key = known;
+        }
+
+      value = quad_compiled_get_string (strings, strings_size,
+                                        compiled[i].value, compiled[i].value_len);
+      resolved = quad_compiled_get_string (strings, strings_size,
+                                           compiled[i].resolved, compiled[i].resolved_len);
+      if (value == NULL || resolved == NULL)
+        return FALSE;
+
+      quad_unit_line_init (&dest[i], key, value, compiled[i].value_len,
+                           QUAD_UNIT_LINE_VALUE_NUL);
+      dest[i].resolved = resolved;
+      dest[i].resolved_len = compiled[i].resolved_len;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+quad_unit_file_parse_compiled (QuadUnitFile *self,
+                               GBytes *bytes,
+                               const char *source_path,
+                               GError **error)
+{
+  gsize size;
+  const char *data = g_bytes_get_data (bytes, &size);
+  const QuadCompiledHeader *header = (const QuadCompiledHeader *)data;
+  const QuadCompiledGroup *groups;
+  const QuadCompiledLine *lines;
+  const char *strings, *path;
+  guint64 expected_size;
+  guint32 line_index = 0;
+  QuadSourceStat source_stat;
+  guint64 source_hash;
+
+  if (size < sizeof (QuadCompiledHeader) ||
+      memcmp (header->magic, QUAD_COMPILED_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != QUAD_COMPILED_VERSION ||
+      header->byte_order != QUAD_COMPILED_BYTE_ORDER)
+    return quad_fail (error, "Unsupported compiled unit format");
+
+  expected_size = sizeof (QuadCompiledHeader) +
+    (guint64)header->n_groups * sizeof (QuadCompiledGroup) +
+    (guint64)header->n_lines * sizeof (QuadCompiledLine) +
+    header->strings_size;
+  if (expected_size != size)
+    return quad_fail (error, "Truncated compiled unit");
+
+  groups = (const QuadCompiledGroup *)(header + 1);
+  lines = (const QuadCompiledLine *)(groups + header->n_groups);
+  strings = (const char *)(lines + header->n_lines);
+
+  path = quad_compiled_get_name (strings, header->strings_size, header->source_path);
+  if (path == NULL || strcmp (path, source_path) != 0)
+    return quad_fail (error, "Compiled unit is for a different source");
+
+  /* Only hash the source if the cheap checks pass */
+  if (!quad_source_stat (source_path, &source_stat, error))
+    return FALSE;
+  if (source_stat.size != header->source_size ||
+      source_stat.mtime_sec != header->source_mtime_sec ||
+      source_stat.mtime_nsec != header->source_mtime_nsec)
+    return quad_fail (error, "Compiled unit is out of date");
+  if (!quad_source_hash (source_path, &source_hash, error))
+    return FALSE;
+  if (source_hash != header->source_hash)
+    return quad_fail (error, "Compiled unit is out of date");
+
+  for (guint32 i = 0; i < header->n_groups; i++)
+    {
+      const char *name = quad_compiled_get_name (strings, header->strings_size, groups[i].name);
+      guint64 n_group_lines = (guint64)groups[i].n_comments + groups[i].n_lines;
+      QuadUnitGroup *group;
+
+      if (name == NULL || n_group_lines > header->n_lines - line_index)
+        return quad_fail (error, "Corrupt compiled unit");
+
+      group = quad_unit_file_ensure_group (self, name);
+      if (!quad_compiled_load_lines (&group->comments, lines + line_index,
+                                     groups[i].n_comments, strings, header->strings_size) ||
+          !quad_compiled_load_lines (&group->lines, lines + line_index + groups[i].n_comments,
+                                     groups[i].n_lines, strings, header->strings_size))
+        return quad_fail (error, "Corrupt compiled unit");
+
+      line_index += n_group_lines;
+    }
+
+  g_ptr_array_add (self->sources, g_bytes_ref (bytes));
+
+  return TRUE;
+}
+
+/* Loads a unit saved with quad_unit_file_save_compiled(). This fails if
+ * source_path has changed since, in which case it has to be parsed */
+QuadUnitFile *
+quad_unit_file_load_compiled (const char *compiled_path,
+                              const char *source_path,
+                              GError **error)
+{
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(QuadUnitFile) unit = NULL;
+
+  mapped = g_mapped_file_new (compiled_path, FALSE, error);
+  if (mapped == NULL)
+    {
+      g_prefix_error (error, "Failed to open %s: ", compiled_path);
+      return NULL;
+    }
+
+  bytes = g_mapped_file_get_bytes (mapped);
+
+  unit = quad_unit_file_new ();
+  if (!quad_unit_file_parse_compiled (unit, bytes, source_path, error))
+    return NULL;
+
+  unit->path = g_strdup (source_path);
+
+  return g_steal_pointer (&unit);
+}
+
+const char *
+quad_unit_file_get_path (QuadUnitFile  *self)
+{
+  return self->path;
+}
+
+void
+quad_unit_file_set_path (QuadUnitFile  *self,
+                         const char *path)
+{
+  g_return_if_fail (!self->frozen);
+
+  g_free (self->path);
+  self->path = g_strdup (path);
+}
+
+QuadUnitFile *
+quad_unit_file_new (void)
+{
+  QuadUnitFile *self;
+
+  self = g_new0 (QuadUnitFile, 1);
+  g_atomic_ref_count_init (&self->ref_count);
+  self->arena = quad_arena_new (QUAD_UNIT_FILE_ARENA_CHUNK_SIZE);
+  self->arenas = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_arena_unref);
+  self->sources = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  self->groups = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_group_unref);
+  self->group_hash = quad_str_table_new (NULL, NULL);
+  self->limits = default_limits;
+  self->line_nr = 1;
+
+  return self;
+}
+
+/* The limits built into quadlet, or the ones set with
+ * quad_unit_file_set_default_limits() */
+void
+quad_unit_file_get_default_limits (QuadUnitFileLimits *limits)
+{
+  *limits = default_limits;
+}
+
+/* Changes the limits of units created after this, NULL restores the
+ * built-in ones. This is not threadsafe, so call it before creating
+ * any threads that parse units */
+void
+quad_unit_file_set_default_limits (const QuadUnitFileLimits *limits)
+{
+  static const QuadUnitFileLimits builtin_limits = {
+    QUAD_UNIT_FILE_DEFAULT_MAX_FILE_SIZE,
+    QUAD_UNIT_FILE_DEFAULT_MAX_LINE_LENGTH,
+    QUAD_UNIT_FILE_DEFAULT_MAX_LINES,
+    QUAD_UNIT_FILE_DEFAULT_MAX_CONTINUATION_LINES,
+  };
+
+  default_limits = limits ? *limits : builtin_limits;
+}
+
+/* Applies to everything parsed into self after this */
+void
+quad_unit_file_set_limits (QuadUnitFile *self,
+                           const QuadUnitFileLimits *limits)
+{
+  g_return_if_fail (!self->frozen);
+
+  self->limits = *limits;
+}
+
+QuadUnitFile *
+quad_unit_file_ref (QuadUnitFile *self)
+{
+  g_atomic_ref_count_inc (&self->ref_count);
+  return self;
+}
+
+void
+quad_unit_file_unref (QuadUnitFile *self)
+{
+  if (!g_atomic_ref_count_dec (&self->ref_count))
+    return;
+
+  g_ptr_array_free (self->groups, TRUE);
+  quad_table_free (self->group_hash);
+  g_clear_pointer (&self->layers, g_ptr_array_unref);
+  quad_unit_lines_clear (&self->pending_comments);
+  g_ptr_array_free (self->sources, TRUE);
+  g_ptr_array_free (self->arenas, TRUE);
+  quad_arena_unref (self->arena);
+  g_free (self->path);
+  g_free (self);
+}
+
+static void
+quad_unit_file_keep_alive (QuadUnitFile *self,
+                           QuadUnitFile *source)
+{
+  if (self == source)
+    return;
+
+  if (!g_ptr_array_find (self->arenas, source->arena, NULL))
+    g_ptr_array_add (self->arenas, quad_arena_ref (source->arena));
+
+  for (guint i = 0; i < source->arenas->len; i++)
+    {
+      QuadArena *arena = g_ptr_array_index (source->arenas, i);
+      if (arena != self->arena && !g_ptr_array_find (self->arenas, arena, NULL))
+        g_ptr_array_add (self->arenas, quad_arena_ref (arena));
+    }
+
+  for (guint i = 0; i < source->sources->len; i++)
+    {
+      GBytes *bytes = g_ptr_array_index (source->sources, i);
+      if (!g_ptr_array_find (self->sources, bytes, NULL))
+        g_ptr_array_add (self->sources, g_bytes_ref (bytes));
+    }
+}
+
+/* Groups that only exist in source are shared rather than copied */
+static void
+quad_unit_file_merge_groups (QuadUnitFile *self,
+                             GPtrArray *groups)
+{
+  for (guint i = 0; i < groups->len; i++)
+    {
+      QuadUnitGroup *src_group = g_ptr_array_index (groups, i);
+      QuadUnitGroup *group = quad_unit_file_lookup_group (self, src_group->name);
+
+      if (group == NULL)
+        {
+          group = quad_unit_group_ref (src_group);
+          g_ptr_array_add (self->groups, group);
+          quad_table_insert (self->group_hash, (char *)group->name, group);
+        }
+      else
+        {
+          group = quad_unit_file_unshare_group (self, group);
+          quad_unit_group_merge (group, src_group);
+        }
+    }
+}
+
+/* Self and its layers, from the lowest to the highest */
+static guint
+quad_unit_file_get_n_sources (QuadUnitFile *self)
+{
+  return self->layers != NULL ? self->layers->len + 1 : 1;
+}
+
+static QuadUnitFile *
+quad_unit_file_get_source (QuadUnitFile *self,
+                           guint index)
+{
+  if (self->layers != NULL && index < self->layers->len)
+    return g_ptr_array_index (self->layers, index);
+
+  return self;
+}
+
+static void
+quad_unit_file_merge_layers (QuadUnitFile *self,
+                             QuadUnitFile *source)
+{
+  for (guint i = 0; i < quad_unit_file_get_n_sources (source); i++)
+    {
+      QuadUnitFile *layer = quad_unit_file_get_source (source, i);
+
+      /* Groups can't be parsed once they are shared */
+      quad_unit_file_parse_lazy_groups (layer);
+      quad_unit_file_keep_alive (self, layer);
+      quad_unit_file_merge_groups (self, layer->groups);
+    }
+}
+
+void
+quad_unit_file_merge (QuadUnitFile *self,
+                      QuadUnitFile *source)
+{
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
+  quad_unit_file_merge_layers (self, source);
+}
+
+/* Adds a layer on top of the existing ones, but below the groups of
+ * self. Lookups fall through to the layers, the last one first, so the
+ * layer is not copied. It must not be modified while in use. Modifying
+ * self merges all the layers into it first */
+void
+quad_unit_file_add_layer (QuadUnitFile *self,
+                          QuadUnitFile *layer)
+{
+  g_return_if_fail (self != layer);
+  g_return_if_fail (!self->frozen);
+
+  if (self->layers == NULL)
+    self->layers = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_file_unref);
+
+  /* Keeps the list flat, so lookups don't have to recurse */
+  for (guint i = 0; i < quad_unit_file_get_n_sources (layer); i++)
+    g_ptr_array_add (self->layers, quad_unit_file_ref (quad_unit_file_get_source (layer, i)));
+}
+
+static void
+quad_unit_file_flatten (QuadUnitFile *self)
+{
+  g_autoptr(GPtrArray) layers = g_steal_pointer (&self->layers);
+  g_autoptr(GPtrArray) groups = NULL;
+  g_autoptr(QuadTable) group_hash = NULL;
+
+  if (layers == NULL)
+    return;
+
+  quad_unit_file_parse_lazy_groups (self);
+  groups = g_steal_pointer (&self->groups);
+  group_hash = g_steal_pointer (&self->group_hash);
+  self->groups = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_group_unref);
+  self->group_hash = quad_str_table_new (NULL, NULL);
+
+  for (guint i = 0; i < layers->len; i++)
+    {
+      QuadUnitFile *layer = g_ptr_array_index (layers, i);
+
+      quad_unit_file_parse_lazy_groups (layer);
+      quad_unit_file_keep_alive (self, layer);
+      quad_unit_file_merge_groups (self, layer->groups);
+    }
+  quad_unit_file_merge_groups (self, groups);
+}
+
+/* This is cheap, the copy shares all groups with self until either
+ * of them is modified */
+QuadUnitFile *
+quad_unit_file_copy (QuadUnitFile *self)
+{
+  QuadUnitFile *copy = quad_unit_file_new ();
+  copy->limits = self->limits;
+  quad_unit_file_merge (copy, self);
+  return copy;
+}
+
+/* Returns an immutable version of self, which can be read from many
+ * threads at once. It still shares the groups with self, so anything
+ * that lookups would do lazily to them is done here instead. Copies of
+ * the frozen unit are not frozen and can be modified as usual */
+QuadUnitFile *
+quad_unit_file_freeze (QuadUnitFile *self)
+{
+  QuadUnitFile *frozen;
+
+  if (self->frozen)
+    return quad_unit_file_ref (self);
+
+  frozen = quad_unit_file_copy (self);
+  frozen->path = g_strdup (self->path);
+
+  for (guint i = 0; i < frozen->groups->len; i++)
+    {
+      QuadUnitGroup *group = g_ptr_array_index (frozen->groups, i);
+
+      quad_unit_group_get_index (group);
+      for (guint j = 0; j < group->lines.len; j++)
+        quad_unit_line_get_value (group, &group->lines.data[j]);
+    }
+
+  frozen->frozen = TRUE;
+  return frozen;
+}
+
+gboolean
+quad_unit_file_is_frozen (QuadUnitFile *self)
+{
+  return self->frozen;
+}
+
+static gboolean
+line_is_comment (const char *line, const char *line_end)
+{
+  return line == line_end || *line == '#' || *line == ';';
+}
+
+/* The scanning functions below only look for ascii characters, which
+ * never occur inside a multibyte utf8 sequence, so they can step bytewise */
+
+static gboolean
+line_is_group (const char *line, const char *line_end)
+{
+  const char *p;
+
+  if (line == line_end)
+    return FALSE;
+
+  p = line;
+  if (*p != '[')
+    return FALSE;
+
+  p++;
+
+  while (p < line_end && *p != ']')
+    p++;
+
+  if (p >= line_end || *p != ']')
+    return FALSE;
+
+  /* silently accept whitespace after the ] */
+  p++;
+  while (p < line_end && (*p == ' ' || *p == '\t'))
+    p++;
+
+  if (p != line_end)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* first_eq is the first '=' in the line, from quad_scan_line() */
+static gboolean
+line_is_key_value_pair (const char *line,
+                        const char *first_eq)
+{
+  /* Key must be non-empty
+   */
+  return first_eq != NULL && first_eq != line;
+}
+
+static const char *
+utf8_next_char (const char *p, const char *end)
+{
+  const char *next = g_utf8_find_next_char (p, end);
+  return next ? next : end;
+}
+
+/* Ascii characters that end a group name, or a key name before the
+ * locale. Bytes >= 0x80 are never special */
+static const guint8 group_name_end_chars[256] = {
+  [0 ... 0x1f] = 1, [0x7f] = 1, ['['] = 1, [']'] = 1,
+};
+
+static const guint8 key_name_end_chars[256] = {
+  [0] = 1, ['='] = 1, ['['] = 1, [']'] = 1,
+};
+
+static const guint8 locale_chars[256] = {
+  ['0' ... '9'] = 1, ['a' ... 'z'] = 1, ['A' ... 'Z'] = 1,
+  ['-'] = 1, ['_'] = 1, ['.'] = 1, ['@'] = 1,
+};
+
+/* Non-ascii characters are rare, so we only validate the
+ * buffer when we need to, and then only once */
+static gboolean
+quad_unit_file_parse_data_is_utf8 (QuadUnitFile *self)
+{
+  if (self->parse_data_is_utf8 < 0)
+    self->parse_data_is_utf8 = g_utf8_validate (self->parse_data, self->parse_data_len, NULL);
+
+  return self->parse_data_is_utf8;
+}
+
+static gboolean
+is_valid_group_name (const char *name,
+                     const char *name_end)
+{
+  const char *p, *q;
+
+  p = q = name;
+  while (q < name_end && !group_name_end_chars[(guchar)*q])
+    q++;
+
+  if (q != name_end || q == p)
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+is_valid_key_name (QuadUnitFile *self,
+                   const char *name,
+                   const char *name_end)
+{
+  const char *p, *q;
+
+  p = q = name;
+
+  /* We accept a little more than the desktop entry spec says,
+   * since gnome-vfs uses mime-types as keys in its cache.
+   */
+  while (q < name_end && !key_name_end_chars[(guchar)*q])
+    q++;
+
+  /* No empty keys, please */
+  if (q == p)
+    return FALSE;
+
+  /* We accept spaces in the middle of keys to not break
+   * existing apps, but we don't tolerate initial or final
+   * spaces, which would lead to silent corruption when
+   * rereading the file.
+   */
+  if (*p == ' ' || q[-1] == ' ')
+    return FALSE;
+
+  if (q < name_end && *q == '[')
+    {
+      q++;
+      while (q < name_end)
+        {
+          if (locale_chars[(guchar)*q])
+            q++;
+          else if ((guchar)*q >= 0x80 &&
+                   g_unichar_isalnum (quad_unit_file_parse_data_is_utf8 (self) ?
+                                      g_utf8_get_char (q) :
+                                      g_utf8_get_char_validated (q, name_end - q)))
+            q = utf8_next_char (q, name_end);
+          else
+            break;
+        }
+
+      if (q >= name_end || *q != ']')
+        return FALSE;
+
+      q++;
+    }
+
+  if (q != name_end)
+    return FALSE;
+
+  return TRUE;
+}
+
+
+static QuadUnitGroup *
+quad_unit_file_lookup_group (QuadUnitFile *self,
+                             const char *group_name)
+{
+  QuadUnitGroup *group;
+
+  group = quad_table_lookup (self->group_hash, group_name);
+
+  /* While parsing, lines are appended after the lazy ones */
+  if (group != NULL && group->lazy_bodies != NULL && self->parse_data == NULL)
+    quad_unit_file_parse_lazy_group (self, group);
+
+  return group;
+}
+
+/* Gives self a private copy of a group it shares with other units.
+ * Only the line records are copied, the strings stay shared */
+static QuadUnitGroup *
+quad_unit_file_unshare_group (QuadUnitFile *self,
+                              QuadUnitGroup *group)
+{
+  QuadUnitGroup *clone;
+  guint i;
+
+  if (!quad_unit_group_is_shared (group))
+    return group;
+
+  clone = quad_unit_group_new (self, group->name);
+  quad_unit_lines_merge (&clone->comments, &group->comments);
+  quad_unit_lines_merge (&clone->lines, &group->lines);
+
+  for (i = 0; i < self->groups->len; i++)
+    if (g_ptr_array_index (self->groups, i) == group)
+      break;
+  g_assert (i < self->groups->len);
+
+  /* Replacing the element doesn't call the free func */
+  self->groups->pdata[i] = clone;
+  quad_table_insert (self->group_hash, (char *)clone->name, clone);
+  quad_unit_group_unref (group);
+
+  return clone;
+}
+
+/* Like quad_unit_file_lookup_group(), but the group may be modified */
+static QuadUnitGroup *
+quad_unit_file_get_writable_group (QuadUnitFile *self,
+                                   const char *group_name)
+{
+  QuadUnitGroup *group = quad_unit_file_lookup_group (self, group_name);
+
+  if (group == NULL)
+    return NULL;
+
+  return quad_unit_file_unshare_group (self, group);
+}
+
+static QuadUnitGroup *
+quad_unit_file_ensure_group (QuadUnitFile *self,
+                             const char *group_name)
+{
+  QuadUnitGroup *group = quad_unit_file_get_writable_group (self, group_name);
+
+  if (group == NULL)
+    {
+      group = quad_unit_group_new (self, quad_unit_name_new (self->arena, group_name,
+                                                             strlen (group_name)));
+      g_ptr_array_add (self->groups, group);
+      quad_table_insert (self->group_hash, (char *)group->name, group);
+    }
+
+  return group;
+}
+
+static gboolean
+quad_unit_file_limits_check_size (const QuadUnitFileLimits *limits,
+                                  guint64 size,
+                                  GError **error)
+{
+  if (limits->max_file_size != 0 && size > limits->max_file_size)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "File is too large (%" G_GUINT64_FORMAT " bytes, the limit is %" G_GSIZE_FORMAT ")",
+                   size, limits->max_file_size);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+quad_unit_file_check_size (QuadUnitFile *self,
+                           guint64 size,
+                           GError **error)
+{
+  return quad_unit_file_limits_check_size (&self->limits, size, error);
+}
+
+/* Checks the line from line to line_end, which starts at line_nr and
+ * is continued over n_lines - 1 more lines */
+static gboolean
+quad_unit_file_check_line (QuadUnitFile *self,
+                           const char *line,
+                           const char *line_end,
+                           int line_nr,
+                           int n_lines,
+                           GError **error)
+{
+  QuadUnitFileLimits *limits = &self->limits;
+
+  if (limits->max_lines != 0 && (guint64)line_nr - 1 + n_lines > limits->max_lines)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "File has more than %u lines", limits->max_lines);
+      return FALSE;
+    }
+
+  if (limits->max_line_length != 0 && (gsize)(line_end - line) > limits->max_line_length)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "Line %d is longer than %" G_GSIZE_FORMAT " bytes",
+                   line_nr, limits->max_line_length);
+      return FALSE;
+    }
+
+  if (limits->max_continuation_lines != 0 && (guint)(n_lines - 1) > limits->max_continuation_lines)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "Line %d is continued over more than %u lines",
+                   line_nr, limits->max_continuation_lines);
+      return FALSE;
+    }
+
+  return TRUE;
+}
 
 static gboolean
 quad_unit_file_parse_comment (QuadUnitFile *self,
@@ -361,26 +1632,24 @@ quad_unit_file_parse_comment (QuadUnitFile *self,
                               const char *line_end,
                               G_GNUC_UNUSED GError **error)
 {
-  QuadUnitLine *l = quad_unit_line_new (NULL, line, line_end - line);
+  QuadUnitLine *l = quad_unit_lines_append (&self->pending_comments, 1);
 
-  g_ptr_array_add (self->pending_comments, l);
+  quad_unit_line_init (l, NULL, line, line_end - line, 0);
 
   return TRUE;
 }
 
 static void
 quad_unit_file_flush_pending_comments (QuadUnitFile *self,
-                                       GPtrArray *to)
+                                       QuadUnitLines *to)
 {
-  gsize n_pending = self->pending_comments->len;
+  guint n_pending = self->pending_comments.len;
 
   if (n_pending > 0)
     {
-      g_autofree QuadUnitLine **pending = (QuadUnitLine **)g_ptr_array_free (self->pending_comments, FALSE);
-      self->pending_comments = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_line_free);
-
-      for (gsize i = 0; i < n_pending; i++)
-        g_ptr_array_add (to, pending[i]);
+      memcpy (quad_unit_lines_append (to, n_pending),
+              self->pending_comments.data, n_pending * sizeof (QuadUnitLine));
+      self->pending_comments.len = 0;
     }
 }
 
@@ -390,7 +1659,7 @@ quad_unit_file_parse_group (QuadUnitFile *self,
                             const char *line_end,
                             GError **error)
 {
-  g_autofree char *group_name = NULL;
+  const char *group_name;
   const char *group_name_start, *group_name_end;
 
   /* advance past opening '['  */
@@ -400,202 +1669,796 @@ quad_unit_file_parse_group (QuadUnitFile *self,
   while (*group_name_end != ']')
     group_name_end--;
 
-  group_name = g_strndup (group_name_start,
-                          group_name_end - group_name_start);
-
-  if (!is_valid_group_name (group_name))
+  if (!is_valid_group_name (group_name_start, group_name_end))
     {
       g_set_error (error, G_KEY_FILE_ERROR,
                    G_KEY_FILE_ERROR_PARSE,
-                   "Invalid group name: %s", group_name);
+                   "Invalid group name: %.*s",
+                   (int)(group_name_end - group_name_start), group_name_start);
       return FALSE;
     }
 
+  group_name = quad_unit_name_new (self->arena, group_name_start,
+                                   group_name_end - group_name_start);
   self->current_group = quad_unit_file_ensure_group (self, group_name);
 
-  if (self->pending_comments->len > 0)
+  if (self->pending_comments.len > 0)
     {
-      QuadUnitLine *first_comment = g_ptr_array_index (self->pending_comments, 0);
+      QuadUnitLine *first_comment = &self->pending_comments.data[0];
 
       /* Remove one newline between groups, which is re-added on printing, see quad_unit_group_print()*/
       if (quad_unit_line_is_empty (first_comment))
-        g_ptr_array_remove_index (self->pending_comments, 0);
+        {
+          self->pending_comments.len--;
+          memmove (self->pending_comments.data, self->pending_comments.data + 1,
+                   self->pending_comments.len * sizeof (QuadUnitLine));
+        }
+
+      quad_unit_file_flush_pending_comments (self, &self->current_group->comments);
+    }
+
+  return TRUE;
+}
+
+/* Returns the end of the key name of a key-value pair, or NULL if it
+ * is not valid */
+static const char *
+parse_key_name (QuadUnitFile *self,
+                const char *line,
+                const char *first_eq,
+                GError **error)
+{
+  const char *key_end = first_eq;
+
+  /* Pull the key name from the line (chomping trailing whitespace) */
+  while (key_end > line && g_ascii_isspace (key_end[-1]))
+    key_end--;
+
+  if (!is_valid_key_name (self, line, key_end))
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "Invalid key name: %.*s", (int)(key_end - line), line);
+      return NULL;
+    }
+
+  return key_end;
+}
+
+static void
+set_invalid_line_error (const char *line,
+                        const char *line_end,
+                        int line_nr,
+                        GError **error)
+{
+  g_autofree char *line_utf8 = g_utf8_make_valid (line, line_end - line);
+
+  g_set_error (error, G_KEY_FILE_ERROR,
+               G_KEY_FILE_ERROR_PARSE,
+               "File contains line %d: “%s” which is not a key-value pair, group, or comment",
+               line_nr,
+               line_utf8);
+}
+
+static gboolean
+quad_unit_file_parse_key_value_pair (QuadUnitFile *self,
+                                     const char *line,
+                                     const char *line_end,
+                                     const char *first_eq,
+                                     gboolean continued,
+                                     GError **error)
+{
+  const char *key_end, *value_start;
+  QuadUnitLine *l;
+
+  if (self->current_group == NULL)
+    {
+      g_set_error_literal (error, G_KEY_FILE_ERROR,
+                           G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
+                           "Key file does not start with a group");
+      return FALSE;
+    }
+
+  key_end = parse_key_name (self, line, first_eq, error);
+  if (key_end == NULL)
+    return FALSE;
+
+  value_start = first_eq + 1;
+
+  /* Pull the value from the line (chugging leading whitespace) */
+  while (value_start < line_end && g_ascii_isspace (*value_start))
+    value_start++;
+
+  quad_unit_file_flush_pending_comments (self, &self->current_group->lines);
+  l = quad_unit_lines_append (&self->current_group->lines, 1);
+  quad_unit_line_init (l,
+                       quad_unit_name_new (self->arena, line, key_end - line),
+                       value_start, line_end - value_start,
+                       0);
+  if (continued)
+    quad_unit_line_resolve (self, l);
+  quad_unit_group_index_lines (self->current_group, self->current_group->lines.len - 1);
+
+  return TRUE;
+}
+
+static gboolean
+quad_unit_file_parse_line (QuadUnitFile *self,
+                           const char *line,
+                           const char *line_end,
+                           const char *first_eq,
+                           gboolean continued,
+                           GError **error)
+{
+  if (line_is_comment (line, line_end))
+    return quad_unit_file_parse_comment (self, line, line_end, error);
+  else if (line_is_group (line, line_end))
+    return quad_unit_file_parse_group (self, line, line_end, error);
+  else if (line_is_key_value_pair (line, first_eq))
+    return quad_unit_file_parse_key_value_pair (self, line,
+                                                line_end, first_eq,
+                                                continued, error);
+  else
+    {
+      set_invalid_line_error (line, line_end, self->line_nr, error);
+      return FALSE;
+    }
+}
+
+/* Returns the end of the line starting at line, including any lines
+ * that continue it, and the start of the next one in next_out */
+static const char *
+scan_logical_line (const char *line,
+                   const char *data_end,
+                   const char **first_eq,
+                   const char **next_out,
+                   int *n_lines_out)
+{
+  const char *endofline = quad_scan_line (line, data_end, first_eq);
+  const char *next;
+  int n_lines = 1;
+
+  if (endofline == data_end)
+    next = data_end;
+  else
+    next = endofline + 1;
+
+  /* Handle multi-line continuations */
+  /* Note: This doesn't support coments in the middle of the continuation, which systemd does */
+  if (line_is_key_value_pair (line, *first_eq))
+    {
+      while (endofline < data_end && endofline[-1] == '\\')
+        {
+          const char *next_endofline = memchr (next, '\n', data_end - next);
+
+          if (next_endofline == NULL)
+            {
+              endofline = data_end;
+              next = data_end;
+            }
+          else
+            {
+              endofline = next_endofline;
+              next = next_endofline + 1;
+            }
+          n_lines++;
+        }
+    }
+
+  *next_out = next;
+  *n_lines_out = n_lines;
+  return endofline;
+}
+
+/* The parsed lines point into data, so it has to stay alive as long as
+ * self. Unless at_eof is set, this stops at the first line that is not
+ * terminated yet, and returns the number of bytes parsed in consumed_out */
+static gboolean
+quad_unit_file_parse_lines (QuadUnitFile *self,
+                            const char *data,
+                            gsize data_len,
+                            gboolean at_eof,
+                            gsize *consumed_out,
+                            GError **error)
+{
+  const char *line;
+  const char *data_end = data + data_len;
+  gboolean res = TRUE;
+
+  self->parse_data = data;
+  self->parse_data_len = data_len;
+  self->parse_data_is_utf8 = -1;
+
+  line = data;
+  while (line < data_end)
+    {
+      const char *next;
+      const char *first_eq;
+      int n_lines;
+      const char *endofline = scan_logical_line (line, data_end, &first_eq, &next, &n_lines);
+
+      /* Wait for the rest of the line */
+      if (!at_eof && endofline == data_end)
+        break;
+
+      if (!quad_unit_file_check_line (self, line, endofline, self->line_nr, n_lines, error) ||
+          !quad_unit_file_parse_line (self, line, endofline, first_eq, n_lines > 1, error))
+        {
+          res = FALSE;
+          break;
+        }
+
+      self->line_nr += n_lines;
+      line = next;
+    }
+
+  /* This drops comments in files without groups, but YOLO */
+  if (res && at_eof && self->current_group)
+    quad_unit_file_flush_pending_comments (self, &self->current_group->lines);
+
+  self->parse_data = NULL;
+  self->parse_data_len = 0;
+
+  if (consumed_out)
+    *consumed_out = line - data;
+
+  return res;
+}
+
+static gboolean
+quad_unit_file_parse_data (QuadUnitFile *self,
+                           const char *data,
+                           gsize data_len,
+                           GError **error)
+{
+  /* The new lines go after the existing ones */
+  quad_unit_file_parse_lazy_groups (self);
 
-      quad_unit_file_flush_pending_comments (self, self->current_group->comments);
+  return quad_unit_file_parse_lines (self, data, data_len, TRUE, NULL, error);
+}
+
+static void
+quad_unit_group_add_lazy_body (QuadUnitFile *self,
+                               QuadUnitGroup *group,
+                               const char *data,
+                               gsize len,
+                               int line_nr)
+{
+  QuadUnitLazyBody body = { data, len, line_nr };
+
+  if (group->lazy_bodies == NULL)
+    group->lazy_bodies = g_array_new (FALSE, FALSE, sizeof (QuadUnitLazyBody));
+  g_array_append_val (group->lazy_bodies, body);
+  self->has_lazy_groups = TRUE;
+}
+
+/* Only parses the comments and group headers, the group bodies are
+ * parsed when the group is first looked up. Comments before a group
+ * header belong to that group, so a body ends at the last line before
+ * them. Everything before the first group is parsed, so files that
+ * don't start with a group still fail to load. The syntax of the other
+ * lines is checked, so a file loads lazily only if it loads eagerly */
+static gboolean
+quad_unit_file_parse_data_lazy (QuadUnitFile *self,
+                                const char *data,
+                                gsize data_len,
+                                GError **error)
+{
+  const char *data_end = data + data_len;
+  const char *line = data;
+  const char *pending = data; /* Start of what is not parsed or deferred yet */
+  int pending_line_nr = self->line_nr;
+  const char *comments = NULL; /* Start of the comments before line */
+  int comments_line_nr = 0;
+  int line_nr = self->line_nr;
+
+  quad_unit_file_parse_lazy_groups (self);
+
+  while (line < data_end)
+    {
+      const char *first_eq, *next;
+      int n_lines;
+      const char *endofline = scan_logical_line (line, data_end, &first_eq, &next, &n_lines);
+
+      /* Checked here too, so the deferred bodies can't exceed them */
+      if (!quad_unit_file_check_line (self, line, endofline, line_nr, n_lines, error))
+        return FALSE;
+
+      if (line_is_comment (line, endofline))
+        {
+          if (comments == NULL)
+            {
+              comments = line;
+              comments_line_nr = line_nr;
+            }
+        }
+      else if (line_is_group (line, endofline))
+        {
+          const char *header = comments ? comments : line;
+          int header_line_nr = comments ? comments_line_nr : line_nr;
+
+          if (self->current_group == NULL)
+            {
+              header = pending;
+              header_line_nr = pending_line_nr;
+            }
+          else if (header > pending)
+            quad_unit_group_add_lazy_body (self, self->current_group,
+                                           pending, header - pending, pending_line_nr);
+
+          self->line_nr = header_line_nr;
+          if (!quad_unit_file_parse_lines (self, header, next - header, TRUE, NULL, error))
+            return FALSE;
+
+          pending = next;
+          pending_line_nr = line_nr + n_lines;
+          comments = NULL;
+        }
+      else
+        {
+          /* Lines before the first group are parsed below */
+          if (self->current_group != NULL)
+            {
+              if (!line_is_key_value_pair (line, first_eq))
+                {
+                  set_invalid_line_error (line, endofline, line_nr, error);
+                  return FALSE;
+                }
+              if (parse_key_name (self, line, first_eq, error) == NULL)
+                return FALSE;
+            }
+          comments = NULL;
+        }
+
+      line_nr += n_lines;
+      line = next;
+    }
+
+  if (self->current_group == NULL)
+    {
+      self->line_nr = pending_line_nr;
+      return quad_unit_file_parse_lines (self, pending, data_end - pending, TRUE, NULL, error);
+    }
+
+  if (pending < data_end)
+    quad_unit_group_add_lazy_body (self, self->current_group,
+                                   pending, data_end - pending, pending_line_nr);
+  self->line_nr = line_nr;
+
+  return TRUE;
+}
+
+static void
+quad_unit_file_parse_lazy_group (QuadUnitFile *self,
+                                 QuadUnitGroup *group)
+{
+  g_autoptr(GArray) bodies = g_steal_pointer (&group->lazy_bodies);
+  QuadUnitGroup *current_group = self->current_group;
+  int line_nr = self->line_nr;
+
+  for (guint i = 0; i < bodies->len; i++)
+    {
+      QuadUnitLazyBody *body = &g_array_index (bodies, QuadUnitLazyBody, i);
+      g_autoptr(GError) error = NULL;
+
+      self->current_group = group;
+      self->line_nr = body->line_nr;
+      if (!quad_unit_file_parse_lines (self, body->data, body->len, TRUE, NULL, &error))
+        {
+          /* The lines were checked when the unit was loaded, so this
+           * can't happen, but the unit is loaded and all we can do is to
+           * report it */
+          quad_log ("Error parsing %s: %s", self->path ? self->path : "unit file", error->message);
+          break;
+        }
+    }
+
+  self->current_group = current_group;
+  self->line_nr = line_nr;
+}
+
+static void
+quad_unit_file_parse_lazy_groups (QuadUnitFile *self)
+{
+  if (!self->has_lazy_groups)
+    return;
+
+  self->has_lazy_groups = FALSE;
+  for (guint i = 0; i < self->groups->len; i++)
+    {
+      QuadUnitGroup *group = g_ptr_array_index (self->groups, i);
+
+      if (group->lazy_bodies != NULL)
+        quad_unit_file_parse_lazy_group (self, group);
+    }
+}
+
+static gboolean
+quad_unit_file_parse_bytes (QuadUnitFile *self,
+                            GBytes *bytes,
+                            QuadUnitFileParseFlags flags,
+                            GError **error)
+{
+  gsize data_len;
+  const char *data = g_bytes_get_data (bytes, &data_len);
+
+  if (!quad_unit_file_check_size (self, data_len, error))
+    return FALSE;
+
+  g_ptr_array_add (self->sources, g_bytes_ref (bytes));
+
+  if (flags & QUAD_UNIT_FILE_PARSE_LAZY)
+    return quad_unit_file_parse_data_lazy (self, data, data_len, error);
+
+  return quad_unit_file_parse_data (self, data, data_len, error);
+}
+
+gboolean
+quad_unit_file_parse (QuadUnitFile *self,
+                      const char *data,
+                      GError **error)
+{
+  gsize data_len = strlen (data);
+
+  g_return_val_if_fail (!self->frozen, FALSE);
+
+  if (!quad_unit_file_check_size (self, data_len, error))
+    return FALSE;
+
+  quad_unit_file_flatten (self);
+
+  /* We don't own data, so take a single copy that the lines can point into */
+  return quad_unit_file_parse_data (self,
+                                    quad_arena_strndup (self->arena, data, data_len),
+                                    data_len, error);
+}
+
+#define QUAD_UNIT_FILE_PARSER_BUFFER_SIZE 4096
+
+struct _QuadUnitFileParser
+{
+  QuadUnitFile *unit;
+
+  /* Allocated in the arena of unit, as the parsed lines point into it.
+   * When it is full we switch to a new one, so the old lines stay valid */
+  char *buffer;
+  gsize buffer_size;
+  gsize start; /* Start of the first line not parsed yet */
+  gsize end;
+  gsize total_len;
+  /* Size of the incomplete line at the start of the buffer when it
+   * was last scanned */
+  gsize stalled_len;
+};
+
+QuadUnitFileParser *
+quad_unit_file_parser_new (void)
+{
+  QuadUnitFileParser *parser = g_new0 (QuadUnitFileParser, 1);
+
+  parser->unit = quad_unit_file_new ();
+
+  return parser;
+}
+
+void
+quad_unit_file_parser_free (QuadUnitFileParser *parser)
+{
+  g_clear_pointer (&parser->unit, quad_unit_file_unref);
+  g_free (parser);
+}
+
+/* Chunks can end anywhere, incomplete lines are kept until the rest
+ * arrives. After an error the parser can only be freed */
+gboolean
+quad_unit_file_parser_feed (QuadUnitFileParser *parser,
+                            const char *chunk,
+                            gsize len,
+                            GError **error)
+{
+  gsize consumed;
+
+  g_return_val_if_fail (parser->unit != NULL, FALSE);
+
+  if (len == 0)
+    return TRUE;
+
+  parser->total_len += len;
+  if (!quad_unit_file_check_size (parser->unit, parser->total_len, error))
+    {
+      g_clear_pointer (&parser->unit, quad_unit_file_unref);
+      return FALSE;
+    }
+
+  if (parser->end + len > parser->buffer_size)
+    {
+      gsize pending = parser->end - parser->start;
+      /* Grow geometrically, so a long line is copied a bounded number of times */
+      gsize new_size = MAX (MAX (pending + len, pending * 2), QUAD_UNIT_FILE_PARSER_BUFFER_SIZE);
+      char *new_buffer = quad_arena_alloc (parser->unit->arena, new_size);
+
+      if (pending > 0)
+        memcpy (new_buffer, parser->buffer + parser->start, pending);
+      parser->buffer = new_buffer;
+      parser->buffer_size = new_size;
+      parser->start = 0;
+      parser->end = pending;
+    }
+
+  memcpy (parser->buffer + parser->end, chunk, len);
+  parser->end += len;
+
+  /* Nothing can be complete without a newline */
+  if (memchr (chunk, '\n', len) == NULL)
+    return TRUE;
+
+  /* An incomplete line is scanned again from its start, so wait until
+   * the data has doubled, or a line continued over many small chunks
+   * would take quadratic time */
+  if (parser->end - parser->start < parser->stalled_len * 2)
+    return TRUE;
+
+  if (!quad_unit_file_parse_lines (parser->unit,
+                                   parser->buffer + parser->start,
+                                   parser->end - parser->start,
+                                   FALSE, &consumed, error))
+    {
+      g_clear_pointer (&parser->unit, quad_unit_file_unref);
+      return FALSE;
+    }
+
+  parser->start += consumed;
+  parser->stalled_len = parser->end - parser->start;
+
+  /* No need to buffer the rest of a line that is already too long */
+  if (parser->unit->limits.max_line_length != 0 &&
+      parser->stalled_len > parser->unit->limits.max_line_length)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR,
+                   G_KEY_FILE_ERROR_PARSE,
+                   "Line %d is longer than %" G_GSIZE_FORMAT " bytes",
+                   parser->unit->line_nr, parser->unit->limits.max_line_length);
+      g_clear_pointer (&parser->unit, quad_unit_file_unref);
+      return FALSE;
     }
 
   return TRUE;
 }
 
-static gboolean
-quad_unit_file_parse_key_value_pair (QuadUnitFile *self,
-                                     const char *line,
-                                     const char *line_end,
-                                     GError **error)
+QuadUnitFile *
+quad_unit_file_parser_finish (QuadUnitFileParser *parser,
+                              GError **error)
 {
-  g_autofree char *key = NULL;
-  char *key_end, *value_start;
+  g_autoptr(QuadUnitFile) unit = g_steal_pointer (&parser->unit);
+  const char *pending = parser->buffer ? parser->buffer + parser->start : "";
 
-  if (self->current_group == NULL)
-    {
-      g_set_error_literal (error, G_KEY_FILE_ERROR,
-                           G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
-                           "Key file does not start with a group");
-      return FALSE;
-    }
+  g_return_val_if_fail (unit != NULL, NULL);
+
+  if (!quad_unit_file_parse_lines (unit, pending,
+                                   parser->end - parser->start,
+                                   TRUE, NULL, error))
+    return NULL;
+
+  return g_steal_pointer (&unit);
+}
 
-  key_end = value_start = strchr (line, '=');
-  g_assert (key_end != NULL);
+/* The output is generated in two passes, first we compute the exact
+ * size, then we copy all strings into a buffer of that size. This
+ * avoids reallocations and formatting each line with printf */
+static gsize
+quad_unit_line_print_size (QuadUnitLine *line)
+{
+  gsize size = line->value_len + 1;
 
-  key_end--;
-  value_start++;
+  if (line->key != NULL)
+    size += strlen (line->key) + 1;
 
-  /* Pull the key name from the line (chomping trailing whitespace) */
-  while (g_ascii_isspace (*key_end))
-    key_end--;
+  return size;
+}
 
-  key = g_strndup (line, key_end + 1 - line);
-  if (!is_valid_key_name (key))
+static char *
+quad_unit_line_print (QuadUnitLine *line, char *dest)
+{
+  if (line->key != NULL)
     {
-      g_set_error (error, G_KEY_FILE_ERROR,
-                   G_KEY_FILE_ERROR_PARSE,
-                   "Invalid key name: %s", key);
-      return FALSE;
+      gsize key_len = strlen (line->key);
+      memcpy (dest, line->key, key_len);
+      dest += key_len;
+      *dest++ = '=';
     }
+  memcpy (dest, line->value, line->value_len);
+  dest += line->value_len;
+  *dest++ = '\n';
 
-  /* Pull the value from the line (chugging leading whitespace) */
-  while (value_start < line_end && g_ascii_isspace (*value_start))
-    value_start++;
+  return dest;
+}
+
+static gsize
+quad_unit_group_print_size (QuadUnitGroup *group)
+{
+  gsize size = strlen (group->name) + 3;
+  guint i;
 
-  quad_unit_file_flush_pending_comments (self, self->current_group->lines);
-  g_ptr_array_add (self->current_group->lines,
-                   quad_unit_line_new (key, value_start, line_end - value_start));
+  for (i = 0; i < group->comments.len; i++)
+    size += quad_unit_line_print_size (&group->comments.data[i]);
+  for (i = 0; i < group->lines.len; i++)
+    size += quad_unit_line_print_size (&group->lines.data[i]);
 
-  return TRUE;
+  return size;
 }
 
-static gboolean
-quad_unit_file_parse_line (QuadUnitFile *self,
-                           const char *line,
-                           const char *line_end,
-                           GError **error)
+static char *
+quad_unit_group_print (QuadUnitGroup *group, char *dest)
 {
-  if (line_is_comment (line, line_end))
-    return quad_unit_file_parse_comment (self, line, line_end, error);
-  else if (line_is_group (line, line_end))
-    return quad_unit_file_parse_group (self, line, line_end, error);
-  else if (line_is_key_value_pair (line, line_end))
-    return quad_unit_file_parse_key_value_pair (self, line,
-                                                line_end,
-                                                error);
-  else
+  gsize name_len = strlen (group->name);
+  guint i;
+
+  for (i = 0; i < group->comments.len; i++)
+    dest = quad_unit_line_print (&group->comments.data[i], dest);
+  *dest++ = '[';
+  memcpy (dest, group->name, name_len);
+  dest += name_len;
+  *dest++ = ']';
+  *dest++ = '\n';
+  for (i = 0; i < group->lines.len; i++)
+    dest = quad_unit_line_print (&group->lines.data[i], dest);
+
+  return dest;
+}
+
+static gsize
+quad_unit_file_print_size (QuadUnitFile *self)
+{
+  gsize size = 0;
+
+  for (guint i = 0; i < self->groups->len; i++)
     {
-      g_autofree char *line_utf8 = g_utf8_make_valid (line, line_end - line);
-      g_set_error (error, G_KEY_FILE_ERROR,
-                   G_KEY_FILE_ERROR_PARSE,
-                   "File contains line %d: “%s” which is not a key-value pair, group, or comment",
-                   self->line_nr,
-                   line_utf8);
-      return FALSE;
+      if (i != 0)
+        size++;
+      size += quad_unit_group_print_size (g_ptr_array_index (self->groups, i));
     }
+
+  return size;
 }
 
-gboolean
-quad_unit_file_parse (QuadUnitFile *self,
-                      const char *data,
-                      GError **error)
+void
+quad_unit_file_print (QuadUnitFile *self, GString *str)
 {
-  const char *line;
-  const char *data_end = data + strlen (data);
+  gsize old_len = str->len;
+  gsize size;
+  char *dest;
+  guint i;
 
-  line = data;
-  while (line < data_end)
+  if (self->layers != NULL)
     {
-      const char *next;
-      const char *endofline = strchr(line, '\n');
-      int n_lines = 1;
+      g_autoptr(QuadUnitFile) flat = quad_unit_file_copy (self);
+      quad_unit_file_print (flat, str);
+      return;
+    }
 
-      if (endofline == NULL)
-        {
-          endofline = data_end;
-          next = data_end;
-        }
-      else
-        {
-          next = endofline + 1;
-        }
+  quad_unit_file_parse_lazy_groups (self);
+  size = quad_unit_file_print_size (self);
 
-      /* Handle multi-line continuations */
-      /* Note: This doesn't support coments in the middle of the continuation, which systemd does */
-      if (line_is_key_value_pair (line, endofline))
-        {
-          while (endofline < data_end && endofline[-1] == '\\')
-            {
-              const char *next_endofline = strchr(next, '\n');
+  g_string_set_size (str, old_len + size);
+  dest = str->str + old_len;
 
-              if (next_endofline == NULL)
-                {
-                  endofline = data_end;
-                  next = data_end;
-                }
-              else
-                {
-                  endofline = next_endofline;
-                  next = next_endofline + 1;
-                }
-            }
-        }
+  for (i = 0; i < self->groups->len; i++)
+    {
+      /* We always add a newline between groups, and strip one if it exists during
+         parsing. This looks nicer, and avoids issues of duplicate newlines when
+         merging groups or missing ones when creating new groups */
+      if (i != 0)
+        *dest++ = '\n';
 
-      if (!quad_unit_file_parse_line (self, line, endofline, error))
-        return FALSE;
+      dest = quad_unit_group_print (g_ptr_array_index (self->groups, i), dest);
+    }
 
-      self->line_nr += n_lines;
-      line = next;
+  g_assert (dest == str->str + str->len);
+}
+
+char *
+quad_unit_file_to_string (QuadUnitFile *self,
+                          gsize *length)
+{
+  g_autoptr(GString) str = NULL;
+
+  if (self->layers != NULL)
+    {
+      g_autoptr(QuadUnitFile) flat = quad_unit_file_copy (self);
+      return quad_unit_file_to_string (flat, length);
     }
 
-  /* This drops comments in files without groups, but YOLO */
-  if (self->current_group)
-    quad_unit_file_flush_pending_comments (self, self->current_group->lines);
+  quad_unit_file_parse_lazy_groups (self);
+  str = g_string_sized_new (quad_unit_file_print_size (self) + 1);
+  quad_unit_file_print (self, str);
+  if (length)
+    *length = str->len;
 
-  return TRUE;
+  return g_string_free (g_steal_pointer (&str), FALSE);
 }
 
 static void
-quad_unit_line_print (QuadUnitLine *line, GString *str)
+quad_iovec_add (GArray *iov, const char *data, gsize len)
 {
-  if (line->key == NULL)
-    g_string_append_printf (str, "%s\n", line->value);
-  else
-    g_string_append_printf (str, "%s=%s\n", line->key, line->value);
+  struct iovec v = { (void *)data, len };
+
+  if (len > 0)
+    g_array_append_val (iov, v);
 }
 
 static void
-quad_unit_group_print (QuadUnitGroup *group, GString *str)
+quad_unit_line_add_iovecs (QuadUnitLine *line, GArray *iov)
 {
-  guint i;
-
-  for (i = 0; i < group->comments->len; i++)
-    quad_unit_line_print (g_ptr_array_index (group->comments, i), str);
-  g_string_append_printf(str, "[%s]\n", group->name);
-  for (i = 0; i < group->lines->len; i++)
-    quad_unit_line_print (g_ptr_array_index (group->lines, i), str);
+  if (line->key != NULL)
+    {
+      quad_iovec_add (iov, line->key, strlen (line->key));
+      quad_iovec_add (iov, "=", 1);
+    }
+  quad_iovec_add (iov, line->value, line->value_len);
+  quad_iovec_add (iov, "\n", 1);
 }
 
-void
-quad_unit_file_print (QuadUnitFile *self, GString *str)
+/* Writes the same output as quad_unit_file_print(), but directly
+ * from the line values, without building a copy in memory */
+gboolean
+quad_unit_file_write_fd (QuadUnitFile *self,
+                         int fd,
+                         GError **error)
 {
-  guint i;
+  g_autoptr(GArray) iov = NULL;
 
-  for (i = 0; i < self->groups->len; i++)
+  if (self->layers != NULL)
     {
-      /* We always add a newline between groups, and strip one if it exists during
-         parsing. This looks nicer, and avoids issues of duplicate newlines when
-         merging groups or missing ones when creating new groups */
+      g_autoptr(QuadUnitFile) flat = quad_unit_file_copy (self);
+      return quad_unit_file_write_fd (flat, fd, error);
+    }
+
+  quad_unit_file_parse_lazy_groups (self);
+  iov = g_array_new (FALSE, FALSE, sizeof (struct iovec));
+  for (guint i = 0; i < self->groups->len; i++)
+    {
+      QuadUnitGroup *group = g_ptr_array_index (self->groups, i);
+      guint j;
+
       if (i != 0)
-        g_string_append_printf (str, "\n");
+        quad_iovec_add (iov, "\n", 1);
+
+      for (j = 0; j < group->comments.len; j++)
+        quad_unit_line_add_iovecs (&group->comments.data[j], iov);
+      quad_iovec_add (iov, "[", 1);
+      quad_iovec_add (iov, group->name, strlen (group->name));
+      quad_iovec_add (iov, "]\n", 2);
+      for (j = 0; j < group->lines.len; j++)
+        quad_unit_line_add_iovecs (&group->lines.data[j], iov);
+    }
+
+  return quad_writev_all (fd, (struct iovec *)iov->data, iov->len, error);
+}
+
+static QuadUnitLine *
+quad_unit_file_lookup_line (QuadUnitFile *self,
+                            const char *group_name,
+                            const char *key,
+                            QuadUnitGroup **group_out)
+{
+  for (guint i = quad_unit_file_get_n_sources (self); i-- > 0; )
+    {
+      QuadUnitGroup *group = quad_unit_file_lookup_group (quad_unit_file_get_source (self, i), group_name);
+      QuadUnitLine *line;
+
+      if (group == NULL)
+        continue;
 
-      quad_unit_group_print (g_ptr_array_index (self->groups, i), str);
+      line = quad_unit_group_find_last (group, key, NULL);
+      if (line != NULL)
+        {
+          if (group_out)
+            *group_out = group;
+          return line;
+        }
     }
+
+  return NULL;
 }
 
 const char *
@@ -604,15 +2467,10 @@ quad_unit_file_lookup_last_raw (QuadUnitFile *self,
                                 const char *key)
 {
   QuadUnitGroup *group;
-  QuadUnitLine *line;
-
-  group = quad_unit_file_lookup_group (self, group_name);
-  if (group == NULL)
-    return NULL;
+  QuadUnitLine *line = quad_unit_file_lookup_line (self, group_name, key, &group);
 
-  line = quad_unit_group_find_last (group, key, NULL);
   if (line)
-    return line->value;
+    return quad_unit_line_get_value (group, line);
 
   return NULL;
 }
@@ -622,7 +2480,7 @@ quad_unit_file_has_key (QuadUnitFile  *self,
                         const char    *group_name,
                         const char    *key)
 {
-  return quad_unit_file_lookup_last_raw (self, group_name, key) != NULL;
+  return quad_unit_file_lookup_line (self, group_name, key, NULL) != NULL;
 }
 
 char *
@@ -630,11 +2488,27 @@ quad_unit_file_lookup_last (QuadUnitFile  *self,
                             const char    *group_name,
                             const char    *key)
 {
-  const char *raw = quad_unit_file_lookup_last_raw (self, group_name, key);
-  if (raw == NULL)
+  QuadUnitLine *line = quad_unit_file_lookup_line (self, group_name, key, NULL);
+  if (line == NULL)
     return NULL;
 
-  return quad_apply_line_continuation (raw);
+  return g_strndup (line->resolved, line->resolved_len);
+}
+
+/* Like quad_unit_file_lookup(), but returns a view of the value in the
+ * unit, which is valid until the key is modified */
+gboolean
+quad_unit_file_lookup_view (QuadUnitFile  *self,
+                            const char    *group_name,
+                            const char    *key,
+                            QuadStrView   *view)
+{
+  QuadUnitLine *line = quad_unit_file_lookup_line (self, group_name, key, NULL);
+  if (line == NULL)
+    return FALSE;
+
+  *view = quad_unit_line_get_view (line, TRUE);
+  return TRUE;
 }
 
 char *
@@ -642,11 +2516,12 @@ quad_unit_file_lookup (QuadUnitFile  *self,
                        const char    *group_name,
                        const char    *key)
 {
-  char *val = quad_unit_file_lookup_last (self, group_name, key);
-  if (val == NULL)
+  QuadStrView view;
+
+  if (!quad_unit_file_lookup_view (self, group_name, key, &view))
     return NULL;
 
-  return g_strchomp (val);
+  return g_strndup (view.str, view.len);
 }
 
 gboolean
@@ -655,15 +2530,16 @@ quad_unit_file_lookup_boolean (QuadUnitFile  *self,
                                const char    *key,
                                gboolean       default_value)
 {
-  g_autofree char *val = quad_unit_file_lookup (self, group_name, key);
-  if (val == NULL || *val == 0)
+  QuadStrView val;
+
+  if (!quad_unit_file_lookup_view (self, group_name, key, &val) || val.len == 0)
     return default_value;
 
   return
-    g_ascii_strcasecmp (val, "1") == 0 ||
-    g_ascii_strcasecmp (val, "yes") == 0 ||
-    g_ascii_strcasecmp (val, "true") == 0 ||
-    g_ascii_strcasecmp (val, "on") == 0;
+    quad_str_view_equal_ascii_nocase (val, "1") ||
+    quad_str_view_equal_ascii_nocase (val, "yes") ||
+    quad_str_view_equal_ascii_nocase (val, "true") ||
+    quad_str_view_equal_ascii_nocase (val, "on");
 }
 
 long
@@ -674,13 +2550,25 @@ quad_unit_file_lookup_int (QuadUnitFile  *self,
 {
   long res;
   char *endp;
-  g_autofree char *val = quad_unit_file_lookup (self, group_name, key);
-  if (val == NULL || *val == 0)
+  char buf[64];
+  g_autofree char *heap = NULL;
+  char *val;
+  QuadStrView view;
+
+  if (!quad_unit_file_lookup_view (self, group_name, key, &view) || view.len == 0)
     return default_value;
 
+  /* strtol needs a nul-terminated string */
+  if (view.len < sizeof (buf))
+    val = buf;
+  else
+    val = heap = g_malloc (view.len + 1);
+  memcpy (val, view.str, view.len);
+  val[view.len] = 0;
+
   /* Convert first part, if any to int */
   res = strtol (val, &endp, 10);
-  if (endp != key)
+  if (endp != val)
     return res;
 
   /* Otherwise return default value */
@@ -692,6 +2580,7 @@ quad_unit_file_lookup_ranges (QuadUnitFile  *self,
                               const char    *group_name,
                               const char    *key,
                               QuadRangeLookupFunc name_lookup,
+                              gpointer       user_data,
                               QuadRanges    *default_value)
 {
   g_autofree char *val = quad_unit_file_lookup (self, group_name, key);
@@ -710,7 +2599,7 @@ quad_unit_file_lookup_ranges (QuadUnitFile  *self,
     {
       if (name_lookup)
         {
-          QuadRanges *res = name_lookup (val);
+          QuadRanges *res = name_lookup (val, user_data);
           if (res)
             return res;
         }
@@ -735,56 +2624,249 @@ quad_unit_file_lookup_uid (QuadUnitFile  *self,
       return default_value;
     }
 
-  return quad_lookup_host_uid (val, error);
+  return quad_lookup_host_uid (val, error);
+}
+
+gid_t
+quad_unit_file_lookup_gid (QuadUnitFile  *self,
+                           const char    *group_name,
+                           const char    *key,
+                           gid_t          default_value,
+                           GError       **error)
+{
+  g_autofree char *val = quad_unit_file_lookup (self, group_name, key);
+  if (val == NULL || *val == 0)
+    {
+      if (default_value == (gid_t)-1)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No key %s", key);
+      return default_value;
+    }
+
+  return quad_lookup_host_gid (val, error);
+}
+
+
+/* The iterators below walk self and its layers from the lowest to
+ * the highest, which gives the same order as the flattened unit. A group
+ * or key is returned by the lowest layer that has it */
+
+static gboolean
+quad_unit_file_lower_has_group (QuadUnitFile *self,
+                                guint source,
+                                const char *group_name)
+{
+  for (guint i = 0; i < source; i++)
+    {
+      if (quad_unit_file_lookup_group (quad_unit_file_get_source (self, i), group_name) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+quad_unit_file_lower_has_key (QuadUnitFile *self,
+                              guint source,
+                              const char *group_name,
+                              const char *key)
+{
+  for (guint i = 0; i < source; i++)
+    {
+      QuadUnitGroup *group = quad_unit_file_lookup_group (quad_unit_file_get_source (self, i), group_name);
+
+      if (group != NULL && quad_unit_group_find_last_index (group, key) != QUAD_UNIT_LINE_NONE)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+quad_unit_group_iter_init (QuadUnitGroupIter *iter,
+                           QuadUnitFile *unit)
+{
+  iter->unit = unit;
+  iter->source = 0;
+  iter->index = 0;
+}
+
+gboolean
+quad_unit_group_iter_next (QuadUnitGroupIter *iter,
+                           const char **group_name)
+{
+  guint n_sources = quad_unit_file_get_n_sources (iter->unit);
+
+  for (; iter->source < n_sources; iter->source++, iter->index = 0)
+    {
+      QuadUnitFile *source = quad_unit_file_get_source (iter->unit, iter->source);
+
+      while (iter->index < source->groups->len)
+        {
+          QuadUnitGroup *group = g_ptr_array_index (source->groups, iter->index++);
+
+          if (!quad_unit_file_lower_has_group (iter->unit, iter->source, group->name))
+            {
+              *group_name = group->name;
+              return TRUE;
+            }
+        }
+    }
+
+  return FALSE;
+}
+
+void
+quad_unit_key_iter_init (QuadUnitKeyIter *iter,
+                         QuadUnitFile *unit,
+                         const char *group_name)
+{
+  iter->unit = unit;
+  iter->group_name = group_name;
+  iter->group = NULL;
+  iter->source = 0;
+  iter->index = 0;
+}
+
+/* Keys are returned once, in the order they first appear */
+gboolean
+quad_unit_key_iter_next (QuadUnitKeyIter *iter,
+                         const char **key)
+{
+  guint n_sources = quad_unit_file_get_n_sources (iter->unit);
+
+  for (; iter->source < n_sources; iter->source++, iter->group = NULL, iter->index = 0)
+    {
+      QuadUnitGroup *group = iter->group;
+
+      if (group == NULL)
+        {
+          group = quad_unit_file_lookup_group (quad_unit_file_get_source (iter->unit, iter->source),
+                                               iter->group_name);
+          if (group == NULL)
+            continue;
+
+          /* Needed for prev_same_key */
+          quad_unit_group_get_index (group);
+          iter->group = group;
+        }
+
+      while (iter->index < group->lines.len)
+        {
+          QuadUnitLine *line = &group->lines.data[iter->index++];
+
+          if (line->key != NULL && line->prev_same_key == QUAD_UNIT_LINE_NONE &&
+              !quad_unit_file_lower_has_key (iter->unit, iter->source, iter->group_name, line->key))
+            {
+              *key = line->key;
+              return TRUE;
+            }
+        }
+    }
+
+  return FALSE;
+}
+
+void
+quad_unit_value_iter_init (QuadUnitValueIter *iter,
+                           QuadUnitFile *unit,
+                           const char *group_name,
+                           const char *key)
+{
+  guint n_sources = quad_unit_file_get_n_sources (unit);
+
+  iter->unit = unit;
+  iter->group_name = group_name;
+  iter->key = key;
+  iter->group = NULL;
+  iter->source = 0;
+  iter->index = 0;
+
+  /* An empty value resets the list, so start after the last one */
+  for (guint i = n_sources; i-- > 0; )
+    {
+      QuadUnitGroup *group = quad_unit_file_lookup_group (quad_unit_file_get_source (unit, i), group_name);
+
+      if (group == NULL)
+        continue;
+
+      for (guint j = quad_unit_group_find_last_index (group, iter->key);
+           j != QUAD_UNIT_LINE_NONE;
+           j = group->lines.data[j].prev_same_key)
+        {
+          if (quad_unit_line_is_empty (&group->lines.data[j]))
+            {
+              iter->source = i;
+              iter->index = j + 1;
+              return;
+            }
+        }
+    }
+}
+
+static gboolean
+quad_unit_value_iter_next_line (QuadUnitValueIter *iter,
+                                QuadUnitGroup **group_out,
+                                QuadUnitLine **line_out)
+{
+  guint n_sources = quad_unit_file_get_n_sources (iter->unit);
+
+  for (; iter->source < n_sources; iter->source++, iter->group = NULL, iter->index = 0)
+    {
+      QuadUnitGroup *group = iter->group;
+
+      if (group == NULL)
+        {
+          group = quad_unit_file_lookup_group (quad_unit_file_get_source (iter->unit, iter->source),
+                                               iter->group_name);
+          if (group == NULL)
+            continue;
+          iter->group = group;
+        }
+
+      while (iter->index < group->lines.len)
+        {
+          QuadUnitLine *line = &group->lines.data[iter->index++];
+
+          if (quad_unit_line_is (line, iter->key))
+            {
+              *group_out = group;
+              *line_out = line;
+              return TRUE;
+            }
+        }
+    }
+
+  return FALSE;
 }
 
-gid_t
-quad_unit_file_lookup_gid (QuadUnitFile  *self,
-                           const char    *group_name,
-                           const char    *key,
-                           gid_t          default_value,
-                           GError       **error)
+/* The value has line continuations applied, and is not nul-terminated */
+gboolean
+quad_unit_value_iter_next (QuadUnitValueIter *iter,
+                           QuadStrView *value)
 {
-  g_autofree char *val = quad_unit_file_lookup (self, group_name, key);
-  if (val == NULL || *val == 0)
-    {
-      if (default_value == (gid_t)-1)
-        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No key %s", key);
-      return default_value;
-    }
+  QuadUnitGroup *group;
+  QuadUnitLine *line;
 
-  return quad_lookup_host_gid (val, error);
-}
+  if (!quad_unit_value_iter_next_line (iter, &group, &line))
+    return FALSE;
 
+  *value = quad_unit_line_get_view (line, FALSE);
+  return TRUE;
+}
 
 const char **
 quad_unit_file_lookup_all_raw (QuadUnitFile *self,
                                const char *group_name,
                                const char *key)
 {
-  QuadUnitGroup *group;
   g_autoptr(GPtrArray) res = g_ptr_array_new ();
+  QuadUnitValueIter iter;
+  QuadUnitGroup *group;
+  QuadUnitLine *line;
 
-  group = quad_unit_file_lookup_group (self, group_name);
-  if (group != NULL)
-    {
-      for (guint i = 0; i < group->lines->len; i++)
-        {
-          QuadUnitLine *line = g_ptr_array_index (group->lines, i);
-          if (quad_unit_line_is (line, key))
-            {
-              if (*line->value == 0)
-                {
-                  /* Empty value clears all before */
-                  g_ptr_array_set_size (res, 0);
-                }
-              else
-                {
-                  g_ptr_array_add (res, line->value);
-                }
-            }
-        }
-    }
+  quad_unit_value_iter_init (&iter, self, group_name, key);
+  while (quad_unit_value_iter_next_line (&iter, &group, &line))
+    g_ptr_array_add (res, (char *)quad_unit_line_get_value (group, line));
 
   g_ptr_array_add (res, NULL);
   return (const char **)g_ptr_array_free (g_steal_pointer (&res), FALSE);
@@ -795,16 +2877,32 @@ quad_unit_file_lookup_all (QuadUnitFile *self,
                            const char *group_name,
                            const char *key)
 {
-  char **res = (char **)quad_unit_file_lookup_all_raw (self, group_name, key);
-  if (res != NULL)
-    {
-      for (int i = 0; res[i] != NULL; i++)
-        {
-          res[i] = quad_apply_line_continuation (res[i]);
-        }
-    }
+  g_autoptr(GPtrArray) res = g_ptr_array_new ();
+  QuadUnitValueIter iter;
+  QuadStrView value;
 
-  return res;
+  quad_unit_value_iter_init (&iter, self, group_name, key);
+  while (quad_unit_value_iter_next (&iter, &value))
+    g_ptr_array_add (res, g_strndup (value.str, value.len));
+
+  g_ptr_array_add (res, NULL);
+  return (char **)g_ptr_array_free (g_steal_pointer (&res), FALSE);
+}
+
+/* Like quad_unit_file_lookup_all(), but appends views of the values to
+ * views, an array of QuadStrView. The array can be reused between calls */
+void
+quad_unit_file_lookup_all_views (QuadUnitFile *self,
+                                 const char *group_name,
+                                 const char *key,
+                                 GArray *views)
+{
+  QuadUnitValueIter iter;
+  QuadStrView value;
+
+  quad_unit_value_iter_init (&iter, self, group_name, key);
+  while (quad_unit_value_iter_next (&iter, &value))
+    g_array_append_val (views, value);
 }
 
 /* this splits space separated values similar to the systemd config_parse_strv, merging multiple values into a single vector */
@@ -828,22 +2926,25 @@ gboolean
 quad_unit_file_has_group (QuadUnitFile  *self,
                           const char    *group_name)
 {
-  QuadUnitGroup *group;
+  for (guint i = 0; i < quad_unit_file_get_n_sources (self); i++)
+    {
+      if (quad_unit_file_lookup_group (quad_unit_file_get_source (self, i), group_name) != NULL)
+        return TRUE;
+    }
 
-  group = quad_unit_file_lookup_group (self, group_name);
-  return group != NULL;
+  return FALSE;
 }
 
 const char **
 quad_unit_file_list_groups (QuadUnitFile  *self)
 {
   g_autoptr(GPtrArray) res = g_ptr_array_new ();
+  QuadUnitGroupIter iter;
+  const char *group_name;
 
-  for (guint i = 0; i < self->groups->len; i++)
-    {
-      QuadUnitGroup *group = g_ptr_array_index (self->groups, i);
-      g_ptr_array_add (res, group->name);
-    }
+  quad_unit_group_iter_init (&iter, self);
+  while (quad_unit_group_iter_next (&iter, &group_name))
+    g_ptr_array_add (res, (char *)group_name);
 
   g_ptr_array_add (res, NULL);
   return (const char **)g_ptr_array_free (g_steal_pointer (&res), FALSE);
@@ -853,21 +2954,16 @@ const char **
 quad_unit_file_list_keys (QuadUnitFile  *self,
                           const char    *group_name)
 {
-  QuadUnitGroup *group;
-  g_autoptr(GHashTable) res = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) res = g_ptr_array_new ();
+  QuadUnitKeyIter iter;
+  const char *key;
 
-  group = quad_unit_file_lookup_group (self, group_name);
-  if (group != NULL)
-    {
-      for (guint i = 0; i < group->lines->len; i++)
-        {
-          QuadUnitLine *line = g_ptr_array_index (group->lines, i);
-          if (line->key != NULL)
-            g_hash_table_add (res, line->key);
-        }
-    }
+  quad_unit_key_iter_init (&iter, self, group_name);
+  while (quad_unit_key_iter_next (&iter, &key))
+    g_ptr_array_add (res, (char *)key);
 
-  return (const char **)g_hash_table_get_keys_as_array (res, NULL);
+  g_ptr_array_add (res, NULL);
+  return (const char **)g_ptr_array_free (g_steal_pointer (&res), FALSE);
 }
 
 void
@@ -879,13 +2975,16 @@ quad_unit_file_set (QuadUnitFile  *self,
   QuadUnitGroup *group;
   QuadUnitLine *line;
 
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
   group = quad_unit_file_ensure_group (self, group_name);
 
   line = quad_unit_group_find_last (group, key, NULL);
   if (line)
-    quad_unit_line_set (line, value);
+    quad_unit_line_set (self, line, value);
   else
-    quad_unit_group_add (group, key, value);
+    quad_unit_group_add (self, group, key, value);
 }
 
 void
@@ -917,8 +3016,11 @@ quad_unit_file_add (QuadUnitFile  *self,
 {
   QuadUnitGroup *group;
 
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
   group = quad_unit_file_ensure_group (self, group_name);
-  quad_unit_group_add (group, key, value);
+  quad_unit_group_add (self, group, key, value);
 }
 
 void
@@ -926,29 +3028,46 @@ quad_unit_file_unset (QuadUnitFile  *self,
                       const char    *group_name,
                       const char    *key)
 {
-  QuadUnitGroup *group = quad_unit_file_lookup_group (self, group_name);
+  QuadUnitGroup *group;
+  guint n_kept = 0;
 
-  if (group == NULL)
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
+  group = quad_unit_file_lookup_group (self, group_name);
+
+  if (group == NULL ||
+      quad_unit_group_find_last_index (group, key) == QUAD_UNIT_LINE_NONE)
     return;
 
-  /* We iterate backwards to avoid the removal affecting the iteration */
-  for (int i = group->lines->len - 1; i >= 0; i--)
+  group = quad_unit_file_unshare_group (self, group);
+
+  /* Compact the remaining lines in a single pass */
+  for (guint i = 0; i < group->lines.len; i++)
     {
-      QuadUnitLine *line = g_ptr_array_index (group->lines, i);
-      if (quad_unit_line_is (line, key))
-        g_ptr_array_remove_index (group->lines, i);
+      QuadUnitLine *line = &group->lines.data[i];
+      if (!quad_unit_line_is (line, key))
+        group->lines.data[n_kept++] = *line;
     }
+  group->lines.len = n_kept;
+
+  quad_unit_group_invalidate_index (group);
 }
 
 void
 quad_unit_file_remove_group (QuadUnitFile  *self,
                              const char    *group_name)
 {
-  QuadUnitGroup *group = quad_unit_file_lookup_group (self, group_name);
+  QuadUnitGroup *group;
+
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
+  group = quad_unit_file_lookup_group (self, group_name);
 
   if (group)
     {
-      g_hash_table_remove (self->group_hash, group->name);
+      quad_table_remove (self->group_hash, group->name);
       g_ptr_array_remove (self->groups, group);
     }
 }
@@ -958,8 +3077,13 @@ quad_unit_file_rename_group (QuadUnitFile  *self,
                              const char    *group_name,
                              const char    *new_name)
 {
-  QuadUnitGroup *group = quad_unit_file_lookup_group (self, group_name);
-  QuadUnitGroup *new_group = quad_unit_file_lookup_group (self, new_name);
+  QuadUnitGroup *group, *new_group;
+
+  g_return_if_fail (!self->frozen);
+
+  quad_unit_file_flatten (self);
+  group = quad_unit_file_lookup_group (self, group_name);
+  new_group = quad_unit_file_lookup_group (self, new_name);
 
   if (group == NULL || group == new_group)
     return;
@@ -967,50 +3091,472 @@ quad_unit_file_rename_group (QuadUnitFile  *self,
   if (new_group == NULL)
     {
       /* New group doesn't exist, just rename in-place */
-      g_hash_table_remove (self->group_hash, group->name);
-      g_free (group->name);
-      group->name = g_strdup (new_name);
-      g_hash_table_insert (self->group_hash, group->name, group);
+      group = quad_unit_file_unshare_group (self, group);
+      quad_table_remove (self->group_hash, group->name);
+      group->name = quad_unit_name_new (self->arena, new_name, strlen (new_name));
+      quad_table_insert (self->group_hash, (char *)group->name, group);
     }
   else
     {
-      /* merge to existing group and delete old */
-      new_group = quad_unit_file_ensure_group (self, new_name);
+      /* Move the lines to the existing group and delete old, the
+       * strings are shared so this doesn't copy any values */
+      new_group = quad_unit_file_unshare_group (self, new_group);
 
       quad_unit_group_merge (new_group, group);
 
-      g_hash_table_remove (self->group_hash, group->name);
+      quad_table_remove (self->group_hash, group->name);
       g_ptr_array_remove (self->groups, group);
     }
 }
 
+/* Folds value into an ordered hash */
+static QuadHash128
+quad_hash128_fold (QuadHash128 state,
+                   QuadHash128 value)
+{
+  guint64 words[4] = {
+    GUINT64_TO_LE (state.h1), GUINT64_TO_LE (state.h2),
+    GUINT64_TO_LE (value.h1), GUINT64_TO_LE (value.h2),
+  };
+
+  return quad_hash128 (words, sizeof (words), 0);
+}
+
+/* Adds value to an unordered hash */
 static void
-quad_unit_file_finalize (GObject *object)
+quad_hash128_add (QuadHash128 *sum,
+                  QuadHash128 value)
 {
-  QuadUnitFile *self = (QuadUnitFile *)object;
+  sum->h1 += value.h1;
+  sum->h2 += value.h2;
+}
 
-  g_ptr_array_free (self->groups, TRUE);
-  g_hash_table_destroy (self->group_hash);
-  g_ptr_array_free (self->pending_comments, TRUE);
-  g_free (self->path);
+static QuadHash128
+quad_unit_group_hash (QuadUnitGroup *group)
+{
+  QuadHash128 keys = { 0, 0 };
+
+  /* The values of a key are hashed in order, but the order of the
+   * keys doesn't matter */
+  QUAD_TABLE_FOREACH_KV (quad_unit_group_get_index (group), const char *, key, gpointer, last)
+    {
+      QuadHash128 hash = quad_hash128 (key, strlen (key), 1);
+
+      for (guint i = GPOINTER_TO_UINT (last) - 1; i != QUAD_UNIT_LINE_NONE; i = group->lines.data[i].prev_same_key)
+        {
+          QuadUnitLine *line = &group->lines.data[i];
+          hash = quad_hash128_fold (hash, quad_hash128 (line->resolved, line->resolved_len, 2));
+        }
+
+      quad_hash128_add (&keys, hash);
+    }
+
+  return quad_hash128_fold (quad_hash128 (group->name, strlen (group->name), 3), keys);
+}
+
+/* A hash of the settings in the unit, which is the same for all units
+ * that systemd would treat the same way. It ignores comments, line
+ * continuations and the order of groups and keys, but not the order
+ * of the values of a key. It is the same on all machines and versions */
+QuadHash128
+quad_unit_file_hash (QuadUnitFile *self)
+{
+  QuadHash128 groups = { 0, 0 };
+  QuadHash128 n_groups = { 0, 0 };
+
+  if (self->layers != NULL)
+    {
+      g_autoptr(QuadUnitFile) flat = quad_unit_file_copy (self);
+      return quad_unit_file_hash (flat);
+    }
+
+  quad_unit_file_parse_lazy_groups (self);
+  for (guint i = 0; i < self->groups->len; i++)
+    quad_hash128_add (&groups, quad_unit_group_hash (g_ptr_array_index (self->groups, i)));
+
+  n_groups.h1 = self->groups->len;
+  return quad_hash128_fold (groups, n_groups);
+}
+
+static gboolean
+quad_unit_group_equal (QuadUnitGroup *a,
+                       QuadUnitGroup *b)
+{
+  QuadTable *b_index;
+
+  if (a == b)
+    return TRUE;
+
+  b_index = quad_unit_group_get_index (b);
+  if (quad_table_size (quad_unit_group_get_index (a)) != quad_table_size (b_index))
+    return FALSE;
 
-  G_OBJECT_CLASS (quad_unit_file_parent_class)->finalize (object);
+  QUAD_TABLE_FOREACH_KV (a->key_index, const char *, key, gpointer, a_last)
+    {
+      guint i = GPOINTER_TO_UINT (a_last) - 1;
+      guint j = GPOINTER_TO_UINT (quad_table_lookup (b_index, key)) - 1;
+
+      while (i != QUAD_UNIT_LINE_NONE && j != QUAD_UNIT_LINE_NONE)
+        {
+          QuadUnitLine *a_line = &a->lines.data[i];
+          QuadUnitLine *b_line = &b->lines.data[j];
+
+          if (a_line->resolved_len != b_line->resolved_len ||
+              memcmp (a_line->resolved, b_line->resolved, a_line->resolved_len) != 0)
+            return FALSE;
+
+          i = a_line->prev_same_key;
+          j = b_line->prev_same_key;
+        }
+
+      if (i != j)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Compares the same way as quad_unit_file_hash() */
+gboolean
+quad_unit_file_equal (QuadUnitFile *a,
+                      QuadUnitFile *b)
+{
+  if (a == b)
+    return TRUE;
+
+  if (a->layers != NULL || b->layers != NULL)
+    {
+      g_autoptr(QuadUnitFile) flat_a = quad_unit_file_copy (a);
+      g_autoptr(QuadUnitFile) flat_b = quad_unit_file_copy (b);
+      return quad_unit_file_equal (flat_a, flat_b);
+    }
+
+  quad_unit_file_parse_lazy_groups (a);
+  quad_unit_file_parse_lazy_groups (b);
+  if (a->groups->len != b->groups->len)
+    return FALSE;
+
+  for (guint i = 0; i < a->groups->len; i++)
+    {
+      QuadUnitGroup *a_group = g_ptr_array_index (a->groups, i);
+      QuadUnitGroup *b_group = quad_table_lookup (b->group_hash, a_group->name);
+
+      if (b_group == NULL || !quad_unit_group_equal (a_group, b_group))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef enum {
+  QUAD_UNIT_EDIT_SET,
+  QUAD_UNIT_EDIT_ADD,
+  QUAD_UNIT_EDIT_UNSET,
+} QuadUnitEditType;
+
+typedef struct {
+  QuadUnitEditType type;
+  const char *group_name; /* Names and values are in the arena of the unit */
+  const char *key;
+  const char *value; /* NULL for unset */
+  gsize value_len;
+} QuadUnitEdit;
+
+/* Edits are staged and applied together by quad_unit_file_batch_commit(),
+ * with the same result as making them one by one. Lookups on the unit
+ * don't see staged edits */
+struct _QuadUnitFileBatch
+{
+  QuadUnitFile *unit;
+  GArray *edits;
+};
+
+QuadUnitFileBatch *
+quad_unit_file_batch_begin (QuadUnitFile *self)
+{
+  QuadUnitFileBatch *batch;
+
+  g_return_val_if_fail (!self->frozen, NULL);
+
+  batch = g_new0 (QuadUnitFileBatch, 1);
+  batch->unit = quad_unit_file_ref (self);
+  batch->edits = g_array_new (FALSE, FALSE, sizeof (QuadUnitEdit));
+
+  return batch;
+}
+
+/* Drops the edits that were not committed */
+void
+quad_unit_file_batch_free (QuadUnitFileBatch *batch)
+{
+  quad_unit_file_unref (batch->unit);
+  g_array_unref (batch->edits);
+  g_free (batch);
 }
 
 static void
-quad_unit_file_class_init (QuadUnitFileClass *klass)
+quad_unit_file_batch_stage (QuadUnitFileBatch *batch,
+                            QuadUnitEditType type,
+                            const char *group_name,
+                            const char *key,
+                            const char *value)
+{
+  QuadArena *arena = batch->unit->arena;
+  QuadUnitEdit edit = {
+    type,
+    quad_unit_name_new (arena, group_name, strlen (group_name)),
+    quad_unit_name_new (arena, key, strlen (key)),
+    NULL, 0
+  };
+
+  if (value != NULL)
+    {
+      edit.value_len = strlen (value);
+      edit.value = quad_arena_strndup (arena, value, edit.value_len);
+    }
+
+  g_array_append_val (batch->edits, edit);
+}
+
+void
+quad_unit_file_batch_set (QuadUnitFileBatch *batch,
+                          const char *group_name,
+                          const char *key,
+                          const char *value)
+{
+  quad_unit_file_batch_stage (batch, QUAD_UNIT_EDIT_SET, group_name, key, value);
+}
+
+void
+quad_unit_file_batch_add (QuadUnitFileBatch *batch,
+                          const char *group_name,
+                          const char *key,
+                          const char *value)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  quad_unit_file_batch_stage (batch, QUAD_UNIT_EDIT_ADD, group_name, key, value);
+}
 
-  object_class->finalize = quad_unit_file_finalize;
+void
+quad_unit_file_batch_unset (QuadUnitFileBatch *batch,
+                            const char *group_name,
+                            const char *key)
+{
+  quad_unit_file_batch_stage (batch, QUAD_UNIT_EDIT_UNSET, group_name, key, NULL);
 }
 
+/* The edits of one group, in the order they were made */
+typedef struct {
+  const char *group_name;
+  GArray *edits; /* Indexes into the edits of the batch */
+  guint first_add; /* The first set or add, which creates the group */
+} QuadUnitGroupEdits;
+
 static void
-quad_unit_file_init (QuadUnitFile *self)
+quad_unit_group_edits_free (QuadUnitGroupEdits *group_edits)
 {
-  self->groups = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_group_free);
-  self->group_hash = g_hash_table_new (g_str_hash, g_str_equal);
+  g_array_unref (group_edits->edits);
+  g_free (group_edits);
+}
 
-  self->line_nr = 1;
-  self->pending_comments = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_line_free);
+/* A line that is appended to the group */
+typedef struct {
+  const char *key;
+  const char *value; /* NULL if it was unset again */
+  gsize value_len;
+  guint prev_same_key; /* Index of the previous added line with the key */
+} QuadUnitAddedLine;
+
+/* The combined effect of the edits of one key */
+typedef struct {
+  gboolean unset; /* Existing lines are removed */
+  const char *value; /* New value for the last existing line */
+  gsize value_len;
+  guint last_added; /* Index in the added lines, or QUAD_UNIT_LINE_NONE */
+} QuadUnitKeyEdit;
+
+static void
+quad_unit_file_batch_commit_group (QuadUnitFile *self,
+                                   QuadUnitEdit *all_edits,
+                                   QuadUnitGroupEdits *group_edits)
+{
+  g_autoptr(QuadTable) key_edits = quad_str_table_new (NULL, g_free);
+  g_autoptr(GArray) added = g_array_new (FALSE, FALSE, sizeof (QuadUnitAddedLine));
+  QuadUnitGroup *group = quad_unit_file_get_writable_group (self, group_edits->group_name);
+  gboolean any_unset = FALSE;
+  guint n_added = 0;
+  guint first_new;
+
+  /* Like quad_unit_file_unset(), unsetting doesn't create the group */
+  if (group == NULL && group_edits->first_add == QUAD_UNIT_LINE_NONE)
+    return;
+
+  /* Like quad_unit_file_set() and _add(), this creates the group even
+   * if the lines are unset again */
+  if (group == NULL)
+    group = quad_unit_file_ensure_group (self, group_edits->group_name);
+
+  /* First reduce the edits to the changes of existing lines, and the
+   * lines to append at the end */
+  for (guint i = 0; i < group_edits->edits->len; i++)
+    {
+      QuadUnitEdit *edit = &all_edits[g_array_index (group_edits->edits, guint, i)];
+      QuadUnitKeyEdit *key_edit = quad_table_lookup (key_edits, edit->key);
+      QuadUnitAddedLine line;
+
+      if (key_edit == NULL)
+        {
+          key_edit = g_new0 (QuadUnitKeyEdit, 1);
+          key_edit->last_added = QUAD_UNIT_LINE_NONE;
+          quad_table_insert (key_edits, (char *)edit->key, key_edit);
+        }
+
+      switch (edit->type)
+        {
+        case QUAD_UNIT_EDIT_SET:
+          if (key_edit->last_added != QUAD_UNIT_LINE_NONE)
+            {
+              QuadUnitAddedLine *last = &g_array_index (added, QuadUnitAddedLine, key_edit->last_added);
+              last->value = edit->value;
+              last->value_len = edit->value_len;
+              break;
+            }
+          if (!key_edit->unset &&
+              quad_unit_group_find_last_index (group, edit->key) != QUAD_UNIT_LINE_NONE)
+            {
+              key_edit->value = edit->value;
+              key_edit->value_len = edit->value_len;
+              break;
+            }
+          G_GNUC_FALLTHROUGH;
+
+        case QUAD_UNIT_EDIT_ADD:
+          line.key = edit->key;
+          line.value = edit->value;
+          line.value_len = edit->value_len;
+          line.prev_same_key = key_edit->last_added;
+          key_edit->last_added = added->len;
+          g_array_append_val (added, line);
+          n_added++;
+          break;
+
+        case QUAD_UNIT_EDIT_UNSET:
+          /* Only the lines added since the last unset are still there */
+          for (guint j = key_edit->last_added; j != QUAD_UNIT_LINE_NONE;)
+            {
+              QuadUnitAddedLine *a = &g_array_index (added, QuadUnitAddedLine, j);
+
+              a->value = NULL;
+              n_added--;
+              j = a->prev_same_key;
+            }
+          key_edit->unset = TRUE;
+          key_edit->value = NULL;
+          key_edit->last_added = QUAD_UNIT_LINE_NONE;
+          any_unset = TRUE;
+          break;
+        }
+    }
+
+  QUAD_TABLE_FOREACH_KV (key_edits, const char *, key, QuadUnitKeyEdit *, key_edit)
+    {
+      if (key_edit->value != NULL)
+        {
+          QuadUnitLine *line = &group->lines.data[quad_unit_group_find_last_index (group, key)];
+
+          quad_unit_line_set_owned (self, line, key_edit->value, key_edit->value_len);
+        }
+    }
+
+  /* Then remove unset lines in a single pass, and append the new ones
+   * with a single resize */
+  if (any_unset)
+    {
+      guint n_kept = 0;
+
+      for (guint i = 0; i < group->lines.len; i++)
+        {
+          QuadUnitLine *line = &group->lines.data[i];
+          QuadUnitKeyEdit *key_edit = line->key ? quad_table_lookup (key_edits, line->key) : NULL;
+
+          if (key_edit == NULL || !key_edit->unset)
+            group->lines.data[n_kept++] = *line;
+        }
+      group->lines.len = n_kept;
+    }
+
+  first_new = group->lines.len;
+  if (n_added > 0)
+    {
+      QuadUnitLine *dest = quad_unit_lines_append (&group->lines, n_added);
+
+      for (guint i = 0; i < added->len; i++)
+        {
+          QuadUnitAddedLine *a = &g_array_index (added, QuadUnitAddedLine, i);
+
+          if (a->value == NULL)
+            continue;
+
+          quad_unit_line_init (dest, a->key, a->value, a->value_len, QUAD_UNIT_LINE_VALUE_NUL);
+          quad_unit_line_resolve (self, dest);
+          dest++;
+        }
+    }
+
+  if (any_unset)
+    quad_unit_group_invalidate_index (group);
+  else
+    quad_unit_group_index_lines (group, first_new);
+}
+
+static int
+compare_group_edits (gconstpointer a,
+                     gconstpointer b)
+{
+  const QuadUnitGroupEdits *a_edits = *(QuadUnitGroupEdits **)a;
+  const QuadUnitGroupEdits *b_edits = *(QuadUnitGroupEdits **)b;
+
+  if (a_edits->first_add == b_edits->first_add)
+    return 0;
+  return a_edits->first_add < b_edits->first_add ? -1 : 1;
+}
+
+/* Applies all staged edits and frees the batch */
+void
+quad_unit_file_batch_commit (QuadUnitFileBatch *batch)
+{
+  QuadUnitFile *self = batch->unit;
+  QuadUnitEdit *edits = (QuadUnitEdit *)batch->edits->data;
+  guint n_edits = batch->edits->len;
+  g_autoptr(QuadTable) by_name = quad_str_table_new (NULL, NULL);
+  g_autoptr(GPtrArray) groups = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_group_edits_free);
+
+  quad_unit_file_flatten (self);
+
+  for (guint i = 0; i < n_edits; i++)
+    {
+      QuadUnitGroupEdits *group_edits = quad_table_lookup (by_name, edits[i].group_name);
+
+      if (group_edits == NULL)
+        {
+          group_edits = g_new0 (QuadUnitGroupEdits, 1);
+          group_edits->group_name = edits[i].group_name;
+          group_edits->edits = g_array_new (FALSE, FALSE, sizeof (guint));
+          group_edits->first_add = QUAD_UNIT_LINE_NONE;
+          quad_table_insert (by_name, (char *)group_edits->group_name, group_edits);
+          g_ptr_array_add (groups, group_edits);
+        }
+
+      if (edits[i].type != QUAD_UNIT_EDIT_UNSET && group_edits->first_add == QUAD_UNIT_LINE_NONE)
+        group_edits->first_add = i;
+      g_array_append_val (group_edits->edits, i);
+    }
+
+  /* Groups that don't exist yet are created in the order they would be
+   * without a batch. The sort is stable, and the order only matters
+   * for groups that are created */
+  g_ptr_array_sort (groups, compare_group_edits);
+  for (guint i = 0; i < groups->len; i++)
+    quad_unit_file_batch_commit_group (self, edits, g_ptr_array_index (groups, i));
+
+  quad_unit_file_batch_free (batch);
 }
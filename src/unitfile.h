@@ -1,23 +1,111 @@
 #pragma once
 
-#include <glib-object.h>
+#include <glib.h>
 #include <utils.h>
 
 G_BEGIN_DECLS
 
-#define QUAD_TYPE_UNIT_FILE (quad_unit_file_get_type())
+/* Refcounted, the refcount is atomic but the unit itself must only be
+ * used by one thread at a time unless it is frozen */
+typedef struct _QuadUnitFile QuadUnitFile;
 
-G_DECLARE_FINAL_TYPE (QuadUnitFile, quad_unit_file, QUAD, UNIT_FILE, GObject)
+typedef QuadRanges *  (*QuadRangeLookupFunc) (const char *name,
+                                             gpointer    user_data);
 
-typedef QuadRanges *  (*QuadRangeLookupFunc) (const char *name);
+typedef enum {
+  QUAD_UNIT_FILE_PARSE_NONE = 0,
+  /* Only find the groups up front, and parse each one when it is
+   * first used. Errors in a group are then logged rather than returned */
+  QUAD_UNIT_FILE_PARSE_LAZY = 1 << 0,
+} QuadUnitFileParseFlags;
 
-QuadUnitFile *quad_unit_file_new_from_path (const char  *path,
-                                            GError     **error);
-QuadUnitFile *quad_unit_file_new           (void);
+/* Caps on the input the parser accepts, so that a broken or hostile
+ * file fails with an error rather than stalling the boot. A limit of 0
+ * means no limit. Lines are counted over everything parsed into a unit */
+typedef struct {
+  gsize max_file_size;          /* Bytes */
+  gsize max_line_length;        /* Bytes, including continued lines */
+  guint max_lines;
+  guint max_continuation_lines; /* Lines that continue a single line */
+} QuadUnitFileLimits;
+
+#define QUAD_UNIT_FILE_DEFAULT_MAX_FILE_SIZE (16 * 1024 * 1024)
+#define QUAD_UNIT_FILE_DEFAULT_MAX_LINE_LENGTH (1024 * 1024)
+#define QUAD_UNIT_FILE_DEFAULT_MAX_LINES 1000000
+#define QUAD_UNIT_FILE_DEFAULT_MAX_CONTINUATION_LINES 10000
+
+/* Incremental parser, for when the whole file is not available at once */
+typedef struct _QuadUnitFileParser QuadUnitFileParser;
+
+/* Edits that are applied together, see quad_unit_file_batch_begin() */
+typedef struct _QuadUnitFileBatch QuadUnitFileBatch;
+
+/* Stack-allocated iterators that walk the lines of a unit in place.
+ * The unit must not be modified while they are in use, and the group
+ * name and key they are given must stay valid. All fields are private */
+typedef struct {
+  QuadUnitFile *unit;
+  guint source;
+  guint index;
+} QuadUnitGroupIter;
+
+typedef struct {
+  QuadUnitFile *unit;
+  const char *group_name;
+  gpointer group;
+  guint source;
+  guint index;
+} QuadUnitKeyIter;
+
+typedef struct {
+  QuadUnitFile *unit;
+  const char *group_name;
+  const char *key;
+  gpointer group;
+  guint source;
+  guint index;
+} QuadUnitValueIter;
+
+QuadUnitFile *quad_unit_file_new_from_path   (const char  *path,
+                                              QuadUnitFileParseFlags flags,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_new_from_path_full (const char *path,
+                                              QuadUnitFileParseFlags flags,
+                                              QuadHash128 *content_hash,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_new_from_contents (const char *path,
+                                              GBytes      *contents,
+                                              QuadUnitFileParseFlags flags,
+                                              QuadHash128 *content_hash,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_new_from_mapped (const char  *path,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_new_from_bytes  (GBytes      *bytes,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_load_compiled   (const char  *compiled_path,
+                                              const char  *source_path,
+                                              GError     **error);
+gboolean      quad_unit_file_save_compiled   (QuadUnitFile *self,
+                                              const char  *compiled_path,
+                                              GError     **error);
+QuadUnitFile *quad_unit_file_new             (void);
+void          quad_unit_file_get_default_limits (QuadUnitFileLimits       *limits);
+void          quad_unit_file_set_default_limits (const QuadUnitFileLimits *limits);
+void          quad_unit_file_set_limits      (QuadUnitFile  *self,
+                                              const QuadUnitFileLimits *limits);
+QuadUnitFile *quad_unit_file_ref             (QuadUnitFile  *self);
+void          quad_unit_file_unref           (QuadUnitFile  *self);
+QuadUnitFile *quad_unit_file_freeze          (QuadUnitFile  *self);
+gboolean      quad_unit_file_is_frozen       (QuadUnitFile  *self);
 
 void          quad_unit_file_merge           (QuadUnitFile  *self,
                                               QuadUnitFile  *source);
+void          quad_unit_file_add_layer       (QuadUnitFile  *self,
+                                              QuadUnitFile  *layer);
 QuadUnitFile *quad_unit_file_copy            (QuadUnitFile  *self);
+QuadHash128   quad_unit_file_hash            (QuadUnitFile  *self);
+gboolean      quad_unit_file_equal           (QuadUnitFile  *a,
+                                              QuadUnitFile  *b);
 gboolean      quad_unit_file_parse           (QuadUnitFile  *self,
                                               const char    *data,
                                               GError       **error);
@@ -26,6 +114,11 @@ void          quad_unit_file_set_path        (QuadUnitFile  *self,
                                               const char    *path);
 void          quad_unit_file_print           (QuadUnitFile  *self,
                                               GString       *str);
+char *        quad_unit_file_to_string       (QuadUnitFile  *self,
+                                              gsize         *length);
+gboolean      quad_unit_file_write_fd        (QuadUnitFile  *self,
+                                              int            fd,
+                                              GError       **error);
 gboolean      quad_unit_file_has_key         (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *key);
@@ -37,7 +130,11 @@ char *        quad_unit_file_lookup_last     (QuadUnitFile  *self,
                                               const char    *key);
 char *        quad_unit_file_lookup          (QuadUnitFile  *self,
                                               const char    *group_name,
-                                              const char    *key); /* Strips trailing newlines */
+                                              const char    *key);
+gboolean      quad_unit_file_lookup_view     (QuadUnitFile  *self,
+                                              const char    *group_name,
+                                              const char    *key,
+                                              QuadStrView   *view); /* Strips trailing whitespace */
 gboolean      quad_unit_file_lookup_boolean  (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *key,
@@ -60,6 +157,7 @@ QuadRanges * quad_unit_file_lookup_ranges    (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *key,
                                               QuadRangeLookupFunc name_lookup,
+                                              gpointer       user_data,
                                               QuadRanges    *default_value);
 const char ** quad_unit_file_lookup_all_raw  (QuadUnitFile  *self,
                                               const char    *group_name,
@@ -67,6 +165,10 @@ const char ** quad_unit_file_lookup_all_raw  (QuadUnitFile  *self,
 char **       quad_unit_file_lookup_all      (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *key);
+void          quad_unit_file_lookup_all_views (QuadUnitFile *self,
+                                               const char   *group_name,
+                                               const char   *key,
+                                               GArray       *views);
 char **       quad_unit_file_lookup_all_strv (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *key);
@@ -95,4 +197,49 @@ void          quad_unit_file_rename_group    (QuadUnitFile  *self,
                                               const char    *group_name,
                                               const char    *new_name);
 
+void     quad_unit_group_iter_init (QuadUnitGroupIter  *iter,
+                                    QuadUnitFile       *unit);
+gboolean quad_unit_group_iter_next (QuadUnitGroupIter  *iter,
+                                    const char        **group_name);
+void     quad_unit_key_iter_init   (QuadUnitKeyIter    *iter,
+                                    QuadUnitFile       *unit,
+                                    const char         *group_name);
+gboolean quad_unit_key_iter_next   (QuadUnitKeyIter    *iter,
+                                    const char        **key);
+void     quad_unit_value_iter_init (QuadUnitValueIter  *iter,
+                                    QuadUnitFile       *unit,
+                                    const char         *group_name,
+                                    const char         *key);
+gboolean quad_unit_value_iter_next (QuadUnitValueIter  *iter,
+                                    QuadStrView        *value);
+
+QuadUnitFileParser *quad_unit_file_parser_new    (void);
+void                quad_unit_file_parser_free   (QuadUnitFileParser  *parser);
+gboolean            quad_unit_file_parser_feed   (QuadUnitFileParser  *parser,
+                                                  const char          *chunk,
+                                                  gsize                len,
+                                                  GError             **error);
+QuadUnitFile *      quad_unit_file_parser_finish (QuadUnitFileParser  *parser,
+                                                  GError             **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadUnitFile, quad_unit_file_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadUnitFileParser, quad_unit_file_parser_free)
+
+QuadUnitFileBatch *quad_unit_file_batch_begin  (QuadUnitFile       *self);
+void               quad_unit_file_batch_set    (QuadUnitFileBatch  *batch,
+                                                const char         *group_name,
+                                                const char         *key,
+                                                const char         *value);
+void               quad_unit_file_batch_add    (QuadUnitFileBatch  *batch,
+                                                const char         *group_name,
+                                                const char         *key,
+                                                const char         *value);
+void               quad_unit_file_batch_unset  (QuadUnitFileBatch  *batch,
+                                                const char         *group_name,
+                                                const char         *key);
+void               quad_unit_file_batch_commit (QuadUnitFileBatch  *batch);
+void               quad_unit_file_batch_free   (QuadUnitFileBatch  *batch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadUnitFileBatch, quad_unit_file_batch_free)
+
 G_END_DECLS
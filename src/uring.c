@@ -0,0 +1,680 @@
+#include "quadlet-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+struct QuadUring {
+  int fd;
+  guint8 *sq_ring;
+  gsize sq_ring_size;
+  guint8 *cq_ring;
+  gsize cq_ring_size;
+  struct io_uring_sqe *sqes;
+  gsize sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sqe_tail;
+  guint n_queued;
+  gboolean dead; /* Submitting failed, which can leave the ring in any state */
+};
+
+/* Everything that quadlet submits, so a kernel that lacks any of them
+ * is not used at all */
+static const guint8 required_ops[] = {
+  IORING_OP_OPENAT,
+  IORING_OP_STATX,
+  IORING_OP_READ,
+  IORING_OP_WRITE,
+  IORING_OP_FSYNC,
+  IORING_OP_CLOSE,
+  IORING_OP_RENAMEAT,
+  IORING_OP_MKDIRAT,
+  IORING_OP_SYMLINKAT,
+};
+
+static int
+uring_setup (unsigned entries,
+             struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter (int fd,
+             unsigned to_submit,
+             unsigned min_complete,
+             unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register (int fd,
+                unsigned opcode,
+                void *arg,
+                unsigned n_args)
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+static void *
+map_ring (int fd,
+          gsize size,
+          off_t offset,
+          GError **error)
+{
+  void *ptr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+  if (ptr == MAP_FAILED)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to map io_uring: %s", g_strerror (errsv));
+      return NULL;
+    }
+
+  return ptr;
+}
+
+/* Fails if io_uring is not available, because the kernel is too old or
+ * it is blocked by seccomp or sysctl, in which case the caller should
+ * do the same work synchronously */
+QuadUring *
+quad_uring_new (guint entries,
+                GError **error)
+{
+  g_autoptr(QuadUring) ring = g_new0 (QuadUring, 1);
+  g_autofree struct io_uring_probe *probe = NULL;
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+  ring->fd = uring_setup (entries, &params);
+  if (ring->fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to set up io_uring: %s", g_strerror (errsv));
+      return NULL;
+    }
+
+  probe = g_malloc0 (sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op));
+  if (uring_register (ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to probe io_uring: %s", g_strerror (errsv));
+      return NULL;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (required_ops); i++)
+    if (required_ops[i] > probe->last_op ||
+        (probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+      {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+                     "io_uring operation %u is not supported", required_ops[i]);
+        return NULL;
+      }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_ring_size = ring->cq_ring_size = MAX (ring->sq_ring_size, ring->cq_ring_size);
+
+  ring->sq_ring = map_ring (ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING, error);
+  if (ring->sq_ring == NULL)
+    return NULL;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = map_ring (ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING, error);
+      if (ring->cq_ring == NULL)
+        return NULL;
+    }
+
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = map_ring (ring->fd, ring->sqes_size, IORING_OFF_SQES, error);
+  if (ring->sqes == NULL)
+    return NULL;
+
+  ring->sq_tail = (unsigned *)(ring->sq_ring + params.sq_off.tail);
+  ring->sq_array = (unsigned *)(ring->sq_ring + params.sq_off.array);
+  ring->sq_mask = *(unsigned *)(ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned *)(ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + params.cq_off.cqes);
+  ring->sqe_tail = *ring->sq_tail;
+
+  return g_steal_pointer (&ring);
+}
+
+void
+quad_uring_free (QuadUring *ring)
+{
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  g_free (ring);
+}
+
+guint
+quad_uring_get_size (QuadUring *ring)
+{
+  return ring->sq_entries;
+}
+
+guint
+quad_uring_get_space (QuadUring *ring)
+{
+  return ring->sq_entries - ring->n_queued;
+}
+
+static struct io_uring_sqe *
+get_sqe (QuadUring *ring,
+         guint8 opcode,
+         int fd,
+         int *result)
+{
+  unsigned index = ring->sqe_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe;
+
+  if (ring->dead || ring->n_queued >= ring->sq_entries)
+    return NULL;
+
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (guint64)(guintptr)result;
+  ring->sq_array[index] = index;
+  ring->sqe_tail++;
+  ring->n_queued++;
+
+  *result = -ECANCELED;
+
+  return sqe;
+}
+
+/* Submits everything that was queued and waits for all of it. This
+ * only fails if the ring itself does, in which case the results that
+ * were not set are undefined, and the ring can't be used again */
+gboolean
+quad_uring_run (QuadUring *ring,
+                GError **error)
+{
+  guint to_submit = ring->n_queued;
+  guint n_pending = ring->n_queued;
+
+  if (ring->dead)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO,
+                   "io_uring failed earlier and can't be used");
+      return FALSE;
+    }
+
+  /* The kernel must see the entries before the new tail */
+  g_atomic_int_set ((gint *)ring->sq_tail, ring->sqe_tail);
+  ring->n_queued = 0;
+
+  while (n_pending > 0)
+    {
+      unsigned head = *ring->cq_head;
+      unsigned tail = g_atomic_int_get ((gint *)ring->cq_tail);
+      int res;
+
+      for (; head != tail; head++)
+        {
+          struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+          *(int *)(guintptr)cqe->user_data = cqe->res;
+          n_pending--;
+        }
+      g_atomic_int_set ((gint *)ring->cq_head, head);
+
+      if (n_pending == 0)
+        break;
+
+      res = uring_enter (ring->fd, to_submit, n_pending, IORING_ENTER_GETEVENTS);
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR || errsv == EAGAIN || errsv == EBUSY)
+            continue;
+
+          ring->dead = TRUE;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                       "Failed to submit to io_uring: %s", g_strerror (errsv));
+          return FALSE;
+        }
+
+      to_submit -= MIN ((guint)res, to_submit);
+    }
+
+  return TRUE;
+}
+
+gboolean
+quad_uring_openat (QuadUring *ring,
+                   int dir_fd,
+                   const char *path,
+                   int flags,
+                   mode_t mode,
+                   int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_OPENAT, dir_fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)path;
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  return TRUE;
+}
+
+gboolean
+quad_uring_statx (QuadUring *ring,
+                  int dir_fd,
+                  const char *path,
+                  int flags,
+                  unsigned int mask,
+                  struct statx *buf,
+                  int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_STATX, dir_fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)path;
+  sqe->len = mask;
+  sqe->off = (guint64)(guintptr)buf;
+  sqe->statx_flags = flags;
+  return TRUE;
+}
+
+gboolean
+quad_uring_read (QuadUring *ring,
+                 int fd,
+                 void *buf,
+                 gsize len,
+                 guint64 offset,
+                 int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_READ, fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  return TRUE;
+}
+
+gboolean
+quad_uring_write (QuadUring *ring,
+                  int fd,
+                  const void *buf,
+                  gsize len,
+                  guint64 offset,
+                  int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_WRITE, fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  return TRUE;
+}
+
+gboolean
+quad_uring_fsync (QuadUring *ring,
+                  int fd,
+                  int *result)
+{
+  return get_sqe (ring, IORING_OP_FSYNC, fd, result) != NULL;
+}
+
+gboolean
+quad_uring_close (QuadUring *ring,
+                  int fd,
+                  int *result)
+{
+  return get_sqe (ring, IORING_OP_CLOSE, fd, result) != NULL;
+}
+
+gboolean
+quad_uring_renameat (QuadUring *ring,
+                     int old_dir_fd,
+                     const char *old_path,
+                     int new_dir_fd,
+                     const char *new_path,
+                     int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_RENAMEAT, old_dir_fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)old_path;
+  sqe->len = new_dir_fd;
+  sqe->off = (guint64)(guintptr)new_path;
+  return TRUE;
+}
+
+gboolean
+quad_uring_mkdirat (QuadUring *ring,
+                    int dir_fd,
+                    const char *path,
+                    mode_t mode,
+                    int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_MKDIRAT, dir_fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)path;
+  sqe->len = mode;
+  return TRUE;
+}
+
+gboolean
+quad_uring_symlinkat (QuadUring *ring,
+                      const char *target,
+                      int dir_fd,
+                      const char *path,
+                      int *result)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring, IORING_OP_SYMLINKAT, dir_fd, result);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->addr = (guint64)(guintptr)target;
+  sqe->off = (guint64)(guintptr)path;
+  return TRUE;
+}
+
+typedef struct {
+  int fd;
+  int stat_result;
+  int read_result;
+  int close_result;
+  struct statx stx;
+  char *data;
+} ReadFile;
+
+/* Returns FALSE if the ring failed. The files that were opened are
+ * then closed without it, and none of the batch is read */
+static gboolean
+read_files_batch (QuadUring *ring,
+                  guint n_files,
+                  const char **paths,
+                  gsize max_size,
+                  GBytes **contents)
+{
+  g_autofree ReadFile *files = g_new0 (ReadFile, n_files);
+  gboolean ok;
+
+  /* The path is opened and stat:ed at the same time, a file that is
+   * replaced in between is caught by the read not matching the size.
+   * Opening doesn't block on fifos, which are then never read */
+  for (guint i = 0; i < n_files; i++)
+    {
+      quad_uring_openat (ring, AT_FDCWD, paths[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC, 0,
+                         &files[i].fd);
+      quad_uring_statx (ring, AT_FDCWD, paths[i], 0, STATX_TYPE | STATX_SIZE,
+                        &files[i].stx, &files[i].stat_result);
+    }
+  ok = quad_uring_run (ring, NULL);
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      if (files[i].fd < 0)
+        continue;
+
+      if (!ok)
+        {
+          close (files[i].fd);
+          files[i].fd = -1;
+          continue;
+        }
+
+      if (files[i].stat_result == 0 && S_ISREG (files[i].stx.stx_mode) &&
+          files[i].stx.stx_size <= max_size)
+        {
+          /* One byte more, to notice if the file grew */
+          files[i].data = g_malloc (files[i].stx.stx_size + 1);
+          quad_uring_read (ring, files[i].fd, files[i].data, files[i].stx.stx_size + 1, 0,
+                           &files[i].read_result);
+        }
+    }
+  if (!ok)
+    return FALSE;
+  ok = quad_uring_run (ring, NULL);
+
+  for (guint i = 0; i < n_files; i++)
+    {
+      if (files[i].data != NULL)
+        {
+          if (ok && files[i].read_result >= 0 &&
+              (guint64)files[i].read_result == files[i].stx.stx_size)
+            contents[i] = g_bytes_new_take (files[i].data, files[i].stx.stx_size);
+          else
+            g_free (files[i].data);
+        }
+
+      if (files[i].fd >= 0 && (!ok || !quad_uring_close (ring, files[i].fd, &files[i].close_result)))
+        close (files[i].fd);
+    }
+
+  return ok && quad_uring_run (ring, NULL);
+}
+
+/* Reads whole files, a batch at a time. Files that can't be read this
+ * way, because they are missing, too large or changed while being
+ * read, or because the ring failed, are left NULL, and should be read
+ * the usual way instead, which also reports the error. Returns FALSE
+ * if the ring failed */
+gboolean
+quad_uring_read_files (QuadUring *ring,
+                       guint n_files,
+                       const char **paths,
+                       gsize max_size,
+                       GBytes **contents)
+{
+  guint batch = MAX (quad_uring_get_size (ring) / 2, 1);
+
+  for (guint i = 0; i < n_files; i++)
+    contents[i] = NULL;
+
+  for (guint start = 0; start < n_files; start += batch)
+    {
+      if (!read_files_batch (ring, MIN (batch, n_files - start), paths + start, max_size,
+                             contents + start))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct QuadUring {
+  int unused;
+};
+
+QuadUring *
+quad_uring_new (G_GNUC_UNUSED guint entries,
+                GError **error)
+{
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+               "Built without io_uring support");
+  return NULL;
+}
+
+void
+quad_uring_free (QuadUring *ring)
+{
+  g_free (ring);
+}
+
+guint
+quad_uring_get_size (G_GNUC_UNUSED QuadUring *ring)
+{
+  return 0;
+}
+
+guint
+quad_uring_get_space (G_GNUC_UNUSED QuadUring *ring)
+{
+  return 0;
+}
+
+gboolean
+quad_uring_run (G_GNUC_UNUSED QuadUring *ring,
+                G_GNUC_UNUSED GError **error)
+{
+  return TRUE;
+}
+
+gboolean
+quad_uring_openat (G_GNUC_UNUSED QuadUring *ring,
+                   G_GNUC_UNUSED int dir_fd,
+                   G_GNUC_UNUSED const char *path,
+                   G_GNUC_UNUSED int flags,
+                   G_GNUC_UNUSED mode_t mode,
+                   G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_statx (G_GNUC_UNUSED QuadUring *ring,
+                  G_GNUC_UNUSED int dir_fd,
+                  G_GNUC_UNUSED const char *path,
+                  G_GNUC_UNUSED int flags,
+                  G_GNUC_UNUSED unsigned int mask,
+                  G_GNUC_UNUSED struct statx *buf,
+                  G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_read (G_GNUC_UNUSED QuadUring *ring,
+                 G_GNUC_UNUSED int fd,
+                 G_GNUC_UNUSED void *buf,
+                 G_GNUC_UNUSED gsize len,
+                 G_GNUC_UNUSED guint64 offset,
+                 G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_write (G_GNUC_UNUSED QuadUring *ring,
+                  G_GNUC_UNUSED int fd,
+                  G_GNUC_UNUSED const void *buf,
+                  G_GNUC_UNUSED gsize len,
+                  G_GNUC_UNUSED guint64 offset,
+                  G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_fsync (G_GNUC_UNUSED QuadUring *ring,
+                  G_GNUC_UNUSED int fd,
+                  G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_close (G_GNUC_UNUSED QuadUring *ring,
+                  G_GNUC_UNUSED int fd,
+                  G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_renameat (G_GNUC_UNUSED QuadUring *ring,
+                     G_GNUC_UNUSED int old_dir_fd,
+                     G_GNUC_UNUSED const char *old_path,
+                     G_GNUC_UNUSED int new_dir_fd,
+                     G_GNUC_UNUSED const char *new_path,
+                     G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_mkdirat (G_GNUC_UNUSED QuadUring *ring,
+                    G_GNUC_UNUSED int dir_fd,
+                    G_GNUC_UNUSED const char *path,
+                    G_GNUC_UNUSED mode_t mode,
+                    G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_symlinkat (G_GNUC_UNUSED QuadUring *ring,
+                      G_GNUC_UNUSED const char *target,
+                      G_GNUC_UNUSED int dir_fd,
+                      G_GNUC_UNUSED const char *path,
+                      G_GNUC_UNUSED int *result)
+{
+  return FALSE;
+}
+
+gboolean
+quad_uring_read_files (G_GNUC_UNUSED QuadUring *ring,
+                       guint n_files,
+                       G_GNUC_UNUSED const char **paths,
+                       G_GNUC_UNUSED gsize max_size,
+                       GBytes **contents)
+{
+  for (guint i = 0; i < n_files; i++)
+    contents[i] = NULL;
+
+  return TRUE;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <glib.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+struct statx;
+
+/* A minimal io_uring on the raw system calls, for submitting file
+ * operations in batches. Operations are queued with the functions
+ * below, each with a place for its result, which is the return value
+ * of the system call or a negative errno. quad_uring_run() then submits
+ * them all and waits until they are done. Operations in a batch may run
+ * in any order, so ones that depend on each other go in separate
+ * batches. A ring is only used from one thread at a time */
+typedef struct QuadUring QuadUring;
+
+QuadUring * quad_uring_new            (guint               entries,
+                                       GError            **error);
+void        quad_uring_free           (QuadUring          *ring);
+
+guint       quad_uring_get_size       (QuadUring          *ring);
+guint       quad_uring_get_space      (QuadUring          *ring);
+gboolean    quad_uring_run            (QuadUring          *ring,
+                                       GError            **error);
+
+/* These return FALSE if the batch is full */
+gboolean    quad_uring_openat         (QuadUring          *ring,
+                                       int                 dir_fd,
+                                       const char         *path,
+                                       int                 flags,
+                                       mode_t              mode,
+                                       int                *result);
+gboolean    quad_uring_statx          (QuadUring          *ring,
+                                       int                 dir_fd,
+                                       const char         *path,
+                                       int                 flags,
+                                       unsigned int        mask,
+                                       struct statx       *buf,
+                                       int                *result);
+gboolean    quad_uring_read           (QuadUring          *ring,
+                                       int                 fd,
+                                       void               *buf,
+                                       gsize               len,
+                                       guint64             offset,
+                                       int                *result);
+gboolean    quad_uring_write          (QuadUring          *ring,
+                                       int                 fd,
+                                       const void         *buf,
+                                       gsize               len,
+                                       guint64             offset,
+                                       int                *result);
+gboolean    quad_uring_fsync          (QuadUring          *ring,
+                                       int                 fd,
+                                       int                *result);
+gboolean    quad_uring_close          (QuadUring          *ring,
+                                       int                 fd,
+                                       int                *result);
+gboolean    quad_uring_renameat       (QuadUring          *ring,
+                                       int                 old_dir_fd,
+                                       const char         *old_path,
+                                       int                 new_dir_fd,
+                                       const char         *new_path,
+                                       int                *result);
+gboolean    quad_uring_mkdirat        (QuadUring          *ring,
+                                       int                 dir_fd,
+                                       const char         *path,
+                                       mode_t              mode,
+                                       int                *result);
+gboolean    quad_uring_symlinkat      (QuadUring          *ring,
+                                       const char         *target,
+                                       int                 dir_fd,
+                                       const char         *path,
+                                       int                *result);
+
+gboolean    quad_uring_read_files     (QuadUring          *ring,
+                                       guint               n_files,
+                                       const char        **paths,
+                                       gsize               max_size,
+                                       GBytes            **contents);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadUring, quad_uring_free)
+
+G_END_DECLS
@@ -14,41 +14,10 @@
 #include "utils.h"
 #include <stdint.h>
 
-const char **
-quad_get_unit_dirs (gboolean user)
-{
-  static const char **unit_dirs = NULL;
-  static const char *unit_dirs_system_default[] = {
-    QUADLET_UNIT_DIR_ADMIN,
-    QUADLET_UNIT_DIR_DISTRO,
-    NULL
-  };
-  static const char *unit_dirs_user_default[] = {
-    NULL,
-    NULL
-  };
-
-  if (unit_dirs == NULL)
-    {
-      const char *unit_dirs_env = g_getenv ("QUADLET_UNIT_DIRS");
-      if (unit_dirs_env != NULL)
-        unit_dirs = (const char **)g_strsplit (unit_dirs_env, ":", -1);
-      else
-        {
-          if (user)
-            {
-              unit_dirs_user_default[0] = g_build_filename (g_get_user_config_dir (), "containers/systemd", NULL);
-              unit_dirs = unit_dirs_user_default;
-            }
-          else
-            {
-              unit_dirs = unit_dirs_system_default;
-            }
-        }
-    }
-
-  return unit_dirs;
-}
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SCAN_LINE_AVX2
+#endif
 
 char *
 quad_replace_extension (const char *name,
@@ -80,26 +49,36 @@ quad_replace_extension (const char *name,
 char *
 quad_apply_line_continuation (const char *raw_string)
 {
-  GString *str = g_string_new ("");
-  const char *continuation;
-
-  while (raw_string && *raw_string)
+  gsize len = raw_string ? strlen (raw_string) : 0;
+  const char *p = raw_string;
+  const char *end = p + len;
+  const char *nl;
+  char *res, *dest;
+
+  /* The result is never longer than the input. This only scans forward
+   * within known bounds, so it stays linear with many continuations */
+  res = dest = g_malloc (len + 1);
+  while (p < end && (nl = memchr (p, '\n', end - p)) != NULL)
     {
-      continuation = strstr (raw_string, "\\\n");
-      if (continuation == NULL)
+      if (nl > p && nl[-1] == '\\')
         {
-          g_string_append (str, raw_string);
-          raw_string = NULL;
+          memcpy (dest, p, nl - 1 - p);
+          dest += nl - 1 - p;
+          *dest++ = ' ';
         }
       else
         {
-          g_string_append_len (str, raw_string, continuation - raw_string);
-          g_string_append (str, " ");
-          raw_string = continuation + 2;
+          memcpy (dest, p, nl + 1 - p);
+          dest += nl + 1 - p;
         }
+      p = nl + 1;
     }
 
-  return g_string_free (str, FALSE);
+  memcpy (dest, p, end - p);
+  dest += end - p;
+  *dest = 0;
+
+  return res;
 }
 
 /* This is based on code from systemd (src/basic/escape.c), marked LGPL-2.1-or-later and is copyrighted by the systemd developers */
@@ -652,39 +631,100 @@ quad_fail (GError    **error,
   return FALSE;
 }
 
-static gboolean
-log_to_kmsg (const char *line)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Handles short writes and batches of more than IOV_MAX vectors */
+gboolean
+quad_writev_all (int                 fd,
+                 const struct iovec *iov,
+                 gsize               n_iov,
+                 GError            **error)
 {
-  static int dev_kmsg_fd = -2;
-  int res;
+  struct iovec current = { NULL, 0 };
+
+  while (n_iov > 0 || current.iov_len > 0)
+    {
+      const struct iovec *batch;
+      int n_batch;
+      ssize_t res;
+
+      /* Finish a partially written vector before continuing */
+      if (current.iov_len > 0)
+        {
+          batch = &current;
+          n_batch = 1;
+        }
+      else
+        {
+          batch = iov;
+          n_batch = MIN (n_iov, IOV_MAX);
+        }
 
-  if (dev_kmsg_fd == -2)
-    dev_kmsg_fd = open ("/dev/kmsg", O_WRONLY);
+      res = writev (fd, batch, n_batch);
+      if (res < 0)
+        {
+          int errsv = errno;
 
-  if (dev_kmsg_fd < 0)
-    return FALSE; /* Failed open */
+          if (errsv == EINTR)
+            continue;
 
-  res = write (dev_kmsg_fd, line, strlen (line));
-  if (res < 0)
-    return FALSE;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                       "Failed to write: %s", g_strerror (errsv));
+          return FALSE;
+        }
 
-   return TRUE;
+      if (batch == &current)
+        {
+          current.iov_base = (char *)current.iov_base + res;
+          current.iov_len -= res;
+          continue;
+        }
+
+      while (n_iov > 0 && (gsize)res >= iov->iov_len)
+        {
+          res -= iov->iov_len;
+          iov++;
+          n_iov--;
+        }
+
+      if (res > 0)
+        {
+          current.iov_base = (char *)iov->iov_base + res;
+          current.iov_len = iov->iov_len - res;
+          iov++;
+          n_iov--;
+        }
+    }
+
+  return TRUE;
+}
+
+gboolean
+quad_write_all (int         fd,
+                const char *data,
+                gsize       len,
+                GError    **error)
+{
+  struct iovec iov = { (void *)data, len };
+
+  return quad_writev_all (fd, &iov, 1, error);
 }
 
+/* Logs to stderr, one line at a time. Conversions log through their
+ * QuadContext instead, which can log to the kernel */
 void
 quad_logv (const char *fmt,
            va_list     args)
 {
   g_autofree char *s = g_strdup_vprintf (fmt, args);
-  g_autofree char *log = g_strdup_printf ("quadlet-generator[%d]: %s\n", getpid (), s);
 
-  if (!log_to_kmsg (log))
-    {
-      /* If we can't log, print to stderr */
-      fputs (s, stderr);
-      fputs ("\n", stderr);
-      fflush (stderr);
-    }
+  flockfile (stderr);
+  fputs (s, stderr);
+  fputs ("\n", stderr);
+  fflush (stderr);
+  funlockfile (stderr);
 }
 
 void
@@ -696,33 +736,14 @@ quad_log (const char *fmt, ...)
   va_end (args);
 }
 
-static gboolean do_debug = FALSE;
-
-void
-quad_enable_debug (void)
-{
-  do_debug = TRUE;
-}
-
-void
-quad_debug (const char *fmt, ...)
-{
-  va_list args;
-  if (do_debug)
-    {
-      va_start (args, fmt);
-      quad_logv (fmt, args);
-      va_end (args);
-    }
-}
-
 uid_t
 quad_lookup_host_uid (const char *user,
                       GError    **error)
 {
   char *endp;
   long long res;
-  struct passwd *pw;
+  struct passwd pwbuf, *pw = NULL;
+  char buf[4096];
 
   /* First special case numeric ids */
 
@@ -740,7 +761,8 @@ quad_lookup_host_uid (const char *user,
       return res;
     }
 
-  pw = getpwnam (user);
+  /* The _r variant, as units are converted in parallel */
+  getpwnam_r (user, &pwbuf, buf, sizeof (buf), &pw);
   if (pw == NULL)
     {
       quad_fail (error, "Unknown user '%s'", user);
@@ -757,7 +779,8 @@ quad_lookup_host_gid (const char *group,
 {
   char *endp;
   long long res;
-  struct group *gp;
+  struct group grbuf, *gp = NULL;
+  char buf[4096];
 
   /* First special case numeric ids */
 
@@ -775,7 +798,7 @@ quad_lookup_host_gid (const char *group,
       return res;
     }
 
-  gp = getgrnam (group);
+  getgrnam_r (group, &grbuf, buf, sizeof (buf), &gp);
   if (gp == NULL)
     {
       quad_fail (error, "Unknown group '%s'", group);
@@ -785,31 +808,19 @@ quad_lookup_host_gid (const char *group,
   return gp->gr_gid;
 }
 
-static QuadRanges *
-quad_lookup_host_subid (const char *path,
-                         char ***cache,
-                         const char *prefix)
+/* Finds the ranges of a user in the lines of /etc/subuid or
+ * /etc/subgid, or returns NULL if there are none */
+QuadRanges *
+quad_lookup_subid (char      **lines,
+                   const char *user)
 {
   g_autoptr(QuadRanges) ranges = quad_ranges_new_empty ();
-  static char *empty = { NULL };
-  char **lines;
-
-  if (*cache == NULL)
-    {
-      g_autofree char *data = NULL;
-
-      if (!g_file_get_contents (path, &data, NULL, NULL))
-        *cache = &empty;
-      else
-        *cache = g_strsplit (data, "\n", -1);
-    }
 
-  lines = *cache;
   for (guint i = 0; lines[i] != NULL; i++)
     {
       const char *line = lines[i];
 
-      if (g_str_has_prefix (line, prefix) && line[strlen (prefix)] == ':')
+      if (g_str_has_prefix (line, user) && line[strlen (user)] == ':')
         {
           g_auto(GStrv) parts = g_strsplit (line, ":", 3);
 
@@ -830,22 +841,6 @@ quad_lookup_host_subid (const char *path,
   return NULL;
 }
 
-QuadRanges *
-quad_lookup_host_subuid (const char *user)
-{
-  static char **cache = NULL;
-
-  return quad_lookup_host_subid ("/etc/subuid", &cache, user);
-}
-
-QuadRanges *
-quad_lookup_host_subgid (const char *user)
-{
-  static char **cache = NULL;
-
-  return quad_lookup_host_subid ("/etc/subgid", &cache, user);
-}
-
 QuadRanges *
 quad_ranges_new_empty (void)
 {
@@ -1099,6 +1094,516 @@ quad_ranges_merge (QuadRanges *ranges,
     quad_ranges_add (ranges, other->ranges[i].start, other->ranges[i].length);
 }
 
+typedef struct QuadArenaChunk QuadArenaChunk;
+
+struct QuadArenaChunk {
+  QuadArenaChunk *next;
+  gsize size;
+  gsize used;
+  char data[];
+};
+
+struct QuadArena {
+  gatomicrefcount ref_count;
+  QuadArenaChunk *chunks; /* First chunk is the one we allocate from */
+  gsize chunk_size;
+};
+
+#define QUAD_ARENA_ALIGN sizeof (gpointer)
+
+QuadArena *
+quad_arena_new (gsize chunk_size)
+{
+  QuadArena *arena = g_new0 (QuadArena, 1);
+
+  g_atomic_ref_count_init (&arena->ref_count);
+  arena->chunk_size = MAX (chunk_size, 256);
+
+  return arena;
+}
+
+/* Arenas are refcounted so that strings can be shared between owners.
+ * Allocation is not threadsafe though. */
+QuadArena *
+quad_arena_ref (QuadArena *arena)
+{
+  g_atomic_ref_count_inc (&arena->ref_count);
+  return arena;
+}
+
+void
+quad_arena_unref (QuadArena *arena)
+{
+  QuadArenaChunk *chunk = arena->chunks;
+
+  if (!g_atomic_ref_count_dec (&arena->ref_count))
+    return;
+
+  while (chunk != NULL)
+    {
+      QuadArenaChunk *next = chunk->next;
+      g_free (chunk);
+      chunk = next;
+    }
+
+  g_free (arena);
+}
+
+static QuadArenaChunk *
+quad_arena_chunk_new (gsize size)
+{
+  QuadArenaChunk *chunk = g_malloc (sizeof (QuadArenaChunk) + size);
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+/* Make sure the next size bytes of allocations fit in the current chunk */
+void
+quad_arena_reserve (QuadArena *arena,
+                    gsize size)
+{
+  QuadArenaChunk *chunk = arena->chunks;
+
+  if (chunk != NULL && chunk->size - chunk->used >= size)
+    return;
+
+  chunk = quad_arena_chunk_new (MAX (size, arena->chunk_size));
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+}
+
+static gpointer
+quad_arena_alloc_unaligned (QuadArena *arena,
+                            gsize size)
+{
+  QuadArenaChunk *chunk = arena->chunks;
+  gpointer res;
+
+  if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+      if (size > arena->chunk_size / 4)
+        {
+          /* Large allocations get a chunk of their own, linked in
+           * after the current one so we keep filling that. */
+          QuadArenaChunk *large = quad_arena_chunk_new (size);
+          large->used = size;
+
+          if (chunk == NULL)
+            arena->chunks = large;
+          else
+            {
+              large->next = chunk->next;
+              chunk->next = large;
+            }
+
+          return large->data;
+        }
+
+      quad_arena_reserve (arena, size);
+      chunk = arena->chunks;
+    }
+
+  res = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return res;
+}
+
+gpointer
+quad_arena_alloc (QuadArena *arena,
+                  gsize size)
+{
+  QuadArenaChunk *chunk = arena->chunks;
+
+  size = (size + QUAD_ARENA_ALIGN - 1) & ~(QUAD_ARENA_ALIGN - 1);
+
+  if (chunk != NULL)
+    {
+      gsize pad = -chunk->used & (QUAD_ARENA_ALIGN - 1);
+
+      if (chunk->size - chunk->used >= size + pad)
+        chunk->used += pad;
+      else
+        chunk->used = chunk->size; /* Doesn't fit aligned, drop the tail */
+    }
+
+  return quad_arena_alloc_unaligned (arena, size);
+}
+
+char *
+quad_arena_strndup (QuadArena *arena,
+                    const char *str,
+                    gsize len)
+{
+  char *res = quad_arena_alloc_unaligned (arena, len + 1);
+
+  memcpy (res, str, len);
+  res[len] = 0;
+
+  return res;
+}
+
+char *
+quad_arena_strdup (QuadArena *arena,
+                   const char *str)
+{
+  if (str == NULL)
+    return NULL;
+
+  return quad_arena_strndup (arena, str, strlen (str));
+}
+
+gboolean
+quad_str_view_equal (QuadStrView view,
+                     const char *str)
+{
+  return strlen (str) == view.len && memcmp (view.str, str, view.len) == 0;
+}
+
+gboolean
+quad_str_view_equal_ascii_nocase (QuadStrView view,
+                                  const char *str)
+{
+  return strlen (str) == view.len && g_ascii_strncasecmp (view.str, str, view.len) == 0;
+}
+
+/* Line scanning. This finds the end of the line and the first '=' on
+ * it in a single pass. We use sse2 or avx2 if available, picked at
+ * runtime, otherwise we fall back to memchr() */
+
+typedef const char *(*QuadScanLineFunc) (const char *line,
+                                         const char *end,
+                                         const char **first_eq);
+
+#if defined(__SSE2__) || defined(HAVE_SCAN_LINE_AVX2)
+static const char *
+scan_line_tail (const char *p,
+                const char *end,
+                const char *eq,
+                const char **first_eq)
+{
+  for (; p < end; p++)
+    {
+      if (*p == '\n')
+        break;
+      if (*p == '=' && eq == NULL)
+        eq = p;
+    }
+
+  *first_eq = eq;
+  return p;
+}
+#endif
+
+static const char *
+scan_line_generic (const char *line,
+                   const char *end,
+                   const char **first_eq)
+{
+  const char *nl = memchr (line, '\n', end - line);
+
+  if (nl == NULL)
+    nl = end;
+
+  *first_eq = memchr (line, '=', nl - line);
+  return nl;
+}
+
+#if defined(__SSE2__)
+static const char *
+scan_line_sse2 (const char *line,
+                const char *end,
+                const char **first_eq)
+{
+  const __m128i nl_v = _mm_set1_epi8 ('\n');
+  const __m128i eq_v = _mm_set1_epi8 ('=');
+  const char *p = line;
+  const char *eq = NULL;
+
+  while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+      guint nl_mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, nl_v));
+
+      if (eq == NULL)
+        {
+          guint eq_mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, eq_v));
+          if (nl_mask)
+            eq_mask &= (nl_mask & -nl_mask) - 1; /* Only before the newline */
+          if (eq_mask)
+            eq = p + __builtin_ctz (eq_mask);
+        }
+
+      if (nl_mask)
+        {
+          *first_eq = eq;
+          return p + __builtin_ctz (nl_mask);
+        }
+
+      p += 16;
+    }
+
+  return scan_line_tail (p, end, eq, first_eq);
+}
+#endif
+
+#ifdef HAVE_SCAN_LINE_AVX2
+__attribute__ ((target ("avx2")))
+static const char *
+scan_line_avx2 (const char *line,
+                const char *end,
+                const char **first_eq)
+{
+  const __m256i nl_v = _mm256_set1_epi8 ('\n');
+  const __m256i eq_v = _mm256_set1_epi8 ('=');
+  const char *p = line;
+  const char *eq = NULL;
+
+  while (end - p >= 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+      guint nl_mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, nl_v));
+
+      if (eq == NULL)
+        {
+          guint eq_mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, eq_v));
+          if (nl_mask)
+            eq_mask &= (nl_mask & -nl_mask) - 1; /* Only before the newline */
+          if (eq_mask)
+            eq = p + __builtin_ctz (eq_mask);
+        }
+
+      if (nl_mask)
+        {
+          *first_eq = eq;
+          return p + __builtin_ctz (nl_mask);
+        }
+
+      p += 32;
+    }
+
+  return scan_line_tail (p, end, eq, first_eq);
+}
+#endif
+
+static QuadScanLineFunc
+choose_scan_line_func (void)
+{
+#ifdef HAVE_SCAN_LINE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return scan_line_avx2;
+#endif
+#if defined(__SSE2__)
+  return scan_line_sse2;
+#else
+  return scan_line_generic;
+#endif
+}
+
+/* Returns the end of the line (the newline, or end), and sets first_eq to
+ * the first '=' before that, or NULL */
+const char *
+quad_scan_line (const char *line,
+                const char *end,
+                const char **first_eq)
+{
+  static QuadScanLineFunc scan_line_func = NULL;
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      scan_line_func = choose_scan_line_func ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return scan_line_func (line, end, first_eq);
+}
+
+/* Same as quad_scan_line(), but never vectorized, for tests */
+const char *
+quad_scan_line_generic (const char *line,
+                        const char *end,
+                        const char **first_eq)
+{
+  return scan_line_generic (line, end, first_eq);
+}
+
+/* Interned strings live for the whole process and can be compared by
+ * pointer. We use the glib quark table, which is shared and threadsafe,
+ * but never shrinks, so only a known set of names should be interned */
+
+const char *
+quad_intern_len (const char *str,
+                 gsize len)
+{
+  char buf[256];
+  g_autofree char *heap = NULL;
+  char *tmp;
+
+  if (len < sizeof (buf))
+    tmp = buf;
+  else
+    tmp = heap = g_malloc (len + 1);
+
+  memcpy (tmp, str, len);
+  tmp[len] = 0;
+
+  return g_intern_string (tmp);
+}
+
+/* Returns NULL if the string was never interned, which means no interned
+ * string can be equal to it */
+const char *
+quad_intern_lookup (const char *str)
+{
+  GQuark quark = g_quark_try_string (str);
+
+  if (quark == 0)
+    return NULL;
+
+  return g_quark_to_string (quark);
+}
+
+/* MurmurHash64A, a fast non-cryptographic hash for detecting changed
+ * contents. The result depends on the byte order of the machine */
+guint64
+quad_hash64 (gconstpointer data,
+             gsize len)
+{
+  const guint64 m = G_GUINT64_CONSTANT (0xc6a4a7935bd1e995);
+  const int r = 47;
+  const guint8 *p = data;
+  const guint8 *end = p + (len & ~(gsize)7);
+  guint64 h = G_GUINT64_CONSTANT (0x51ad1e7c0ffee) ^ (len * m);
+
+  for (; p != end; p += 8)
+    {
+      guint64 k;
+
+      memcpy (&k, p, sizeof (k));
+      k *= m;
+      k ^= k >> r;
+      k *= m;
+
+      h ^= k;
+      h *= m;
+    }
+
+  switch (len & 7)
+    {
+    case 7: h ^= (guint64)p[6] << 48; G_GNUC_FALLTHROUGH;
+    case 6: h ^= (guint64)p[5] << 40; G_GNUC_FALLTHROUGH;
+    case 5: h ^= (guint64)p[4] << 32; G_GNUC_FALLTHROUGH;
+    case 4: h ^= (guint64)p[3] << 24; G_GNUC_FALLTHROUGH;
+    case 3: h ^= (guint64)p[2] << 16; G_GNUC_FALLTHROUGH;
+    case 2: h ^= (guint64)p[1] << 8; G_GNUC_FALLTHROUGH;
+    case 1: h ^= (guint64)p[0];
+      h *= m;
+    }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+static inline guint64
+rotl64 (guint64 x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+fmix64 (guint64 k)
+{
+  k ^= k >> 33;
+  k *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  k ^= k >> 33;
+  k *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  k ^= k >> 33;
+  return k;
+}
+
+/* MurmurHash3_x64_128. The input is read as little endian words, so
+ * unlike quad_hash64() the result is the same on all machines */
+QuadHash128
+quad_hash128 (gconstpointer data,
+              gsize len,
+              guint64 seed)
+{
+  const guint64 c1 = G_GUINT64_CONSTANT (0x87c37b91114253d5);
+  const guint64 c2 = G_GUINT64_CONSTANT (0x4cf5ad432745937f);
+  const guint8 *p = data;
+  const guint8 *end = p + (len & ~(gsize)15);
+  guint64 h1 = seed, h2 = seed;
+  guint64 k1 = 0, k2 = 0;
+  QuadHash128 res;
+
+  for (; p != end; p += 16)
+    {
+      memcpy (&k1, p, sizeof (k1));
+      memcpy (&k2, p + 8, sizeof (k2));
+      k1 = GUINT64_FROM_LE (k1);
+      k2 = GUINT64_FROM_LE (k2);
+
+      k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+      h1 = rotl64 (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+      k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+      h2 = rotl64 (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+  k1 = k2 = 0;
+  switch (len & 15)
+    {
+    case 15: k2 ^= (guint64)p[14] << 48; G_GNUC_FALLTHROUGH;
+    case 14: k2 ^= (guint64)p[13] << 40; G_GNUC_FALLTHROUGH;
+    case 13: k2 ^= (guint64)p[12] << 32; G_GNUC_FALLTHROUGH;
+    case 12: k2 ^= (guint64)p[11] << 24; G_GNUC_FALLTHROUGH;
+    case 11: k2 ^= (guint64)p[10] << 16; G_GNUC_FALLTHROUGH;
+    case 10: k2 ^= (guint64)p[9] << 8; G_GNUC_FALLTHROUGH;
+    case 9: k2 ^= (guint64)p[8];
+      k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+      G_GNUC_FALLTHROUGH;
+    case 8: k1 ^= (guint64)p[7] << 56; G_GNUC_FALLTHROUGH;
+    case 7: k1 ^= (guint64)p[6] << 48; G_GNUC_FALLTHROUGH;
+    case 6: k1 ^= (guint64)p[5] << 40; G_GNUC_FALLTHROUGH;
+    case 5: k1 ^= (guint64)p[4] << 32; G_GNUC_FALLTHROUGH;
+    case 4: k1 ^= (guint64)p[3] << 24; G_GNUC_FALLTHROUGH;
+    case 3: k1 ^= (guint64)p[2] << 16; G_GNUC_FALLTHROUGH;
+    case 2: k1 ^= (guint64)p[1] << 8; G_GNUC_FALLTHROUGH;
+    case 1: k1 ^= (guint64)p[0];
+      k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64 (h1);
+  h2 = fmix64 (h2);
+  h1 += h2;
+  h2 += h1;
+
+  res.h1 = h1;
+  res.h2 = h2;
+  return res;
+}
+
+/* Returns the hash as 32 hex digits */
+char *
+quad_hash128_to_string (QuadHash128 hash)
+{
+  return g_strdup_printf ("%016" G_GINT64_MODIFIER "x%016" G_GINT64_MODIFIER "x",
+                          hash.h1, hash.h2);
+}
+
 /* This function normalizes relative the paths by dropping multiple slashes,
  * removing "." elements and making ".." drop the parent element as long
  * as there is not (otherwise the .. is just removed). Symlinks are not
@@ -1182,3 +1687,517 @@ quad_split_ports (const char *ports)
 
   return (char **) g_ptr_array_free (parts, FALSE);
 }
+
+/* Open addressing hash table in the style of SwissTable. Besides the
+ * entries, which keep the full hash of their key, there is one control
+ * byte per bucket: empty, deleted, or the low 7 bits of the hash of the
+ * key in it. Lookups compare the control bytes of 8 buckets at once, and
+ * only look at an entry when its byte matches, so a miss rarely touches
+ * the entries at all. The first group of control bytes is repeated after
+ * the last one, so a group can be loaded at any bucket */
+
+#define QUAD_TABLE_GROUP_WIDTH 8
+#define QUAD_TABLE_MIN_BUCKETS 8
+
+#define QUAD_TABLE_CTRL_EMPTY ((guint8)0x80)
+#define QUAD_TABLE_CTRL_DELETED ((guint8)0xfe)
+
+#define QUAD_TABLE_LSBS G_GUINT64_CONSTANT (0x0101010101010101)
+#define QUAD_TABLE_MSBS G_GUINT64_CONSTANT (0x8080808080808080)
+
+typedef struct {
+  guint64 hash;
+  gpointer key;
+  gpointer value;
+} QuadTableEntry;
+
+struct QuadTable {
+  QuadTableEntry *entries; /* The control bytes follow in the same allocation */
+  guint8 *ctrl;
+  gsize n_buckets; /* 0, or a power of two */
+  gsize n_items;
+  gsize growth_left; /* Empty buckets we can still use before rehashing */
+  gboolean str_keys;
+  GDestroyNotify key_destroy;
+  GDestroyNotify value_destroy;
+};
+
+static const guint8 empty_ctrl_group[QUAD_TABLE_GROUP_WIDTH] = {
+  QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY,
+  QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY, QUAD_TABLE_CTRL_EMPTY,
+};
+
+static inline guint64
+quad_table_hash (QuadTable *table,
+                 gconstpointer key)
+{
+  guint64 h;
+
+  if (table->str_keys)
+    return quad_hash64 (key, strlen (key));
+
+  /* The finalizer of MurmurHash3, pointers have too few random bits */
+  h = (guint64)(guintptr)key;
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+
+  return h;
+}
+
+static inline guint8
+quad_table_h2 (guint64 hash)
+{
+  return hash & 0x7f;
+}
+
+static inline guint64
+quad_table_load_group (const guint8 *ctrl)
+{
+  guint64 group;
+
+  memcpy (&group, ctrl, sizeof (group));
+  return GUINT64_FROM_LE (group);
+}
+
+/* The match functions return a mask with the top bit set in each
+ * matching byte. matching_h2 can have false positives right after a
+ * real match, which is fine as the full hash is compared anyway */
+static inline guint64
+quad_table_match_h2 (guint64 group,
+                     guint8 h2)
+{
+  guint64 x = group ^ (QUAD_TABLE_LSBS * h2);
+
+  return (x - QUAD_TABLE_LSBS) & ~x & QUAD_TABLE_MSBS;
+}
+
+static inline guint64
+quad_table_match_empty (guint64 group)
+{
+  return group & ~(group << 6) & QUAD_TABLE_MSBS;
+}
+
+static inline guint64
+quad_table_match_empty_or_deleted (guint64 group)
+{
+  return group & ~(group << 7) & QUAD_TABLE_MSBS;
+}
+
+static inline gsize
+quad_table_match_first (guint64 match)
+{
+  return __builtin_ctzll (match) >> 3;
+}
+
+static inline void
+quad_table_set_ctrl (QuadTable *table,
+                     gsize index,
+                     guint8 ctrl)
+{
+  table->ctrl[index] = ctrl;
+  if (index < QUAD_TABLE_GROUP_WIDTH)
+    table->ctrl[table->n_buckets + index] = ctrl;
+}
+
+static inline gsize
+quad_table_max_items (gsize n_buckets)
+{
+  return n_buckets - n_buckets / 8;
+}
+
+/* Returns the bucket of key, or G_MAXSIZE */
+static inline gsize
+quad_table_find (QuadTable *table,
+                 gconstpointer key,
+                 guint64 hash)
+{
+  gsize mask = table->n_buckets - 1;
+  gsize pos = (hash >> 7) & mask;
+  guint8 h2 = quad_table_h2 (hash);
+  gsize stride = 0;
+
+  if (table->n_buckets == 0)
+    return G_MAXSIZE;
+
+  for (;;)
+    {
+      guint64 group = quad_table_load_group (table->ctrl + pos);
+
+      for (guint64 match = quad_table_match_h2 (group, h2); match != 0; match &= match - 1)
+        {
+          gsize index = (pos + quad_table_match_first (match)) & mask;
+          QuadTableEntry *entry = &table->entries[index];
+
+          if (entry->hash == hash &&
+              (entry->key == key || (table->str_keys && strcmp (entry->key, key) == 0)))
+            return index;
+        }
+
+      /* An empty bucket ends every probe sequence that reaches it */
+      if (quad_table_match_empty (group) != 0)
+        return G_MAXSIZE;
+
+      stride += QUAD_TABLE_GROUP_WIDTH;
+      pos = (pos + stride) & mask;
+    }
+}
+
+/* The first bucket that is empty or deleted in the probe sequence of hash */
+static inline gsize
+quad_table_find_free (QuadTable *table,
+                      guint64 hash)
+{
+  gsize mask = table->n_buckets - 1;
+  gsize pos = (hash >> 7) & mask;
+  gsize stride = 0;
+
+  for (;;)
+    {
+      guint64 match = quad_table_match_empty_or_deleted (quad_table_load_group (table->ctrl + pos));
+
+      if (match != 0)
+        return (pos + quad_table_match_first (match)) & mask;
+
+      stride += QUAD_TABLE_GROUP_WIDTH;
+      pos = (pos + stride) & mask;
+    }
+}
+
+static void
+quad_table_resize (QuadTable *table,
+                   gsize n_buckets)
+{
+  QuadTableEntry *old_entries = table->entries;
+  guint8 *old_ctrl = table->ctrl;
+  gsize old_n_buckets = table->n_buckets;
+
+  table->entries = g_malloc (n_buckets * sizeof (QuadTableEntry) + n_buckets + QUAD_TABLE_GROUP_WIDTH);
+  table->ctrl = (guint8 *)(table->entries + n_buckets);
+  table->n_buckets = n_buckets;
+  table->growth_left = quad_table_max_items (n_buckets) - table->n_items;
+  memset (table->ctrl, QUAD_TABLE_CTRL_EMPTY, n_buckets + QUAD_TABLE_GROUP_WIDTH);
+
+  /* The hashes are stored, so this never looks at the keys */
+  for (gsize i = 0; i < old_n_buckets; i++)
+    {
+      gsize index;
+
+      if (old_ctrl[i] & 0x80)
+        continue;
+
+      index = quad_table_find_free (table, old_entries[i].hash);
+      quad_table_set_ctrl (table, index, quad_table_h2 (old_entries[i].hash));
+      table->entries[index] = old_entries[i];
+    }
+
+  if (old_n_buckets != 0)
+    g_free (old_entries);
+}
+
+/* Makes room for one more item, either by dropping the deleted
+ * buckets, or if the table is too full for that, by doubling it */
+static void
+quad_table_grow (QuadTable *table)
+{
+  gsize n_buckets = MAX (table->n_buckets, QUAD_TABLE_MIN_BUCKETS);
+
+  while ((table->n_items + 1) * 2 > quad_table_max_items (n_buckets))
+    n_buckets *= 2;
+
+  quad_table_resize (table, n_buckets);
+}
+
+static QuadTable *
+quad_table_new_internal (gboolean str_keys,
+                         GDestroyNotify key_destroy,
+                         GDestroyNotify value_destroy)
+{
+  QuadTable *table = g_new0 (QuadTable, 1);
+
+  /* Lookups in a new table read this instead of allocating */
+  table->ctrl = (guint8 *)empty_ctrl_group;
+  table->str_keys = str_keys;
+  table->key_destroy = key_destroy;
+  table->value_destroy = value_destroy;
+
+  return table;
+}
+
+/* Keys are compared by pointer, like g_direct_hash() */
+QuadTable *
+quad_table_new (GDestroyNotify key_destroy,
+                GDestroyNotify value_destroy)
+{
+  return quad_table_new_internal (FALSE, key_destroy, value_destroy);
+}
+
+/* Keys are nul-terminated strings, like g_str_hash() */
+QuadTable *
+quad_str_table_new (GDestroyNotify key_destroy,
+                    GDestroyNotify value_destroy)
+{
+  return quad_table_new_internal (TRUE, key_destroy, value_destroy);
+}
+
+static void
+quad_table_destroy_entry (QuadTable *table,
+                          QuadTableEntry *entry)
+{
+  if (table->key_destroy)
+    table->key_destroy (entry->key);
+  if (table->value_destroy)
+    table->value_destroy (entry->value);
+}
+
+void
+quad_table_remove_all (QuadTable *table)
+{
+  for (gsize i = 0; i < table->n_buckets; i++)
+    {
+      if ((table->ctrl[i] & 0x80) == 0)
+        quad_table_destroy_entry (table, &table->entries[i]);
+    }
+
+  if (table->n_buckets != 0)
+    {
+      table->n_items = 0;
+      table->growth_left = quad_table_max_items (table->n_buckets);
+      memset (table->ctrl, QUAD_TABLE_CTRL_EMPTY, table->n_buckets + QUAD_TABLE_GROUP_WIDTH);
+    }
+}
+
+void
+quad_table_free (QuadTable *table)
+{
+  quad_table_remove_all (table);
+  if (table->n_buckets != 0)
+    g_free (table->entries);
+  g_free (table);
+}
+
+gsize
+quad_table_size (QuadTable *table)
+{
+  return table->n_items;
+}
+
+gpointer
+quad_table_lookup (QuadTable *table,
+                   gconstpointer key)
+{
+  gsize index = quad_table_find (table, key, quad_table_hash (table, key));
+
+  if (index == G_MAXSIZE)
+    return NULL;
+
+  return table->entries[index].value;
+}
+
+gboolean
+quad_table_lookup_extended (QuadTable *table,
+                            gconstpointer key,
+                            gpointer *orig_key,
+                            gpointer *value)
+{
+  gsize index = quad_table_find (table, key, quad_table_hash (table, key));
+
+  if (index == G_MAXSIZE)
+    return FALSE;
+
+  if (orig_key)
+    *orig_key = table->entries[index].key;
+  if (value)
+    *value = table->entries[index].value;
+
+  return TRUE;
+}
+
+gboolean
+quad_table_contains (QuadTable *table,
+                     gconstpointer key)
+{
+  return quad_table_find (table, key, quad_table_hash (table, key)) != G_MAXSIZE;
+}
+
+/* Adds a key that is not in the table yet */
+static void
+quad_table_insert_new (QuadTable *table,
+                       gpointer key,
+                       gpointer value,
+                       guint64 hash)
+{
+  QuadTableEntry *entry;
+  gsize index;
+
+  index = table->n_buckets ? quad_table_find_free (table, hash) : 0;
+  if (table->growth_left == 0 && table->ctrl[index] != QUAD_TABLE_CTRL_DELETED)
+    {
+      quad_table_grow (table);
+      index = quad_table_find_free (table, hash);
+    }
+
+  if (table->ctrl[index] == QUAD_TABLE_CTRL_EMPTY)
+    table->growth_left--;
+  quad_table_set_ctrl (table, index, quad_table_h2 (hash));
+
+  entry = &table->entries[index];
+  entry->hash = hash;
+  entry->key = key;
+  entry->value = value;
+  table->n_items++;
+}
+
+/* Like g_hash_table_insert(), if the key is already there its value is
+ * replaced, and the new key is destroyed. Returns TRUE if it was not */
+gboolean
+quad_table_insert (QuadTable *table,
+                   gpointer key,
+                   gpointer value)
+{
+  guint64 hash = quad_table_hash (table, key);
+  gsize index = quad_table_find (table, key, hash);
+
+  if (index != G_MAXSIZE)
+    {
+      QuadTableEntry *entry = &table->entries[index];
+
+      if (table->key_destroy && key != entry->key)
+        table->key_destroy (key);
+      if (table->value_destroy && value != entry->value)
+        table->value_destroy (entry->value);
+      entry->value = value;
+      return FALSE;
+    }
+
+  quad_table_insert_new (table, key, value, hash);
+
+  return TRUE;
+}
+
+/* For using the table as a set, like g_hash_table_add(). The value
+ * of each key is the key itself, so the table must not have a
+ * value_destroy */
+gboolean
+quad_table_add (QuadTable *table,
+                gpointer key)
+{
+  guint64 hash = quad_table_hash (table, key);
+  gsize index = quad_table_find (table, key, hash);
+
+  if (index != G_MAXSIZE)
+    {
+      if (table->key_destroy && key != table->entries[index].key)
+        table->key_destroy (key);
+      return FALSE;
+    }
+
+  quad_table_insert_new (table, key, key, hash);
+
+  return TRUE;
+}
+
+static void
+quad_table_remove_index (QuadTable *table,
+                         gsize index)
+{
+  gsize mask = table->n_buckets - 1;
+  gsize before = (index - QUAD_TABLE_GROUP_WIDTH) & mask;
+  guint64 empty_before = quad_table_match_empty (quad_table_load_group (table->ctrl + before));
+  guint64 empty_after = quad_table_match_empty (quad_table_load_group (table->ctrl + index));
+
+  /* If no group that contains the bucket was ever full, no probe
+   * sequence went past it, so it can be made empty again */
+  if (empty_before != 0 && empty_after != 0 &&
+      quad_table_match_first (empty_after) + (__builtin_clzll (empty_before) >> 3) < QUAD_TABLE_GROUP_WIDTH)
+    {
+      quad_table_set_ctrl (table, index, QUAD_TABLE_CTRL_EMPTY);
+      table->growth_left++;
+    }
+  else
+    quad_table_set_ctrl (table, index, QUAD_TABLE_CTRL_DELETED);
+
+  table->n_items--;
+}
+
+gboolean
+quad_table_remove (QuadTable *table,
+                   gconstpointer key)
+{
+  gsize index = quad_table_find (table, key, quad_table_hash (table, key));
+
+  if (index == G_MAXSIZE)
+    return FALSE;
+
+  quad_table_destroy_entry (table, &table->entries[index]);
+  quad_table_remove_index (table, index);
+
+  return TRUE;
+}
+
+/* Returns the keys in iteration order, and the number of them in
+ * n_keys. The array is NULL terminated and owned by the caller, the
+ * keys are owned by the table */
+gpointer *
+quad_table_get_keys (QuadTable *table,
+                     gsize *n_keys)
+{
+  gpointer *keys = g_new (gpointer, table->n_items + 1);
+  gsize n = 0;
+
+  for (gsize i = 0; i < table->n_buckets; i++)
+    {
+      if ((table->ctrl[i] & 0x80) == 0)
+        keys[n++] = table->entries[i].key;
+    }
+  keys[n] = NULL;
+
+  if (n_keys)
+    *n_keys = n;
+
+  return keys;
+}
+
+/* The table must not be modified during iteration, other than with
+ * quad_table_iter_remove() */
+void
+quad_table_iter_init (QuadTableIter *iter,
+                      QuadTable *table)
+{
+  iter->table = table;
+  iter->index = G_MAXSIZE;
+}
+
+gboolean
+quad_table_iter_next (QuadTableIter *iter,
+                      gpointer *key,
+                      gpointer *value)
+{
+  QuadTable *table = iter->table;
+
+  for (iter->index++; iter->index < table->n_buckets; iter->index++)
+    {
+      if ((table->ctrl[iter->index] & 0x80) == 0)
+        {
+          if (key)
+            *key = table->entries[iter->index].key;
+          if (value)
+            *value = table->entries[iter->index].value;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Removes the item last returned by quad_table_iter_next() */
+void
+quad_table_iter_remove (QuadTableIter *iter)
+{
+  QuadTable *table = iter->table;
+
+  quad_table_destroy_entry (table, &table->entries[iter->index]);
+  quad_table_remove_index (table, iter->index);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glib.h>
+#include <sys/uio.h>
 
 G_BEGIN_DECLS
 
@@ -28,7 +29,28 @@ typedef struct {
   guint32 n_ranges;
 } QuadRanges;
 
-const char **         quad_get_unit_dirs           (gboolean        user);
+/* A borrowed string, not nul-terminated */
+typedef struct {
+  const char *str;
+  gsize len;
+} QuadStrView;
+
+typedef struct {
+  guint64 h1;
+  guint64 h2;
+} QuadHash128;
+
+/* Bump allocator, all memory is released at once when the last reference is dropped */
+typedef struct QuadArena QuadArena;
+
+/* Open addressing hash table, keyed by pointer or by string */
+typedef struct QuadTable QuadTable;
+
+typedef struct {
+  QuadTable *table;
+  gsize index;
+} QuadTableIter;
+
 char *                quad_replace_extension       (const char     *name,
                                                     const char     *extension,
                                                     const char     *extra_prefix,
@@ -49,15 +71,22 @@ gboolean              quad_fail                    (GError **error,
 void                  quad_logv                    (const char     *fmt,
                                                     va_list         args);
 void                  quad_log                     (const char *fmt, ...) G_GNUC_PRINTF (1,2);
-void                  quad_enable_debug            (void);
-void                  quad_debug                   (const char *fmt, ...) G_GNUC_PRINTF (1,2);
+
+gboolean              quad_writev_all              (int                 fd,
+                                                    const struct iovec *iov,
+                                                    gsize               n_iov,
+                                                    GError            **error);
+gboolean              quad_write_all               (int                 fd,
+                                                    const char         *data,
+                                                    gsize               len,
+                                                    GError            **error);
 
 uid_t                 quad_lookup_host_uid         (const char *user,
                                                     GError    **error);
 gid_t                 quad_lookup_host_gid         (const char *group,
                                                     GError    **error);
-QuadRanges *          quad_lookup_host_subuid      (const char *user);
-QuadRanges *          quad_lookup_host_subgid      (const char *user);
+QuadRanges *          quad_lookup_subid            (char      **lines,
+                                                    const char *user);
 
 char *                canonicalize_relative_path   (const char *filename);
 
@@ -79,6 +108,77 @@ guint32 quad_ranges_length (QuadRanges *ranges);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadRanges, quad_ranges_free)
 
+QuadArena *quad_arena_new (gsize chunk_size);
+QuadArena *quad_arena_ref (QuadArena *arena);
+void quad_arena_unref (QuadArena *arena);
+void quad_arena_reserve (QuadArena *arena,
+                         gsize size);
+gpointer quad_arena_alloc (QuadArena *arena,
+                           gsize size);
+char *quad_arena_strndup (QuadArena *arena,
+                          const char *str,
+                          gsize len);
+char *quad_arena_strdup (QuadArena *arena,
+                         const char *str);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadArena, quad_arena_unref)
+
+gboolean quad_str_view_equal (QuadStrView view,
+                              const char *str);
+gboolean quad_str_view_equal_ascii_nocase (QuadStrView view,
+                                           const char *str);
+
+const char *quad_scan_line (const char *line,
+                            const char *end,
+                            const char **first_eq);
+const char *quad_scan_line_generic (const char *line,
+                                    const char *end,
+                                    const char **first_eq);
+
+const char *quad_intern_len (const char *str,
+                             gsize len);
+const char *quad_intern_lookup (const char *str);
+
+guint64 quad_hash64 (gconstpointer data,
+                     gsize len);
+QuadHash128 quad_hash128 (gconstpointer data,
+                          gsize len,
+                          guint64 seed);
+char *quad_hash128_to_string (QuadHash128 hash);
+
+QuadTable *quad_table_new (GDestroyNotify key_destroy,
+                           GDestroyNotify value_destroy);
+QuadTable *quad_str_table_new (GDestroyNotify key_destroy,
+                               GDestroyNotify value_destroy);
+void quad_table_free (QuadTable *table);
+gsize quad_table_size (QuadTable *table);
+gpointer quad_table_lookup (QuadTable *table,
+                            gconstpointer key);
+gboolean quad_table_lookup_extended (QuadTable *table,
+                                     gconstpointer key,
+                                     gpointer *orig_key,
+                                     gpointer *value);
+gboolean quad_table_contains (QuadTable *table,
+                              gconstpointer key);
+gboolean quad_table_insert (QuadTable *table,
+                            gpointer key,
+                            gpointer value);
+gboolean quad_table_add (QuadTable *table,
+                         gpointer key);
+gboolean quad_table_remove (QuadTable *table,
+                            gconstpointer key);
+void quad_table_remove_all (QuadTable *table);
+gpointer *quad_table_get_keys (QuadTable *table,
+                               gsize *n_keys);
+void quad_table_iter_init (QuadTableIter *iter,
+                           QuadTable *table);
+gboolean quad_table_iter_next (QuadTableIter *iter,
+                               gpointer *key,
+                               gpointer *value);
+void quad_table_iter_remove (QuadTableIter *iter);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadTable, quad_table_free)
+
 #define _QUAD_CONCAT(a, b)  a##b
 #define _QUAD_CONCAT_INDIRECT(a, b) _QUAD_CONCAT(a, b)
 #define _QUAD_MAKE_ANONYMOUS(a) _QUAD_CONCAT_INDIRECT(a, __COUNTER__)
@@ -149,5 +249,21 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadRanges, quad_ranges_free)
          _QUAD_MAKE_ANONYMOUS(_glnx_ht_iter_it_), kt, k, \
          gpointer, _QUAD_MAKE_ANONYMOUS(_glnx_ht_iter_v_))
 
+#define _QUAD_TABLE_FOREACH_IMPL_KV(guard, table, it, kt, k, vt, v)           \
+    gboolean guard = TRUE;                                                     \
+    G_STATIC_ASSERT (sizeof (kt) == sizeof (void*));                           \
+    G_STATIC_ASSERT (sizeof (vt) == sizeof (void*));                           \
+    for (QuadTableIter it;                                                     \
+         guard && ({ quad_table_iter_init (&it, table), TRUE; });              \
+         guard = FALSE)                                                        \
+            for (kt k; guard; guard = FALSE)                                   \
+                for (vt v; quad_table_iter_next (&it, (gpointer)&k, (gpointer)&v);)
+
+/* The same as QUAD_HASH_TABLE_FOREACH_KV, for a QuadTable */
+#define QUAD_TABLE_FOREACH_KV(table, kt, k, vt, v) \
+    _QUAD_TABLE_FOREACH_IMPL_KV( \
+         _QUAD_MAKE_ANONYMOUS(_quad_table_iter_guard_), table, \
+         _QUAD_MAKE_ANONYMOUS(_quad_table_iter_it_), kt, k, vt, v)
+
 
 G_END_DECLS
@@ -0,0 +1,682 @@
+#include "quadlet-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "utils.h"
+#include "writer.h"
+
+/* A write or symlink that is done by quad_writer_flush() */
+typedef struct {
+  char *name;
+  char *target; /* For symlinks */
+  GBytes *data; /* For files */
+  char *tmp_name;
+  int fd;
+  int result;
+  gboolean done;
+} QueuedOp;
+
+struct QuadWriter {
+  char *path;
+  int fd;
+  gboolean sync;
+  QuadTable *dirs; /* Directories that were created or already existed */
+  GPtrArray *queued_files;
+  GPtrArray *queued_symlinks;
+  QuadTable *queued_names; /* Of the symlinks */
+};
+
+static void
+queued_op_free (QueuedOp *op)
+{
+  g_free (op->name);
+  g_free (op->target);
+  if (op->data != NULL)
+    g_bytes_unref (op->data);
+  g_free (op->tmp_name);
+  g_free (op);
+}
+
+static void
+set_error_from_errno (GError **error,
+                      int errsv,
+                      QuadWriter *writer,
+                      const char *name,
+                      const char *what)
+{
+  g_autofree char *path = g_build_filename (writer->path, name, NULL);
+
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+               "Failed to %s '%s': %s", what, path, g_strerror (errsv));
+}
+
+QuadWriter *
+quad_writer_new (const char *path,
+                 GError **error)
+{
+  g_autoptr(QuadWriter) writer = g_new0 (QuadWriter, 1);
+  struct statfs buf;
+
+  writer->path = g_strdup (path);
+  writer->dirs = quad_str_table_new (g_free, NULL);
+  writer->queued_files = g_ptr_array_new_with_free_func ((GDestroyNotify)queued_op_free);
+  writer->queued_symlinks = g_ptr_array_new_with_free_func ((GDestroyNotify)queued_op_free);
+  writer->queued_names = quad_str_table_new (NULL, NULL);
+  writer->fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (writer->fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open '%s': %s", path, g_strerror (errsv));
+      return NULL;
+    }
+
+  /* Nothing on tmpfs survives a crash, so there is no point in syncing */
+  writer->sync = TRUE;
+  if (fstatfs (writer->fd, &buf) == 0 &&
+      (buf.f_type == TMPFS_MAGIC || buf.f_type == RAMFS_MAGIC))
+    writer->sync = FALSE;
+
+  return g_steal_pointer (&writer);
+}
+
+void
+quad_writer_free (QuadWriter *writer)
+{
+  if (writer->fd >= 0)
+    close (writer->fd);
+  g_clear_pointer (&writer->dirs, quad_table_free);
+  g_clear_pointer (&writer->queued_names, quad_table_free);
+  g_clear_pointer (&writer->queued_files, g_ptr_array_unref);
+  g_clear_pointer (&writer->queued_symlinks, g_ptr_array_unref);
+  g_free (writer->path);
+  g_free (writer);
+}
+
+const char *
+quad_writer_get_path (QuadWriter *writer)
+{
+  return writer->path;
+}
+
+gboolean
+quad_writer_get_sync (QuadWriter *writer)
+{
+  return writer->sync;
+}
+
+void
+quad_writer_set_sync (QuadWriter *writer,
+                      gboolean sync)
+{
+  writer->sync = sync;
+}
+
+/* Like mkstemp(), but relative to the directory. Returns the fd and
+ * sets tmp_name */
+static int
+open_tmp (QuadWriter *writer,
+          const char *name,
+          char **tmp_name,
+          GError **error)
+{
+  int errsv = EEXIST;
+
+  for (guint i = 0; i < 100; i++)
+    {
+      g_autofree char *tmp = g_strdup_printf ("%s.%08x", name, g_random_int ());
+      int fd = openat (writer->fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+      if (fd >= 0)
+        {
+          *tmp_name = g_steal_pointer (&tmp);
+          return fd;
+        }
+
+      errsv = errno;
+      if (errsv != EEXIST)
+        break;
+    }
+
+  set_error_from_errno (error, errsv, writer, name, "create temporary file for");
+  return -1;
+}
+
+static gboolean
+rename_tmp (QuadWriter *writer,
+            const char *tmp_name,
+            const char *name,
+            GError **error)
+{
+  if (renameat (writer->fd, tmp_name, writer->fd, name) < 0)
+    {
+      set_error_from_errno (error, errno, writer, name, "rename to");
+      unlinkat (writer->fd, tmp_name, 0);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Calls func to write the contents of name to an fd */
+gboolean
+quad_writer_write (QuadWriter *writer,
+                   const char *name,
+                   QuadWriteFunc func,
+                   gpointer user_data,
+                   GError **error)
+{
+  g_autofree char *tmp_name = NULL;
+  int fd;
+
+  fd = open_tmp (writer, name, &tmp_name, error);
+  if (fd < 0)
+    return FALSE;
+
+  if (!func (fd, user_data, error))
+    {
+      close (fd);
+      unlinkat (writer->fd, tmp_name, 0);
+      return FALSE;
+    }
+
+  if (writer->sync && fsync (fd) < 0)
+    {
+      set_error_from_errno (error, errno, writer, name, "sync");
+      close (fd);
+      unlinkat (writer->fd, tmp_name, 0);
+      return FALSE;
+    }
+
+  if (!g_close (fd, error))
+    {
+      unlinkat (writer->fd, tmp_name, 0);
+      return FALSE;
+    }
+
+  return rename_tmp (writer, tmp_name, name, error);
+}
+
+typedef struct {
+  const char *data;
+  gsize len;
+} WriteData;
+
+static gboolean
+write_data (int fd,
+            gpointer user_data,
+            GError **error)
+{
+  WriteData *data = user_data;
+
+  return quad_write_all (fd, data->data, data->len, error);
+}
+
+gboolean
+quad_writer_write_data (QuadWriter *writer,
+                        const char *name,
+                        const char *data,
+                        gsize len,
+                        GError **error)
+{
+  WriteData write = { data, len };
+
+  return quad_writer_write (writer, name, write_data, &write, error);
+}
+
+/* Creates the directories leading up to name, each only once */
+static gboolean
+ensure_parent_dirs (QuadWriter *writer,
+                    const char *name,
+                    GError **error)
+{
+  const char *slash = strrchr (name, '/');
+  g_autofree char *dir = NULL;
+
+  if (slash == NULL)
+    return TRUE;
+
+  dir = g_strndup (name, slash - name);
+  if (quad_table_contains (writer->dirs, dir))
+    return TRUE;
+
+  if (!ensure_parent_dirs (writer, dir, error))
+    return FALSE;
+
+  if (mkdirat (writer->fd, dir, 0755) < 0 && errno != EEXIST)
+    {
+      set_error_from_errno (error, errno, writer, dir, "create directory");
+      return FALSE;
+    }
+
+  quad_table_add (writer->dirs, g_steal_pointer (&dir));
+  return TRUE;
+}
+
+/* Fails with G_FILE_ERROR_EXIST if name already exists */
+gboolean
+quad_writer_symlink (QuadWriter *writer,
+                     const char *target,
+                     const char *name,
+                     GError **error)
+{
+  if (!ensure_parent_dirs (writer, name, error))
+    return FALSE;
+
+  if (symlinkat (target, writer->fd, name) < 0)
+    {
+      set_error_from_errno (error, errno, writer, name, "create symlink");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Queued files and symlinks are only written by quad_writer_flush() */
+void
+quad_writer_queue_data (QuadWriter *writer,
+                        const char *name,
+                        GBytes *data)
+{
+  QueuedOp *op = g_new0 (QueuedOp, 1);
+
+  op->name = g_strdup (name);
+  op->data = g_bytes_ref (data);
+  op->fd = -1;
+  g_ptr_array_add (writer->queued_files, op);
+}
+
+/* Only the first symlink with a name is created, and none that already
+ * exist are replaced */
+void
+quad_writer_queue_symlink (QuadWriter *writer,
+                           const char *target,
+                           const char *name)
+{
+  QueuedOp *op;
+
+  if (quad_table_contains (writer->queued_names, name))
+    return;
+
+  op = g_new0 (QueuedOp, 1);
+  op->name = g_strdup (name);
+  op->target = g_strdup (target);
+  op->fd = -1;
+  g_ptr_array_add (writer->queued_symlinks, op);
+  quad_table_add (writer->queued_names, op->name);
+}
+
+static void
+fail_op (QuadWriter *writer,
+         QueuedOp *op,
+         int errsv,
+         const char *what,
+         QuadWriteErrorFunc func,
+         gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  set_error_from_errno (&error, errsv, writer, op->name, what);
+  func (op->name, op->target, error, user_data);
+  op->done = TRUE;
+}
+
+static void
+discard_tmp (QuadWriter *writer,
+             QueuedOp *op)
+{
+  if (op->fd >= 0)
+    close (op->fd);
+  op->fd = -1;
+  unlinkat (writer->fd, op->tmp_name, 0);
+}
+
+static void
+write_file_sync (QuadWriter *writer,
+                 QueuedOp *op,
+                 QuadWriteErrorFunc func,
+                 gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gsize len;
+  const char *data = g_bytes_get_data (op->data, &len);
+
+  if (!quad_writer_write_data (writer, op->name, data, len, &error))
+    func (op->name, op->target, error, user_data);
+  op->done = TRUE;
+}
+
+/* Writes what a short write left out */
+static gboolean
+finish_write (QuadWriter *writer,
+              QueuedOp *op,
+              const char *data,
+              gsize len,
+              GError **error)
+{
+  if (lseek (op->fd, op->result, SEEK_SET) < 0)
+    {
+      set_error_from_errno (error, errno, writer, op->name, "write");
+      return FALSE;
+    }
+
+  return quad_write_all (op->fd, data + op->result, len - op->result, error);
+}
+
+/* Writes what the ring left undone when it failed, after discarding
+ * the temporary files. Once the files were handed to the ring to
+ * close, they are not closed again, as they may have been already */
+static void
+finish_files_sync (QuadWriter *writer,
+                   QueuedOp **ops,
+                   guint n_ops,
+                   gboolean close_fds,
+                   QuadWriteErrorFunc func,
+                   gpointer user_data)
+{
+  for (guint i = 0; i < n_ops; i++)
+    {
+      if (ops[i]->done)
+        continue;
+
+      if (!close_fds)
+        ops[i]->fd = -1;
+      discard_tmp (writer, ops[i]);
+      write_file_sync (writer, ops[i], func, user_data);
+    }
+}
+
+/* The same steps as quad_writer_write(), each one a batch. Anything
+ * unexpected, like a short write, is finished synchronously, and so is
+ * all of the batch if the ring fails, in which case this returns
+ * FALSE */
+static gboolean
+flush_files_batch (QuadWriter *writer,
+                   QuadUring *ring,
+                   QueuedOp **ops,
+                   guint n_ops,
+                   QuadWriteErrorFunc func,
+                   gpointer user_data)
+{
+  for (guint i = 0; i < n_ops; i++)
+    {
+      ops[i]->tmp_name = g_strdup_printf ("%s.%08x", ops[i]->name, g_random_int ());
+      quad_uring_openat (ring, writer->fd, ops[i]->tmp_name,
+                         O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666, &ops[i]->fd);
+    }
+  if (!quad_uring_run (ring, NULL))
+    {
+      finish_files_sync (writer, ops, n_ops, TRUE, func, user_data);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < n_ops; i++)
+    {
+      gsize len;
+      const char *data = g_bytes_get_data (ops[i]->data, &len);
+
+      if (ops[i]->fd < 0)
+        {
+          ops[i]->fd = -1;
+          write_file_sync (writer, ops[i], func, user_data);
+        }
+      else
+        quad_uring_write (ring, ops[i]->fd, data, len, 0, &ops[i]->result);
+    }
+  if (!quad_uring_run (ring, NULL))
+    {
+      finish_files_sync (writer, ops, n_ops, TRUE, func, user_data);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < n_ops; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      gsize len;
+      const char *data = g_bytes_get_data (ops[i]->data, &len);
+
+      if (ops[i]->done)
+        continue;
+
+      if (ops[i]->result < 0)
+        {
+          discard_tmp (writer, ops[i]);
+          fail_op (writer, ops[i], -ops[i]->result, "write", func, user_data);
+        }
+      else if ((gsize)ops[i]->result < len &&
+               !finish_write (writer, ops[i], data, len, &error))
+        {
+          discard_tmp (writer, ops[i]);
+          func (ops[i]->name, ops[i]->target, error, user_data);
+          ops[i]->done = TRUE;
+        }
+      else if (writer->sync)
+        quad_uring_fsync (ring, ops[i]->fd, &ops[i]->result);
+    }
+
+  if (writer->sync)
+    {
+      if (!quad_uring_run (ring, NULL))
+        {
+          finish_files_sync (writer, ops, n_ops, TRUE, func, user_data);
+          return FALSE;
+        }
+
+      for (guint i = 0; i < n_ops; i++)
+        if (!ops[i]->done && ops[i]->result < 0)
+          {
+            discard_tmp (writer, ops[i]);
+            fail_op (writer, ops[i], -ops[i]->result, "sync", func, user_data);
+          }
+    }
+
+  for (guint i = 0; i < n_ops; i++)
+    if (!ops[i]->done)
+      quad_uring_close (ring, ops[i]->fd, &ops[i]->result);
+  if (!quad_uring_run (ring, NULL))
+    {
+      finish_files_sync (writer, ops, n_ops, FALSE, func, user_data);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < n_ops; i++)
+    {
+      if (ops[i]->done)
+        continue;
+
+      ops[i]->fd = -1;
+      if (ops[i]->result < 0)
+        {
+          discard_tmp (writer, ops[i]);
+          fail_op (writer, ops[i], -ops[i]->result, "close", func, user_data);
+        }
+      else
+        quad_uring_renameat (ring, writer->fd, ops[i]->tmp_name, writer->fd, ops[i]->name,
+                             &ops[i]->result);
+    }
+  if (!quad_uring_run (ring, NULL))
+    {
+      /* The files that were renamed are in place */
+      for (guint i = 0; i < n_ops; i++)
+        if (ops[i]->result == 0)
+          ops[i]->done = TRUE;
+      finish_files_sync (writer, ops, n_ops, FALSE, func, user_data);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < n_ops; i++)
+    if (!ops[i]->done && ops[i]->result < 0)
+      {
+        discard_tmp (writer, ops[i]);
+        fail_op (writer, ops[i], -ops[i]->result, "rename to", func, user_data);
+      }
+
+  return TRUE;
+}
+
+static guint
+get_depth (const char *path)
+{
+  guint depth = 0;
+
+  while ((path = strchr (path, '/')) != NULL)
+    {
+      path++;
+      depth++;
+    }
+
+  return depth;
+}
+
+static int
+compare_depth (gconstpointer a,
+               gconstpointer b)
+{
+  return (int)get_depth (*(const char **)a) - (int)get_depth (*(const char **)b);
+}
+
+static void
+symlink_sync (QuadWriter *writer,
+              QueuedOp *op,
+              QuadWriteErrorFunc func,
+              gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!quad_writer_symlink (writer, op->target, op->name, &error) &&
+      !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_EXIST))
+    func (op->name, op->target, error, user_data);
+  op->done = TRUE;
+}
+
+/* Directories are created before the symlinks in them, and parents
+ * before their children, so each level is a batch. Returns FALSE if
+ * the ring failed, with the symlinks it didn't create left undone */
+static gboolean
+flush_symlinks (QuadWriter *writer,
+                QuadUring *ring,
+                QuadWriteErrorFunc func,
+                gpointer user_data)
+{
+  g_autoptr(GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(QuadTable) new_dirs = quad_str_table_new (NULL, NULL);
+  g_autofree int *results = NULL;
+  guint batch = quad_uring_get_size (ring);
+  gboolean ok;
+
+  for (guint i = 0; i < writer->queued_symlinks->len; i++)
+    {
+      QueuedOp *op = g_ptr_array_index (writer->queued_symlinks, i);
+      const char *slash = op->name;
+
+      while ((slash = strchr (slash, '/')) != NULL)
+        {
+          g_autofree char *dir = g_strndup (op->name, slash - op->name);
+
+          if (!quad_table_contains (writer->dirs, dir) && !quad_table_contains (new_dirs, dir))
+            {
+              quad_table_add (new_dirs, dir);
+              g_ptr_array_add (dirs, g_steal_pointer (&dir));
+            }
+          slash++;
+        }
+    }
+  g_ptr_array_sort (dirs, compare_depth);
+
+  results = g_new0 (int, dirs->len);
+  for (guint start = 0; start < dirs->len;)
+    {
+      guint depth = get_depth (g_ptr_array_index (dirs, start));
+      guint end = start;
+
+      while (end < dirs->len && end - start < batch &&
+             get_depth (g_ptr_array_index (dirs, end)) == depth)
+        {
+          quad_uring_mkdirat (ring, writer->fd, g_ptr_array_index (dirs, end), 0755, &results[end]);
+          end++;
+        }
+      if (!quad_uring_run (ring, NULL))
+        return FALSE;
+
+      /* Failures show up as the symlinks failing */
+      for (guint i = start; i < end; i++)
+        if (results[i] == 0 || results[i] == -EEXIST)
+          quad_table_add (writer->dirs, g_strdup (g_ptr_array_index (dirs, i)));
+
+      start = end;
+    }
+
+  for (guint start = 0; start < writer->queued_symlinks->len; start += batch)
+    {
+      guint end = MIN (start + batch, writer->queued_symlinks->len);
+
+      for (guint i = start; i < end; i++)
+        {
+          QueuedOp *op = g_ptr_array_index (writer->queued_symlinks, i);
+          if (!quad_uring_symlinkat (ring, op->target, writer->fd, op->name, &op->result))
+            op->result = -ECANCELED;
+        }
+      ok = quad_uring_run (ring, NULL);
+
+      for (guint i = start; i < end; i++)
+        {
+          QueuedOp *op = g_ptr_array_index (writer->queued_symlinks, i);
+
+          if (op->result == 0 || op->result == -EEXIST)
+            op->done = TRUE;
+          else if (ok)
+            fail_op (writer, op, -op->result, "create symlink", func, user_data);
+        }
+
+      if (!ok)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Writes all queued files, then creates the queued symlinks, in batches
+ * on the ring if there is one, and calls func for every one that
+ * fails. If the ring fails, the rest is done without it */
+void
+quad_writer_flush (QuadWriter *writer,
+                   QuadUring *ring,
+                   QuadWriteErrorFunc func,
+                   gpointer user_data)
+{
+  QueuedOp **files = (QueuedOp **)writer->queued_files->pdata;
+  guint i = 0;
+
+  while (ring != NULL && i < writer->queued_files->len)
+    {
+      guint n = MIN (quad_uring_get_size (ring), writer->queued_files->len - i);
+
+      if (!flush_files_batch (writer, ring, files + i, n, func, user_data))
+        ring = NULL;
+      i += n;
+    }
+  for (; i < writer->queued_files->len; i++)
+    write_file_sync (writer, files[i], func, user_data);
+
+  if (ring == NULL || !flush_symlinks (writer, ring, func, user_data))
+    {
+      for (i = 0; i < writer->queued_symlinks->len; i++)
+        {
+          QueuedOp *op = g_ptr_array_index (writer->queued_symlinks, i);
+
+          if (!op->done)
+            symlink_sync (writer, op, func, user_data);
+        }
+    }
+
+  quad_table_remove_all (writer->queued_names);
+  g_ptr_array_set_size (writer->queued_files, 0);
+  g_ptr_array_set_size (writer->queued_symlinks, 0);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <glib.h>
+#include <uring.h>
+
+G_BEGIN_DECLS
+
+/* Writes files into an output directory that is opened once, with all
+ * paths relative to it. Files are written to a temporary name and
+ * renamed into place, and are only synced when the directory is not on
+ * tmpfs, where syncing does nothing but cost time.
+ *
+ * Files can be written from any thread, but directories and symlinks
+ * must be created, and writes queued and flushed, from one thread at a
+ * time */
+typedef struct QuadWriter QuadWriter;
+
+typedef gboolean (*QuadWriteFunc) (int        fd,
+                                   gpointer   user_data,
+                                   GError   **error);
+/* target is NULL if name is a file, and the target of the symlink
+ * otherwise */
+typedef void     (*QuadWriteErrorFunc) (const char   *name,
+                                        const char   *target,
+                                        const GError *error,
+                                        gpointer      user_data);
+
+QuadWriter *   quad_writer_new              (const char     *path,
+                                             GError        **error);
+void           quad_writer_free             (QuadWriter     *writer);
+
+const char *   quad_writer_get_path         (QuadWriter     *writer);
+gboolean       quad_writer_get_sync         (QuadWriter     *writer);
+void           quad_writer_set_sync         (QuadWriter     *writer,
+                                             gboolean        sync);
+
+gboolean       quad_writer_write            (QuadWriter     *writer,
+                                             const char     *name,
+                                             QuadWriteFunc   func,
+                                             gpointer        user_data,
+                                             GError        **error);
+gboolean       quad_writer_write_data       (QuadWriter     *writer,
+                                             const char     *name,
+                                             const char     *data,
+                                             gsize           len,
+                                             GError        **error);
+gboolean       quad_writer_symlink          (QuadWriter     *writer,
+                                             const char     *target,
+                                             const char     *name,
+                                             GError        **error);
+
+void           quad_writer_queue_data       (QuadWriter     *writer,
+                                             const char     *name,
+                                             GBytes         *data);
+void           quad_writer_queue_symlink    (QuadWriter     *writer,
+                                             const char     *target,
+                                             const char     *name);
+void           quad_writer_flush            (QuadWriter     *writer,
+                                             QuadUring      *ring,
+                                             QuadWriteErrorFunc func,
+                                             gpointer        user_data);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QuadWriter, quad_writer_free)
+
+G_END_DECLS
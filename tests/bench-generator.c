@@ -0,0 +1,272 @@
+#include <glib.h>
+#include <uring.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Runs the generator on a large tree of units with each I/O backend,
+ * once with the sources and the unit directory out of the page cache
+ * and once with them in it. The output goes to tmpfs, like /run for the
+ * real generator, so writeback doesn't hide the reads. Reading the
+ * sources is also timed on its own. Run with meson test --benchmark */
+
+#define N_UNITS 10000
+#define N_RUNS 3
+#define URING_ENTRIES 256
+
+static const char *unit_template =
+  "[Unit]\n"
+  "Description=Benchmark container %u\n"
+  "\n"
+  "[Container]\n"
+  "Image=registry.example.com/bench/image-%u:latest\n"
+  "Exec=/usr/bin/sleep infinity\n"
+  "Environment=UNIT=%u\n"
+  "PublishPort=%u:80\n"
+  "Volume=/srv/bench-%u:/data\n"
+  "\n"
+  "[Service]\n"
+  "Restart=always\n";
+
+static void
+remove_dir (const char *path)
+{
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+        remove_dir (child);
+      else
+        unlink (child);
+    }
+  rmdir (path);
+}
+
+static char *
+make_units (const char *base_dir)
+{
+  char *unit_dir = g_build_filename (base_dir, "units", NULL);
+
+  g_mkdir_with_parents (unit_dir, 0755);
+  for (guint i = 0; i < N_UNITS; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("bench-%05u.container", i);
+      g_autofree char *path = g_build_filename (unit_dir, name, NULL);
+      g_autoptr(GString) data = g_string_new (NULL);
+
+      g_string_printf (data, unit_template, i, i, i, 10000 + i, i);
+      /* Some are enabled, so symlinks are part of the output */
+      if (i % 4 == 0)
+        g_string_append (data, "\n[Install]\nWantedBy=multi-user.target default.target\n");
+
+      if (!g_file_set_contents (path, data->str, data->len, NULL))
+        g_error ("Failed to write %s", path);
+    }
+
+  return unit_dir;
+}
+
+/* Dropping all caches needs root, otherwise only the contents of the
+ * sources are evicted, and their inodes stay cached */
+static gboolean
+drop_caches (const char *unit_dir)
+{
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  int fd;
+
+  fd = open ("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      gboolean dropped = write (fd, "3", 1) == 1;
+      close (fd);
+      if (dropped)
+        return TRUE;
+    }
+
+  dir = g_dir_open (unit_dir, 0, NULL);
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = g_build_filename (unit_dir, name, NULL);
+
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0)
+        {
+          posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+          close (fd);
+        }
+    }
+
+  return FALSE;
+}
+
+/* Where the output goes, the generator writes to /run */
+static char *
+make_out_dir (void)
+{
+  const char *runtime_dir = g_getenv ("XDG_RUNTIME_DIR");
+  const char *tmpfs_dir = NULL;
+  g_autofree char *template = NULL;
+
+  if (g_file_test ("/dev/shm", G_FILE_TEST_IS_DIR) && access ("/dev/shm", W_OK) == 0)
+    tmpfs_dir = "/dev/shm";
+  else if (runtime_dir != NULL)
+    tmpfs_dir = runtime_dir;
+  else
+    tmpfs_dir = g_get_tmp_dir ();
+
+  template = g_build_filename (tmpfs_dir, "quadlet-bench-out-XXXXXX", NULL);
+  if (g_mkdtemp (template) == NULL)
+    g_error ("Failed to create output directory in %s", tmpfs_dir);
+
+  return g_steal_pointer (&template);
+}
+
+/* Returns the fastest of the runs in milliseconds */
+static double
+bench (const char *generator,
+       const char *out_dir,
+       const char *unit_dir,
+       const char *io,
+       gboolean cold)
+{
+  g_autofree char *io_arg = g_strconcat ("--io=", io, NULL);
+  g_auto(GStrv) envp = g_environ_setenv (g_get_environ (), "QUADLET_UNIT_DIRS", unit_dir, TRUE);
+  char *argv[] = { (char *)generator, "--no-cache", io_arg, (char *)out_dir, NULL };
+  gint64 best = G_MAXINT64;
+
+  for (guint run = 0; run < N_RUNS; run++)
+    {
+      g_autoptr(GError) error = NULL;
+      int status;
+      gint64 start;
+
+      /* So no run waits for the writeback of the one before */
+      g_mkdir_with_parents (out_dir, 0755);
+      sync ();
+      if (cold)
+        drop_caches (unit_dir);
+
+      start = g_get_monotonic_time ();
+      if (!g_spawn_sync (NULL, argv, envp,
+                         G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                         NULL, NULL, NULL, NULL, &status, &error))
+        g_error ("Failed to run %s: %s", generator, error->message);
+      best = MIN (best, g_get_monotonic_time () - start);
+
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        g_error ("%s failed", generator);
+
+      remove_dir (out_dir);
+    }
+
+  return best / 1000.0;
+}
+
+/* Like bench(), but only reads the sources, the way the generator does
+ * with each backend */
+static double
+bench_reads (QuadUring *ring,
+             const char *unit_dir,
+             GPtrArray *paths,
+             gboolean cold)
+{
+  gint64 best = G_MAXINT64;
+
+  for (guint run = 0; run < N_RUNS; run++)
+    {
+      g_autofree GBytes **contents = g_new0 (GBytes *, paths->len);
+      gint64 start;
+
+      if (cold)
+        drop_caches (unit_dir);
+
+      start = g_get_monotonic_time ();
+      if (ring != NULL)
+        quad_uring_read_files (ring, paths->len, (const char **)paths->pdata, G_MAXSIZE, contents);
+      else
+        for (guint i = 0; i < paths->len; i++)
+          {
+            char *data;
+            gsize len;
+
+            if (g_file_get_contents (g_ptr_array_index (paths, i), &data, &len, NULL))
+              contents[i] = g_bytes_new_take (data, len);
+          }
+      best = MIN (best, g_get_monotonic_time () - start);
+
+      for (guint i = 0; i < paths->len; i++)
+        {
+          if (contents[i] == NULL)
+            g_error ("Failed to read %s", (char *)g_ptr_array_index (paths, i));
+          g_bytes_unref (contents[i]);
+        }
+    }
+
+  return best / 1000.0;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  const char *backends[] = { "sync", "io_uring" };
+  g_autoptr(QuadUring) ring = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *base_dir = NULL;
+  g_autofree char *unit_dir = NULL;
+  g_autofree char *out_dir = NULL;
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s GENERATOR\n", argv[0]);
+      return 1;
+    }
+
+  ring = quad_uring_new (URING_ENTRIES, &error);
+  if (ring == NULL)
+    g_print ("io_uring is not available, only the synchronous backend is run: %s\n",
+             error->message);
+
+  base_dir = g_dir_make_tmp ("quadlet-bench-XXXXXX", NULL);
+  if (base_dir == NULL)
+    g_error ("Failed to create temporary directory");
+  unit_dir = make_units (base_dir);
+  out_dir = make_out_dir ();
+  for (guint i = 0; i < N_UNITS; i++)
+    g_ptr_array_add (paths, g_strdup_printf ("%s/bench-%05u.container", unit_dir, i));
+
+  g_print ("%u units, fastest of %u runs, output in %s%s\n", N_UNITS, N_RUNS, out_dir,
+           drop_caches (unit_dir) ? "" : ", cold runs only evict the sources");
+  g_print ("%-10s %-6s %-9s %10s %12s\n", "backend", "cache", "what", "time", "units/s");
+  for (guint i = 0; i < G_N_ELEMENTS (backends); i++)
+    {
+      if (ring == NULL && i > 0)
+        break;
+
+      for (int cold = 1; cold >= 0; cold--)
+        {
+          double ms = bench_reads (i > 0 ? ring : NULL, unit_dir, paths, cold);
+
+          g_print ("%-10s %-6s %-9s %7.1f ms %12.0f\n", backends[i], cold ? "cold" : "warm",
+                   "read", ms, N_UNITS * 1000.0 / ms);
+          ms = bench (argv[1], out_dir, unit_dir, backends[i], cold);
+          g_print ("%-10s %-6s %-9s %7.1f ms %12.0f\n", backends[i], cold ? "cold" : "warm",
+                   "generate", ms, N_UNITS * 1000.0 / ms);
+        }
+    }
+
+  remove_dir (out_dir);
+  remove_dir (base_dir);
+
+  return 0;
+}
@@ -0,0 +1,312 @@
+#include <glib.h>
+#include <unitfile.h>
+#include <utils.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* Parser throughput benchmark, run with meson test --benchmark. The
+ * numbers are only comparable between runs on the same machine */
+
+#define MIN_PHASE_SECONDS 0.2
+#define MIN_PHASE_RUNS 3
+
+/* Counts allocations by interposing malloc, which only works with glibc.
+ * Allocations that bypass malloc, like GSlice on older glib, are missed */
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gsize n_allocs;
+
+void *
+malloc (size_t size)
+{
+  n_allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  n_allocs++;
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    n_allocs++;
+  return __libc_realloc (ptr, size);
+}
+
+#define HAVE_ALLOC_COUNT 1
+#else
+static gsize n_allocs;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+typedef struct {
+  const char *name;
+  GPtrArray *units; /* Unit file contents, as char * */
+  gsize n_bytes;
+  gsize n_lines;
+} Corpus;
+
+static void
+corpus_free (Corpus *corpus)
+{
+  g_ptr_array_unref (corpus->units);
+  g_free (corpus);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Corpus, corpus_free)
+
+static Corpus *
+corpus_new (const char *name)
+{
+  Corpus *corpus = g_new0 (Corpus, 1);
+
+  corpus->name = name;
+  corpus->units = g_ptr_array_new_with_free_func (g_free);
+
+  return corpus;
+}
+
+static void
+corpus_add (Corpus *corpus,
+            char *data)
+{
+  g_ptr_array_add (corpus->units, data);
+  corpus->n_bytes += strlen (data);
+  for (const char *p = data; (p = strchr (p, '\n')) != NULL; p++)
+    corpus->n_lines++;
+}
+
+static Corpus *
+load_samples (void)
+{
+  g_autoptr(Corpus) corpus = corpus_new ("samples");
+  g_autofree char *dir_path = g_test_build_filename (G_TEST_DIST, "samples", NULL);
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *name;
+
+  dir = g_dir_open (dir_path, 0, &error);
+  g_assert_no_error (error);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = g_build_filename (dir_path, name, NULL);
+      char *data = NULL;
+
+      g_file_get_contents (path, &data, NULL, &error);
+      g_assert_no_error (error);
+      corpus_add (corpus, data);
+    }
+
+  return g_steal_pointer (&corpus);
+}
+
+/* A unit with the kinds of lines real units have: a few groups, repeated
+ * keys, resets, comments, continuations and quoted lists */
+static Corpus *
+make_synthetic (const char *name,
+                guint n_lines)
+{
+  g_autoptr(Corpus) corpus = corpus_new (name);
+  g_autoptr(GString) str = g_string_new ("");
+  guint line = 0;
+
+  while (line < n_lines)
+    {
+      guint group = line / 50;
+
+      g_string_append_printf (str, "\n# Group %u\n[Group%u]\n", group, group % 20);
+      line += 3;
+
+      for (guint i = 0; i < 47 && line < n_lines; i++)
+        {
+          switch (i % 8)
+            {
+            case 0:
+              g_string_append_printf (str, "Description=Synthetic unit number %u\n", line);
+              break;
+            case 1:
+              g_string_append_printf (str, "Environment=KEY%u=value%u \"QUOTED=a b c\"\n", i, line);
+              break;
+            case 2:
+              g_string_append (str, "Environment=\n");
+              break;
+            case 3:
+              g_string_append_printf (str, "ExecStart=/usr/bin/program --option=%u \\\n    --more-options\n", line);
+              line++;
+              break;
+            case 4:
+              g_string_append (str, "; A comment line\n");
+              break;
+            case 5:
+              g_string_append_printf (str, "After=network.target remote-fs.target unit%u.service\n", line);
+              break;
+            case 6:
+              g_string_append_printf (str, "Key%u = spaced value %u\n", i, line);
+              break;
+            default:
+              g_string_append (str, "Restart=on-failure\n");
+              break;
+            }
+          line++;
+        }
+    }
+
+  corpus_add (corpus, g_string_free (g_steal_pointer (&str), FALSE));
+  return g_steal_pointer (&corpus);
+}
+
+typedef void (*PhaseFunc) (Corpus *corpus, QuadUnitFile **units);
+
+static void
+phase_parse (Corpus *corpus,
+             G_GNUC_UNUSED QuadUnitFile **units)
+{
+  for (guint i = 0; i < corpus->units->len; i++)
+    {
+      g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+      g_autoptr(GError) error = NULL;
+
+      quad_unit_file_parse (unit, g_ptr_array_index (corpus->units, i), &error);
+      g_assert_no_error (error);
+    }
+}
+
+static void
+phase_print (Corpus *corpus,
+             QuadUnitFile **units)
+{
+  g_autoptr(GString) str = g_string_new ("");
+
+  for (guint i = 0; i < corpus->units->len; i++)
+    {
+      g_string_truncate (str, 0);
+      quad_unit_file_print (units[i], str);
+    }
+}
+
+static void
+phase_lookup (Corpus *corpus,
+              QuadUnitFile **units)
+{
+  for (guint i = 0; i < corpus->units->len; i++)
+    {
+      QuadUnitGroupIter group_iter;
+      const char *group_name;
+
+      quad_unit_group_iter_init (&group_iter, units[i]);
+      while (quad_unit_group_iter_next (&group_iter, &group_name))
+        {
+          QuadUnitKeyIter key_iter;
+          const char *key;
+
+          quad_unit_key_iter_init (&key_iter, units[i], group_name);
+          while (quad_unit_key_iter_next (&key_iter, &key))
+            {
+              g_autofree char *last = quad_unit_file_lookup_last (units[i], group_name, key);
+              g_auto(GStrv) all = quad_unit_file_lookup_all (units[i], group_name, key);
+              g_auto(GStrv) words = quad_unit_file_lookup_all_strv (units[i], group_name, key);
+            }
+        }
+    }
+}
+
+static long
+get_peak_rss_kb (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return -1;
+
+  return usage.ru_maxrss;
+}
+
+static void
+run_phase (Corpus *corpus,
+           QuadUnitFile **units,
+           const char *phase_name,
+           PhaseFunc func)
+{
+  g_autoptr(GTimer) timer = g_timer_new ();
+  gsize allocs_before;
+  guint runs = 0;
+  double seconds;
+
+  /* Warm up, and count the allocations of a single run */
+  allocs_before = n_allocs;
+  func (corpus, units);
+  allocs_before = n_allocs - allocs_before;
+
+  g_timer_start (timer);
+  do
+    {
+      func (corpus, units);
+      runs++;
+    }
+  while (runs < MIN_PHASE_RUNS || g_timer_elapsed (timer, NULL) < MIN_PHASE_SECONDS);
+  seconds = g_timer_elapsed (timer, NULL);
+
+  g_print ("%-14s %-8s %10.1f MB/s %12.0f lines/s %10" G_GSIZE_FORMAT " allocs/run %8ld KB peak RSS\n",
+           corpus->name, phase_name,
+           corpus->n_bytes * runs / seconds / (1024 * 1024),
+           corpus->n_lines * runs / seconds,
+           allocs_before,
+           get_peak_rss_kb ());
+}
+
+static void
+run_corpus (Corpus *corpus)
+{
+  g_autofree QuadUnitFile **units = g_new0 (QuadUnitFile *, corpus->units->len);
+
+  for (guint i = 0; i < corpus->units->len; i++)
+    {
+      g_autoptr(GError) error = NULL;
+
+      units[i] = quad_unit_file_new ();
+      quad_unit_file_parse (units[i], g_ptr_array_index (corpus->units, i), &error);
+      g_assert_no_error (error);
+    }
+
+  run_phase (corpus, units, "parse", phase_parse);
+  run_phase (corpus, units, "print", phase_print);
+  run_phase (corpus, units, "lookup", phase_lookup);
+
+  for (guint i = 0; i < corpus->units->len; i++)
+    quad_unit_file_unref (units[i]);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  setlocale (LC_ALL, "");
+  g_test_init (&argc, &argv, NULL);
+
+  if (!HAVE_ALLOC_COUNT)
+    g_print ("Allocation counts are only available with glibc\n");
+
+  {
+    g_autoptr(Corpus) samples = load_samples ();
+    g_autoptr(Corpus) synthetic_1k = make_synthetic ("synthetic-1k", 1000);
+    g_autoptr(Corpus) synthetic_10k = make_synthetic ("synthetic-10k", 10000);
+    g_autoptr(Corpus) synthetic_100k = make_synthetic ("synthetic-100k", 100000);
+
+    run_corpus (samples);
+    run_corpus (synthetic_1k);
+    run_corpus (synthetic_10k);
+    run_corpus (synthetic_100k);
+  }
+
+  return 0;
+}
@@ -0,0 +1,217 @@
+#include <glib.h>
+#include <utils.h>
+#include <locale.h>
+#include <string.h>
+
+/* Compares QuadTable to GHashTable for the ways quadlet uses them:
+ * interned keys compared by pointer, and string keys. Run with
+ * meson test --benchmark */
+
+#define MIN_SECONDS 0.1
+
+typedef enum {
+  OP_INSERT,
+  OP_LOOKUP_HIT,
+  OP_LOOKUP_MISS,
+  OP_ITERATE,
+  OP_REMOVE,
+  N_OPS
+} BenchOp;
+
+static const char *op_names[N_OPS] = {
+  "insert",
+  "lookup hit",
+  "lookup miss",
+  "iterate",
+  "remove",
+};
+
+typedef struct {
+  gboolean str_keys;
+  char **keys;
+  char **missing;
+  guint n_keys;
+} BenchKeys;
+
+static void
+bench_keys_init (BenchKeys *keys,
+                 guint n_keys,
+                 gboolean str_keys)
+{
+  keys->str_keys = str_keys;
+  keys->n_keys = n_keys;
+  keys->keys = g_new0 (char *, n_keys + 1);
+  keys->missing = g_new0 (char *, n_keys + 1);
+
+  for (guint i = 0; i < n_keys; i++)
+    {
+      /* Lookups use copies of string keys, so they can't match by pointer */
+      g_autofree char *key = g_strdup_printf ("Key%u", i);
+      g_autofree char *missing = g_strdup_printf ("Missing%u", i);
+
+      if (str_keys)
+        {
+          keys->keys[i] = g_steal_pointer (&key);
+          keys->missing[i] = g_steal_pointer (&missing);
+        }
+      else
+        {
+          keys->keys[i] = (char *)quad_intern_len (key, strlen (key));
+          keys->missing[i] = (char *)quad_intern_len (missing, strlen (missing));
+        }
+    }
+}
+
+static void
+bench_keys_clear (BenchKeys *keys)
+{
+  if (keys->str_keys)
+    {
+      g_strfreev (keys->keys);
+      g_strfreev (keys->missing);
+    }
+  else
+    {
+      g_free (keys->keys);
+      g_free (keys->missing);
+    }
+}
+
+static gsize
+run_quad_table (BenchKeys *keys,
+                BenchOp op,
+                gint64 *op_time)
+{
+  g_autoptr(QuadTable) table = keys->str_keys ? quad_str_table_new (NULL, NULL) : quad_table_new (NULL, NULL);
+  gsize found = 0;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < keys->n_keys; i++)
+    quad_table_insert (table, keys->keys[i], keys->keys[i]);
+  if (op == OP_INSERT)
+    *op_time += g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  switch (op)
+    {
+    case OP_LOOKUP_HIT:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += quad_table_lookup (table, keys->keys[i]) != NULL;
+      break;
+    case OP_LOOKUP_MISS:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += quad_table_lookup (table, keys->missing[i]) != NULL;
+      break;
+    case OP_ITERATE:
+      QUAD_TABLE_FOREACH_KV (table, const char *, key, gpointer, value)
+        found += key == value;
+      break;
+    case OP_REMOVE:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += quad_table_remove (table, keys->keys[i]);
+      break;
+    default:
+      break;
+    }
+  if (op != OP_INSERT)
+    *op_time += g_get_monotonic_time () - start;
+
+  return found;
+}
+
+static gsize
+run_ghashtable (BenchKeys *keys,
+                BenchOp op,
+                gint64 *op_time)
+{
+  g_autoptr(GHashTable) table = keys->str_keys ?
+    g_hash_table_new (g_str_hash, g_str_equal) : g_hash_table_new (g_direct_hash, g_direct_equal);
+  gsize found = 0;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < keys->n_keys; i++)
+    g_hash_table_insert (table, keys->keys[i], keys->keys[i]);
+  if (op == OP_INSERT)
+    *op_time += g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  switch (op)
+    {
+    case OP_LOOKUP_HIT:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += g_hash_table_lookup (table, keys->keys[i]) != NULL;
+      break;
+    case OP_LOOKUP_MISS:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += g_hash_table_lookup (table, keys->missing[i]) != NULL;
+      break;
+    case OP_ITERATE:
+      QUAD_HASH_TABLE_FOREACH_KV (table, const char *, key, gpointer, value)
+        found += key == value;
+      break;
+    case OP_REMOVE:
+      for (guint i = 0; i < keys->n_keys; i++)
+        found += g_hash_table_remove (table, keys->keys[i]);
+      break;
+    default:
+      break;
+    }
+  if (op != OP_INSERT)
+    *op_time += g_get_monotonic_time () - start;
+
+  return found;
+}
+
+/* Returns nanoseconds per key */
+static double
+bench (BenchKeys *keys,
+       BenchOp op,
+       gsize (*run) (BenchKeys *keys, BenchOp op, gint64 *op_time))
+{
+  gint64 op_time = 0;
+  gint64 start = g_get_monotonic_time ();
+  guint64 runs = 0;
+  gsize found = 0;
+
+  do
+    {
+      found += run (keys, op, &op_time);
+      runs++;
+    }
+  while (g_get_monotonic_time () - start < MIN_SECONDS * G_USEC_PER_SEC);
+
+  /* Makes sure the work isn't optimized out */
+  if (found == G_MAXSIZE)
+    g_print ("\n");
+
+  return op_time * 1000.0 / (runs * keys->n_keys);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  const guint sizes[] = { 16, 1000, 100000 };
+
+  setlocale (LC_ALL, "");
+  g_test_init (&argc, &argv, NULL);
+
+  g_print ("%-8s %8s %-12s %12s %12s\n", "keys", "size", "op", "QuadTable", "GHashTable");
+  for (guint str_keys = 0; str_keys <= 1; str_keys++)
+    for (guint i = 0; i < G_N_ELEMENTS (sizes); i++)
+      {
+        BenchKeys keys;
+
+        bench_keys_init (&keys, sizes[i], str_keys);
+        for (BenchOp op = 0; op < N_OPS; op++)
+          g_print ("%-8s %8u %-12s %9.1f ns %9.1f ns\n",
+                   str_keys ? "string" : "interned", sizes[i], op_names[op],
+                   bench (&keys, op, run_quad_table),
+                   bench (&keys, op, run_ghashtable));
+        bench_keys_clear (&keys);
+      }
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/python3
+
+import sys
+import os
+import json
+import tempfile
+import subprocess
+
+query_binary = sys.argv[1]
+
+units = {
+    "a.container": """[Container]
+Image=first
+Image=last
+Environment=A=1
+Environment=
+Environment=B=2 "C=3 4"
+Label=a\\
+  b
+
+[Install]
+WantedBy=default.target multi-user.target
+""",
+    "b.container": """# No install section
+[Container]
+Image=other\tname
+""",
+}
+
+def run(args):
+    res = subprocess.run([query_binary] + args, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    return (res.returncode, res.stdout, res.stderr)
+
+def check(cond, msg):
+    if not cond:
+        print("FAIL: " + msg)
+        sys.exit(1)
+
+with tempfile.TemporaryDirectory(prefix="quadlet-query") as dir:
+    for name, data in units.items():
+        with open(os.path.join(dir, name), "w") as f:
+            f.write(data)
+
+    queries = ["-q", "Container.Image", "-q", "Container.Environment:all",
+               "-q", "Container.Environment:words", "-q", "Container.Label",
+               "-q", "Install.WantedBy:words"]
+
+    (rc, out, err) = run(["--json"] + queries + [dir])
+    check(rc == 0, "json query failed: " + err)
+    rows = json.loads(out)
+    check(len(rows) == 2, "expected two rows")
+    a = rows[0]
+    check(a["path"] == os.path.join(dir, "a.container"), "rows not in order")
+    check(a["Container.Image"] == "last", "last value not used")
+    check(a["Container.Environment:all"] == ['B=2 "C=3 4"'], "empty value didn't reset")
+    check(a["Container.Environment:words"] == ["B=2", "C=3 4"], "words not split")
+    check(a["Container.Label"] == "a   b", "continuation not applied")
+    check(a["Install.WantedBy:words"] == ["default.target", "multi-user.target"], "wrong WantedBy")
+    b = rows[1]
+    check(b["Install.WantedBy:words"] == [], "missing list not empty")
+    check(b["Container.Label"] is None, "missing value not null")
+
+    (rc, out, err) = run(["-j", "1"] + queries + [os.path.join(dir, "b.container")])
+    check(rc == 0, "tsv query failed: " + err)
+    lines = out.splitlines()
+    check(lines[0].split("\t")[1] == "Container.Image", "wrong header")
+    check(lines[1].split("\t")[1] == "other\\tname", "tab not escaped")
+
+    (rc, out, err) = run(["-q", "Container.Image", os.path.join(dir, "missing.container")])
+    check(rc == 1, "missing file should fail")
+
+    # A malformed line fails the file even in a group that isn't queried
+    broken = os.path.join(dir, "broken", "c.container")
+    os.mkdir(os.path.dirname(broken))
+    with open(broken, "w") as f:
+        f.write("[Container]\nImage=broken\n\n[Service]\nnot a key\n")
+    (rc, out, err) = run(["--json", "-q", "Container.Image", broken, os.path.join(dir, "b.container")])
+    check(rc == 1, "malformed file should fail")
+    check("not a key-value pair" in err, "malformed line not reported")
+    rows = json.loads(out)
+    check([row["Container.Image"] for row in rows] == ["other\tname"], "malformed file has a row")
+
+    (rc, out, err) = run(["-q", "NoKey"])
+    check(rc == 1, "invalid query should fail")
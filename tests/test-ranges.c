@@ -1,4 +1,4 @@
-#include <glib-object.h>
+#include <glib.h>
 #include <unitfile.h>
 #include <locale.h>
 
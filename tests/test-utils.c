@@ -1,7 +1,15 @@
-#include <glib-object.h>
+#include <glib.h>
+#include <cache.h>
+#include <context.h>
+#include <convert.h>
 #include <unitfile.h>
+#include <uring.h>
 #include <utils.h>
+#include <writer.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 const char *sample_service_files[] = {
   "memcached.service",
@@ -36,7 +44,7 @@ load_sample_unit (const char *filename)
   g_autofree char *path = get_sample_path (filename);
   QuadUnitFile *unit;
 
-  unit = quad_unit_file_new_from_path (path, &error);
+  unit = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_NONE, &error);
   g_assert_no_error (error);
   g_assert_true (unit != NULL);
   return unit;
@@ -52,11 +60,1017 @@ test_unitfile_print (void)
       g_autofree char *data = load_sample_file (sample_file);
       g_autoptr(QuadUnitFile) unit = load_sample_unit (sample_file);
       g_autoptr(GString) str = g_string_new ("");
+      g_autoptr(GError) error = NULL;
+      g_autofree char *tmp_path = NULL;
+      g_autofree char *written = NULL;
+      g_autofree char *printed = NULL;
+      gsize printed_len;
+      int fd;
+
       quad_unit_file_print (unit, str);
       g_assert_cmpstr (str->str, ==, data);
+
+      printed = quad_unit_file_to_string (unit, &printed_len);
+      g_assert_cmpstr (printed, ==, data);
+      g_assert_cmpuint (printed_len, ==, strlen (data));
+
+      fd = g_file_open_tmp ("quadlet-test-XXXXXX", &tmp_path, &error);
+      g_assert_no_error (error);
+      g_assert_true (quad_unit_file_write_fd (unit, fd, &error));
+      g_assert_no_error (error);
+      close (fd);
+
+      g_file_get_contents (tmp_path, &written, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (written, ==, data);
+      unlink (tmp_path);
+    }
+}
+
+/* Mapped files are parsed in place, make sure that gives the same result */
+static void
+test_unitfile_mapped (void)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (sample_service_files); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      const char *sample_file = sample_service_files[i];
+      g_autofree char *path = get_sample_path (sample_file);
+      g_autoptr(QuadUnitFile) unit = load_sample_unit (sample_file);
+      g_autoptr(QuadUnitFile) mapped = NULL;
+      g_autoptr(GString) str = g_string_new ("");
+      g_autoptr(GString) mapped_str = g_string_new ("");
+      g_autofree char *description = NULL;
+
+      mapped = quad_unit_file_new_from_mapped (path, &error);
+      g_assert_no_error (error);
+
+      quad_unit_file_set (unit, "Unit", "Description", "changed");
+      quad_unit_file_set (mapped, "Unit", "Description", "changed");
+
+      quad_unit_file_print (unit, str);
+      quad_unit_file_print (mapped, mapped_str);
+      g_assert_cmpstr (str->str, ==, mapped_str->str);
+
+      description = quad_unit_file_lookup_last (mapped, "Unit", "Description");
+      g_assert_cmpstr (description, ==, "changed");
+    }
+}
+
+static QuadUnitFile *
+parse_in_chunks (const char *data,
+                 gsize chunk_size,
+                 GError **error)
+{
+  g_autoptr(QuadUnitFileParser) parser = quad_unit_file_parser_new ();
+  gsize len = strlen (data);
+
+  for (gsize i = 0; i < len; i += chunk_size)
+    {
+      if (!quad_unit_file_parser_feed (parser, data + i, MIN (chunk_size, len - i), error))
+        return NULL;
+    }
+
+  return quad_unit_file_parser_finish (parser, error);
+}
+
+/* The push parser must give the same result for any chunk boundaries */
+static void
+test_unitfile_parser (void)
+{
+  const char *invalid = "[Unit]\nA=foo \\\n  bar\n# Comment\ninvalid\n";
+  const char *no_newline = "[Unit]\nA=foo \\\n  bar";
+
+  for (guint i = 0; i < G_N_ELEMENTS (sample_service_files); i++)
+    {
+      g_autofree char *data = load_sample_file (sample_service_files[i]);
+
+      for (gsize chunk_size = 1; chunk_size < 300; chunk_size += 13)
+        {
+          g_autoptr(GError) error = NULL;
+          g_autoptr(QuadUnitFile) unit = parse_in_chunks (data, chunk_size, &error);
+          g_autoptr(GString) str = g_string_new ("");
+
+          g_assert_no_error (error);
+          quad_unit_file_print (unit, str);
+          g_assert_cmpstr (str->str, ==, data);
+        }
+    }
+
+  for (gsize chunk_size = 1; chunk_size < 10; chunk_size++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(QuadUnitFile) unit = parse_in_chunks (invalid, chunk_size, &error);
+
+      g_assert_null (unit);
+      g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE);
+      g_assert_true (strstr (error->message, "line 5:") != NULL);
+    }
+
+  for (gsize chunk_size = 1; chunk_size < 10; chunk_size++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(QuadUnitFile) unit = parse_in_chunks (no_newline, chunk_size, &error);
+
+      g_assert_no_error (error);
+      g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Unit", "A"), ==, "foo \\\n  bar");
+    }
+}
+
+/* Continuations are resolved at parse time, but printed in raw form */
+static void
+test_unitfile_views (void)
+{
+  const char *data = "[A]\nK=a \\\n b\\\nc  \nK=d\nB=yes \nI=42x\nN=x42\n";
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) str = g_string_new ("");
+  g_autoptr(GArray) views = g_array_new (FALSE, FALSE, sizeof (QuadStrView));
+  g_autofree char *last = NULL;
+  g_auto(GStrv) all = NULL;
+  QuadStrView view;
+
+  g_assert_true (quad_unit_file_parse (unit, data, &error));
+  g_assert_no_error (error);
+
+  quad_unit_file_print (unit, str);
+  g_assert_cmpstr (str->str, ==, data);
+
+  g_assert_true (quad_unit_file_lookup_view (unit, "A", "B", &view));
+  g_assert_true (quad_str_view_equal (view, "yes"));
+  g_assert_false (quad_unit_file_lookup_view (unit, "A", "Missing", &view));
+  g_assert_true (quad_unit_file_lookup_boolean (unit, "A", "B", FALSE));
+  g_assert_cmpint (quad_unit_file_lookup_int (unit, "A", "I", 0), ==, 42);
+  g_assert_cmpint (quad_unit_file_lookup_int (unit, "A", "N", 7), ==, 7);
+
+  quad_unit_file_lookup_all_views (unit, "A", "K", views);
+  g_assert_cmpuint (views->len, ==, 2);
+  g_assert_true (quad_str_view_equal (g_array_index (views, QuadStrView, 0), "a   b c  "));
+  g_assert_true (quad_str_view_equal (g_array_index (views, QuadStrView, 1), "d"));
+
+  all = quad_unit_file_lookup_all (unit, "A", "K");
+  g_assert_cmpstr (all[0], ==, "a   b c  ");
+
+  quad_unit_file_set (unit, "A", "K", "e\\\nf");
+  last = quad_unit_file_lookup_last (unit, "A", "K");
+  g_assert_cmpstr (last, ==, "e f");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "A", "K"), ==, "e\\\nf");
+}
+
+static void
+test_unitfile_key_names (void)
+{
+  const char *valid[] = {
+    "Key=v",
+    "Key With Space = v",
+    "Name[de_DE.UTF-8@euro]=v",
+    "Name[\xc3\xa4]=v",
+    "N\xc3\xa4me=v",
+  };
+  const char *invalid[] = {
+    " =v",
+    "Name[de=v",
+    "Name[de]x=v",
+    "Name[\xc3]=v",
+    "Name[!]=v",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (valid); i++)
+    {
+      g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+      g_autofree char *data = g_strconcat ("[Group]\n", valid[i], "\n", NULL);
+      g_autoptr(GError) error = NULL;
+
+      g_assert_true (quad_unit_file_parse (unit, data, &error));
+      g_assert_no_error (error);
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (invalid); i++)
+    {
+      g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+      g_autofree char *data = g_strconcat ("[Group]\n", invalid[i], "\n", NULL);
+      g_autoptr(GError) error = NULL;
+
+      g_assert_false (quad_unit_file_parse (unit, data, &error));
+      g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE);
+    }
+}
+
+#define N_INDEX_LINES 10000
+#define N_INDEX_KEYS 500
+
+/* Lookups use a per-group key index, make sure it stays correct when the
+ * group is modified. With a linear scan per lookup this would be slow */
+static void
+test_unitfile_key_index (void)
+{
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+  g_autoptr(QuadUnitFile) other = quad_unit_file_new ();
+  g_autoptr(GTimer) timer = g_timer_new ();
+  g_autofree const char **all = NULL;
+
+  for (guint i = 0; i < N_INDEX_LINES; i++)
+    {
+      g_autofree char *key = g_strdup_printf ("Key%u", i % N_INDEX_KEYS);
+      g_autofree char *value = g_strdup_printf ("%u", i);
+      quad_unit_file_add (unit, "Big", key, value);
+      quad_unit_file_add (unit, "Big", "Multi", i == N_INDEX_LINES / 2 ? "" : value);
+    }
+
+  for (guint i = 0; i < N_INDEX_KEYS; i++)
+    {
+      g_autofree char *key = g_strdup_printf ("Key%u", i);
+      g_autofree char *expected = g_strdup_printf ("%u", i + N_INDEX_LINES - N_INDEX_KEYS);
+      g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", key), ==, expected);
+    }
+
+  /* Empty value resets the list */
+  all = quad_unit_file_lookup_all_raw (unit, "Big", "Multi");
+  g_assert_cmpuint (g_strv_length ((char **)all), ==, N_INDEX_LINES / 2 - 1);
+  g_assert_cmpstr (all[0], ==, "5001");
+  g_clear_pointer (&all, g_free);
+
+  quad_unit_file_unset (unit, "Big", "Key0");
+  g_assert_false (quad_unit_file_has_key (unit, "Big", "Key0"));
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", "Key1"), ==, "9501");
+
+  quad_unit_file_set (unit, "Big", "Key1", "set");
+  quad_unit_file_add (unit, "Big", "Key0", "added");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", "Key1"), ==, "set");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", "Key0"), ==, "added");
+
+  quad_unit_file_add (other, "Other", "Key2", "merged");
+  quad_unit_file_merge (unit, other);
+  quad_unit_file_rename_group (unit, "Other", "Big");
+  g_assert_false (quad_unit_file_has_group (unit, "Other"));
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", "Key2"), ==, "merged");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Big", "Key3"), ==, "9503");
+
+  all = quad_unit_file_lookup_all_raw (unit, "Big", "Key2");
+  g_assert_cmpuint (g_strv_length ((char **)all), ==, N_INDEX_LINES / N_INDEX_KEYS + 1);
+  g_assert_cmpstr (all[0], ==, "2");
+  g_assert_cmpstr (all[N_INDEX_LINES / N_INDEX_KEYS], ==, "merged");
+
+  g_test_message ("%d line key index test took %.3f seconds",
+                  N_INDEX_LINES * 2, g_timer_elapsed (timer, NULL));
+}
+
+static QuadUnitFile *
+parse_unit (const char *data)
+{
+  g_autoptr(GError) error = NULL;
+  QuadUnitFile *unit = quad_unit_file_new ();
+
+  quad_unit_file_parse (unit, data, &error);
+  g_assert_no_error (error);
+
+  return unit;
+}
+
+static void
+test_unitfile_layers (void)
+{
+  g_autoptr(QuadUnitFile) base = parse_unit ("[A]\nK=base\nL=1\nL=2\n\n[Base]\nB=yes\n");
+  g_autoptr(QuadUnitFile) file = parse_unit ("[A]\nK=file\nL=3\n");
+  g_autoptr(QuadUnitFile) drop_in = parse_unit ("[A]\nM=\nM=4\n");
+  g_autoptr(QuadUnitFile) reset = parse_unit ("[A]\nL=\nL=5\n");
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+  g_autoptr(QuadUnitFile) copy = NULL;
+  g_autofree const char **values = NULL;
+  g_autofree const char **groups = NULL;
+  g_autofree const char **keys = NULL;
+  g_autofree char *printed = NULL;
+
+  quad_unit_file_add_layer (unit, base);
+  quad_unit_file_add_layer (unit, file);
+  quad_unit_file_add_layer (unit, drop_in);
+
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "A", "K"), ==, "file");
+  g_assert_true (quad_unit_file_lookup_boolean (unit, "Base", "B", FALSE));
+  g_assert_true (quad_unit_file_has_group (unit, "Base"));
+  g_assert_false (quad_unit_file_has_key (unit, "Base", "K"));
+
+  values = quad_unit_file_lookup_all_raw (unit, "A", "L");
+  g_assert_cmpuint (g_strv_length ((char **)values), ==, 3);
+  g_assert_cmpstr (values[0], ==, "1");
+  g_assert_cmpstr (values[2], ==, "3");
+  g_clear_pointer (&values, g_free);
+
+  groups = quad_unit_file_list_groups (unit);
+  g_assert_cmpuint (g_strv_length ((char **)groups), ==, 2);
+  keys = quad_unit_file_list_keys (unit, "A");
+  g_assert_cmpuint (g_strv_length ((char **)keys), ==, 3);
+
+  /* An empty value in a higher layer hides the lower ones */
+  quad_unit_file_add_layer (unit, reset);
+  values = quad_unit_file_lookup_all_raw (unit, "A", "L");
+  g_assert_cmpuint (g_strv_length ((char **)values), ==, 1);
+  g_assert_cmpstr (values[0], ==, "5");
+  g_clear_pointer (&values, g_free);
+
+  copy = quad_unit_file_copy (unit);
+  printed = quad_unit_file_to_string (copy, NULL);
+  g_assert_cmpstr (printed, ==,
+                   "[A]\nK=base\nL=1\nL=2\nK=file\nL=3\nM=\nM=4\nL=\nL=5\n\n[Base]\nB=yes\n");
+
+  /* Modifying the unit doesn't change the layers */
+  quad_unit_file_set (unit, "A", "K", "set");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "A", "K"), ==, "set");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (file, "A", "K"), ==, "file");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (base, "A", "K"), ==, "base");
+}
+
+static void
+assert_unit_hash (const char *a_data,
+                  const char *b_data,
+                  gboolean    equal)
+{
+  g_autoptr(QuadUnitFile) a = parse_unit (a_data);
+  g_autoptr(QuadUnitFile) b = parse_unit (b_data);
+  QuadHash128 a_hash = quad_unit_file_hash (a);
+  QuadHash128 b_hash = quad_unit_file_hash (b);
+
+  g_assert_cmpint (quad_unit_file_equal (a, b), ==, equal);
+  g_assert_cmpint (quad_unit_file_equal (b, a), ==, equal);
+  g_assert_cmpint (a_hash.h1 == b_hash.h1 && a_hash.h2 == b_hash.h2, ==, equal);
+}
+
+static void
+test_unitfile_hash (void)
+{
+  g_autoptr(QuadUnitFile) unit = parse_unit ("[A]\nK=1\n");
+  g_autoptr(QuadUnitFile) layered = quad_unit_file_new ();
+  g_autoptr(QuadUnitFile) copy = NULL;
+  QuadHash128 hash, copy_hash;
+
+  /* The order of groups and keys doesn't matter, only the order of values */
+  assert_unit_hash ("[A]\nK=1\nL=2\n\n[B]\nM=3\n", "[B]\nM=3\n\n[A]\nL=2\nK=1\n", TRUE);
+  assert_unit_hash ("[A]\nK=1\nK=2\n", "[A]\nK=2\nK=1\n", FALSE);
+  assert_unit_hash ("[A]\nK=1\nK=2\n", "[A]\nK=1\n", FALSE);
+  assert_unit_hash ("[A]\nK=1\n", "[B]\nK=1\n", FALSE);
+  assert_unit_hash ("[A]\nK=1\n", "[A]\nK=1\n\n[B]\n", FALSE);
+  assert_unit_hash ("[A]\nK=1\n", "[A]\nL=1\n", FALSE);
+  assert_unit_hash ("[A]\nK=1\n", "[A]\nK=10\n", FALSE);
+
+  /* Comments and formatting are ignored */
+  assert_unit_hash ("# Comment\n[A]\nK = a\\\nb\n", "[A]\n; Other\nK=a b\n", TRUE);
+
+  /* The hash is the same for copies, layers and modified units */
+  copy = quad_unit_file_copy (unit);
+  hash = quad_unit_file_hash (unit);
+  copy_hash = quad_unit_file_hash (copy);
+  g_assert_true (hash.h1 == copy_hash.h1 && hash.h2 == copy_hash.h2);
+  quad_unit_file_add_layer (layered, unit);
+  g_assert_true (quad_unit_file_equal (layered, unit));
+  quad_unit_file_add (copy, "A", "K", "2");
+  g_assert_false (quad_unit_file_equal (copy, unit));
+  quad_unit_file_unset (copy, "A", "K");
+  quad_unit_file_add (copy, "A", "K", "1");
+  g_assert_true (quad_unit_file_equal (copy, unit));
+  copy_hash = quad_unit_file_hash (copy);
+  g_assert_true (hash.h1 == copy_hash.h1 && hash.h2 == copy_hash.h2);
+}
+
+#define N_FREEZE_THREADS 4
+#define N_FREEZE_LOOKUPS 2000
+
+static gpointer
+freeze_reader_thread (gpointer data)
+{
+  QuadUnitFile *frozen = data;
+
+  for (guint i = 0; i < N_FREEZE_LOOKUPS; i++)
+    {
+      g_autofree const char **values = quad_unit_file_lookup_all_raw (frozen, "A", "L");
+      g_autofree char *continued = quad_unit_file_lookup_last (frozen, "A", "C");
+
+      g_assert_cmpstr (quad_unit_file_lookup_last_raw (frozen, "A", "K"), ==, "file");
+      g_assert_cmpuint (g_strv_length ((char **)values), ==, 3);
+      g_assert_cmpstr (values[2], ==, "3");
+      g_assert_cmpstr (continued, ==, "a b");
+      g_assert_true (quad_unit_file_lookup_boolean (frozen, "Base", "B", FALSE));
+    }
+
+  return NULL;
+}
+
+static void
+test_unitfile_freeze (void)
+{
+  g_autoptr(QuadUnitFile) base = parse_unit ("[A]\nK=base\nL=1\nL=2\n\n[Base]\nB=yes\n");
+  const char *data = "[A]\nK=file\nL=3\nC=a\\\nb\n";
+  g_autoptr(GBytes) bytes = g_bytes_new_static (data, strlen (data));
+  g_autoptr(GError) error = NULL;
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new_from_bytes (bytes, &error);
+  g_autoptr(QuadUnitFile) frozen = NULL;
+  g_autoptr(QuadUnitFile) refrozen = NULL;
+  g_autoptr(QuadUnitFile) copy = NULL;
+  GThread *threads[N_FREEZE_THREADS];
+
+  g_assert_no_error (error);
+  quad_unit_file_set_path (unit, "/some/path");
+  quad_unit_file_add_layer (unit, base);
+
+  frozen = quad_unit_file_freeze (unit);
+  g_assert_true (quad_unit_file_is_frozen (frozen));
+  g_assert_false (quad_unit_file_is_frozen (unit));
+  g_assert_cmpstr (quad_unit_file_get_path (frozen), ==, "/some/path");
+  g_assert_true (quad_unit_file_equal (frozen, unit));
+
+  refrozen = quad_unit_file_freeze (frozen);
+  g_assert_true (refrozen == frozen);
+
+  for (guint i = 0; i < N_FREEZE_THREADS; i++)
+    threads[i] = g_thread_new ("reader", freeze_reader_thread, frozen);
+
+  /* Modifying the original or a copy doesn't affect the frozen unit */
+  quad_unit_file_set (unit, "A", "K", "changed");
+  copy = quad_unit_file_copy (frozen);
+  g_assert_false (quad_unit_file_is_frozen (copy));
+  quad_unit_file_unset (copy, "A", "L");
+
+  for (guint i = 0; i < N_FREEZE_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (frozen, "A", "K"), ==, "file");
+  g_assert_false (quad_unit_file_has_key (copy, "A", "L"));
+}
+
+static void
+test_unitfile_iterators (void)
+{
+  g_autoptr(QuadUnitFile) base = parse_unit ("[B]\nX=1\n\n[A]\nK=1\nL=1\nK=2\n");
+  g_autoptr(QuadUnitFile) file = parse_unit ("[A]\nM=1\nK=\nK=3\n\n[C]\n");
+  g_autoptr(QuadUnitFile) drop_in = parse_unit ("[A]\nL=2\nK=4\nM=2\n\n[B]\nY=1\n");
+  g_autoptr(QuadUnitFile) based = quad_unit_file_new ();
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+  g_autoptr(QuadUnitFile) flat = NULL;
+  const char *expected_groups[] = { "B", "A", "C", NULL };
+  const char *expected_keys[] = { "K", "L", "M", NULL };
+  const char *expected_k[] = { "3", "4", NULL };
+  QuadUnitGroupIter group_iter;
+  QuadUnitKeyIter key_iter;
+  QuadUnitValueIter value_iter;
+  const char *name;
+  QuadStrView value;
+  guint n;
+
+  /* Nested layers */
+  quad_unit_file_add_layer (based, base);
+  quad_unit_file_add_layer (based, file);
+  quad_unit_file_add_layer (unit, based);
+  quad_unit_file_add_layer (unit, drop_in);
+  flat = quad_unit_file_copy (unit);
+
+  for (guint i = 0; i < 2; i++)
+    {
+      QuadUnitFile *u = i == 0 ? unit : flat;
+
+      n = 0;
+      quad_unit_group_iter_init (&group_iter, u);
+      while (quad_unit_group_iter_next (&group_iter, &name))
+        g_assert_cmpstr (name, ==, expected_groups[n++]);
+      g_assert_null (expected_groups[n]);
+
+      n = 0;
+      quad_unit_key_iter_init (&key_iter, u, "A");
+      while (quad_unit_key_iter_next (&key_iter, &name))
+        g_assert_cmpstr (name, ==, expected_keys[n++]);
+      g_assert_null (expected_keys[n]);
+
+      /* The empty value resets the list */
+      n = 0;
+      quad_unit_value_iter_init (&value_iter, u, "A", "K");
+      while (quad_unit_value_iter_next (&value_iter, &value))
+        g_assert_true (quad_str_view_equal (value, expected_k[n++]));
+      g_assert_null (expected_k[n]);
+
+      n = 0;
+      quad_unit_value_iter_init (&value_iter, u, "A", "L");
+      while (quad_unit_value_iter_next (&value_iter, &value))
+        n++;
+      g_assert_cmpuint (n, ==, 2);
+
+      quad_unit_key_iter_init (&key_iter, u, "Missing");
+      g_assert_false (quad_unit_key_iter_next (&key_iter, &name));
+      quad_unit_value_iter_init (&value_iter, u, "A", "NoSuchKeyAnywhere");
+      g_assert_false (quad_unit_value_iter_next (&value_iter, &value));
     }
 }
 
+static QuadUnitFile *
+load_lazy_unit (const char *data,
+                char      **path_out)
+{
+  g_autoptr(GError) error = NULL;
+  QuadUnitFile *unit;
+  int fd;
+
+  fd = g_file_open_tmp ("quadlet-test-XXXXXX.service", path_out, &error);
+  g_assert_no_error (error);
+  close (fd);
+  g_file_set_contents (*path_out, data, -1, &error);
+  g_assert_no_error (error);
+
+  unit = quad_unit_file_new_from_path (*path_out, QUAD_UNIT_FILE_PARSE_LAZY, &error);
+  g_assert_no_error (error);
+  return unit;
+}
+
+static void
+test_unitfile_lazy (void)
+{
+  const char *data =
+    "# Before\n"
+    "[A]\nK=1\n# Inside\nL=a\\\n[NotAGroup]\n\n"
+    "# Comment for B\n[B]\nM=1\n\n"
+    "[A]\nK=2\n# Trailing\n";
+  const char *broken[] = {
+    "[A]\nK=1\n\n[B]\nnot a key\n",
+    "[A]\nK=1\n\n[B]\nM=1\n =2\n",
+    "[A]\nK=1\\\ncontinued\nnot a key\n[B]\n",
+  };
+  g_autoptr(GError) error = NULL;
+
+  /* Sample files and tricky layouts give the same unit either way */
+  for (guint i = 0; i <= G_N_ELEMENTS (sample_service_files); i++)
+    {
+      g_autofree char *sample = i < G_N_ELEMENTS (sample_service_files) ?
+        load_sample_file (sample_service_files[i]) : g_strdup (data);
+      g_autoptr(QuadUnitFile) eager = parse_unit (sample);
+      g_autoptr(QuadUnitFile) lazy = NULL;
+      g_autofree char *path = NULL;
+      g_autofree char *expected = quad_unit_file_to_string (eager, NULL);
+      g_autofree char *printed = NULL;
+      g_autofree const char **groups = NULL;
+
+      lazy = load_lazy_unit (sample, &path);
+      groups = quad_unit_file_list_groups (lazy);
+      for (guint j = 0; groups[j] != NULL; j++)
+        {
+          g_autofree const char **keys = quad_unit_file_list_keys (lazy, groups[j]);
+
+          for (guint k = 0; keys[k] != NULL; k++)
+            {
+              g_auto(GStrv) lazy_values = quad_unit_file_lookup_all (lazy, groups[j], keys[k]);
+              g_auto(GStrv) eager_values = quad_unit_file_lookup_all (eager, groups[j], keys[k]);
+
+              g_assert_cmpuint (g_strv_length (lazy_values), ==, g_strv_length (eager_values));
+              for (guint l = 0; lazy_values[l] != NULL; l++)
+                g_assert_cmpstr (lazy_values[l], ==, eager_values[l]);
+            }
+        }
+
+      printed = quad_unit_file_to_string (lazy, NULL);
+      g_assert_cmpstr (printed, ==, expected);
+      unlink (path);
+    }
+
+  /* Errors in a group body fail the load like in an eager parse */
+  for (guint i = 0; i < G_N_ELEMENTS (broken); i++)
+    {
+      g_autoptr(QuadUnitFile) unit = NULL;
+      g_autoptr(QuadUnitFile) lazy = NULL;
+      g_autoptr(GError) eager_error = NULL;
+      g_autofree char *path = NULL;
+      int fd;
+
+      unit = quad_unit_file_new ();
+      g_assert_false (quad_unit_file_parse (unit, broken[i], &eager_error));
+
+      fd = g_file_open_tmp ("quadlet-test-XXXXXX.service", &path, &error);
+      g_assert_no_error (error);
+      close (fd);
+      g_file_set_contents (path, broken[i], -1, &error);
+      g_assert_no_error (error);
+      lazy = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_LAZY, &error);
+      g_assert_null (lazy);
+      g_assert_error (error, eager_error->domain, eager_error->code);
+      g_assert_cmpstr (error->message, ==, eager_error->message);
+      g_clear_error (&error);
+      unlink (path);
+    }
+
+  /* A file has to start with a group */
+  {
+    g_autoptr(QuadUnitFile) lazy = NULL;
+    g_autofree char *path = NULL;
+    int fd;
+
+    fd = g_file_open_tmp ("quadlet-test-XXXXXX.service", &path, &error);
+    g_assert_no_error (error);
+    close (fd);
+    g_file_set_contents (path, "K=1\n[A]\n", -1, &error);
+    g_assert_no_error (error);
+    lazy = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_LAZY, &error);
+    g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND);
+    g_assert_null (lazy);
+    unlink (path);
+  }
+}
+
+#define N_BATCH_RUNS 50
+#define N_BATCH_EDITS 40
+
+/* Batched edits must give the same result as making them one by one */
+static void
+test_unitfile_batch (void)
+{
+  const char *groups[] = { "A", "B", "New", "Other" };
+  const char *keys[] = { "K", "L", "M" };
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr(QuadUnitFile) unit = parse_unit ("[A]\nK=1\n");
+  QuadUnitFileBatch *batch = quad_unit_file_batch_begin (unit);
+  g_autofree char *printed = NULL;
+
+  /* Groups are created by the first set or add, like without a batch,
+   * and unsetting a key doesn't create one */
+  quad_unit_file_batch_unset (batch, "Unset", "K");
+  quad_unit_file_batch_unset (batch, "Second", "K");
+  quad_unit_file_batch_add (batch, "First", "K", "1");
+  quad_unit_file_batch_set (batch, "Second", "K", "2");
+  quad_unit_file_batch_unset (batch, "First", "K");
+  quad_unit_file_batch_commit (batch);
+  printed = quad_unit_file_to_string (unit, NULL);
+  g_assert_cmpstr (printed, ==, "[A]\nK=1\n\n[First]\n\n[Second]\nK=2\n");
+
+  for (guint run = 0; run < N_BATCH_RUNS; run++)
+    {
+      g_autoptr(QuadUnitFile) unit = parse_unit ("[A]\nK=1\nL=2\nK=3\n\n[B]\nM=4\n");
+      g_autoptr(QuadUnitFile) batched = quad_unit_file_copy (unit);
+      QuadUnitFileBatch *batch = quad_unit_file_batch_begin (batched);
+      g_autofree char *expected = NULL;
+      g_autofree char *result = NULL;
+
+      for (guint i = 0; i < N_BATCH_EDITS; i++)
+        {
+          const char *group = groups[g_rand_int_range (rand, 0, G_N_ELEMENTS (groups))];
+          const char *key = keys[g_rand_int_range (rand, 0, G_N_ELEMENTS (keys))];
+          g_autofree char *value = g_strdup_printf ("v%u", i);
+
+          switch (g_rand_int_range (rand, 0, 3))
+            {
+            case 0:
+              quad_unit_file_set (unit, group, key, value);
+              quad_unit_file_batch_set (batch, group, key, value);
+              break;
+            case 1:
+              quad_unit_file_add (unit, group, key, value);
+              quad_unit_file_batch_add (batch, group, key, value);
+              break;
+            default:
+              quad_unit_file_unset (unit, group, key);
+              quad_unit_file_batch_unset (batch, group, key);
+              break;
+            }
+        }
+
+      quad_unit_file_batch_commit (batch);
+
+      expected = quad_unit_file_to_string (unit, NULL);
+      result = quad_unit_file_to_string (batched, NULL);
+      g_assert_cmpstr (result, ==, expected);
+
+      for (guint i = 0; i < G_N_ELEMENTS (keys); i++)
+        g_assert_cmpstr (quad_unit_file_lookup_last_raw (batched, "A", keys[i]), ==,
+                         quad_unit_file_lookup_last_raw (unit, "A", keys[i]));
+    }
+}
+
+static QuadUnitFile *
+parse_with_limits (const char *data,
+                   const QuadUnitFileLimits *limits,
+                   GError **error)
+{
+  g_autoptr(QuadUnitFile) unit = quad_unit_file_new ();
+
+  quad_unit_file_set_limits (unit, limits);
+  if (!quad_unit_file_parse (unit, data, error))
+    return NULL;
+
+  return g_steal_pointer (&unit);
+}
+
+static void
+test_unitfile_limits (void)
+{
+  const QuadUnitFileLimits limits = { 64, 16, 4, 1 };
+  const QuadUnitFileLimits unlimited = { 0, 0, 0, 0 };
+  g_autofree char *large = g_strnfill (100, '#');
+  g_autoptr(GError) error = NULL;
+  struct {
+    const char *data;
+    gboolean valid;
+  } cases[] = {
+    { "[A]\nK=12345678901234\n", TRUE },
+    { "[A]\nK=123456789012345\n", FALSE },
+    { "[A]\nK=1\nL=2\n# 4\n", TRUE },
+    { "[A]\nK=1\nL=2\n# 4\n# 5\n", FALSE },
+    { "[A]\nK=a\\\nb\n", TRUE },
+    { "[A]\nK=a\\\nb\\\nc\n", FALSE },
+    { large, FALSE },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      g_autoptr(QuadUnitFile) unit = parse_with_limits (cases[i].data, &limits, &error);
+
+      if (cases[i].valid)
+        g_assert_no_error (error);
+      else
+        g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE);
+      g_clear_error (&error);
+
+      /* 0 turns a limit off */
+      g_clear_pointer (&unit, quad_unit_file_unref);
+      unit = parse_with_limits (cases[i].data, &unlimited, &error);
+      g_assert_no_error (error);
+    }
+
+  /* The other ways to load a unit use the default limits */
+  quad_unit_file_set_default_limits (&limits);
+  for (guint i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      g_autoptr(QuadUnitFile) streamed = parse_in_chunks (cases[i].data, 3, &error);
+      g_autoptr(QuadUnitFile) lazy = NULL;
+      g_autoptr(QuadUnitFile) mapped = NULL;
+      g_autofree char *path = NULL;
+      int fd;
+
+      g_assert_true ((streamed != NULL) == cases[i].valid);
+      g_clear_error (&error);
+
+      fd = g_file_open_tmp ("quadlet-test-XXXXXX.service", &path, &error);
+      g_assert_no_error (error);
+      close (fd);
+      g_file_set_contents (path, cases[i].data, -1, &error);
+      g_assert_no_error (error);
+      lazy = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_LAZY, &error);
+      g_assert_true ((lazy != NULL) == cases[i].valid);
+      g_clear_error (&error);
+      mapped = quad_unit_file_new_from_mapped (path, &error);
+      g_assert_true ((mapped != NULL) == cases[i].valid);
+      g_clear_error (&error);
+      unlink (path);
+    }
+  quad_unit_file_set_default_limits (NULL);
+}
+
+typedef char *(*HostileUnitFunc) (guint n);
+
+static char *
+hostile_long_line (guint n)
+{
+  g_autofree char *value = g_strnfill (n * 8, 'x');
+
+  return g_strconcat ("[A]\nK=", value, "\n", NULL);
+}
+
+static char *
+hostile_continuations (guint n)
+{
+  g_autoptr(GString) str = g_string_new ("[A]\nK=a");
+
+  for (guint i = 0; i < n; i++)
+    g_string_append (str, " b\\\n");
+  g_string_append (str, "c\n");
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+static char *
+hostile_comments (guint n)
+{
+  g_autoptr(GString) str = g_string_new ("");
+
+  for (guint i = 0; i < n; i++)
+    g_string_append (str, "\n# comment\n");
+  g_string_append (str, "[A]\nK=1\n");
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+static char *
+hostile_repeated_keys (guint n)
+{
+  g_autoptr(GString) str = g_string_new ("");
+
+  for (guint i = 0; i < n; i++)
+    g_string_append (str, "[A]\nK=1\nK=\n");
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+static char *
+hostile_unique_names (guint n)
+{
+  g_autoptr(GString) str = g_string_new ("");
+
+  for (guint i = 0; i < n; i++)
+    g_string_append_printf (str, "[Hostile-Group-%u]\nHostile-Key-%u=1\n", i, i);
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+/* Best of a few runs, in seconds */
+static double
+time_hostile_unit (const char *data,
+                   gboolean streamed)
+{
+  double best = G_MAXDOUBLE;
+
+  for (guint run = 0; run < 3; run++)
+    {
+      g_autoptr(QuadUnitFile) unit = NULL;
+      g_autoptr(GError) error = NULL;
+      gint64 start = g_get_monotonic_time ();
+
+      if (streamed)
+        unit = parse_in_chunks (data, 7, &error);
+      else
+        unit = parse_unit (data);
+      g_assert_no_error (error);
+      g_free (quad_unit_file_lookup_last (unit, "A", "K"));
+
+      best = MIN (best, (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC);
+    }
+
+  return best;
+}
+
+/* Inputs that used to make parts of the parser quadratic must take
+ * about 8 times as long for 8 times the size. The limits are turned
+ * off, as they would hide it */
+static void
+test_unitfile_linear (void)
+{
+  const QuadUnitFileLimits unlimited = { 0, 0, 0, 0 };
+  HostileUnitFunc funcs[] = {
+    hostile_long_line,
+    hostile_continuations,
+    hostile_comments,
+    hostile_repeated_keys,
+    hostile_unique_names,
+  };
+
+  quad_unit_file_set_default_limits (&unlimited);
+  for (guint i = 0; i < G_N_ELEMENTS (funcs); i++)
+    for (guint streamed = 0; streamed <= 1; streamed++)
+      {
+        g_autofree char *small = funcs[i] (10000);
+        g_autofree char *large = funcs[i] (80000);
+        double small_time = time_hostile_unit (small, streamed);
+        double large_time = time_hostile_unit (large, streamed);
+
+        g_test_message ("case %u%s: %.4fs, 8x: %.4fs", i, streamed ? " streamed" : "",
+                        small_time, large_time);
+        /* Quadratic would be 64 times, the slack is for timer noise */
+        g_assert_cmpfloat (large_time, <, small_time * 8 * 3 + 0.01);
+      }
+  quad_unit_file_set_default_limits (NULL);
+
+  /* Unknown names are stored in the unit, so a hostile unit can't grow
+   * the global table of interned strings */
+  {
+    g_autofree char *data = hostile_unique_names (1000);
+    g_autoptr(QuadUnitFile) unit = parse_unit (data);
+
+    g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "Hostile-Group-999", "Hostile-Key-999"), ==, "1");
+    g_assert_null (quad_intern_lookup ("Hostile-Group-0"));
+    g_assert_null (quad_intern_lookup ("Hostile-Key-999"));
+  }
+
+  {
+    g_autofree char *large = hostile_continuations (80000);
+    g_autofree char *resolved = NULL;
+    gint64 start = g_get_monotonic_time ();
+
+    resolved = quad_apply_line_continuation (large);
+    g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC);
+  }
+
+  {
+    g_autofree char *resolved = quad_apply_line_continuation ("a\\\nb\n\\\nc\\");
+
+    g_assert_cmpstr (resolved, ==, "a b\n c\\");
+  }
+}
+
+static void
+test_unitfile_compiled (void)
+{
+  g_autofree char *data = load_sample_file ("systemd-networkd.service");
+  g_autoptr(GError) error = NULL;
+  g_autoptr(QuadUnitFile) unit = NULL;
+  g_autoptr(QuadUnitFile) loaded = NULL;
+  g_autoptr(GString) str = g_string_new ("");
+  g_autofree char *source_path = NULL;
+  g_autofree char *compiled_path = NULL;
+  g_autofree char *compiled = NULL;
+  g_autofree char *expected = NULL;
+  g_autofree char *resolved = NULL;
+  gsize compiled_len;
+  int fd;
+
+  fd = g_file_open_tmp ("quadlet-test-XXXXXX.service", &source_path, &error);
+  g_assert_no_error (error);
+  close (fd);
+  fd = g_file_open_tmp ("quadlet-test-XXXXXX.compiled", &compiled_path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  g_file_set_contents (source_path, data, -1, &error);
+  g_assert_no_error (error);
+  unit = quad_unit_file_new_from_path (source_path, QUAD_UNIT_FILE_PARSE_NONE, &error);
+  g_assert_no_error (error);
+  quad_unit_file_set (unit, "Service", "Continued", "a\\\nb");
+
+  expected = quad_unit_file_to_string (unit, NULL);
+
+  g_assert_true (quad_unit_file_save_compiled (unit, compiled_path, &error));
+  g_assert_no_error (error);
+
+  loaded = quad_unit_file_load_compiled (compiled_path, source_path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (quad_unit_file_get_path (loaded), ==, source_path);
+  quad_unit_file_print (loaded, str);
+  g_assert_cmpstr (str->str, ==, expected);
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (loaded, "Service", "Continued"), ==, "a\\\nb");
+  resolved = quad_unit_file_lookup_last (loaded, "Service", "Continued");
+  g_assert_cmpstr (resolved, ==, "a b");
+  g_clear_pointer (&loaded, quad_unit_file_unref);
+
+  /* A different source can't use it */
+  loaded = quad_unit_file_load_compiled (compiled_path, compiled_path, &error);
+  g_assert_null (loaded);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+  g_clear_error (&error);
+
+  /* Truncated files are rejected */
+  g_file_get_contents (compiled_path, &compiled, &compiled_len, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (compiled_path, compiled, compiled_len - 1, &error);
+  g_assert_no_error (error);
+  loaded = quad_unit_file_load_compiled (compiled_path, source_path, &error);
+  g_assert_null (loaded);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+  g_clear_error (&error);
+
+  /* Changing the source invalidates it, even with the same size */
+  g_file_set_contents (compiled_path, compiled, compiled_len, &error);
+  g_assert_no_error (error);
+  data[0] = data[0] == '#' ? ';' : '#';
+  g_file_set_contents (source_path, data, -1, &error);
+  g_assert_no_error (error);
+  loaded = quad_unit_file_load_compiled (compiled_path, source_path, &error);
+  g_assert_null (loaded);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+
+  unlink (source_path);
+  unlink (compiled_path);
+}
+
+static void
+test_unitfile_copy (void)
+{
+  const char *data = "[A]\nK=a\nK=b\n\n[B]\nL=c\n";
+  g_autoptr(GBytes) bytes = g_bytes_new (data, strlen (data));
+  g_autoptr(QuadUnitFile) unit = NULL;
+  g_autoptr(QuadUnitFile) copy = NULL;
+  g_autoptr(QuadUnitFile) copy2 = NULL;
+  g_autoptr(GString) str = g_string_new ("");
+  g_autoptr(GError) error = NULL;
+
+  unit = quad_unit_file_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_clear_pointer (&bytes, g_bytes_unref);
+
+  copy = quad_unit_file_copy (unit);
+  copy2 = quad_unit_file_copy (copy);
+  quad_unit_file_set (copy, "A", "K", "changed");
+  quad_unit_file_unset (copy, "B", "L");
+  quad_unit_file_rename_group (copy, "A", "B");
+
+  quad_unit_file_print (unit, str);
+  g_assert_cmpstr (str->str, ==, data);
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "A", "K"), ==, "b");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "B", "L"), ==, "c");
+
+  /* Shared values must outlive the unit they were parsed into */
+  g_clear_pointer (&unit, quad_unit_file_unref);
+
+  g_assert_false (quad_unit_file_has_group (copy, "A"));
+  g_assert_false (quad_unit_file_has_key (copy, "B", "L"));
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (copy, "B", "K"), ==, "changed");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (copy2, "A", "K"), ==, "b");
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (copy2, "B", "L"), ==, "c");
+
+  g_clear_pointer (&copy, quad_unit_file_unref);
+  g_string_truncate (str, 0);
+  quad_unit_file_print (copy2, str);
+  g_assert_cmpstr (str->str, ==, data);
+}
+
 static void
 test_range_creation (void)
 {
@@ -402,6 +1416,798 @@ test_split_ports (void)
 
 }
 
+static void
+test_arena (void)
+{
+  g_autoptr(QuadArena) arena = quad_arena_new (256);
+  g_autofree char *large = g_strnfill (1000, 'x');
+  const char *strs[100];
+
+  for (guint i = 0; i < G_N_ELEMENTS (strs); i++)
+    {
+      g_autofree char *s = g_strdup_printf ("string-%u", i);
+      guint64 *aligned;
+
+      strs[i] = quad_arena_strdup (arena, s);
+      aligned = quad_arena_alloc (arena, sizeof (guint64));
+      g_assert_cmpuint ((gsize)aligned % sizeof (gpointer), ==, 0);
+      *aligned = i;
+    }
+
+  g_assert_cmpstr (quad_arena_strdup (arena, large), ==, large);
+  g_assert_cmpstr (quad_arena_strndup (arena, "abcdef", 3), ==, "abc");
+
+  for (guint i = 0; i < G_N_ELEMENTS (strs); i++)
+    {
+      g_autofree char *s = g_strdup_printf ("string-%u", i);
+      g_assert_cmpstr (strs[i], ==, s);
+    }
+}
+
+/* The vectorized scanners must agree with the generic one for
+ * all positions of newlines and '=' relative to the vector size */
+static guint n_destroyed;
+
+static void
+count_destroy (gpointer data)
+{
+  n_destroyed++;
+  g_free (data);
+}
+
+/* Random inserts and removes must give the same result as GHashTable,
+ * with enough churn to leave deleted buckets and resize several times */
+static void
+test_table (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr(QuadTable) table = quad_str_table_new (count_destroy, NULL);
+  g_autoptr(GHashTable) expected = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(QuadTable) direct = quad_table_new (NULL, NULL);
+  g_autofree char *copy = g_strdup ("Image");
+  g_autofree gpointer *keys = NULL;
+  QuadTableIter iter;
+  gpointer key, value;
+  guint n_inserted = 0;
+  gsize n_keys;
+
+  n_destroyed = 0;
+  g_assert_null (quad_table_lookup (table, "missing"));
+  g_assert_false (quad_table_remove (table, "missing"));
+
+  for (guint i = 0; i < 20000; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("key-%u", g_rand_int_range (rand, 0, 2000));
+      gboolean contained = g_hash_table_contains (expected, name);
+
+      if (g_rand_int_range (rand, 0, 3) == 0)
+        {
+          g_assert_true (quad_table_remove (table, name) == contained);
+          g_hash_table_remove (expected, name);
+        }
+      else
+        {
+          g_assert_true (quad_table_insert (table, g_strdup (name), GUINT_TO_POINTER (i)) == !contained);
+          g_hash_table_insert (expected, g_strdup (name), GUINT_TO_POINTER (i));
+          n_inserted++;
+        }
+      g_assert_cmpuint (quad_table_size (table), ==, g_hash_table_size (expected));
+    }
+
+  QUAD_HASH_TABLE_FOREACH_KV (expected, const char *, name, gpointer, expected_value)
+    {
+      gpointer orig_key;
+
+      g_assert_true (quad_table_lookup_extended (table, name, &orig_key, &value));
+      g_assert_cmpstr (orig_key, ==, name);
+      g_assert_true (value == expected_value);
+    }
+
+  /* Iteration sees each key once */
+  quad_table_iter_init (&iter, table);
+  while (quad_table_iter_next (&iter, &key, &value))
+    {
+      g_assert_true (g_hash_table_lookup (expected, key) == value);
+      g_hash_table_remove (expected, key);
+    }
+  g_assert_cmpuint (g_hash_table_size (expected), ==, 0);
+
+  keys = quad_table_get_keys (table, &n_keys);
+  g_assert_cmpuint (n_keys, ==, quad_table_size (table));
+  g_assert_null (keys[n_keys]);
+
+  quad_table_iter_init (&iter, table);
+  while (quad_table_iter_next (&iter, &key, NULL))
+    {
+      if (g_str_has_suffix (key, "0"))
+        quad_table_iter_remove (&iter);
+    }
+  g_assert_false (quad_table_contains (table, "key-10"));
+
+  /* Every key that was inserted is destroyed exactly once */
+  quad_table_remove_all (table);
+  g_assert_cmpuint (n_destroyed, ==, n_inserted);
+  g_assert_cmpuint (quad_table_size (table), ==, 0);
+
+  /* Sets of interned strings are compared by pointer */
+  g_assert_true (quad_table_add (direct, (char *)quad_intern_len ("Image", 5)));
+  g_assert_false (quad_table_add (direct, (char *)quad_intern_len ("Image", 5)));
+  g_assert_true (quad_table_contains (direct, quad_intern_len ("Image", 5)));
+  g_assert_false (quad_table_contains (direct, copy));
+}
+
+static void
+test_scan_line (void)
+{
+  char buf[200];
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+
+  for (guint iter = 0; iter < 2000; iter++)
+    {
+      gsize len = g_rand_int_range (rand, 0, sizeof (buf));
+      const char *line = buf;
+      const char *end = buf + len;
+
+      for (gsize i = 0; i < len; i++)
+        {
+          guint r = g_rand_int_range (rand, 0, 100);
+          buf[i] = r < 2 ? '\n' : r < 5 ? '=' : 'a' + r % 26;
+        }
+
+      while (line < end)
+        {
+          const char *eq, *generic_eq;
+          const char *eol = quad_scan_line (line, end, &eq);
+          const char *generic_eol = quad_scan_line_generic (line, end, &generic_eq);
+
+          g_assert_true (eol == generic_eol);
+          g_assert_true (eq == generic_eq);
+
+          line = eol == end ? end : eol + 1;
+        }
+    }
+}
+
+#define N_WRITEV_VECS 5000
+
+static void
+test_writev_all (void)
+{
+  g_autoptr(GArray) iov = g_array_new (FALSE, FALSE, sizeof (struct iovec));
+  g_autoptr(GString) expected = g_string_new ("");
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmp_path = NULL;
+  g_autofree char *written = NULL;
+  const char *words[] = { "a", "", "bc", "def\n" };
+  int fd;
+
+  /* More vectors than IOV_MAX, including empty ones */
+  for (guint i = 0; i < N_WRITEV_VECS; i++)
+    {
+      const char *word = words[i % G_N_ELEMENTS (words)];
+      struct iovec v = { (void *)word, strlen (word) };
+      g_array_append_val (iov, v);
+      g_string_append (expected, word);
+    }
+
+  fd = g_file_open_tmp ("quadlet-test-XXXXXX", &tmp_path, &error);
+  g_assert_no_error (error);
+  g_assert_true (quad_writev_all (fd, (struct iovec *)iov->data, iov->len, &error));
+  g_assert_no_error (error);
+  close (fd);
+
+  g_file_get_contents (tmp_path, &written, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (written, ==, expected->str);
+  unlink (tmp_path);
+}
+
+static void
+test_intern (void)
+{
+  const char *a = quad_intern_len ("ExecStart=foo", strlen ("ExecStart"));
+  g_autofree char *b = g_strdup ("ExecStart");
+
+  g_assert_cmpstr (a, ==, "ExecStart");
+  g_assert_true (quad_intern_lookup (b) == a);
+  g_assert_true (g_intern_string (b) == a);
+  g_assert_null (quad_intern_lookup ("Quadlet-NeverInternedKey"));
+}
+
+static void
+get_first_name (QuadUnitFile *unit,
+                const char **group_name,
+                const char **key)
+{
+  QuadUnitGroupIter group_iter;
+  QuadUnitKeyIter key_iter;
+
+  quad_unit_group_iter_init (&group_iter, unit);
+  g_assert_true (quad_unit_group_iter_next (&group_iter, group_name));
+  quad_unit_key_iter_init (&key_iter, unit, *group_name);
+  g_assert_true (quad_unit_key_iter_next (&key_iter, key));
+}
+
+/* Known names are shared by all units. Other names stay private to
+ * the unit, but are still compared by content */
+static void
+test_unitfile_names (void)
+{
+  g_autoptr(QuadUnitFile) unit = parse_unit ("[X-Quadlet-Group]\nX-Quadlet-Key=1\nX-Quadlet-Key=2\n");
+  g_autoptr(QuadUnitFile) drop_in = parse_unit ("[X-Quadlet-Group]\nX-Quadlet-Key=3\n");
+  g_autoptr(QuadUnitFile) merged = quad_unit_file_copy (unit);
+  g_autoptr(QuadUnitFile) container_a = parse_unit ("[Container]\nImage=a\n");
+  g_autoptr(QuadUnitFile) container_b = parse_unit ("[Container]\nImage=b\n");
+  g_autofree char *key = g_strdup ("X-Quadlet-Key");
+  g_autofree const char **values = NULL;
+  g_autofree char *printed = NULL;
+  const char *group_a, *group_b, *key_a, *key_b;
+  QuadUnitFileBatch *batch;
+
+  get_first_name (container_a, &group_a, &key_a);
+  get_first_name (container_b, &group_b, &key_b);
+  g_assert_true (group_a == group_b);
+  g_assert_true (key_a == key_b);
+
+  get_first_name (unit, &group_a, &key_a);
+  get_first_name (drop_in, &group_b, &key_b);
+  g_assert_true (group_a != group_b);
+  g_assert_true (key_a != key_b);
+
+  g_assert_null (quad_intern_lookup ("X-Quadlet-Group"));
+  g_assert_null (quad_intern_lookup ("X-Quadlet-Key"));
+  g_assert_cmpstr (quad_unit_file_lookup_last_raw (unit, "X-Quadlet-Group", key), ==, "2");
+
+  quad_unit_file_merge (merged, drop_in);
+  values = quad_unit_file_lookup_all_raw (merged, "X-Quadlet-Group", key);
+  g_assert_cmpuint (g_strv_length ((char **)values), ==, 3);
+  g_assert_cmpstr (values[2], ==, "3");
+  quad_unit_file_unset (merged, "X-Quadlet-Group", key);
+  g_assert_false (quad_unit_file_has_key (merged, "X-Quadlet-Group", key));
+
+  batch = quad_unit_file_batch_begin (unit);
+  quad_unit_file_batch_set (batch, "X-Quadlet-Group", "X-Quadlet-Key", "4");
+  quad_unit_file_batch_add (batch, "X-Quadlet-Other", "X-Quadlet-Key", "5");
+  quad_unit_file_batch_commit (batch);
+  quad_unit_file_rename_group (unit, "X-Quadlet-Other", "X-Quadlet-Renamed");
+
+  printed = quad_unit_file_to_string (unit, NULL);
+  g_assert_cmpstr (printed, ==,
+                   "[X-Quadlet-Group]\nX-Quadlet-Key=1\nX-Quadlet-Key=4\n\n"
+                   "[X-Quadlet-Renamed]\nX-Quadlet-Key=5\n");
+  g_assert_null (quad_intern_lookup ("X-Quadlet-Other"));
+  g_assert_null (quad_intern_lookup ("X-Quadlet-Renamed"));
+}
+
+#define N_CONVERT_THREADS 8
+#define N_CONVERT_ROUNDS 10
+
+typedef struct {
+  QuadContext *ctx;
+  GPtrArray *names;
+  GPtrArray *units;    /* Frozen, shared by all threads */
+  GPtrArray *expected; /* The printed services, or the errors */
+} ConvertJob;
+
+static char *
+convert_to_string (QuadContext *ctx,
+                   QuadUnitFile *unit,
+                   const char *name)
+{
+  g_autoptr(QuadUnitFile) service = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) str = g_string_new ("");
+
+  if (g_str_has_suffix (name, ".volume"))
+    service = quad_convert_volume (ctx, unit, name, &error);
+  else
+    service = quad_convert_container (ctx, unit, &error);
+
+  if (service == NULL)
+    return g_strdup (error->message);
+
+  quad_unit_file_print (service, str);
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+static gpointer
+convert_thread (gpointer data)
+{
+  ConvertJob *job = data;
+  /* Contexts can also be created while others are in use */
+  g_autoptr(QuadContext) own_ctx = quad_context_new (FALSE);
+
+  for (guint round = 0; round < N_CONVERT_ROUNDS; round++)
+    for (guint i = 0; i < job->units->len; i++)
+      {
+        QuadContext *ctx = (round % 2) ? own_ctx : job->ctx;
+        g_autofree char *converted = convert_to_string (ctx, g_ptr_array_index (job->units, i),
+                                                        g_ptr_array_index (job->names, i));
+
+        g_assert_cmpstr (converted, ==, g_ptr_array_index (job->expected, i));
+      }
+
+  return NULL;
+}
+
+/* Converts the generator test cases from many threads at once, which is
+ * mostly useful with -Db_sanitize=thread */
+static void
+test_convert_threads (void)
+{
+  g_autofree char *cases_path = g_test_build_filename (G_TEST_DIST, "cases", NULL);
+  g_autoptr(QuadContext) ctx = quad_context_new (FALSE);
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) units = g_ptr_array_new_with_free_func ((GDestroyNotify)quad_unit_file_unref);
+  g_autoptr(GPtrArray) expected = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GError) error = NULL;
+  GThread *threads[N_CONVERT_THREADS];
+  ConvertJob job = { ctx, names, units, expected };
+  const char *name;
+
+  dir = g_dir_open (cases_path, 0, &error);
+  g_assert_no_error (error);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = NULL;
+      g_autoptr(QuadUnitFile) unit = NULL;
+
+      if (!g_str_has_suffix (name, ".container") && !g_str_has_suffix (name, ".volume"))
+        continue;
+
+      path = g_build_filename (cases_path, name, NULL);
+      unit = quad_unit_file_new_from_path (path, QUAD_UNIT_FILE_PARSE_NONE, &error);
+      g_assert_no_error (error);
+
+      g_ptr_array_add (names, g_strdup (name));
+      g_ptr_array_add (units, quad_unit_file_freeze (unit));
+      g_ptr_array_add (expected, convert_to_string (ctx, unit, name));
+    }
+  g_assert_cmpuint (units->len, >, 0);
+
+  for (guint i = 0; i < N_CONVERT_THREADS; i++)
+    threads[i] = g_thread_new ("convert", convert_thread, &job);
+  for (guint i = 0; i < N_CONVERT_THREADS; i++)
+    g_thread_join (threads[i]);
+}
+
+static void
+remove_dir (const char *path)
+{
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+        remove_dir (child);
+      else
+        g_assert_cmpint (unlink (child), ==, 0);
+    }
+  g_assert_cmpint (rmdir (path), ==, 0);
+}
+
+static void
+test_cache (void)
+{
+  g_autofree char *tmpdir = g_dir_make_tmp ("quadlet-cache-XXXXXX", NULL);
+  g_autofree char *cache_dir = g_build_filename (tmpdir, "cache", NULL);
+  g_autofree char *source = g_build_filename (tmpdir, "test.container", NULL);
+  g_autofree char *other = g_build_filename (tmpdir, "other.container", NULL);
+  g_autofree char *output_path = NULL;
+  g_autofree char *stale_path = g_build_filename (cache_dir, "gone.container.entry", NULL);
+  g_autofree char *tmp_path = g_build_filename (cache_dir, "test.container.entry.AbC123", NULL);
+  g_autofree char *other_path = g_build_filename (cache_dir, "README", NULL);
+  g_autoptr(QuadTable) names = quad_str_table_new (NULL, NULL);
+  g_autoptr(QuadTable) output_hashes = quad_str_table_new (NULL, NULL);
+  g_autoptr(GBytes) restored = NULL;
+  g_autoptr(GPtrArray) drop_ins = g_ptr_array_new ();
+  g_autoptr(GPtrArray) other_drop_ins = g_ptr_array_new ();
+  g_autoptr(QuadCacheEntry) entry = NULL;
+  g_autoptr(QuadCacheEntry) found = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *source_data = "[Container]\nImage=test\n";
+  g_autoptr(GBytes) source_bytes = g_bytes_new_static (source_data, strlen (source_data));
+  g_autoptr(GBytes) changed_bytes = g_bytes_new_static ("[Container]\n", 12);
+  g_autoptr(GBytes) output = g_bytes_new_static ("[Service]\nExecStart=test\n", 26);
+
+  g_assert_nonnull (tmpdir);
+  g_assert_true (g_file_set_contents (source, source_data, -1, NULL));
+
+  /* Nothing is cached yet */
+  g_assert_null (quad_cache_lookup (cache_dir, "key", "test.container", source, NULL, drop_ins));
+
+  entry = quad_cache_entry_new (source);
+  quad_cache_add_input (entry->inputs, source, quad_hash128 (source_data, strlen (source_data), 0));
+  entry->service_name = g_strdup ("test.service");
+  g_ptr_array_add (entry->symlinks, g_strdup ("default.target.wants/test.service"));
+  g_ptr_array_add (entry->log, g_strdup ("A warning"));
+  g_assert_true (quad_cache_store (cache_dir, "key", "test.container", entry, output, &error));
+  g_assert_no_error (error);
+
+  found = quad_cache_lookup (cache_dir, "key", "test.container", source, NULL, drop_ins);
+  g_assert_nonnull (found);
+  g_assert_cmpstr (found->service_name, ==, "test.service");
+  g_assert_cmpstr (found->output_hash, ==, entry->output_hash);
+  g_assert_cmpuint (found->symlinks->len, ==, 1);
+  g_assert_cmpstr (g_ptr_array_index (found->symlinks, 0), ==, "default.target.wants/test.service");
+  g_assert_cmpuint (found->log->len, ==, 1);
+  g_assert_cmpstr (g_ptr_array_index (found->log, 0), ==, "A warning");
+
+  restored = quad_cache_read_output (cache_dir, found, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_bytes_equal (restored, output));
+
+  /* The output is checked against the entry */
+  output_path = g_strconcat (cache_dir, "/", found->output_hash, ".service", NULL);
+  g_assert_true (g_file_set_contents (output_path, "[Service]\nExecStart=tset\n", -1, NULL));
+  g_clear_pointer (&restored, g_bytes_unref);
+  restored = quad_cache_read_output (cache_dir, found, &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+  g_assert_null (restored);
+  g_clear_error (&error);
+  g_assert_true (quad_cache_store (cache_dir, "key", "test.container", entry, output, &error));
+  g_assert_no_error (error);
+
+  /* Only the entries and outputs in use are kept, and files that are
+   * not part of the cache */
+  g_assert_true (g_file_set_contents (stale_path, "", -1, NULL));
+  g_assert_true (g_file_set_contents (tmp_path, "", -1, NULL));
+  g_assert_true (g_file_set_contents (other_path, "", -1, NULL));
+  quad_table_add (names, (char *)"test.container");
+  quad_table_add (output_hashes, entry->output_hash);
+  quad_cache_prune (cache_dir, names, output_hashes);
+  g_assert_false (g_file_test (stale_path, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (tmp_path, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (other_path, G_FILE_TEST_EXISTS));
+  g_clear_pointer (&found, quad_cache_entry_free);
+  found = quad_cache_lookup (cache_dir, "key", "test.container", source, NULL, drop_ins);
+  g_assert_nonnull (found);
+  restored = quad_cache_read_output (cache_dir, found, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (restored);
+
+  quad_table_remove (output_hashes, entry->output_hash);
+  quad_cache_prune (cache_dir, names, output_hashes);
+  g_assert_false (g_file_test (output_path, G_FILE_TEST_EXISTS));
+
+  /* Contents that were already read are used instead of the file */
+  g_clear_pointer (&found, quad_cache_entry_free);
+  found = quad_cache_lookup (cache_dir, "key", "test.container", source, source_bytes, drop_ins);
+  g_assert_nonnull (found);
+  g_clear_pointer (&found, quad_cache_entry_free);
+  g_assert_null (quad_cache_lookup (cache_dir, "key", "test.container", source, changed_bytes, drop_ins));
+
+  /* Anything that differs from what was stored is a miss */
+  g_assert_null (quad_cache_lookup (cache_dir, "other-key", "test.container", source, NULL, drop_ins));
+  g_assert_null (quad_cache_lookup (cache_dir, "key", "test.container", other, NULL, drop_ins));
+  g_ptr_array_add (other_drop_ins, (char *)"/etc/containers/systemd/test.container.d/a.conf");
+  g_assert_null (quad_cache_lookup (cache_dir, "key", "test.container", source, NULL, other_drop_ins));
+
+  g_assert_true (g_file_set_contents (source, "[Container]\nImage=other\n", -1, NULL));
+  g_assert_null (quad_cache_lookup (cache_dir, "key", "test.container", source, NULL, drop_ins));
+
+  /* Values that don't fit in an entry are not stored */
+  g_free (entry->service_name);
+  entry->service_name = g_strdup ("test\n.service");
+  g_assert_false (quad_cache_store (cache_dir, "key", "test.container", entry, output, &error));
+  g_assert_no_error (error);
+
+  remove_dir (cache_dir);
+  g_assert_cmpint (unlink (source), ==, 0);
+  g_assert_cmpint (rmdir (tmpdir), ==, 0);
+}
+
+static void
+test_writer (void)
+{
+  g_autofree char *tmpdir = g_dir_make_tmp ("quadlet-writer-XXXXXX", NULL);
+  g_autofree char *path = NULL;
+  g_autofree char *data = NULL;
+  g_autofree char *target = NULL;
+  g_autoptr(QuadWriter) writer = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_nonnull (tmpdir);
+  writer = quad_writer_new (tmpdir, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (quad_writer_get_path (writer), ==, tmpdir);
+
+  /* Syncing doesn't change what is written */
+  for (guint i = 0; i < 2; i++)
+    {
+      quad_writer_set_sync (writer, i == 0);
+      g_assert_true (quad_writer_write_data (writer, "test.service", "[Service]\n", 10, &error));
+      g_assert_no_error (error);
+
+      path = g_build_filename (tmpdir, "test.service", NULL);
+      g_assert_true (g_file_get_contents (path, &data, NULL, NULL));
+      g_assert_cmpstr (data, ==, "[Service]\n");
+      g_clear_pointer (&path, g_free);
+      g_clear_pointer (&data, g_free);
+    }
+
+  /* Directories are created as needed, also when they exist already */
+  g_assert_true (quad_writer_symlink (writer, "../test.service", "a.target.wants/test.service", &error));
+  g_assert_no_error (error);
+  g_assert_true (quad_writer_symlink (writer, "../../test.service", "b/c/test.service", &error));
+  g_assert_no_error (error);
+  g_assert_true (quad_writer_symlink (writer, "../test.service", "b/test.service", &error));
+  g_assert_no_error (error);
+
+  path = g_build_filename (tmpdir, "b/c/test.service", NULL);
+  target = g_file_read_link (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (target, ==, "../../test.service");
+
+  g_assert_false (quad_writer_symlink (writer, "../other.service", "a.target.wants/test.service", &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_EXIST);
+  g_clear_error (&error);
+
+  remove_dir (tmpdir);
+}
+
+static void
+count_write_error (const char *name,
+                   G_GNUC_UNUSED const char *target,
+                   const GError *error,
+                   gpointer user_data)
+{
+  guint *n_errors = user_data;
+
+  g_test_message ("%s: %s", name, error->message);
+  (*n_errors)++;
+}
+
+static void
+check_file (const char *dir,
+            const char *name,
+            const char *expected)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  g_autofree char *data = NULL;
+
+  g_assert_true (g_file_get_contents (path, &data, NULL, NULL));
+  g_assert_cmpstr (data, ==, expected);
+}
+
+static void
+check_symlink (const char *dir,
+               const char *name,
+               const char *expected)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  g_autofree char *target = g_file_read_link (path, NULL);
+
+  g_assert_cmpstr (target, ==, expected);
+}
+
+/* Writes the same files and symlinks with and without io_uring. The
+ * ring is small, so the writes are split into several batches */
+static void
+test_writer_queue (void)
+{
+  for (guint use_ring = 0; use_ring < 2; use_ring++)
+    {
+      g_autofree char *tmpdir = g_dir_make_tmp ("quadlet-writer-XXXXXX", NULL);
+      g_autoptr(QuadUring) ring = NULL;
+      g_autoptr(QuadWriter) writer = NULL;
+      g_autoptr(GBytes) empty = g_bytes_new_static ("", 0);
+      g_autoptr(GError) error = NULL;
+      guint n_errors = 0;
+
+      if (use_ring)
+        {
+          ring = quad_uring_new (4, &error);
+          if (ring == NULL)
+            {
+              g_test_message ("Not testing io_uring: %s", error->message);
+              remove_dir (tmpdir);
+              continue;
+            }
+        }
+
+      writer = quad_writer_new (tmpdir, &error);
+      g_assert_no_error (error);
+      g_assert_true (quad_writer_symlink (writer, "other.service", "existing.service", &error));
+      g_assert_no_error (error);
+
+      for (guint i = 0; i < 10; i++)
+        {
+          g_autofree char *name = g_strdup_printf ("unit%u.service", i);
+          g_autofree char *data = g_strdup_printf ("[Unit]\nDescription=%u\n", i);
+          g_autoptr(GBytes) bytes = g_bytes_new (data, strlen (data));
+
+          quad_writer_queue_data (writer, name, bytes);
+        }
+      quad_writer_queue_data (writer, "missing/unit.service", empty);
+
+      /* The first symlink with a name wins, and existing ones are kept */
+      quad_writer_queue_symlink (writer, "../unit0.service", "a.target.wants/unit.service");
+      quad_writer_queue_symlink (writer, "../unit1.service", "a.target.wants/unit.service");
+      quad_writer_queue_symlink (writer, "unit2.service", "existing.service");
+      quad_writer_queue_symlink (writer, "../../../unit3.service", "b/c/d/unit3.service");
+      quad_writer_queue_symlink (writer, "../unit4.service", "b/unit4.service");
+      quad_writer_queue_symlink (writer, "../unit5.service", "c.target.requires/unit5.service");
+      quad_writer_queue_symlink (writer, "../unit6.service", "d.target.wants/unit6.service");
+      quad_writer_queue_symlink (writer, "unit7.service", "alias.service");
+      quad_writer_queue_symlink (writer, "../unit8.service", "unit9.service/unit8.service");
+
+      quad_writer_flush (writer, ring, count_write_error, &n_errors);
+
+      /* missing/ doesn't exist, and unit9.service is not a directory */
+      g_assert_cmpuint (n_errors, ==, 2);
+
+      for (guint i = 0; i < 10; i++)
+        {
+          g_autofree char *name = g_strdup_printf ("unit%u.service", i);
+          g_autofree char *data = g_strdup_printf ("[Unit]\nDescription=%u\n", i);
+
+          check_file (tmpdir, name, data);
+        }
+
+      check_symlink (tmpdir, "a.target.wants/unit.service", "../unit0.service");
+      check_symlink (tmpdir, "existing.service", "other.service");
+      check_symlink (tmpdir, "b/c/d/unit3.service", "../../../unit3.service");
+      check_symlink (tmpdir, "b/unit4.service", "../unit4.service");
+      check_symlink (tmpdir, "c.target.requires/unit5.service", "../unit5.service");
+      check_symlink (tmpdir, "d.target.wants/unit6.service", "../unit6.service");
+      check_symlink (tmpdir, "alias.service", "unit7.service");
+      check_file (tmpdir, "alias.service", "[Unit]\nDescription=7\n");
+
+      /* Nothing is left queued */
+      quad_writer_flush (writer, ring, count_write_error, &n_errors);
+      g_assert_cmpuint (n_errors, ==, 2);
+
+      remove_dir (tmpdir);
+    }
+}
+
+static void
+test_uring_read_files (void)
+{
+  g_autofree char *tmpdir = g_dir_make_tmp ("quadlet-uring-XXXXXX", NULL);
+  g_autofree char *large = g_strnfill (200, 'x');
+  g_autoptr(QuadUring) ring = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *names[] = { "a", "empty", "missing", "large", "dir", "fifo", "b", "c", "d", "e" };
+  const char *paths[G_N_ELEMENTS (names)];
+  GBytes *contents[G_N_ELEMENTS (names)];
+  g_autoptr(GPtrArray) owned = g_ptr_array_new_with_free_func (g_free);
+
+  ring = quad_uring_new (4, &error);
+  if (ring == NULL)
+    {
+      g_test_skip (error->message);
+      remove_dir (tmpdir);
+      return;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      char *path = g_build_filename (tmpdir, names[i], NULL);
+
+      g_ptr_array_add (owned, path);
+      paths[i] = path;
+
+      if (strcmp (names[i], "missing") == 0)
+        continue;
+      else if (strcmp (names[i], "dir") == 0)
+        g_assert_cmpint (mkdir (path, 0755), ==, 0);
+      else if (strcmp (names[i], "fifo") == 0)
+        g_assert_cmpint (mkfifo (path, 0644), ==, 0);
+      else if (strcmp (names[i], "empty") == 0)
+        g_assert_true (g_file_set_contents (path, "", 0, NULL));
+      else if (strcmp (names[i], "large") == 0)
+        g_assert_true (g_file_set_contents (path, large, -1, NULL));
+      else
+        g_assert_true (g_file_set_contents (path, names[i], -1, NULL));
+    }
+
+  /* Anything that can't be read is left for the caller */
+  g_assert_true (quad_uring_read_files (ring, G_N_ELEMENTS (names), paths, 100, contents));
+
+  for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      if (strcmp (names[i], "missing") == 0 || strcmp (names[i], "dir") == 0 ||
+          strcmp (names[i], "fifo") == 0 || strcmp (names[i], "large") == 0)
+        g_assert_null (contents[i]);
+      else
+        {
+          gsize len;
+          const char *data;
+          const char *expected = strcmp (names[i], "empty") == 0 ? "" : names[i];
+
+          g_assert_nonnull (contents[i]);
+          data = g_bytes_get_data (contents[i], &len);
+          g_assert_cmpuint (len, ==, strlen (expected));
+          g_assert_true (memcmp (data, expected, len) == 0);
+          g_bytes_unref (contents[i]);
+        }
+    }
+
+  remove_dir (tmpdir);
+}
+
+/* Makes io_uring_enter() fail on the only ring, by putting /dev/null
+ * in place of its file descriptor */
+static void
+break_ring (void)
+{
+  g_autoptr(GDir) dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  const char *name;
+  int null_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+  gboolean found = FALSE;
+
+  g_assert_nonnull (dir);
+  g_assert_cmpint (null_fd, >=, 0);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = g_build_filename ("/proc/self/fd", name, NULL);
+      g_autofree char *target = g_file_read_link (path, NULL);
+
+      if (g_strcmp0 (target, "anon_inode:[io_uring]") == 0)
+        {
+          g_assert_cmpint (dup2 (null_fd, atoi (name)), >=, 0);
+          found = TRUE;
+        }
+    }
+
+  close (null_fd);
+  g_assert_true (found);
+}
+
+/* Once the ring fails it is not used again, and what it didn't do is
+ * done synchronously */
+static void
+test_uring_dead (void)
+{
+  g_autofree char *tmpdir = g_dir_make_tmp ("quadlet-uring-XXXXXX", NULL);
+  g_autofree char *path = g_build_filename (tmpdir, "a", NULL);
+  g_autofree char *wants_dir = g_build_filename (tmpdir, "a.target.wants", NULL);
+  g_autoptr(QuadUring) ring = NULL;
+  g_autoptr(QuadWriter) writer = NULL;
+  g_autoptr(GBytes) bytes = g_bytes_new_static ("[Unit]\n", 7);
+  g_autoptr(GError) error = NULL;
+  const char *paths[] = { path };
+  GBytes *contents[G_N_ELEMENTS (paths)];
+  guint n_errors = 0;
+
+  ring = quad_uring_new (4, &error);
+  if (ring == NULL)
+    {
+      g_test_skip (error->message);
+      remove_dir (tmpdir);
+      return;
+    }
+
+  g_assert_true (g_file_set_contents (path, "a", -1, NULL));
+  break_ring ();
+
+  g_assert_false (quad_uring_read_files (ring, G_N_ELEMENTS (paths), paths, 100, contents));
+  g_assert_null (contents[0]);
+  g_assert_false (quad_uring_run (ring, &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_IO);
+  g_clear_error (&error);
+
+  writer = quad_writer_new (tmpdir, &error);
+  g_assert_no_error (error);
+  quad_writer_queue_data (writer, "unit.service", bytes);
+  quad_writer_queue_symlink (writer, "../unit.service", "a.target.wants/unit.service");
+  quad_writer_flush (writer, ring, count_write_error, &n_errors);
+  g_assert_cmpuint (n_errors, ==, 0);
+  check_file (tmpdir, "unit.service", "[Unit]\n");
+  check_symlink (tmpdir, "a.target.wants/unit.service", "../unit.service");
+
+  remove_dir (wants_dir);
+  remove_dir (tmpdir);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -411,11 +2217,38 @@ main (int argc, char *argv[])
 
   // Define the tests.
   g_test_add_func ("/unit-file/print", test_unitfile_print);
+  g_test_add_func ("/unit-file/mapped", test_unitfile_mapped);
+  g_test_add_func ("/unit-file/parser", test_unitfile_parser);
+  g_test_add_func ("/unit-file/views", test_unitfile_views);
+  g_test_add_func ("/unit-file/key-names", test_unitfile_key_names);
+  g_test_add_func ("/unit-file/key-index", test_unitfile_key_index);
+  g_test_add_func ("/unit-file/copy", test_unitfile_copy);
+  g_test_add_func ("/unit-file/layers", test_unitfile_layers);
+  g_test_add_func ("/unit-file/batch", test_unitfile_batch);
+  g_test_add_func ("/unit-file/hash", test_unitfile_hash);
+  g_test_add_func ("/unit-file/freeze", test_unitfile_freeze);
+  g_test_add_func ("/unit-file/iterators", test_unitfile_iterators);
+  g_test_add_func ("/unit-file/lazy", test_unitfile_lazy);
+  g_test_add_func ("/unit-file/limits", test_unitfile_limits);
+  g_test_add_func ("/unit-file/linear", test_unitfile_linear);
+  g_test_add_func ("/unit-file/compiled", test_unitfile_compiled);
   g_test_add_func ("/ranges/creation", test_range_creation);
   g_test_add_func ("/ranges/single", test_range_single);
   g_test_add_func ("/ranges/multi", test_range_multi);
   g_test_add_func ("/ranges/remove", test_range_remove);
   g_test_add_func ("/split-ports", test_split_ports);
+  g_test_add_func ("/arena", test_arena);
+  g_test_add_func ("/table", test_table);
+  g_test_add_func ("/intern", test_intern);
+  g_test_add_func ("/unit-file/names", test_unitfile_names);
+  g_test_add_func ("/writev-all", test_writev_all);
+  g_test_add_func ("/scan-line", test_scan_line);
+  g_test_add_func ("/cache", test_cache);
+  g_test_add_func ("/writer", test_writer);
+  g_test_add_func ("/writer/queue", test_writer_queue);
+  g_test_add_func ("/uring/read-files", test_uring_read_files);
+  g_test_add_func ("/uring/dead", test_uring_dead);
+  g_test_add_func ("/convert/threads", test_convert_threads);
 
   return g_test_run ();
 }
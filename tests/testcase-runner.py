@@ -5,6 +5,7 @@ import os
 import tempfile
 import subprocess
 import shlex
+import shutil
 
 def match_sublist_at(full_list, pos, sublist):
     if len(sublist) > len(full_list) - pos:
@@ -95,6 +96,12 @@ class Testcase:
         def assert_failed(args, testcase):
             return True # We already handled this specially after running
 
+        def depends_on(args, testcase):
+            return True # The files were copied before running
+
+        def shadowed_by(args, testcase):
+            return True # The file was copied before running
+
         def assert_stderr_contains(args, testcase):
             return args[0] in testcase.stdout
 
@@ -143,6 +150,8 @@ class Testcase:
 
         ops = {
             "assert-failed": assert_failed,
+            "depends-on": depends_on,
+            "shadowed-by": shadowed_by,
             "assert-stderr-contains": assert_stderr_contains,
             "assert-key-is": assert_key_is,
             "assert-key-contains": assert_key_contains,
@@ -192,22 +201,40 @@ class Testcase:
         with tempfile.TemporaryDirectory(prefix="quadlet-test-") as basedir:
             indir = os.path.join(basedir, "in")
             os.mkdir(indir)
-            outdir = os.path.join(basedir, "out")
-            os.mkdir(outdir)
+            # Units in the admin directory shadow the ones in indir
+            admindir = os.path.join(basedir, "admin")
+            os.mkdir(admindir)
+            cachedir = os.path.join(basedir, "cache")
 
             write_file (indir, testcase.filename, self.data);
-            cmd = [generator_bin, outdir]
-            if use_valgrind:
-                cmd = ["valgrind", "--error-exitcode=1", "--leak-check=full", "--show-possibly-lost=no", "--errors-for-leak-kinds=definite"] + cmd
-            res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env = {
-                "QUADLET_UNIT_DIRS": indir
-            })
-            self.stdout = res.stdout.decode('utf8')
-            # The generator should never fail, just log warnings
-            if res.returncode != 0:
-                self.fail(f"Unexpected generator failure\n" + self.stdout)
-
-            testcase.check(outdir)
+            dropin_dir = testcase.filename + ".d"
+            if os.path.isdir(os.path.join(testcases_dir, dropin_dir)):
+                shutil.copytree(os.path.join(testcases_dir, dropin_dir), os.path.join(indir, dropin_dir))
+            for check in self.checks:
+                if check[0] == "depends-on":
+                    for f in check[1:]:
+                        shutil.copy(os.path.join(testcases_dir, f), indir)
+                if check[0] == "shadowed-by":
+                    shutil.copy(os.path.join(testcases_dir, check[1]), os.path.join(admindir, testcase.filename))
+            # The second run uses what the first one cached, and the
+            # third uses neither the cache nor io_uring. All must give
+            # the same result
+            runs = [("cold", ["--io=io_uring"]), ("warm", ["--io=io_uring"]), ("sync", ["--no-cache", "--io=sync"])]
+            for run, args in runs:
+                outdir = os.path.join(basedir, "out-" + run)
+                os.mkdir(outdir)
+                cmd = [generator_bin, "--cache-dir", cachedir] + args + [outdir]
+                if use_valgrind:
+                    cmd = ["valgrind", "--error-exitcode=1", "--leak-check=full", "--show-possibly-lost=no", "--errors-for-leak-kinds=definite"] + cmd
+                res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env = {
+                    "QUADLET_UNIT_DIRS": admindir + ":" + indir
+                })
+                self.stdout = res.stdout.decode('utf8')
+                # The generator should never fail, just log warnings
+                if res.returncode != 0:
+                    self.fail(f"Unexpected generator failure ({run} run)\n" + self.stdout)
+
+                testcase.check(outdir)
 
 
     def fail(self, msg):